@@ -3,10 +3,14 @@ import sys
 
 config_c, config_h, config_vapi = sc.config({
     "output-file": sc.string(),
+    "output-format": sc.enum("png") | sc.enum("pam") | sc.enum("ppm") | sc.enum("farbfeld"),
     "verbose": sc.bool(),
     "png-compression-level": sc.int().require("0 <= x && x <= 9"),
     "move-to-background": sc.bool(),
+    "persistent-clipboard-holder": sc.bool(),
     "copy-to-clipboard": sc.bool(),
+    "all-outputs-clipboard": sc.enum("primary") | sc.enum("archive"),
+    "compress-deferred-images": sc.bool(),
     "output-capture-backends": sc.tokenlist("ext", "wlr"),
     "notify": {
         "enabled": sc.bool(),
@@ -21,6 +25,14 @@ config_c, config_h, config_vapi = sc.config({
         "selection-border-color": sc.color() | sc.enum("smart"),
         "selection-border-width": sc.length(),
         "background": sc.color(),
+    },
+    "replay": {
+        "fps": sc.int().require("1 <= x && x <= 60"),
+        "memory-budget": sc.int().require("x >= 1"),
+    },
+    "export": {
+        "memory-budget": sc.int().require("x >= 1"),
+        "captures-in-flight": sc.int().require("1 <= x && x <= 64"),
     }
 })
 
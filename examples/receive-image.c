@@ -0,0 +1,176 @@
+// This is a reference receiver for spaceshot's `unix:` output target.
+// Build it by configuring meson with `-Dexamples=true`, or on its own with
+// `gcc receive-image.c -o ./receive-image`,
+// and run `./receive-image /tmp/spaceshot.sock` before
+// `spaceshot output -o unix:/tmp/spaceshot.sock`.
+//
+// It accepts a single connection, maps the received image and prints its
+// properties. If a second argument is given, the image is also written there
+// as a PAM file (8-bit formats only).
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+// This mirrors ImageSocketHeader in src/image-socket.h.
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t width;
+    uint32_t height;
+    uint32_t stride;
+    uint32_t fourcc;
+    uint64_t size;
+} ImageSocketHeader;
+
+static const uint32_t IMAGE_SOCKET_MAGIC = 0x48535053;
+
+static int listen_on(const char *path) {
+    struct sockaddr_un address = {.sun_family = AF_UNIX};
+    if (strlen(path) >= sizeof(address.sun_path)) {
+        fprintf(stderr, "socket path too long\n");
+        return -1;
+    }
+    strcpy(address.sun_path, path);
+    unlink(path);
+
+    int socket_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (socket_fd < 0 ||
+        bind(socket_fd, (struct sockaddr *)&address, sizeof(address)) != 0 ||
+        listen(socket_fd, 1) != 0) {
+        perror("couldn't listen");
+        return -1;
+    }
+    return socket_fd;
+}
+
+static int receive_header(int connection, ImageSocketHeader *header) {
+    struct iovec iov = {.iov_base = header, .iov_len = sizeof(*header)};
+    union {
+        char buf[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    struct msghdr message = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control.buf,
+        .msg_controllen = sizeof(control.buf),
+    };
+
+    ssize_t received = recvmsg(connection, &message, MSG_WAITALL);
+    if (received != sizeof(*header)) {
+        fprintf(stderr, "short read of header\n");
+        return -1;
+    }
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&message);
+    if (!cmsg || cmsg->cmsg_level != SOL_SOCKET ||
+        cmsg->cmsg_type != SCM_RIGHTS) {
+        fprintf(stderr, "no file descriptor received\n");
+        return -1;
+    }
+    int fd;
+    memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+    return fd;
+}
+
+static void write_pam(
+    const char *path, const ImageSocketHeader *header, const uint8_t *pixels
+) {
+    // 'XR24' and 'AR24' are BGRX/BGRA in memory, 'XB24' is RGBX
+    uint32_t xb24 = 'X' | 'B' << 8 | '2' << 16 | '4' << 24;
+    bool is_rgb = header->fourcc == xb24;
+
+    FILE *out = fopen(path, "wb");
+    if (!out) {
+        perror("couldn't open output file");
+        return;
+    }
+    fprintf(
+        out,
+        "P7\nWIDTH %u\nHEIGHT %u\nDEPTH 3\nMAXVAL 255\nTUPLTYPE RGB\nENDHDR\n",
+        header->width,
+        header->height
+    );
+    for (uint32_t y = 0; y < header->height; y++) {
+        const uint8_t *row = pixels + (size_t)y * header->stride;
+        for (uint32_t x = 0; x < header->width; x++) {
+            const uint8_t *pixel = row + x * 4;
+            uint8_t rgb[3] = {
+                is_rgb ? pixel[0] : pixel[2],
+                pixel[1],
+                is_rgb ? pixel[2] : pixel[0],
+            };
+            fwrite(rgb, 1, 3, out);
+        }
+    }
+    fclose(out);
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s <socket path> [output.pam]\n", argv[0]);
+        return 2;
+    }
+
+    int socket_fd = listen_on(argv[1]);
+    if (socket_fd < 0) {
+        return 2;
+    }
+    int connection = accept(socket_fd, NULL, NULL);
+    if (connection < 0) {
+        perror("accept");
+        return 2;
+    }
+
+    ImageSocketHeader header;
+    int image_fd = receive_header(connection, &header);
+    close(connection);
+    close(socket_fd);
+    unlink(argv[1]);
+    if (image_fd < 0) {
+        return 2;
+    }
+    if (header.magic != IMAGE_SOCKET_MAGIC) {
+        fprintf(stderr, "bad magic %08x\n", header.magic);
+        return 2;
+    }
+
+    // No copy: the pixels are read straight out of spaceshot's memfd
+    uint8_t *pixels = mmap(NULL, header.size, PROT_READ, MAP_SHARED, image_fd, 0);
+    if (pixels == MAP_FAILED) {
+        perror("mmap");
+        return 2;
+    }
+
+    printf(
+        "%ux%u, stride %u, format %.4s, %lu bytes\n",
+        header.width,
+        header.height,
+        header.stride,
+        (const char *)&header.fourcc,
+        (unsigned long)header.size
+    );
+
+    if (argc >= 3) {
+        uint32_t ar24 = 'A' | 'R' << 8 | '2' << 16 | '4' << 24;
+        uint32_t xr24 = 'X' | 'R' << 8 | '2' << 16 | '4' << 24;
+        uint32_t xb24 = 'X' | 'B' << 8 | '2' << 16 | '4' << 24;
+        if (header.fourcc == ar24 || header.fourcc == xr24 ||
+            header.fourcc == xb24) {
+            write_pam(argv[2], &header, pixels);
+        } else {
+            fprintf(stderr, "only 8-bit formats can be saved\n");
+        }
+    }
+
+    munmap(pixels, header.size);
+    close(image_fd);
+    return 0;
+}
@@ -4,6 +4,7 @@
 #include <build-config.h>
 #include <config/config.h>
 #include <ctype.h>
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -15,19 +16,32 @@ static void print_help(const char *program_name) {
         "  - output [output-name]: screenshot an entire output\n"
         "    if output is not specified and there's more than one connected, "
         "opens the output picker to let the user choose\n"
+        "    with --all, saves every output to its own file instead, and "
+        "with --union, the whole desktop as one image\n"
         "  - region [region]: screenshot a region\n"
         "    region format is 'X,Y WxH', in global compositor space\n"
         "    if region is not specified, opens the region picker to let the "
         "user choose\n"
-        "    note that the region must be fully contained within one output\n"
+        "    a region spanning several outputs needs them all to have the "
+        "same scale\n"
         "  - toplevel <identifier>: screenshot a toplevel (window)\n"
-        "    pass in an ext-foreign-toplevel-list-v1 identifier\n"
+        "    pass in an ext-foreign-toplevel-list-v1 identifier, or use "
+        "--all to export every toplevel to --dir\n"
         "  - defer <targets>: prepare a screenshot for later\n"
         "    at least one of the keywords 'output' or 'toplevel' must be "
         "passed in as targets to be captured for later usage\n"
         "    prints 'ready' when everything is captured; "
         "afterwards, write mode and additional arguments to stdin, separated "
         "by null bytes, to continue as normal\n"
+        "  - burst <target>: take --count screenshots, --interval ms apart\n"
+        "    target is 'output [output-name]' or 'region <region>'\n"
+        "  - stream <target>: write video frames of a target to stdout\n"
+        "  - watch <region>...: print a line whenever a region changes\n"
+        "  - compare <target>: compare a target with --reference\n"
+        "    target is 'output [output-name]', 'region <region>' or "
+        "'toplevel <identifier>'\n"
+        "  - replay-daemon: keep recent frames for --ago\n"
+        "  - daemon: take screenshots for spaceshot-client\n"
         "Options:\n"
         "  -h, --help        display this help and exit\n"
         "  -v, --version     output version information and exit\n"
@@ -41,7 +55,32 @@ static void print_help(const char *program_name) {
         "(default)\n"
         "  --no-notify       do not send notifications\n"
         "  -o, --output-file set output file path template\n"
+        "  -F, --format      set output image format "
+        "(png, pam, ppm, farbfeld)\n"
         "  --verbose         enable debug logging\n"
+        "  --count           number of screenshots to take (burst) or frames "
+        "to write (stream)\n"
+        "  --interval        milliseconds between screenshots (burst)\n"
+        "  --fps             frames per second to write (stream)\n"
+        "  --stream-format   set stream format (y4m, raw)\n"
+        "  --until-stable    exit once the regions haven't changed for this "
+        "many milliseconds (watch)\n"
+        "  --save            save the regions that changed (watch)\n"
+        "  --reference       the PNG image to compare against (compare)\n"
+        "  --tolerance       how much each channel may differ, 0-255 "
+        "(compare)\n"
+        "  --diff            write an image of the differences (compare)\n"
+        "  --wait-until-match\n"
+        "                    recapture for up to this many milliseconds until "
+        "the target matches (compare)\n"
+        "  --all             save every output (output) or export every "
+        "toplevel (toplevel)\n"
+        "  --dir             the directory to export to (toplevel --all)\n"
+        "  --union           capture every output together as one image "
+        "(output)\n"
+        "  --ago             take the screenshot from this long ago, "
+        "like 500ms or 2s\n"
+        "                    (region, output; needs replay-daemon)\n"
     );
 }
 
@@ -49,6 +88,97 @@ static void print_version() {
     printf("spaceshot version %s\n", SPACESHOT_VERSION);
 }
 
+/** Parse a duration like "500ms", "2s" or "500" (milliseconds). */
+static bool parse_duration_ms(const char *str, uint32_t *out) {
+    char *end;
+    errno = 0;
+    unsigned long value = strtoul(str, &end, 10);
+    if (errno != 0 || end == str || str[0] == '-' || value == 0) {
+        return false;
+    }
+    unsigned long multiplier;
+    if (*end == '\0' || strcmp(end, "ms") == 0) {
+        multiplier = 1;
+    } else if (strcmp(end, "s") == 0) {
+        multiplier = 1000;
+    } else {
+        return false;
+    }
+    if (value > UINT32_MAX / multiplier) {
+        return false;
+    }
+    *out = value * multiplier;
+    return true;
+}
+
+/** Parse a positive integer. */
+static bool parse_positive(const char *str, uint32_t *out) {
+    char *end;
+    errno = 0;
+    unsigned long value = strtoul(str, &end, 10);
+    if (errno != 0 || end == str || *end != '\0' || value == 0 ||
+        value > UINT32_MAX || str[0] == '-') {
+        return false;
+    }
+    *out = value;
+    return true;
+}
+
+static const char *get_target_mode_name(CaptureMode mode) {
+    switch (mode) {
+    case CAPTURE_BURST:
+        return "burst";
+    case CAPTURE_STREAM:
+        return "stream";
+    case CAPTURE_COMPARE:
+        return "compare";
+    default:
+        REPORT_UNHANDLED("capture mode", "%d", mode);
+    }
+}
+
+/**
+ * Parse a parameter of a mode that takes a target (output or region).
+ * @returns whether it was valid
+ */
+static bool parse_target_param(Arguments *args, const char *arg) {
+    TargetParams *params = &args->target_params;
+    const char *mode_name = get_target_mode_name(args->mode);
+    // only compare mode has a way to capture toplevels repeatedly
+    bool can_use_toplevel = args->mode == CAPTURE_COMPARE;
+    if (args->captured_mode_params == 1) {
+        if (strcmp(arg, "output") == 0) {
+            params->type = CAPTURE_OUTPUT;
+        } else if (strcmp(arg, "region") == 0) {
+            params->type = CAPTURE_REGION;
+        } else if (can_use_toplevel && strcmp(arg, "toplevel") == 0) {
+            params->type = CAPTURE_TOPLEVEL;
+        } else {
+            report_error(
+                "invalid %s target '%s'\n"
+                "valid targets are 'output', 'region'%s",
+                mode_name,
+                arg,
+                can_use_toplevel ? " and 'toplevel'" : ""
+            );
+            return false;
+        }
+    } else if (args->captured_mode_params == 2) {
+        if (params->type == CAPTURE_OUTPUT) {
+            params->output_name = strdup(arg);
+        } else if (params->type == CAPTURE_TOPLEVEL) {
+            params->toplevel_id = strdup(arg);
+        } else if (!bbox_parse(arg, &params->region)) {
+            report_error("invalid region\nregion format is 'X,Y WxH'");
+            return false;
+        }
+    } else {
+        report_error("too many parameters for mode '%s' (max 2)", mode_name);
+        return false;
+    }
+    return true;
+}
+
 static void interpret_option(Arguments *args, char opt, char *value) {
     switch (opt) {
     case 'f':
@@ -83,6 +213,23 @@ static void interpret_option(Arguments *args, char opt, char *value) {
         free(config_get()->output_file);
         config_get()->output_file = strdup(value);
         break;
+    case 'F':
+        if (strcmp(value, "png") == 0) {
+            config_get()->output_format = CONFIG_OUTPUT_FORMAT_PNG;
+        } else if (strcmp(value, "pam") == 0) {
+            config_get()->output_format = CONFIG_OUTPUT_FORMAT_PAM;
+        } else if (strcmp(value, "ppm") == 0) {
+            config_get()->output_format = CONFIG_OUTPUT_FORMAT_PPM;
+        } else if (strcmp(value, "farbfeld") == 0) {
+            config_get()->output_format = CONFIG_OUTPUT_FORMAT_FARBFELD;
+        } else {
+            report_error(
+                "invalid format %s\nvalid formats are png, pam, ppm, farbfeld",
+                value
+            );
+            exit(2);
+        }
+        break;
     case '#':
         // only as --verbose
         config_get()->verbose = true;
@@ -90,6 +237,100 @@ static void interpret_option(Arguments *args, char opt, char *value) {
     case 'v':
         print_version();
         exit(EXIT_SUCCESS);
+    case '%':
+        // only as --count
+        if (!parse_positive(value, &args->count)) {
+            report_error("invalid count %s", value);
+            exit(2);
+        }
+        break;
+    case '^':
+        // only as --interval
+        if (!parse_positive(value, &args->interval_ms)) {
+            report_error("invalid interval %s", value);
+            exit(2);
+        }
+        break;
+    case '&':
+        // only as --fps
+        if (!parse_positive(value, &args->fps)) {
+            report_error("invalid frame rate %s", value);
+            exit(2);
+        }
+        break;
+    case '*':
+        // only as --stream-format
+        if (strcmp(value, "y4m") == 0) {
+            args->stream_format = STREAM_FORMAT_Y4M;
+        } else if (strcmp(value, "raw") == 0) {
+            args->stream_format = STREAM_FORMAT_RAW;
+        } else {
+            report_error(
+                "invalid stream format %s\nvalid formats are y4m, raw", value
+            );
+            exit(2);
+        }
+        break;
+    case '~':
+        // only as --until-stable
+        if (!parse_positive(value, &args->until_stable_ms)) {
+            report_error("invalid duration %s", value);
+            exit(2);
+        }
+        break;
+    case '+':
+        // only as --save
+        args->should_save_changes = true;
+        break;
+    case '<':
+        // only as --reference
+        free(args->reference_path);
+        args->reference_path = strdup(value);
+        break;
+    case '>': {
+        // only as --tolerance
+        char *end;
+        unsigned long tolerance = strtoul(value, &end, 10);
+        if (end == value || *end != '\0' || tolerance > 255 ||
+            value[0] == '-') {
+            report_error("invalid tolerance %s (must be 0-255)", value);
+            exit(2);
+        }
+        args->tolerance = tolerance;
+        break;
+    }
+    case '|':
+        // only as --diff
+        free(args->diff_path);
+        args->diff_path = strdup(value);
+        break;
+    case ')':
+        // only as --ago
+        if (!parse_duration_ms(value, &args->ago_ms)) {
+            report_error("invalid duration %s", value);
+            exit(2);
+        }
+        break;
+    case '(':
+        // only as --all
+        args->should_capture_all = true;
+        break;
+    case ']':
+        // only as --union
+        args->should_capture_union = true;
+        break;
+    case '[':
+        // only as --dir
+        free(args->export_dir);
+        args->export_dir = strdup(value);
+        break;
+    case '?':
+        // only as --wait-until-match
+        if (!parse_positive(value, &args->match_timeout_ms)) {
+            report_error("invalid timeout %s", value);
+            exit(2);
+        }
+        break;
     default:
         REPORT_UNHANDLED("converted option", "%c", opt);
     }
@@ -111,8 +352,23 @@ static const LongOption LONG_OPTIONS[] = {
     {"notify", 'n', false},
     {"no-notify", '@', false},
     {"output-file", 'o', true},
+    {"format", 'F', true},
     {"verbose", '#', false},
-    {"version", 'v', false}
+    {"version", 'v', false},
+    {"count", '%', true},
+    {"interval", '^', true},
+    {"fps", '&', true},
+    {"stream-format", '*', true},
+    {"until-stable", '~', true},
+    {"save", '+', false},
+    {"reference", '<', true},
+    {"tolerance", '>', true},
+    {"diff", '|', true},
+    {"wait-until-match", '?', true},
+    {"ago", ')', true},
+    {"all", '(', false},
+    {"dir", '[', true},
+    {"union", ']', false},
 };
 static const int LONG_OPTION_COUNT = sizeof(LONG_OPTIONS) / sizeof(LongOption);
 
@@ -188,6 +444,7 @@ void parse_argv(Arguments *result, int argc, char **argv) {
                     // must be at the end of the string
                     case 'C':
                     case 'o':
+                    case 'F':
                         if (arg[j + 1] != '\0') {
                             report_error(
                                 "option -%c requires an argument and "
@@ -255,13 +512,36 @@ void parse_argv(Arguments *result, int argc, char **argv) {
                     result->defer_params =
                         (DeferParams){.needs_output = false,
                                       .needs_toplevel = false};
+                } else if (strcmp(mode, "burst") == 0) {
+                    result->mode = CAPTURE_BURST;
+                    result->target_params = (TargetParams){.type = 0};
+                } else if (strcmp(mode, "stream") == 0) {
+                    result->mode = CAPTURE_STREAM;
+                    result->target_params = (TargetParams){.type = 0};
+                } else if (strcmp(mode, "compare") == 0) {
+                    result->mode = CAPTURE_COMPARE;
+                    result->target_params = (TargetParams){.type = 0};
+                } else if (strcmp(mode, "replay-daemon") == 0) {
+                    result->mode = CAPTURE_REPLAY_DAEMON;
+                } else if (strcmp(mode, "daemon") == 0) {
+                    result->mode = CAPTURE_DAEMON;
+                } else if (strcmp(mode, "watch") == 0) {
+                    result->mode = CAPTURE_WATCH;
+                    result->watch_params =
+                        (WatchParams){.regions = NULL, .region_count = 0};
                 } else {
                     report_error(
                         "invalid mode %s\n"
                         "valid modes are 'output [output-name]', "
                         "'region [region]', "
                         "'toplevel <toplevel>', "
-                        "and 'defer <targets>'\n",
+                        "'defer <targets>', "
+                        "'burst <target>', "
+                        "'stream <target>', "
+                        "'watch <region>...', "
+                        "'compare <target>', "
+                        "'replay-daemon' "
+                        "and 'daemon'\n",
                         mode
                     );
                     goto error;
@@ -311,6 +591,36 @@ void parse_argv(Arguments *result, int argc, char **argv) {
                         report_error("invalid defer target '%s'", arg);
                         goto error;
                     }
+                } else if (result->mode == CAPTURE_BURST ||
+                           result->mode == CAPTURE_STREAM ||
+                           result->mode == CAPTURE_COMPARE) {
+                    if (!parse_target_param(result, arg)) {
+                        goto error;
+                    }
+                } else if (result->mode == CAPTURE_REPLAY_DAEMON) {
+                    report_error(
+                        "too many parameters for mode 'replay-daemon' (max 0)"
+                    );
+                    goto error;
+                } else if (result->mode == CAPTURE_DAEMON) {
+                    report_error(
+                        "too many parameters for mode 'daemon' (max 0)"
+                    );
+                    goto error;
+                } else if (result->mode == CAPTURE_WATCH) {
+                    WatchParams *params = &result->watch_params;
+                    BBox region;
+                    if (!bbox_parse(arg, &region)) {
+                        report_error(
+                            "invalid region\nregion format is 'X,Y WxH'"
+                        );
+                        goto error;
+                    }
+                    params->regions = realloc(
+                        params->regions,
+                        (params->region_count + 1) * sizeof(BBox)
+                    );
+                    params->regions[params->region_count++] = region;
                 } else {
                     REPORT_UNHANDLED("mode", "%d", result->mode);
                     goto error;
@@ -329,8 +639,39 @@ void parse_argv(Arguments *result, int argc, char **argv) {
         goto error;
     }
 
+    if (result->should_capture_all && result->mode == CAPTURE_OUTPUT) {
+        if (result->output_params.output_name) {
+            report_error("--all can't be combined with an output name");
+            goto error;
+        }
+        if (result->export_dir) {
+            report_error("--dir only works with toplevel --all");
+            goto error;
+        }
+        if (strcmp(config_get()->output_file, "-") == 0) {
+            report_error("output --all can't write every output to stdout");
+            goto error;
+        }
+    } else if (result->should_capture_all) {
+        if (result->mode != CAPTURE_TOPLEVEL) {
+            report_error("--all only works with the output and toplevel modes");
+            goto error;
+        }
+        if (result->toplevel_params.toplevel_id) {
+            report_error("--all can't be combined with a toplevel id");
+            goto error;
+        }
+        if (!result->export_dir) {
+            report_error("toplevel --all needs a --dir to export to");
+            goto error;
+        }
+    } else if (result->export_dir) {
+        report_error("--dir only works with toplevel --all");
+        goto error;
+    }
+
     if (result->mode == CAPTURE_TOPLEVEL &&
-        !result->toplevel_params.toplevel_id) {
+        !result->toplevel_params.toplevel_id && !result->should_capture_all) {
         report_error(
             "a toplevel id is required\ntry %s --help for more information",
             result->executable_name
@@ -348,6 +689,71 @@ void parse_argv(Arguments *result, int argc, char **argv) {
         goto error;
     }
 
+    if (result->mode == CAPTURE_BURST || result->mode == CAPTURE_STREAM ||
+        result->mode == CAPTURE_COMPARE) {
+        const char *mode_name = get_target_mode_name(result->mode);
+        if (result->captured_mode_params < 2) {
+            report_error(
+                "a %s target is required\ntry %s --help for more "
+                "information",
+                mode_name,
+                result->executable_name
+            );
+            goto error;
+        }
+        if (result->target_params.type == CAPTURE_REGION &&
+            result->captured_mode_params < 3) {
+            report_error("%s needs a region to capture", mode_name);
+            goto error;
+        }
+        if (result->target_params.type == CAPTURE_TOPLEVEL &&
+            result->captured_mode_params < 3) {
+            report_error("%s needs a toplevel id", mode_name);
+            goto error;
+        }
+    }
+
+    if (result->mode == CAPTURE_WATCH &&
+        result->watch_params.region_count == 0) {
+        report_error(
+            "at least one region to watch is required\ntry %s --help for "
+            "more information",
+            result->executable_name
+        );
+        goto error;
+    }
+
+    if (result->should_capture_union) {
+        if (result->mode != CAPTURE_OUTPUT) {
+            report_error("--union only works with the output mode");
+            goto error;
+        }
+        if (result->output_params.output_name || result->should_capture_all) {
+            report_error(
+                "--union can't be combined with an output name or --all"
+            );
+            goto error;
+        }
+    }
+
+    if (result->ago_ms && result->mode != CAPTURE_REGION &&
+        result->mode != CAPTURE_OUTPUT) {
+        report_error("--ago only works with the region and output modes");
+        goto error;
+    }
+
+    if (result->mode == CAPTURE_COMPARE && !result->reference_path) {
+        report_error("compare needs a --reference image");
+        goto error;
+    }
+
+    if (result->mode == CAPTURE_BURST) {
+        if (!result->count || !result->interval_ms) {
+            report_error("burst needs both --count and --interval");
+            goto error;
+        }
+    }
+
     return;
 error:
     exit(2);
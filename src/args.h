@@ -1,5 +1,6 @@
 #pragma once
 #include "bbox.h"
+#include <stddef.h>
 #include <stdint.h>
 
 typedef enum {
@@ -7,6 +8,12 @@ typedef enum {
     CAPTURE_REGION,
     CAPTURE_TOPLEVEL,
     CAPTURE_DEFER,
+    CAPTURE_BURST,
+    CAPTURE_STREAM,
+    CAPTURE_WATCH,
+    CAPTURE_COMPARE,
+    CAPTURE_REPLAY_DAEMON,
+    CAPTURE_DAEMON,
 } CaptureMode;
 
 typedef struct {
@@ -28,6 +35,31 @@ typedef struct {
     bool needs_toplevel;
 } DeferParams;
 
+/** A single capture target, for the modes that don't use pickers. */
+typedef struct {
+    /**
+     * Either CAPTURE_OUTPUT or CAPTURE_REGION, or CAPTURE_TOPLEVEL in
+     * compare mode.
+     */
+    CaptureMode type;
+    /** For output targets; may be NULL if there's only one output. */
+    char *output_name;
+    /** For region targets. */
+    BBox region;
+    /** For toplevel targets. */
+    char *toplevel_id;
+} TargetParams;
+
+typedef struct {
+    BBox *regions;
+    size_t region_count;
+} WatchParams;
+
+typedef enum {
+    STREAM_FORMAT_Y4M,
+    STREAM_FORMAT_RAW,
+} StreamFormat;
+
 typedef struct {
     CaptureMode mode;
     union {
@@ -35,8 +67,53 @@ typedef struct {
         RegionCaptureParams region_params;
         ToplevelCaptureParams toplevel_params;
         DeferParams defer_params;
+        // burst, stream and compare
+        TargetParams target_params;
+        WatchParams watch_params;
     };
     int captured_mode_params;
+    /**
+     * The number of shots to take (burst mode) or frames to write (stream
+     * mode), or 0 if not specified.
+     */
+    uint32_t count;
+    /** The time between shots in milliseconds, or 0 if not specified. */
+    uint32_t interval_ms;
+    /** The target frame rate (stream mode), or 0 to follow the compositor. */
+    uint32_t fps;
+    StreamFormat stream_format;
+    /**
+     * How long the watched regions need to stay the same before exiting
+     * (watch mode), or 0 to keep watching.
+     */
+    uint32_t until_stable_ms;
+    /** Whether to save the regions that changed (watch mode). */
+    bool should_save_changes;
+    /** The image to compare against (compare mode). */
+    char *reference_path;
+    /** How much each channel may differ while still matching (compare). */
+    uint8_t tolerance;
+    /** Where to write an image showing the differences, or NULL (compare). */
+    char *diff_path;
+    /**
+     * How long to keep capturing until the target matches (compare mode), or
+     * 0 to only capture once.
+     */
+    uint32_t match_timeout_ms;
+    /**
+     * How far back to take the screenshot from, using the replay daemon
+     * (region and output mode), or 0 for the current screen contents.
+     */
+    uint32_t ago_ms;
+    /**
+     * Whether to save every output to its own file (output mode), or export
+     * every toplevel (toplevel mode).
+     */
+    bool should_capture_all;
+    /** Whether to capture every output together as one image (output mode). */
+    bool should_capture_union;
+    /** Where to export toplevels to, with --all (toplevel mode). */
+    char *export_dir;
     const char *executable_name;
 } Arguments;
 
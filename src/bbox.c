@@ -74,6 +74,11 @@ bool bbox_contains(const BBox outer, const BBox inner) {
            (outer_right >= inner_right) && (outer_bottom >= inner_bottom);
 }
 
+bool bbox_intersects(const BBox a, const BBox b) {
+    BBox overlap = bbox_constrain(a, b);
+    return overlap.width > 0 && overlap.height > 0;
+}
+
 BBox bbox_constrain(const BBox src, const BBox max_bounds) {
     double left = fmax(src.x, max_bounds.x);
     double top = fmax(src.y, max_bounds.y);
@@ -87,6 +92,19 @@ BBox bbox_constrain(const BBox src, const BBox max_bounds) {
     };
 }
 
+BBox bbox_union(const BBox a, const BBox b) {
+    double left = fmin(a.x, b.x);
+    double top = fmin(a.y, b.y);
+    double right = fmax(a.x + a.width, b.x + b.width);
+    double bottom = fmax(a.y + a.height, b.y + b.height);
+    return (BBox){
+        .x = left,
+        .y = top,
+        .width = right - left,
+        .height = bottom - top,
+    };
+}
+
 BBox bbox_translate(const BBox src, double dx, double dy) {
     return (BBox){
         .x = src.x + dx,
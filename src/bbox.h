@@ -36,12 +36,22 @@ char *bbox_stringify(const BBox src);
  */
 bool bbox_contains(const BBox outer, const BBox inner);
 
+/**
+ * Test whether @p a and @p b overlap by more than just an edge.
+ */
+bool bbox_intersects(const BBox a, const BBox b);
+
 /**
  * Constrain @p src to some specified boundary, such that the result is
  * contained within @p max_bounds.
  */
 BBox bbox_constrain(const BBox src, const BBox max_bounds);
 
+/**
+ * Get the smallest BBox that contains both @p a and @p b.
+ */
+BBox bbox_union(const BBox a, const BBox b);
+
 /**
  * Translate a BBox by the specified @p dx and @p dy.
  */
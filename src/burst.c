@@ -0,0 +1,319 @@
+#include "burst.h"
+#include "capture-target.h"
+#include "event-loop.h"
+#include "log.h"
+#include "paths.h"
+#include "save.h"
+#include "wayland/globals.h"
+#include "wayland/screen-capture.h"
+#include "worker.h"
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+
+// Frames waiting to be encoded or written. Beyond this, new frames are
+// dropped instead of piling up in memory.
+constexpr uint32_t MAX_QUEUED_FRAMES = 8;
+
+typedef struct {
+    struct wl_list link;
+    Image *image;
+    // the part to keep, in image pixels, if has_crop is set
+    bool has_crop;
+    BBox crop;
+    char *filename;
+    LinkBuffer *encoded_image;
+    bool is_encoded;
+} BurstFrame;
+
+static struct {
+    WrappedOutput *output;
+    bool has_region;
+    // in output-local logical coordinates
+    BBox region;
+    CaptureSession *session;
+    // The newest image from the session. Holding on to it means the session
+    // has to copy it before applying new damage, but only once per shot.
+    Image *last_image;
+    // the shot that gets the session's next frame, if there is one
+    bool has_pending_shot;
+    uint32_t pending_index;
+    char *base_filename;
+    int number_width;
+    uint32_t count;
+    // shots that were either taken or dropped
+    uint32_t scheduled_count;
+    uint32_t dropped_count;
+    // Frames that are being encoded or written, in the order they were
+    // taken. They're encoded in parallel, but written one at a time and in
+    // order, so the files show up in sequence.
+    struct wl_list frames;
+    uint32_t queued_count;
+    bool is_writing;
+    bool has_failed;
+    int timer_fd;
+    EventLoopSource *timer_source;
+} burst;
+
+static void burst_frame_destroy(BurstFrame *frame) {
+    wl_list_remove(&frame->link);
+    burst.queued_count--;
+    image_destroy(frame->image);
+    if (frame->encoded_image) {
+        link_buffer_destroy(frame->encoded_image);
+    }
+    free(frame->filename);
+    free(frame);
+}
+
+static void burst_frame_write(void *data) {
+    BurstFrame *frame = data;
+    save_screenshot(frame->image, frame->encoded_image, frame->filename);
+}
+
+static void write_next_frame();
+
+static void burst_frame_written(void *data) {
+    BurstFrame *frame = data;
+    log_debug("wrote %s\n", frame->filename);
+    burst_frame_destroy(frame);
+    burst.is_writing = false;
+    write_next_frame();
+}
+
+static void write_next_frame() {
+    if (burst.is_writing || wl_list_empty(&burst.frames)) {
+        return;
+    }
+    BurstFrame *frame = wl_container_of(burst.frames.next, frame, link);
+    if (!frame->is_encoded) {
+        // later frames wait for this one
+        return;
+    }
+    burst.is_writing = true;
+    worker_run(burst_frame_write, burst_frame_written, frame);
+}
+
+static void burst_frame_encode(void *data) {
+    BurstFrame *frame = data;
+    if (frame->has_crop) {
+        Image *cropped = image_crop(
+            frame->image,
+            frame->crop.x,
+            frame->crop.y,
+            frame->crop.width,
+            frame->crop.height
+        );
+        image_destroy(frame->image);
+        frame->image = cropped;
+    }
+    if (is_png_needed_for_saving(frame->filename)) {
+        frame->encoded_image = image_save_png(frame->image);
+    }
+}
+
+static void burst_frame_encoded(void *data) {
+    BurstFrame *frame = data;
+    frame->is_encoded = true;
+    write_next_frame();
+}
+
+static char *get_frame_filename(uint32_t index) {
+    if (!is_file_target(burst.base_filename)) {
+        // sockets get every frame at the same address
+        return strdup(burst.base_filename);
+    }
+    char suffix[16];
+    snprintf(suffix, sizeof(suffix), "-%0*u", burst.number_width, index + 1);
+    return get_suffixed_filename(burst.base_filename, suffix);
+}
+
+/** Hand a shot's image to the encoders. This takes a new reference. */
+static void queue_frame(uint32_t index, Image *image) {
+    if (burst.queued_count >= MAX_QUEUED_FRAMES) {
+        log_debug("encoding can't keep up, dropping frame %u\n", index + 1);
+        burst.dropped_count++;
+        return;
+    }
+
+    BurstFrame *frame = calloc(1, sizeof(BurstFrame));
+    frame->image = image_ref(image);
+    if (burst.has_region) {
+        // the session always captures the whole output
+        double scale = image->width / burst.output->logical_bounds.width;
+        frame->has_crop = true;
+        frame->crop = bbox_constrain(
+            bbox_round(bbox_scale(burst.region, scale)),
+            (BBox){.width = image->width, .height = image->height}
+        );
+    }
+    frame->filename = get_frame_filename(index);
+    wl_list_insert(burst.frames.prev, &frame->link);
+    burst.queued_count++;
+    worker_run(burst_frame_encode, burst_frame_encoded, frame);
+}
+
+static void handle_session_frame(
+    Image *image,
+    const BBox * /* damage */,
+    size_t /* damage_count */,
+    void * /* data */
+) {
+    if (!image) {
+        report_error("capturing frames failed");
+        burst.has_failed = true;
+        burst.has_pending_shot = false;
+        return;
+    }
+    if (burst.last_image) {
+        image_destroy(burst.last_image);
+    }
+    burst.last_image = image;
+    if (burst.has_pending_shot) {
+        burst.has_pending_shot = false;
+        queue_frame(burst.pending_index, image);
+    }
+}
+
+static void take_shot() {
+    uint32_t index = burst.scheduled_count++;
+    if (!is_output_valid(burst.output)) {
+        report_error("output disappeared while screenshotting");
+        burst.has_failed = true;
+        burst.has_pending_shot = false;
+        return;
+    }
+
+    if (burst.has_pending_shot && !burst.last_image) {
+        // the compositor hasn't delivered the first frame yet
+        log_debug(
+            "capture is behind, dropping frame %u\n", burst.pending_index + 1
+        );
+        burst.dropped_count++;
+    } else if (burst.has_pending_shot) {
+        // The compositor only sends a frame once something changes, so if
+        // the last shot's frame hasn't come yet, the screen still looks like
+        // the newest image
+        burst.has_pending_shot = false;
+        queue_frame(burst.pending_index, burst.last_image);
+    }
+    burst.has_pending_shot = true;
+    burst.pending_index = index;
+    capture_session_request_frame(burst.session);
+}
+
+static void stop_timer() {
+    if (burst.timer_source) {
+        event_loop_remove(burst.timer_source);
+        close(burst.timer_fd);
+        burst.timer_source = NULL;
+    }
+}
+
+static void handle_timer(void * /* data */, int fd, short /* revents */) {
+    uint64_t expirations;
+    if (read(fd, &expirations, sizeof(expirations)) != sizeof(expirations)) {
+        return;
+    }
+    if (burst.scheduled_count >= burst.count) {
+        // This tick only settles the last shot, for which nothing changed
+        if (burst.has_pending_shot && !burst.last_image) {
+            return;
+        }
+        if (burst.has_pending_shot) {
+            burst.has_pending_shot = false;
+            queue_frame(burst.pending_index, burst.last_image);
+        }
+        stop_timer();
+        return;
+    }
+    // If the main thread fell behind, the missed shots count as dropped
+    while (expirations > 0 && burst.scheduled_count < burst.count &&
+           !burst.has_failed) {
+        if (expirations > 1) {
+            burst.scheduled_count++;
+            burst.dropped_count++;
+        } else {
+            take_shot();
+        }
+        expirations--;
+    }
+    if (burst.has_failed) {
+        stop_timer();
+    }
+}
+
+static void start_timer(uint32_t interval_ms) {
+    burst.timer_fd =
+        timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+    if (burst.timer_fd < 0) {
+        report_error_fatal("couldn't create timer: %s", strerror(errno));
+    }
+    struct timespec interval = {
+        .tv_sec = interval_ms / 1000,
+        .tv_nsec = (long)(interval_ms % 1000) * 1000000,
+    };
+    struct itimerspec timer_spec = {
+        .it_interval = interval,
+        .it_value = interval,
+    };
+    timerfd_settime(burst.timer_fd, 0, &timer_spec, NULL);
+    burst.timer_source =
+        event_loop_add_fd(burst.timer_fd, POLLIN, handle_timer, NULL);
+}
+
+static bool is_finished() {
+    bool is_done_scheduling =
+        burst.scheduled_count >= burst.count || burst.has_failed;
+    return is_done_scheduling && !burst.has_pending_shot &&
+           wl_list_empty(&burst.frames);
+}
+
+int burst_run(const Arguments *args) {
+    BBox region;
+    burst.output = find_target_output(&args->target_params, &region);
+    if (args->target_params.type == CAPTURE_REGION) {
+        burst.has_region = true;
+        burst.region = region;
+    }
+
+    burst.base_filename = get_output_filename();
+    if (strcmp(burst.base_filename, "-") == 0) {
+        report_error_fatal("burst mode can't write to stdout");
+    }
+    burst.count = args->count;
+    burst.number_width = snprintf(NULL, 0, "%u", burst.count);
+
+    wl_list_init(&burst.frames);
+    TIMING_START(burst);
+    // One session for every shot, so that its setup is only paid once
+    burst.session =
+        capture_session_new(burst.output, handle_session_frame, NULL);
+    take_shot();
+    // The timer also runs once after the last shot, in case its frame never
+    // comes because nothing changed
+    start_timer(args->interval_ms);
+    while (!is_finished()) {
+        if (event_loop_dispatch() == -1) {
+            report_error_fatal("lost connection to the compositor");
+        }
+    }
+    TIMING_END(burst);
+    stop_timer();
+    capture_session_destroy(burst.session);
+    if (burst.last_image) {
+        image_destroy(burst.last_image);
+    }
+
+    if (burst.dropped_count > 0) {
+        report_warning(
+            "dropped %u of %u frames", burst.dropped_count, burst.count
+        );
+    }
+    free(burst.base_filename);
+    return burst.has_failed ? 2 : 0;
+}
@@ -0,0 +1,11 @@
+#pragma once
+#include "args.h"
+
+/**
+ * Take a series of screenshots on a fixed schedule, as described by
+ * @p args. One capture session is used for every shot. Frames are encoded on
+ * the worker pool while capturing continues, and written out in order.
+ * The Wayland globals need to be set up already.
+ * @returns the exit code (0 on success, 2 if any frame failed)
+ */
+int burst_run(const Arguments *args);
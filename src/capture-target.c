@@ -0,0 +1,33 @@
+#include "capture-target.h"
+#include "log.h"
+#include "wayland/globals.h"
+
+WrappedOutput *
+find_target_output(const TargetParams *params, BBox *local_region) {
+    WrappedOutput *output;
+    if (params->type == CAPTURE_REGION) {
+        output = find_output_containing(params->region);
+        if (!output) {
+            report_error_fatal("couldn't find an output containing the region");
+        }
+        *local_region = bbox_translate(
+            params->region,
+            -output->logical_bounds.x,
+            -output->logical_bounds.y
+        );
+    } else {
+        output = find_output_by_name(params->output_name);
+        if (!output) {
+            report_error_fatal(
+                params->output_name ? "couldn't find matching output"
+                                    : "there's more than one output, so "
+                                      "one needs to be specified"
+            );
+        }
+        *local_region = (BBox){
+            .width = output->logical_bounds.width,
+            .height = output->logical_bounds.height,
+        };
+    }
+    return output;
+}
@@ -0,0 +1,13 @@
+#pragma once
+#include "args.h"
+#include "bbox.h"
+#include "wayland/output.h"
+
+/**
+ * Find the output that a target is on. Exits with an error if there isn't
+ * one. The Wayland globals need to be set up already.
+ * @param[out] local_region The target's area in logical coordinates relative
+ * to the output; for output targets, that's the whole output.
+ */
+WrappedOutput *
+find_target_output(const TargetParams *params, BBox *local_region);
@@ -0,0 +1,92 @@
+#include "daemon.h"
+#include "log.h"
+#include "unix-socket.h"
+#include <errno.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+// spaceshot-client: hand the arguments over to spaceshot daemon, or run
+// spaceshot itself if there's no daemon. See daemon.h for the protocol.
+
+[[noreturn]] static void run_locally(char **argv) {
+    const char *spaceshot_path = getenv("SPACESHOT_PATH");
+    spaceshot_path = spaceshot_path ? spaceshot_path : "spaceshot";
+    argv[0] = (char *)spaceshot_path;
+    execvp(spaceshot_path, argv);
+    report_error_fatal("couldn't run %s: %s", spaceshot_path, strerror(errno));
+}
+
+static bool send_request(int socket_fd, int argc, char **argv) {
+    for (int i = 0; i < 3; i++) {
+        uint8_t index = i;
+        if (!unix_socket_send_with_fd(socket_fd, &index, 1, i)) {
+            return false;
+        }
+    }
+
+    char *cwd = getcwd(NULL, 0);
+    if (!cwd) {
+        report_error("couldn't get current directory");
+        return false;
+    }
+    size_t payload_length = strlen(cwd) + 1;
+    for (int i = 0; i < argc; i++) {
+        payload_length += strlen(argv[i]) + 1;
+    }
+    if (payload_length > DAEMON_MAX_PAYLOAD_LENGTH) {
+        report_error("too many arguments");
+        free(cwd);
+        return false;
+    }
+
+    char *payload = malloc(payload_length);
+    char *cursor = stpcpy(payload, cwd) + 1;
+    for (int i = 0; i < argc; i++) {
+        cursor = stpcpy(cursor, argv[i]) + 1;
+    }
+    free(cwd);
+
+    DaemonRequest request = {
+        .magic = DAEMON_REQUEST_MAGIC,
+        .version = DAEMON_REQUEST_VERSION,
+        .argc = argc,
+        .payload_length = payload_length,
+    };
+    bool is_sent =
+        unix_socket_send_with_fd(socket_fd, &request, sizeof(request), -1) &&
+        unix_socket_send_with_fd(socket_fd, payload, payload_length, -1);
+    free(payload);
+    return is_sent;
+}
+
+int main(int argc, char **argv) {
+    set_program_name(argv[0]);
+    signal(SIGPIPE, SIG_IGN);
+
+    char *socket_path = unix_socket_runtime_path(DAEMON_SOCKET_NAME);
+    int socket_fd = socket_path ? unix_socket_connect(socket_path) : -1;
+    free(socket_path);
+    if (socket_fd < 0) {
+        // no daemon, so pay the startup cost after all
+        run_locally(argv);
+    }
+
+    if (!send_request(socket_fd, argc, argv)) {
+        report_error("couldn't send the request to the daemon");
+        return 2;
+    }
+    int32_t exit_code;
+    ssize_t received;
+    do {
+        received = recv(socket_fd, &exit_code, sizeof(exit_code), MSG_WAITALL);
+    } while (received < 0 && errno == EINTR);
+    if (received != sizeof(exit_code)) {
+        report_error("the daemon went away");
+        return 2;
+    }
+    close(socket_fd);
+    return exit_code;
+}
@@ -0,0 +1,507 @@
+// spaceshot-clipboard-holder: keeps spaceshot's clipboard contents available
+// after it exits. It's deliberately tiny (no image, cairo or config code), so
+// that waiting for pastes costs next to no memory. See clipboard-holder.h for
+// how the data gets here.
+#include "clipboard-holder.h"
+#include "event-loop.h"
+#include "ext-data-control-client.h"
+#include "log.h"
+#include "memfd.h"
+#include "unix-socket.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <wayland-client.h>
+
+constexpr size_t MAX_OFFER_COUNT = 16;
+
+typedef struct {
+    char mime[sizeof(((ClipboardHandoffOffer *)0)->mime)];
+    const uint8_t *data;
+    size_t length;
+} HeldOffer;
+
+/**
+ * One spaceshot invocation's clipboard contents. A persistent holder goes
+ * through many of these; each one stays alive until it has been replaced and
+ * all of its pastes are done.
+ */
+typedef struct {
+    HeldOffer offers[MAX_OFFER_COUNT];
+    size_t offer_count;
+    struct ext_data_control_source_v1 *source;
+    int transfer_count;
+    bool is_cancelled;
+} HeldSelection;
+
+typedef struct {
+    HeldSelection *selection;
+    int fd;
+    EventLoopSource *loop_source;
+    const uint8_t *cursor;
+    size_t remaining;
+} HolderTransfer;
+
+static struct {
+    struct wl_display *display;
+    struct wl_seat *seat;
+    struct ext_data_control_manager_v1 *manager;
+    struct ext_data_control_device_v1 *device;
+    // the newest selection; older ones are only kept alive by their pastes
+    HeldSelection *current;
+} holder;
+
+static void held_selection_destroy(HeldSelection *selection) {
+    for (size_t i = 0; i < selection->offer_count; i++) {
+        if (selection->offers[i].data) {
+            munmap(
+                (void *)selection->offers[i].data, selection->offers[i].length
+            );
+        }
+    }
+    free(selection);
+}
+
+static void held_selection_maybe_destroy(HeldSelection *selection) {
+    if (selection->is_cancelled && selection->transfer_count == 0) {
+        if (holder.current == selection) {
+            holder.current = NULL;
+        }
+        held_selection_destroy(selection);
+    }
+}
+
+/**
+ * Add one received offer to a selection.
+ * @param memfd The offer's contents; closed by this function.
+ * @returns false if the offer was malformed
+ */
+static bool held_selection_add_offer(
+    HeldSelection *selection, const ClipboardHandoffOffer *message, int memfd
+) {
+    if (memfd < 0 || selection->offer_count == MAX_OFFER_COUNT ||
+        !memfd_check_sealed(memfd, message->length)) {
+        report_error("malformed hand-off message");
+        if (memfd >= 0) {
+            close(memfd);
+        }
+        return false;
+    }
+
+    HeldOffer *offer = &selection->offers[selection->offer_count++];
+    memcpy(offer->mime, message->mime, sizeof(offer->mime));
+    offer->mime[sizeof(offer->mime) - 1] = '\0';
+    offer->length = message->length;
+    // Pages are only faulted in when pasted, and are backed by the memfd
+    // rather than by this process
+    offer->data =
+        message->length > 0
+            ? mmap(NULL, message->length, PROT_READ, MAP_SHARED, memfd, 0)
+            : NULL;
+    close(memfd);
+    if (offer->data == MAP_FAILED) {
+        report_error("couldn't map %s: %s", offer->mime, strerror(errno));
+        offer->data = NULL;
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Read a whole hand-off from a spaceshot invocation.
+ * @returns the selection, or NULL if the hand-off was malformed
+ */
+static HeldSelection *held_selection_receive(int socket_fd) {
+    HeldSelection *selection = calloc(1, sizeof(HeldSelection));
+    while (true) {
+        ClipboardHandoffOffer message;
+        int memfd;
+        ssize_t received = unix_socket_recv_with_fd(
+            socket_fd, &message, sizeof(message), &memfd
+        );
+        if (received == 0) {
+            // spaceshot is done sending
+            break;
+        }
+        if (received != sizeof(message)) {
+            report_error("malformed hand-off message");
+            if (memfd >= 0) {
+                close(memfd);
+            }
+            goto error;
+        }
+        if (!held_selection_add_offer(selection, &message, memfd)) {
+            goto error;
+        }
+    }
+    if (selection->offer_count == 0) {
+        goto error;
+    }
+    return selection;
+
+error:
+    held_selection_destroy(selection);
+    return NULL;
+}
+
+static void holder_transfer_destroy(HolderTransfer *transfer) {
+    if (transfer->loop_source) {
+        event_loop_remove(transfer->loop_source);
+    }
+    close(transfer->fd);
+    HeldSelection *selection = transfer->selection;
+    selection->transfer_count--;
+    free(transfer);
+    held_selection_maybe_destroy(selection);
+}
+
+/** @returns whether the transfer is over */
+static bool holder_transfer_advance(HolderTransfer *transfer) {
+    while (transfer->remaining > 0) {
+        ssize_t written =
+            write(transfer->fd, transfer->cursor, transfer->remaining);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            // EPIPE and friends mean the reader gave up; nothing to do
+            return errno != EAGAIN && errno != EWOULDBLOCK;
+        }
+        transfer->cursor += written;
+        transfer->remaining -= written;
+    }
+    return true;
+}
+
+static void holder_transfer_handle_ready(
+    void *data, int /* fd */, short /* revents */
+) {
+    HolderTransfer *transfer = data;
+    if (holder_transfer_advance(transfer)) {
+        holder_transfer_destroy(transfer);
+    }
+}
+
+static void source_handle_send(
+    void *data,
+    struct ext_data_control_source_v1 * /* source */,
+    const char *mime_type,
+    int fd
+) {
+    HeldSelection *selection = data;
+    HeldOffer *offer = NULL;
+    for (size_t i = 0; i < selection->offer_count; i++) {
+        if (strcmp(selection->offers[i].mime, mime_type) == 0) {
+            offer = &selection->offers[i];
+            break;
+        }
+    }
+    int flags = fcntl(fd, F_GETFL);
+    if (!offer || flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+        close(fd);
+        return;
+    }
+
+    HolderTransfer *transfer = calloc(1, sizeof(HolderTransfer));
+    transfer->selection = selection;
+    transfer->fd = fd;
+    transfer->cursor = offer->data;
+    transfer->remaining = offer->length;
+    selection->transfer_count++;
+    if (holder_transfer_advance(transfer)) {
+        holder_transfer_destroy(transfer);
+        return;
+    }
+    transfer->loop_source = event_loop_add_fd(
+        fd, POLLOUT, holder_transfer_handle_ready, transfer
+    );
+}
+
+static void source_handle_cancelled(
+    void *data, struct ext_data_control_source_v1 *source
+) {
+    HeldSelection *selection = data;
+    ext_data_control_source_v1_destroy(source);
+    selection->is_cancelled = true;
+    held_selection_maybe_destroy(selection);
+}
+
+static const struct ext_data_control_source_v1_listener source_listener = {
+    .send = source_handle_send,
+    .cancelled = source_handle_cancelled,
+};
+
+/** Take over the selection. The previous one gets cancelled by this. */
+static void held_selection_activate(HeldSelection *selection) {
+    selection->source =
+        ext_data_control_manager_v1_create_data_source(holder.manager);
+    for (size_t i = 0; i < selection->offer_count; i++) {
+        ext_data_control_source_v1_offer(
+            selection->source, selection->offers[i].mime
+        );
+    }
+    ext_data_control_source_v1_add_listener(
+        selection->source, &source_listener, selection
+    );
+    ext_data_control_device_v1_set_selection(holder.device, selection->source);
+    holder.current = selection;
+}
+
+static bool send_ack(int socket_fd) {
+    char ack = 1;
+    return send(socket_fd, &ack, 1, MSG_NOSIGNAL) == 1;
+}
+
+static void registry_handle_global(
+    void * /* data */,
+    struct wl_registry *registry,
+    uint32_t name,
+    const char *interface,
+    uint32_t /* version */
+) {
+    if (strcmp(interface, wl_seat_interface.name) == 0 && !holder.seat) {
+        // spaceshot uses the first seat too
+        holder.seat = wl_registry_bind(registry, name, &wl_seat_interface, 1);
+    } else if (strcmp(
+                   interface, ext_data_control_manager_v1_interface.name
+               ) == 0) {
+        holder.manager = wl_registry_bind(
+            registry, name, &ext_data_control_manager_v1_interface, 1
+        );
+    }
+}
+
+static void registry_handle_global_remove(
+    void * /* data */, struct wl_registry * /* registry */, uint32_t /* name */
+) {}
+
+static const struct wl_registry_listener registry_listener = {
+    .global = registry_handle_global,
+    .global_remove = registry_handle_global_remove,
+};
+
+static void connect_to_wayland() {
+    holder.display = wl_display_connect(NULL);
+    if (!holder.display) {
+        report_error_fatal("failed to connect to Wayland display");
+    }
+    struct wl_registry *registry = wl_display_get_registry(holder.display);
+    wl_registry_add_listener(registry, &registry_listener, NULL);
+    wl_display_roundtrip(holder.display);
+    wl_registry_destroy(registry);
+    if (!holder.seat || !holder.manager) {
+        report_error_fatal("ext-data-control is not available");
+    }
+    holder.device = ext_data_control_manager_v1_get_data_device(
+        holder.manager, holder.seat
+    );
+    event_loop_init(holder.display);
+}
+
+static void detach() {
+    setsid();
+    if (chdir("/") != 0) {
+        // this doesn't break anything, but shouldn't happen either
+        report_error("chdir failed: %s", strerror(errno));
+    }
+
+    int dev_null = open("/dev/null", O_RDWR);
+    if (dev_null >= 0) {
+        dup2(dev_null, STDIN_FILENO);
+        dup2(dev_null, STDOUT_FILENO);
+        dup2(dev_null, STDERR_FILENO);
+        close(dev_null);
+    }
+}
+
+/** Hold a single hand-off, passed in by the spaceshot that spawned us. */
+static int run_oneshot() {
+    HeldSelection *selection = held_selection_receive(CLIPBOARD_HANDOFF_FD);
+    if (!selection) {
+        return 1;
+    }
+    connect_to_wayland();
+    held_selection_activate(selection);
+    // make sure the compositor has seen it before acknowledging
+    wl_display_roundtrip(holder.display);
+    if (!send_ack(CLIPBOARD_HANDOFF_FD)) {
+        report_error_fatal("spaceshot went away during the hand-off");
+    }
+    close(CLIPBOARD_HANDOFF_FD);
+    detach();
+
+    // the selection is freed once it's cancelled and done being pasted
+    while (holder.current) {
+        if (event_loop_dispatch() == -1) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * A spaceshot invocation handing off to the persistent holder. Its messages
+ * are received as they arrive, so that a slow one doesn't hold up pastes.
+ */
+typedef struct {
+    int socket_fd;
+    EventLoopSource *loop_source;
+    HeldSelection *selection;
+    // the offer being received, which the socket may deliver in parts
+    ClipboardHandoffOffer message;
+    size_t received_length;
+    int memfd;
+} HandoffClient;
+
+static void handoff_client_destroy(HandoffClient *client) {
+    if (client->loop_source) {
+        event_loop_remove(client->loop_source);
+    }
+    close(client->socket_fd);
+    if (client->memfd >= 0) {
+        close(client->memfd);
+    }
+    if (client->selection) {
+        held_selection_destroy(client->selection);
+    }
+    free(client);
+}
+
+static void handle_activation_done(
+    void *data, struct wl_callback *callback, uint32_t /* callback_data */
+) {
+    HandoffClient *client = data;
+    wl_callback_destroy(callback);
+    send_ack(client->socket_fd);
+    handoff_client_destroy(client);
+}
+
+static struct wl_callback_listener activation_listener = {
+    .done = handle_activation_done,
+};
+
+/**
+ * Take over the selection with the client's offers, and acknowledge once the
+ * compositor has seen it. This waits on the event loop rather than with a
+ * roundtrip, since it's called from one of its callbacks.
+ */
+static void handoff_client_activate(HandoffClient *client) {
+    event_loop_remove(client->loop_source);
+    client->loop_source = NULL;
+    held_selection_activate(client->selection);
+    client->selection = NULL;
+    struct wl_callback *callback = wl_display_sync(holder.display);
+    wl_callback_add_listener(callback, &activation_listener, client);
+}
+
+static void handoff_client_handle_readable(
+    void *data, int /* fd */, short /* revents */
+) {
+    HandoffClient *client = data;
+    while (true) {
+        ssize_t received = unix_socket_recv_some_with_fd(
+            client->socket_fd,
+            (char *)&client->message + client->received_length,
+            sizeof(client->message) - client->received_length,
+            &client->memfd
+        );
+        if (received < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                // wait for the rest
+                return;
+            }
+            report_error("couldn't receive hand-off: %s", strerror(errno));
+            break;
+        }
+        if (received == 0) {
+            // spaceshot is done sending
+            if (client->received_length > 0) {
+                report_error("malformed hand-off message");
+            } else if (client->selection->offer_count > 0) {
+                handoff_client_activate(client);
+                return;
+            }
+            break;
+        }
+
+        client->received_length += received;
+        if (client->received_length < sizeof(client->message)) {
+            continue;
+        }
+        client->received_length = 0;
+        int memfd = client->memfd;
+        client->memfd = -1;
+        if (!held_selection_add_offer(
+                client->selection, &client->message, memfd
+            )) {
+            break;
+        }
+    }
+    handoff_client_destroy(client);
+}
+
+static void
+handle_client(void * /* data */, int listen_fd, short /* revents */) {
+    int client_fd = accept(listen_fd, NULL, NULL);
+    if (client_fd < 0) {
+        return;
+    }
+    fcntl(client_fd, F_SETFD, FD_CLOEXEC);
+    fcntl(client_fd, F_SETFL, fcntl(client_fd, F_GETFL) | O_NONBLOCK);
+
+    HandoffClient *client = calloc(1, sizeof(HandoffClient));
+    client->socket_fd = client_fd;
+    client->selection = calloc(1, sizeof(HeldSelection));
+    client->memfd = -1;
+    client->loop_source = event_loop_add_fd(
+        client_fd, POLLIN, handoff_client_handle_readable, client
+    );
+}
+
+/** Hold hand-offs from any number of spaceshot invocations over a socket. */
+static int run_persistent() {
+    int listen_fd = unix_socket_from_activation();
+    if (listen_fd < 0) {
+        char *socket_path =
+            unix_socket_runtime_path(CLIPBOARD_HOLDER_SOCKET_NAME);
+        if (!socket_path) {
+            report_error_fatal("XDG_RUNTIME_DIR is not set");
+        }
+        listen_fd = unix_socket_listen(socket_path);
+        if (listen_fd < 0) {
+            if (errno == EADDRINUSE) {
+                // someone else got there first, which is fine
+                log_debug("a persistent holder is already running\n");
+                return 0;
+            }
+            report_error_fatal(
+                "couldn't listen on %s: %s", socket_path, strerror(errno)
+            );
+        }
+        free(socket_path);
+    }
+
+    connect_to_wayland();
+    detach();
+    event_loop_add_fd(listen_fd, POLLIN, handle_client, NULL);
+    while (event_loop_dispatch() != -1) {
+    }
+    // the compositor went away, which takes the clipboard with it
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    set_program_name(argv[0]);
+    signal(SIGPIPE, SIG_IGN);
+
+    if (argc > 1 && strcmp(argv[1], "--persistent") == 0) {
+        return run_persistent();
+    }
+    return run_oneshot();
+}
@@ -0,0 +1,27 @@
+#pragma once
+#include <stdint.h>
+
+// This describes how spaceshot hands its clipboard contents over to
+// spaceshot-clipboard-holder, a small helper which keeps them available after
+// spaceshot itself exits.
+//
+// spaceshot spawns the holder with one end of a socket pair as
+// CLIPBOARD_HANDOFF_FD. It then sends one ClipboardHandoffOffer per MIME
+// type, each carrying a sealed memfd with the data, and shuts down its end
+// for writing. Once the holder has taken over the selection, it replies with
+// a single byte.
+//
+// A persistent holder (started with --persistent) speaks the same protocol,
+// once per connection, on CLIPBOARD_HOLDER_SOCKET_NAME in $XDG_RUNTIME_DIR.
+// It can also be socket-activated, with the listening socket passed as in
+// sd_listen_fds(3).
+
+constexpr int CLIPBOARD_HANDOFF_FD = 3;
+static const char *const CLIPBOARD_HOLDER_SOCKET_NAME =
+    "spaceshot-clipboard.sock";
+
+typedef struct {
+    uint64_t length;
+    // NUL-terminated
+    char mime[120];
+} ClipboardHandoffOffer;
@@ -0,0 +1,340 @@
+#include "compare.h"
+#include "capture-target.h"
+#include "event-loop.h"
+#include "image-compare.h"
+#include "log.h"
+#include "save.h"
+#include "wayland/globals.h"
+#include "wayland/screen-capture.h"
+#include <errno.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+
+// How often toplevels are recaptured while waiting for a match; unlike
+// outputs, they don't have a way to wait for changes
+constexpr uint32_t TOPLEVEL_RETRY_MS = 100;
+
+static struct {
+    Image *reference;
+    uint8_t tolerance;
+    const char *diff_path;
+    uint32_t timeout_ms;
+
+    WrappedOutput *output;
+    // in logical coordinates relative to the output
+    BBox region;
+    WrappedToplevel *toplevel;
+    CaptureSession *session;
+    bool is_capturing;
+
+    // the most recent capture, and where the target is in it (in pixels)
+    Image *latest;
+    uint32_t latest_x;
+    uint32_t latest_y;
+    uint32_t latest_width;
+    uint32_t latest_height;
+    uint32_t attempt_count;
+
+    bool is_done;
+    bool is_match;
+    bool has_failed;
+    int timeout_fd;
+    EventLoopSource *timeout_source;
+    int retry_fd;
+    EventLoopSource *retry_source;
+} compare;
+
+static int create_timer(uint32_t ms, bool is_periodic) {
+    int fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+    if (fd < 0) {
+        report_error_fatal("couldn't create timer: %s", strerror(errno));
+    }
+    struct timespec duration = {
+        .tv_sec = ms / 1000,
+        .tv_nsec = (long)(ms % 1000) * 1000000,
+    };
+    struct itimerspec timer_spec = {
+        .it_interval = is_periodic ? duration : (struct timespec){0},
+        .it_value = duration,
+    };
+    timerfd_settime(fd, 0, &timer_spec, NULL);
+    return fd;
+}
+
+static bool is_size_matching() {
+    return compare.latest_width == compare.reference->width &&
+           compare.latest_height == compare.reference->height;
+}
+
+static void write_diff_image() {
+    Image *diff = image_compare_make_diff(
+        compare.latest,
+        compare.latest_x,
+        compare.latest_y,
+        compare.reference,
+        compare.tolerance
+    );
+    LinkBuffer *encoded = is_png_needed_for_saving(compare.diff_path)
+                              ? image_save_png(diff)
+                              : NULL;
+    save_screenshot(diff, encoded, compare.diff_path);
+    if (encoded) {
+        link_buffer_destroy(encoded);
+    }
+    image_destroy(diff);
+}
+
+/** Do a full comparison of the latest capture, and print the summary. */
+static void report_result() {
+    if (!compare.latest) {
+        report_error("nothing was captured");
+        compare.has_failed = true;
+        return;
+    }
+
+    bool is_size_matched = is_size_matching();
+    ImageComparison result = {0};
+    if (is_size_matched) {
+        result = image_compare(
+            compare.latest,
+            compare.latest_x,
+            compare.latest_y,
+            compare.reference,
+            compare.tolerance,
+            false
+        );
+    }
+    compare.is_match = is_size_matched && result.mismatched_count == 0;
+
+    printf(
+        "{\"match\": %s, \"size_matches\": %s, \"attempts\": %u, "
+        "\"width\": %u, \"height\": %u, \"mismatched_pixels\": %" PRIu64 ", "
+        "\"bounding_box\": ",
+        compare.is_match ? "true" : "false",
+        is_size_matched ? "true" : "false",
+        compare.attempt_count,
+        compare.latest_width,
+        compare.latest_height,
+        result.mismatched_count
+    );
+    if (result.mismatched_count > 0) {
+        printf(
+            "{\"x\": %u, \"y\": %u, \"width\": %u, \"height\": %u}}\n",
+            result.min_x,
+            result.min_y,
+            result.max_x - result.min_x + 1,
+            result.max_y - result.min_y + 1
+        );
+    } else {
+        printf("null}\n");
+    }
+    fflush(stdout);
+
+    if (compare.diff_path && is_size_matched) {
+        write_diff_image();
+    }
+}
+
+/** Take in a new capture. @p area is where the target is in the image. */
+static void check_capture(Image *image, BBox area) {
+    compare.attempt_count++;
+    if (compare.latest) {
+        image_destroy(compare.latest);
+    }
+    area = bbox_constrain(
+        area, (BBox){.width = image->width, .height = image->height}
+    );
+    compare.latest = image;
+    compare.latest_x = area.x;
+    compare.latest_y = area.y;
+    compare.latest_width = area.width > 0.0 ? area.width : 0;
+    compare.latest_height = area.height > 0.0 ? area.height : 0;
+
+    if (!compare.timeout_ms) {
+        // only one chance, so there's no point in a quick check
+        compare.is_done = true;
+        return;
+    }
+
+    bool is_match = is_size_matching() &&
+                    image_compare(
+                        image,
+                        compare.latest_x,
+                        compare.latest_y,
+                        compare.reference,
+                        compare.tolerance,
+                        true
+                    )
+                            .mismatched_count == 0;
+    log_debug(
+        "attempt %u: %s\n", compare.attempt_count, is_match ? "match" : "no"
+    );
+    if (is_match) {
+        compare.is_done = true;
+    }
+}
+
+static void handle_captured_image(Image *image, void * /* data */) {
+    compare.is_capturing = false;
+    if (!image) {
+        report_error("capturing the target failed");
+        compare.has_failed = true;
+        compare.is_done = true;
+        return;
+    }
+    if (compare.is_done) {
+        image_destroy(image);
+        return;
+    }
+    check_capture(
+        image, (BBox){.width = image->width, .height = image->height}
+    );
+}
+
+static void handle_session_frame(
+    Image *image,
+    const BBox * /* damage */,
+    size_t /* damage_count */,
+    void * /* data */
+) {
+    if (!image) {
+        report_error("capturing the target failed");
+        compare.has_failed = true;
+        compare.is_done = true;
+        return;
+    }
+    if (compare.is_done) {
+        image_destroy(image);
+        return;
+    }
+
+    double scale = image->width / compare.output->logical_bounds.width;
+    check_capture(image, bbox_round(bbox_scale(compare.region, scale)));
+    if (!compare.is_done) {
+        // compositors only send the next frame once something changes
+        capture_session_request_frame(compare.session);
+    }
+}
+
+static void capture_once() {
+    compare.is_capturing = true;
+    if (compare.toplevel) {
+        if (!is_toplevel_valid(compare.toplevel)) {
+            report_error("toplevel disappeared while screenshotting");
+            compare.has_failed = true;
+            compare.is_done = true;
+            compare.is_capturing = false;
+            return;
+        }
+        capture_toplevel(compare.toplevel, handle_captured_image, NULL);
+    } else if (compare.region.x != 0.0 || compare.region.y != 0.0 ||
+               compare.region.width != compare.output->logical_bounds.width ||
+               compare.region.height !=
+                   compare.output->logical_bounds.height) {
+        capture_output_region(
+            compare.output, compare.region, handle_captured_image, NULL
+        );
+    } else {
+        capture_output(compare.output, handle_captured_image, NULL);
+    }
+}
+
+static void handle_retry_timer(void * /* data */, int fd, short /* revents */) {
+    uint64_t expirations;
+    if (read(fd, &expirations, sizeof(expirations)) != sizeof(expirations)) {
+        return;
+    }
+    if (!compare.is_capturing && !compare.is_done) {
+        capture_once();
+    }
+}
+
+static void
+handle_timeout_timer(void * /* data */, int fd, short /* revents */) {
+    uint64_t expirations;
+    if (read(fd, &expirations, sizeof(expirations)) != sizeof(expirations)) {
+        return;
+    }
+    log_debug("no match after %u ms\n", compare.timeout_ms);
+    compare.is_done = true;
+}
+
+static void remove_timer(EventLoopSource **source, int fd) {
+    if (*source) {
+        event_loop_remove(*source);
+        close(fd);
+        *source = NULL;
+    }
+}
+
+int compare_run(const Arguments *args) {
+    compare.reference = image_load_png(args->reference_path);
+    if (!compare.reference) {
+        return 2;
+    }
+    compare.tolerance = args->tolerance;
+    compare.diff_path = args->diff_path;
+    compare.timeout_ms = args->match_timeout_ms;
+
+    const TargetParams *target = &args->target_params;
+    if (target->type == CAPTURE_TOPLEVEL) {
+        compare.toplevel = find_toplevel_by_identifier(target->toplevel_id);
+        if (!compare.toplevel) {
+            report_error_fatal("couldn't find matching toplevel");
+        }
+    } else {
+        compare.output = find_target_output(target, &compare.region);
+    }
+
+    if (compare.timeout_ms) {
+        compare.timeout_fd = create_timer(compare.timeout_ms, false);
+        compare.timeout_source = event_loop_add_fd(
+            compare.timeout_fd, POLLIN, handle_timeout_timer, NULL
+        );
+    }
+    if (compare.timeout_ms && compare.output) {
+        // the session only delivers frames when the screen changes
+        compare.session =
+            capture_session_new(compare.output, handle_session_frame, NULL);
+        capture_session_request_frame(compare.session);
+    } else {
+        if (compare.timeout_ms) {
+            compare.retry_fd = create_timer(TOPLEVEL_RETRY_MS, true);
+            compare.retry_source = event_loop_add_fd(
+                compare.retry_fd, POLLIN, handle_retry_timer, NULL
+            );
+        }
+        capture_once();
+    }
+
+    while (!compare.is_done || compare.is_capturing) {
+        if (event_loop_dispatch() == -1) {
+            report_error("lost connection to the compositor");
+            compare.has_failed = true;
+            break;
+        }
+    }
+    remove_timer(&compare.timeout_source, compare.timeout_fd);
+    remove_timer(&compare.retry_source, compare.retry_fd);
+    if (compare.session) {
+        capture_session_destroy(compare.session);
+    }
+
+    if (!compare.has_failed) {
+        report_result();
+    }
+    if (compare.latest) {
+        image_destroy(compare.latest);
+    }
+    image_destroy(compare.reference);
+
+    if (compare.has_failed) {
+        return 2;
+    }
+    return compare.is_match ? 0 : 1;
+}
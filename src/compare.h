@@ -0,0 +1,11 @@
+#pragma once
+#include "args.h"
+
+/**
+ * Capture the target described by @p args and compare it with the reference
+ * image, printing a JSON summary to stdout. The Wayland globals need to be
+ * set up already.
+ * @returns the exit code: 0 if the target matches, 1 if it doesn't, and 2 on
+ * errors
+ */
+int compare_run(const Arguments *args);
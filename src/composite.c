@@ -0,0 +1,204 @@
+#include "composite.h"
+#include "log.h"
+#include "worker.h"
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct {
+    Image *result;
+    size_t remaining;
+    CompositeCallback callback;
+    void *data;
+} CompositeJob;
+
+/** One part's copy into the result. */
+typedef struct {
+    CompositeJob *job;
+    Image *source;
+    /** Where the part goes in the result, in device pixels. */
+    int64_t x;
+    int64_t y;
+} CompositeCopy;
+
+/**
+ * A batch of copies that run on the same worker, one after the other.
+ * Usually that's just one, but overlapping parts can't be copied in parallel.
+ */
+typedef struct {
+    CompositeJob *job;
+    CompositeCopy *copies;
+    size_t count;
+} CompositeBatch;
+
+TIMING_DECLARE(composite_images);
+
+bool composite_get_shared_scale(
+    const CompositePart *parts, size_t count, double *scale
+) {
+    // Each edge of an image can be off by up to half a pixel, so every part
+    // only narrows the scale down to a range. Small parts (like a sliver of
+    // a region on a neighbouring output) give a wide range, so the estimate
+    // comes from the biggest one.
+    double min_scale = 0;
+    double max_scale = INFINITY;
+    double largest_area = -1;
+    for (size_t i = 0; i < count; i++) {
+        const Image *image = parts[i].image;
+        BBox bounds = parts[i].logical_bounds;
+        min_scale = fmax(min_scale, (image->width - 1.0) / bounds.width);
+        min_scale = fmax(min_scale, (image->height - 1.0) / bounds.height);
+        max_scale = fmin(max_scale, (image->width + 1.0) / bounds.width);
+        max_scale = fmin(max_scale, (image->height + 1.0) / bounds.height);
+        if (bounds.width * bounds.height > largest_area) {
+            largest_area = bounds.width * bounds.height;
+            *scale = image->width / bounds.width;
+        }
+    }
+    if (count == 0 || min_scale > max_scale) {
+        return false;
+    }
+    *scale = fmin(fmax(*scale, min_scale), max_scale);
+    return true;
+}
+
+static void copy_part(CompositeCopy *copy) {
+    Image *result = copy->job->result;
+    Image *source = copy->source;
+    Image *converted = NULL;
+    if (source->format != result->format) {
+        converted = image_convert_format(source, result->format);
+        source = converted;
+    }
+
+    // clip to the result, in case the part sticks out
+    int64_t src_x = copy->x < 0 ? -copy->x : 0;
+    int64_t src_y = copy->y < 0 ? -copy->y : 0;
+    int64_t dst_x = copy->x + src_x;
+    int64_t dst_y = copy->y + src_y;
+    int64_t width = (int64_t)source->width - src_x;
+    int64_t height = (int64_t)source->height - src_y;
+    if (dst_x + width > result->width) {
+        width = result->width - dst_x;
+    }
+    if (dst_y + height > result->height) {
+        height = result->height - dst_y;
+    }
+
+    if (width > 0 && height > 0) {
+        uint32_t bytes_per_pixel = image_format_bytes_per_pixel(result->format);
+        for (int64_t row = 0; row < height; row++) {
+            memcpy(
+                result->data + (dst_y + row) * result->stride +
+                    dst_x * bytes_per_pixel,
+                source->data + (src_y + row) * source->stride +
+                    src_x * bytes_per_pixel,
+                width * bytes_per_pixel
+            );
+        }
+    }
+    image_destroy(converted);
+}
+
+static void composite_batch_run(void *data) {
+    CompositeBatch *batch = data;
+    for (size_t i = 0; i < batch->count; i++) {
+        copy_part(&batch->copies[i]);
+    }
+}
+
+static void composite_batch_done(void *data) {
+    CompositeBatch *batch = data;
+    CompositeJob *job = batch->job;
+    for (size_t i = 0; i < batch->count; i++) {
+        image_destroy(batch->copies[i].source);
+    }
+    free(batch->copies);
+    free(batch);
+
+    job->remaining--;
+    if (job->remaining == 0) {
+        TIMING_END(composite_images);
+        job->callback(job->result, job->data);
+        free(job);
+    }
+}
+
+static bool are_parts_overlapping(const CompositePart *parts, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        for (size_t j = i + 1; j < count; j++) {
+            if (bbox_intersects(
+                    parts[i].logical_bounds, parts[j].logical_bounds
+                )) {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+void composite_images(
+    const CompositePart *parts,
+    size_t count,
+    BBox bounds,
+    double scale,
+    CompositeCallback callback,
+    void *data
+) {
+    TIMING_START_DECLARED(composite_images);
+    CompositeJob *job = calloc(1, sizeof(CompositeJob));
+    job->callback = callback;
+    job->data = data;
+    job->result = image_new(
+        round(bounds.width * scale),
+        round(bounds.height * scale),
+        parts[0].image->format
+    );
+
+    CompositeCopy *copies = calloc(count, sizeof(CompositeCopy));
+    double covered_area = 0;
+    for (size_t i = 0; i < count; i++) {
+        copies[i].job = job;
+        copies[i].source = image_ref(parts[i].image);
+        copies[i].x = round((parts[i].logical_bounds.x - bounds.x) * scale);
+        copies[i].y = round((parts[i].logical_bounds.y - bounds.y) * scale);
+        if (bbox_intersects(parts[i].logical_bounds, bounds)) {
+            BBox visible = bbox_constrain(parts[i].logical_bounds, bounds);
+            covered_area += visible.width * visible.height;
+        }
+    }
+
+    bool is_overlapping = are_parts_overlapping(parts, count);
+    // Without overlaps, the parts only leave gaps if they don't add up to
+    // the whole area. Fresh zeroed pages are cheap, unlike clearing them.
+    if (is_overlapping || covered_area < bounds.width * bounds.height - 0.5) {
+        free(job->result->data);
+        job->result->data = calloc(job->result->height, job->result->stride);
+        if (!job->result->data) {
+            report_error_fatal("couldn't allocate composite image");
+        }
+    }
+
+    if (is_overlapping) {
+        // Overlapping parts are written in order, so the later ones win
+        log_debug("compositing %zu overlapping parts in sequence\n", count);
+        CompositeBatch *batch = calloc(1, sizeof(CompositeBatch));
+        batch->job = job;
+        batch->copies = copies;
+        batch->count = count;
+        job->remaining = 1;
+        worker_run(composite_batch_run, composite_batch_done, batch);
+        return;
+    }
+
+    job->remaining = count;
+    for (size_t i = 0; i < count; i++) {
+        CompositeBatch *batch = calloc(1, sizeof(CompositeBatch));
+        batch->job = job;
+        batch->copies = malloc(sizeof(CompositeCopy));
+        batch->copies[0] = copies[i];
+        batch->count = 1;
+        worker_run(composite_batch_run, composite_batch_done, batch);
+    }
+    free(copies);
+}
@@ -0,0 +1,44 @@
+#pragma once
+#include "bbox.h"
+#include "image.h"
+#include <stddef.h>
+
+// Assembling images of several outputs into one, for screenshots that span
+// more than one of them. The images are only ever copied, never resampled,
+// so this only works when every output has the same scale.
+
+typedef struct {
+    Image *image;
+    /** The logical area the image covers. */
+    BBox logical_bounds;
+} CompositePart;
+
+/**
+ * Get the device-to-logical scale shared by every part, within the precision
+ * that their pixel sizes allow.
+ * @returns whether there is one; if the parts' scales differ, they can't be
+ * composited
+ */
+bool composite_get_shared_scale(
+    const CompositePart *parts, size_t count, double *scale
+);
+
+typedef void (*CompositeCallback)(Image *image, void *data);
+
+/**
+ * Put the parts together by their logical position, into one image covering
+ * the logical area @p bounds at @p scale. Each part is copied on the worker
+ * pool, in parallel. Areas not covered by any part are left zeroed, so black
+ * (or transparent, if the format has alpha).
+ * There needs to be at least one part; the result is in the first one's
+ * format, and is passed to @p callback on the main thread. The parts' images
+ * get a new reference, so the caller can drop theirs right away.
+ */
+void composite_images(
+    const CompositePart *parts,
+    size_t count,
+    BBox bounds,
+    double scale,
+    CompositeCallback callback,
+    void *data
+);
@@ -0,0 +1,156 @@
+#include "compressed-image.h"
+#include "log.h"
+#include "tile-rle.h"
+#include <stdlib.h>
+#include <string.h>
+
+static uint32_t min_u32(uint32_t a, uint32_t b) {
+    return a < b ? a : b;
+}
+
+CompressedImage *compressed_image_new(const Image *image) {
+    TIMING_START(compressed_image_new);
+    CompressedImage *result = calloc(1, sizeof(CompressedImage));
+    result->width = image->width;
+    result->height = image->height;
+    result->format = image->format;
+    atomic_init(&result->ref_count, 1);
+    result->tiles_x = (image->width + TILE_RLE_SIZE - 1) / TILE_RLE_SIZE;
+    result->tiles_y = (image->height + TILE_RLE_SIZE - 1) / TILE_RLE_SIZE;
+    size_t tile_count = (size_t)result->tiles_x * result->tiles_y;
+    result->tile_offsets = malloc((tile_count + 1) * sizeof(size_t));
+
+    // Start with enough room for the whole image at a 4:1 ratio, and grow
+    // from there if needed. The result is trimmed at the end.
+    size_t capacity = (size_t)image->width * image->height + 1;
+    if (capacity < TILE_RLE_MAX_ENCODED_SIZE) {
+        capacity = TILE_RLE_MAX_ENCODED_SIZE;
+    }
+    result->data = malloc(capacity);
+    size_t size = 0;
+    for (uint32_t tile_y = 0; tile_y < result->tiles_y; tile_y++) {
+        uint32_t y = tile_y * TILE_RLE_SIZE;
+        uint32_t height = min_u32(image->height - y, TILE_RLE_SIZE);
+        for (uint32_t tile_x = 0; tile_x < result->tiles_x; tile_x++) {
+            uint32_t x = tile_x * TILE_RLE_SIZE;
+            uint32_t width = min_u32(image->width - x, TILE_RLE_SIZE);
+            if (capacity - size < TILE_RLE_MAX_ENCODED_SIZE) {
+                capacity *= 2;
+                result->data = realloc(result->data, capacity);
+            }
+            result->tile_offsets[tile_y * result->tiles_x + tile_x] = size;
+            size += tile_rle_encode(
+                image, x, y, width, height, result->data + size
+            );
+        }
+    }
+    result->tile_offsets[tile_count] = size;
+    // keep a byte around so that empty images don't realloc to NULL
+    result->data = realloc(result->data, size + 1);
+
+    log_debug(
+        "compressed %ux%u image to %zu bytes (from %zu)\n",
+        image->width,
+        image->height,
+        size,
+        (size_t)image->stride * image->height
+    );
+    TIMING_END(compressed_image_new);
+    return result;
+}
+
+Image *compressed_image_crop(
+    const CompressedImage *image,
+    uint32_t x,
+    uint32_t y,
+    uint32_t width,
+    uint32_t height
+) {
+    Image *result = image_new(width, height, image->format);
+    if (width == 0 || height == 0) {
+        return result;
+    }
+
+    // Tiles at the edges of the area are decompressed into a scratch tile,
+    // and only the overlapping part is copied over
+    Image *scratch = image_new(TILE_RLE_SIZE, TILE_RLE_SIZE, image->format);
+    uint32_t first_tile_x = x / TILE_RLE_SIZE;
+    uint32_t first_tile_y = y / TILE_RLE_SIZE;
+    uint32_t last_tile_x = (x + width - 1) / TILE_RLE_SIZE;
+    uint32_t last_tile_y = (y + height - 1) / TILE_RLE_SIZE;
+    for (uint32_t tile_y = first_tile_y; tile_y <= last_tile_y; tile_y++) {
+        uint32_t tile_top = tile_y * TILE_RLE_SIZE;
+        uint32_t tile_height = min_u32(image->height - tile_top, TILE_RLE_SIZE);
+        for (uint32_t tile_x = first_tile_x; tile_x <= last_tile_x; tile_x++) {
+            uint32_t tile_left = tile_x * TILE_RLE_SIZE;
+            uint32_t tile_width =
+                min_u32(image->width - tile_left, TILE_RLE_SIZE);
+            size_t index = (size_t)tile_y * image->tiles_x + tile_x;
+            size_t offset = image->tile_offsets[index];
+            size_t size = image->tile_offsets[index + 1] - offset;
+            if (tile_left >= x && tile_top >= y &&
+                tile_left + tile_width <= x + width &&
+                tile_top + tile_height <= y + height) {
+                tile_rle_decode(
+                    image->data + offset,
+                    size,
+                    result,
+                    tile_left - x,
+                    tile_top - y,
+                    tile_width,
+                    tile_height
+                );
+                continue;
+            }
+
+            tile_rle_decode(
+                image->data + offset,
+                size,
+                scratch,
+                0,
+                0,
+                tile_width,
+                tile_height
+            );
+
+            uint32_t left = tile_left > x ? tile_left : x;
+            uint32_t top = tile_top > y ? tile_top : y;
+            uint32_t right = min_u32(tile_left + tile_width, x + width);
+            uint32_t bottom = min_u32(tile_top + tile_height, y + height);
+            for (uint32_t row = top; row < bottom; row++) {
+                memcpy(
+                    result->data + (size_t)(row - y) * result->stride +
+                        (left - x) * sizeof(uint32_t),
+                    scratch->data + (size_t)(row - tile_top) * scratch->stride +
+                        (left - tile_left) * sizeof(uint32_t),
+                    (right - left) * sizeof(uint32_t)
+                );
+            }
+        }
+    }
+    image_destroy(scratch);
+    return result;
+}
+
+Image *compressed_image_decompress(const CompressedImage *image) {
+    return compressed_image_crop(image, 0, 0, image->width, image->height);
+}
+
+size_t compressed_image_size(const CompressedImage *image) {
+    size_t tile_count = (size_t)image->tiles_x * image->tiles_y;
+    return sizeof(CompressedImage) + (tile_count + 1) * sizeof(size_t) +
+           image->tile_offsets[tile_count];
+}
+
+CompressedImage *compressed_image_ref(CompressedImage *image) {
+    atomic_fetch_add(&image->ref_count, 1);
+    return image;
+}
+
+void compressed_image_destroy(CompressedImage *image) {
+    if (atomic_fetch_sub(&image->ref_count, 1) == 1) {
+        free(image->tile_offsets);
+        free(image->data);
+        free(image);
+    }
+}
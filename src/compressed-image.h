@@ -0,0 +1,54 @@
+#pragma once
+#include "image.h"
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * An image kept in a compressed form, split into tiles that can be
+ * decompressed separately, so that reading a small part of it is cheap.
+ */
+typedef struct {
+    uint32_t width;
+    uint32_t height;
+    ImageFormat format;
+    uint32_t tiles_x;
+    uint32_t tiles_y;
+    /** Where each tile starts in @c data, plus the end of the last one. */
+    size_t *tile_offsets;
+    uint8_t *data;
+    atomic_int ref_count;
+} CompressedImage;
+
+/** Compress an image. This can take a while, so it's best done on a worker. */
+CompressedImage *compressed_image_new(const Image *image);
+
+/**
+ * Decompress part of an image, only touching the tiles that overlap it.
+ * The area needs to be within the image.
+ */
+Image *compressed_image_crop(
+    const CompressedImage *image,
+    uint32_t x,
+    uint32_t y,
+    uint32_t width,
+    uint32_t height
+);
+
+/** Decompress the whole image. */
+Image *compressed_image_decompress(const CompressedImage *image);
+
+/** Get the amount of memory the compressed image takes up. */
+size_t compressed_image_size(const CompressedImage *image);
+
+/**
+ * Take another reference to a compressed image, for sharing it.
+ * @returns the same image
+ */
+CompressedImage *compressed_image_ref(CompressedImage *image);
+
+/**
+ * Drop a reference to a compressed image, freeing it once the last one is
+ * gone. New compressed images start out with one reference.
+ */
+void compressed_image_destroy(CompressedImage *image);
@@ -0,0 +1,68 @@
+#include "content-hash.h"
+#include "log.h"
+#include <string.h>
+
+// Four independent 64-bit lanes, each of which takes in two pixels at a
+// time. GCC lowers these to the target's SIMD instructions where it can.
+typedef uint64_t u64x4 __attribute__((vector_size(32)));
+
+constexpr uint32_t BLOCK_PIXELS = 8;
+constexpr uint64_t HASH_MULTIPLIER = 0x9e3779b97f4a7c15;
+
+/** The bits of each pixel that are actually visible, for two pixels. */
+static uint64_t get_pixel_pair_mask(ImageFormat format) {
+    switch (format & ~IMAGE_FORMAT_FLIPPED_ORDER) {
+    case IMAGE_FORMAT_XRGB8888:
+        return 0x00ffffff00ffffff;
+    case IMAGE_FORMAT_ARGB8888:
+        return 0xffffffffffffffff;
+    case IMAGE_FORMAT_XRGB2101010:
+        return 0x3fffffff3fffffff;
+    default:
+        REPORT_UNHANDLED("image format", "%x", format);
+    }
+}
+
+/** The splitmix64 finalizer, which spreads every input bit around. */
+static inline uint64_t mix(uint64_t value) {
+    value ^= value >> 30;
+    value *= 0xbf58476d1ce4e5b9;
+    value ^= value >> 27;
+    value *= 0x94d049bb133111eb;
+    value ^= value >> 31;
+    return value;
+}
+
+uint64_t content_hash(
+    const Image *image, uint32_t x, uint32_t y, uint32_t width, uint32_t height
+) {
+    uint64_t pair_mask = get_pixel_pair_mask(image->format);
+    uint32_t pixel_mask = pair_mask & 0xffffffff;
+    // Start the lanes off differently, so that swapped blocks don't cancel out
+    u64x4 lanes = {1, 2, 3, 4};
+    uint64_t tail = (uint64_t)width << 32 | height;
+
+    for (uint32_t row = y; row < y + height; row++) {
+        const uint8_t *src =
+            image->data + (size_t)row * image->stride + (size_t)x * 4;
+        uint32_t col = 0;
+        for (; col + BLOCK_PIXELS <= width; col += BLOCK_PIXELS) {
+            u64x4 block;
+            memcpy(&block, src + col * 4, sizeof(block));
+            lanes = (lanes ^ (block & pair_mask)) * HASH_MULTIPLIER;
+            lanes ^= lanes >> 29;
+        }
+        for (; col < width; col++) {
+            uint32_t pixel;
+            memcpy(&pixel, src + col * 4, sizeof(pixel));
+            tail = (tail ^ (pixel & pixel_mask)) * HASH_MULTIPLIER;
+            tail ^= tail >> 29;
+        }
+    }
+
+    uint64_t result = mix(tail);
+    for (int i = 0; i < 4; i++) {
+        result = mix(result ^ lanes[i]);
+    }
+    return result;
+}
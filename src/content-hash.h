@@ -0,0 +1,12 @@
+#pragma once
+#include "image.h"
+#include <stdint.h>
+
+/**
+ * Hash the pixels in an area of an image, ignoring padding bits (such as the
+ * X in XRGB), so that the result only changes when the visible content does.
+ * This isn't cryptographic; it's meant for spotting changes quickly.
+ */
+uint64_t content_hash(
+    const Image *image, uint32_t x, uint32_t y, uint32_t width, uint32_t height
+);
@@ -0,0 +1,489 @@
+#include "daemon.h"
+#include "event-loop.h"
+#include "log.h"
+#include "unix-socket.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+#include <wayland-util.h>
+
+constexpr uint32_t MAX_ARGUMENT_COUNT = 4096;
+/**
+ * What the argument-checking process exits with if parsing returned, plus the
+ * request's priority.
+ */
+constexpr int ARGUMENTS_VALID_EXIT_CODE = 100;
+constexpr int STANDARD_STREAM_COUNT = 3;
+
+typedef enum {
+    DAEMON_CLIENT_RECEIVING_STREAMS,
+    DAEMON_CLIENT_RECEIVING_REQUEST,
+    DAEMON_CLIENT_RECEIVING_PAYLOAD,
+    DAEMON_CLIENT_CHECKING,
+    DAEMON_CLIENT_QUEUED,
+} DaemonClientState;
+
+typedef enum {
+    RECEIVE_INCOMPLETE,
+    RECEIVE_DONE,
+    RECEIVE_FAILED,
+} ReceiveResult;
+
+typedef struct {
+    struct wl_list link;
+    DaemonClientState state;
+    int socket_fd;
+    /** Watches the socket while receiving, and the check after that. */
+    EventLoopSource *source;
+    /** The client's stdin, stdout and stderr. */
+    int streams[STANDARD_STREAM_COUNT];
+    int stream_count;
+    DaemonRequest request;
+    /** How much of the request or payload has been received so far. */
+    size_t received_length;
+    char *payload;
+    const char *cwd;
+    int argc;
+    char **argv;
+    /** The argument-checking process, and the pipe that closes as it exits. */
+    pid_t check_pid;
+    int check_fd;
+    /** When the client connected, in CLOCK_MONOTONIC microseconds. */
+    uint64_t received_at_us;
+    DaemonPriority priority;
+} DaemonClient;
+
+static struct {
+    pid_t pid;
+    int listen_fd;
+    const DaemonHandlers *handlers;
+    /** Requests that are still being received or checked. */
+    struct wl_list pending;
+    /** Requests waiting for their turn, by priority and then by arrival. */
+    struct wl_list queue;
+    /** The client being served, or -1. */
+    int current_client_fd;
+    /** The daemon's own standard streams, put back after each request. */
+    int own_streams[STANDARD_STREAM_COUNT];
+} daemon_state;
+
+static void daemon_client_destroy(DaemonClient *client) {
+    wl_list_remove(&client->link);
+    if (client->source) {
+        event_loop_remove(client->source);
+    }
+    if (client->check_fd >= 0) {
+        close(client->check_fd);
+    }
+    for (int i = 0; i < STANDARD_STREAM_COUNT; i++) {
+        if (client->streams[i] >= 0) {
+            close(client->streams[i]);
+        }
+    }
+    free(client->payload);
+    free(client->argv);
+    close(client->socket_fd);
+    free(client);
+}
+
+static uint64_t get_time_us() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+/** Receive whatever has arrived of the @p length bytes at @p data. */
+static ReceiveResult
+receive_part(DaemonClient *client, void *data, size_t length) {
+    while (client->received_length < length) {
+        ssize_t received = recv(
+            client->socket_fd,
+            (char *)data + client->received_length,
+            length - client->received_length,
+            0
+        );
+        if (received < 0 && errno == EINTR) {
+            continue;
+        }
+        if (received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return RECEIVE_INCOMPLETE;
+        }
+        if (received <= 0) {
+            return RECEIVE_FAILED;
+        }
+        client->received_length += received;
+    }
+    client->received_length = 0;
+    return RECEIVE_DONE;
+}
+
+static bool split_payload(DaemonClient *client) {
+    const char *end = client->payload + client->request.payload_length;
+    const char *cursor = client->payload;
+    client->cwd = cursor;
+    cursor += strlen(cursor) + 1;
+    client->argc = client->request.argc;
+    client->argv = calloc(client->request.argc + 1, sizeof(char *));
+    for (uint32_t i = 0; i < client->request.argc; i++) {
+        if (cursor >= end) {
+            return false;
+        }
+        client->argv[i] = (char *)cursor;
+        cursor += strlen(cursor) + 1;
+    }
+    return true;
+}
+
+/** Receive as much of the request as has arrived, without blocking. */
+static ReceiveResult daemon_client_receive(DaemonClient *client) {
+    while (client->state == DAEMON_CLIENT_RECEIVING_STREAMS) {
+        uint8_t index;
+        int fd;
+        ssize_t received =
+            unix_socket_recv_with_fd(client->socket_fd, &index, 1, &fd);
+        if (received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return RECEIVE_INCOMPLETE;
+        }
+        if (received != 1 || fd < 0 || index != client->stream_count) {
+            if (fd >= 0) {
+                close(fd);
+            }
+            return RECEIVE_FAILED;
+        }
+        client->streams[client->stream_count++] = fd;
+        if (client->stream_count == STANDARD_STREAM_COUNT) {
+            client->state = DAEMON_CLIENT_RECEIVING_REQUEST;
+        }
+    }
+
+    if (client->state == DAEMON_CLIENT_RECEIVING_REQUEST) {
+        ReceiveResult result = receive_part(
+            client, &client->request, sizeof(client->request)
+        );
+        if (result != RECEIVE_DONE) {
+            return result;
+        }
+        DaemonRequest *request = &client->request;
+        if (request->magic != DAEMON_REQUEST_MAGIC ||
+            request->version != DAEMON_REQUEST_VERSION || request->argc < 1 ||
+            request->argc > MAX_ARGUMENT_COUNT ||
+            request->payload_length > DAEMON_MAX_PAYLOAD_LENGTH) {
+            return RECEIVE_FAILED;
+        }
+        // the terminator makes sure that reading the strings stays in bounds
+        client->payload = malloc(request->payload_length + 1);
+        client->payload[request->payload_length] = '\0';
+        client->state = DAEMON_CLIENT_RECEIVING_PAYLOAD;
+    }
+
+    ReceiveResult result = receive_part(
+        client, client->payload, client->request.payload_length
+    );
+    if (result != RECEIVE_DONE) {
+        return result;
+    }
+    return split_payload(client) ? RECEIVE_DONE : RECEIVE_FAILED;
+}
+
+/**
+ * Switch to the client's standard streams and working directory.
+ * @returns false if its working directory can't be entered
+ */
+static bool enter_client(DaemonClient *client) {
+    fflush(stdout);
+    fflush(stderr);
+    for (int i = 0; i < STANDARD_STREAM_COUNT; i++) {
+        dup2(client->streams[i], i);
+    }
+    if (chdir(client->cwd) != 0) {
+        report_error("couldn't change to %s: %s", client->cwd, strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+static void handle_check_done(void *data, int fd, short revents);
+
+/**
+ * Parse the arguments in a separate process, since parsing exits for invalid
+ * arguments (and --help), which would take the daemon down with it. This
+ * also finds out the request's priority. The process' end is noticed through
+ * a pipe, so that a request that's being served doesn't wait for it.
+ * @returns whether the check was started
+ */
+static bool start_argument_check(DaemonClient *client) {
+    int pipe_fds[2];
+    if (pipe(pipe_fds) != 0) {
+        report_error("couldn't create a pipe: %s", strerror(errno));
+        return false;
+    }
+    fcntl(pipe_fds[0], F_SETFD, FD_CLOEXEC);
+    fcntl(pipe_fds[1], F_SETFD, FD_CLOEXEC);
+
+    fflush(NULL);
+    pid_t pid = fork();
+    if (pid < 0) {
+        report_error("couldn't fork: %s", strerror(errno));
+        close(pipe_fds[0]);
+        close(pipe_fds[1]);
+        return false;
+    }
+    if (pid == 0) {
+        // Another request might be running, but this process is about to go
+        // away anyway, so its streams can be taken over freely
+        close(pipe_fds[0]);
+        if (!enter_client(client)) {
+            fflush(NULL);
+            _exit(2);
+        }
+        daemon_state.handlers->parse(client->argc, client->argv);
+        DaemonPriority priority = daemon_state.handlers->get_priority();
+        fflush(NULL);
+        _exit(ARGUMENTS_VALID_EXIT_CODE + priority);
+    }
+
+    close(pipe_fds[1]);
+    client->state = DAEMON_CLIENT_CHECKING;
+    client->check_pid = pid;
+    client->check_fd = pipe_fds[0];
+    client->source =
+        event_loop_add_fd(client->check_fd, POLLIN, handle_check_done, client);
+    return true;
+}
+
+/**
+ * @returns -1 if the arguments are fine, or the exit code to send back
+ */
+static int get_argument_check_result(DaemonClient *client) {
+    // The pipe only closes as the process exits, so this doesn't take long
+    int status;
+    while (waitpid(client->check_pid, &status, 0) < 0) {
+        if (errno != EINTR) {
+            return 2;
+        }
+    }
+    if (!WIFEXITED(status)) {
+        return 2;
+    }
+    int exit_code = WEXITSTATUS(status);
+    if (exit_code == ARGUMENTS_VALID_EXIT_CODE + DAEMON_PRIORITY_BACKGROUND ||
+        exit_code == ARGUMENTS_VALID_EXIT_CODE + DAEMON_PRIORITY_INTERACTIVE) {
+        client->priority = exit_code - ARGUMENTS_VALID_EXIT_CODE;
+        return -1;
+    }
+    return exit_code;
+}
+
+static void send_exit_code(int socket_fd, int exit_code) {
+    int32_t message = exit_code;
+    send(socket_fd, &message, sizeof(message), MSG_NOSIGNAL);
+}
+
+static void restore_own_streams() {
+    fflush(stdout);
+    fflush(stderr);
+    for (int i = 0; i < STANDARD_STREAM_COUNT; i++) {
+        dup2(daemon_state.own_streams[i], i);
+    }
+}
+
+/**
+ * Tell the client if a request ends up exiting the whole daemon, e.g. with
+ * report_error_fatal. The daemon is gone after that, but the client at least
+ * doesn't wait forever, and gets the same exit code spaceshot would give.
+ */
+static void handle_exit() {
+    if (getpid() != daemon_state.pid || daemon_state.current_client_fd < 0) {
+        return;
+    }
+    restore_own_streams();
+    send_exit_code(daemon_state.current_client_fd, 2);
+}
+
+static void queue_client(DaemonClient *client) {
+    wl_list_remove(&client->link);
+    client->state = DAEMON_CLIENT_QUEUED;
+    // Queue it behind everything that's at least as important
+    struct wl_list *position = daemon_state.queue.prev;
+    while (position != &daemon_state.queue) {
+        DaemonClient *other = wl_container_of(position, other, link);
+        if (other->priority >= client->priority) {
+            break;
+        }
+        position = position->prev;
+    }
+    wl_list_insert(position, &client->link);
+    log_debug("queued daemon request with priority %d\n", client->priority);
+}
+
+static void reject_client(DaemonClient *client, int exit_code) {
+    send_exit_code(client->socket_fd, exit_code);
+    daemon_client_destroy(client);
+}
+
+static void handle_check_done(
+    void *data, int /* fd */, short /* revents */
+) {
+    DaemonClient *client = data;
+    event_loop_remove(client->source);
+    client->source = NULL;
+    close(client->check_fd);
+    client->check_fd = -1;
+
+    int exit_code = get_argument_check_result(client);
+    if (exit_code >= 0) {
+        reject_client(client, exit_code);
+        return;
+    }
+    queue_client(client);
+}
+
+static void handle_client_readable(
+    void *data, int /* fd */, short /* revents */
+) {
+    DaemonClient *client = data;
+    ReceiveResult result = daemon_client_receive(client);
+    if (result == RECEIVE_INCOMPLETE) {
+        return;
+    }
+    event_loop_remove(client->source);
+    client->source = NULL;
+    if (result == RECEIVE_FAILED) {
+        log_debug("received an invalid daemon request\n");
+        daemon_client_destroy(client);
+        return;
+    }
+    if (!start_argument_check(client)) {
+        reject_client(client, 2);
+    }
+}
+
+static void
+serve_client(const DaemonHandlers *handlers, DaemonClient *client) {
+    TIMING_START(daemon_request);
+    int exit_code = 2;
+    if (enter_client(client)) {
+        daemon_state.current_client_fd = client->socket_fd;
+        handlers->parse(client->argc, client->argv);
+        exit_code = handlers->handle(client->received_at_us);
+        daemon_state.current_client_fd = -1;
+    }
+
+    // The client's streams need to be closed before it's let go, or whatever
+    // is reading its output would keep waiting for more
+    restore_own_streams();
+    for (int i = 0; i < STANDARD_STREAM_COUNT; i++) {
+        close(client->streams[i]);
+        client->streams[i] = -1;
+    }
+    if (chdir("/") != 0) {
+        report_error("chdir failed: %s", strerror(errno));
+    }
+    send_exit_code(client->socket_fd, exit_code);
+    daemon_client_destroy(client);
+    TIMING_END(daemon_request);
+}
+
+static void handle_listen_socket_ready(
+    void * /* data */, int /* fd */, short /* revents */
+) {
+    // Requests run their own event loops, so new ones also arrive while
+    // another is being served; they're only received and queued here
+    while (true) {
+        int client_fd = accept(daemon_state.listen_fd, NULL, NULL);
+        if (client_fd < 0) {
+            break;
+        }
+        fcntl(client_fd, F_SETFD, FD_CLOEXEC);
+        fcntl(client_fd, F_SETFL, fcntl(client_fd, F_GETFL) | O_NONBLOCK);
+
+        DaemonClient *client = calloc(1, sizeof(DaemonClient));
+        client->state = DAEMON_CLIENT_RECEIVING_STREAMS;
+        client->socket_fd = client_fd;
+        client->streams[0] = client->streams[1] = client->streams[2] = -1;
+        client->check_fd = -1;
+        // Requests that come in at the same time should count as such, no
+        // matter how long receiving and checking them takes
+        client->received_at_us = get_time_us();
+        wl_list_insert(daemon_state.pending.prev, &client->link);
+        client->source = event_loop_add_fd(
+            client_fd, POLLIN, handle_client_readable, client
+        );
+    }
+}
+
+int daemon_run(const DaemonHandlers *handlers) {
+    int listen_fd = unix_socket_from_activation();
+    if (listen_fd < 0) {
+        char *socket_path = unix_socket_runtime_path(DAEMON_SOCKET_NAME);
+        if (!socket_path) {
+            report_error_fatal("XDG_RUNTIME_DIR is not set");
+        }
+        listen_fd = unix_socket_listen(socket_path);
+        if (listen_fd < 0) {
+            if (errno == EADDRINUSE) {
+                report_error_fatal("the daemon is already running");
+            }
+            report_error_fatal(
+                "couldn't listen on %s: %s", socket_path, strerror(errno)
+            );
+        }
+        free(socket_path);
+    }
+    // accepting shouldn't block if the client gave up in the meantime
+    fcntl(listen_fd, F_SETFL, fcntl(listen_fd, F_GETFL) | O_NONBLOCK);
+
+    daemon_state.pid = getpid();
+    daemon_state.listen_fd = listen_fd;
+    daemon_state.handlers = handlers;
+    daemon_state.current_client_fd = -1;
+    wl_list_init(&daemon_state.pending);
+    wl_list_init(&daemon_state.queue);
+    for (int i = 0; i < STANDARD_STREAM_COUNT; i++) {
+        daemon_state.own_streams[i] = fcntl(i, F_DUPFD_CLOEXEC, 0);
+    }
+    atexit(handle_exit);
+
+    EventLoopSource *listen_source = event_loop_add_fd(
+        listen_fd, POLLIN, handle_listen_socket_ready, NULL
+    );
+    log_debug("daemon ready\n");
+    bool is_idle = true;
+    while (event_loop_dispatch() != -1) {
+        while (!wl_list_empty(&daemon_state.queue)) {
+            DaemonClient *client =
+                wl_container_of(daemon_state.queue.next, client, link);
+            // out of the queue, so that others can be queued around it
+            wl_list_remove(&client->link);
+            wl_list_init(&client->link);
+            serve_client(handlers, client);
+            is_idle = false;
+        }
+        // Take in whatever arrived while the last request wasn't listening;
+        // requests that are still on their way may want its captures too
+        handle_listen_socket_ready(NULL, listen_fd, POLLIN);
+        if (!is_idle && wl_list_empty(&daemon_state.pending)) {
+            handlers->idle();
+            is_idle = true;
+        }
+    }
+
+    // the compositor went away, so there's nothing left to capture
+    DaemonClient *client, *tmp;
+    wl_list_for_each_safe(client, tmp, &daemon_state.pending, link) {
+        daemon_client_destroy(client);
+    }
+    wl_list_for_each_safe(client, tmp, &daemon_state.queue, link) {
+        reject_client(client, 2);
+    }
+    event_loop_remove(listen_source);
+    close(listen_fd);
+    return 0;
+}
@@ -0,0 +1,71 @@
+#pragma once
+#include <stdint.h>
+
+// spaceshot daemon keeps the Wayland connection, and everything else that's
+// slow to set up, around between screenshots. spaceshot-client forwards its
+// arguments to it, so that a screenshot only costs the capture itself.
+//
+// A client connects to DAEMON_SOCKET_NAME in $XDG_RUNTIME_DIR, and sends its
+// stdin, stdout and stderr, each as a single-byte message (holding its index)
+// carrying the descriptor. Then comes a DaemonRequest, followed by the
+// payload: the client's working directory, and then each argument (starting
+// with the program name), all NUL-terminated. Once the request is done, the
+// daemon answers with the exit code as an int32_t, and closes the connection.
+//
+// Requests are served one at a time. The arguments of each are checked as
+// soon as it arrives, and it's queued behind every request of the same or
+// higher priority until it's its turn. The daemon can also be
+// socket-activated, with the listening socket passed as in sd_listen_fds(3).
+
+static const char *const DAEMON_SOCKET_NAME = "spaceshot.sock";
+
+/** "SPDM" in little-endian */
+constexpr uint32_t DAEMON_REQUEST_MAGIC = 0x4d445053;
+constexpr uint32_t DAEMON_REQUEST_VERSION = 1;
+/** The most the payload of a request may take up. */
+constexpr uint32_t DAEMON_MAX_PAYLOAD_LENGTH = 64 * 1024;
+
+/** All fields are in host byte order. */
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t argc;
+    uint32_t payload_length;
+} DaemonRequest;
+
+typedef enum {
+    /** Nobody's waiting on the screen for it, e.g. a script. */
+    DAEMON_PRIORITY_BACKGROUND,
+    /** Someone's waiting for a picker to show up. */
+    DAEMON_PRIORITY_INTERACTIVE,
+} DaemonPriority;
+
+typedef struct {
+    /**
+     * Parse the arguments into the global state, with the client's standard
+     * streams and working directory in place. This is also called in a
+     * separate process as soon as the request arrives, to see if it exits
+     * (for invalid arguments, or --help); only if it returns is the request
+     * handled for real.
+     */
+    void (*parse)(int argc, char **argv);
+    /** Decide where a request goes in the queue, after @c parse. */
+    DaemonPriority (*get_priority)();
+    /**
+     * Handle a request whose arguments have been parsed, with the client's
+     * standard streams and working directory in place.
+     * @param received_at_us when the request arrived, in CLOCK_MONOTONIC
+     * microseconds
+     * @returns the exit code for the client
+     */
+    int (*handle)(uint64_t received_at_us);
+    /** Called whenever the queue runs empty. */
+    void (*idle)();
+} DaemonHandlers;
+
+/**
+ * Serve requests until the compositor goes away. The Wayland globals need to
+ * be set up already.
+ * @returns the exit code
+ */
+int daemon_run(const DaemonHandlers *handlers);
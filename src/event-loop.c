@@ -0,0 +1,152 @@
+#include "event-loop.h"
+#include "log.h"
+#include <errno.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <wayland-util.h>
+
+struct EventLoopSource {
+    int fd;
+    short events;
+    EventLoopCallback callback;
+    void *data;
+    bool is_removed;
+    struct wl_list link;
+};
+
+static struct {
+    struct wl_display *display;
+    struct wl_list sources;
+    // Sources removed during dispatch, which can't be freed until it's done
+    struct wl_list removed_sources;
+    bool is_dispatching;
+
+    struct pollfd *poll_fds;
+    EventLoopSource **poll_sources;
+    size_t poll_capacity;
+} loop;
+
+void event_loop_init(struct wl_display *display) {
+    loop.display = display;
+    wl_list_init(&loop.sources);
+    wl_list_init(&loop.removed_sources);
+}
+
+EventLoopSource *event_loop_add_fd(
+    int fd, short events, EventLoopCallback callback, void *data
+) {
+    EventLoopSource *source = calloc(1, sizeof(EventLoopSource));
+    if (!source) {
+        report_error_fatal("couldn't allocate event source");
+    }
+    source->fd = fd;
+    source->events = events;
+    source->callback = callback;
+    source->data = data;
+    wl_list_insert(loop.sources.prev, &source->link);
+    return source;
+}
+
+void event_loop_remove(EventLoopSource *source) {
+    wl_list_remove(&source->link);
+    if (loop.is_dispatching) {
+        source->is_removed = true;
+        wl_list_insert(&loop.removed_sources, &source->link);
+    } else {
+        free(source);
+    }
+}
+
+static void ensure_poll_capacity(size_t count) {
+    if (count <= loop.poll_capacity) {
+        return;
+    }
+    size_t new_capacity = loop.poll_capacity ? loop.poll_capacity * 2 : 8;
+    while (new_capacity < count) {
+        new_capacity *= 2;
+    }
+    loop.poll_fds =
+        realloc(loop.poll_fds, new_capacity * sizeof(struct pollfd));
+    loop.poll_sources =
+        realloc(loop.poll_sources, new_capacity * sizeof(EventLoopSource *));
+    if (!loop.poll_fds || !loop.poll_sources) {
+        report_error_fatal("couldn't allocate poll set");
+    }
+    loop.poll_capacity = new_capacity;
+}
+
+static void dispatch_sources(size_t count) {
+    loop.is_dispatching = true;
+    // index 0 is the Wayland connection
+    for (size_t i = 1; i < count; i++) {
+        EventLoopSource *source = loop.poll_sources[i];
+        short revents = loop.poll_fds[i].revents;
+        if (revents && !source->is_removed) {
+            source->callback(source->data, source->fd, revents);
+        }
+    }
+    loop.is_dispatching = false;
+
+    EventLoopSource *source, *tmp;
+    wl_list_for_each_safe(source, tmp, &loop.removed_sources, link) {
+        wl_list_remove(&source->link);
+        free(source);
+    }
+}
+
+int event_loop_dispatch() {
+    // Same protocol as wl_display_dispatch, but polling our fds as well
+    if (wl_display_prepare_read(loop.display) != 0) {
+        return wl_display_dispatch_pending(loop.display);
+    }
+
+    short display_events = POLLIN;
+    int ret;
+    do {
+        ret = wl_display_flush(loop.display);
+    } while (ret < 0 && errno == EINTR);
+    if (ret < 0) {
+        if (errno == EAGAIN) {
+            display_events |= POLLOUT;
+        } else {
+            wl_display_cancel_read(loop.display);
+            return -1;
+        }
+    }
+
+    size_t count = wl_list_length(&loop.sources) + 1;
+    ensure_poll_capacity(count);
+    loop.poll_fds[0] = (struct pollfd){
+        .fd = wl_display_get_fd(loop.display),
+        .events = display_events,
+    };
+    loop.poll_sources[0] = NULL;
+    size_t i = 1;
+    EventLoopSource *source;
+    wl_list_for_each(source, &loop.sources, link) {
+        loop.poll_fds[i] = (struct pollfd){
+            .fd = source->fd,
+            .events = source->events,
+        };
+        loop.poll_sources[i] = source;
+        i++;
+    }
+
+    ret = poll(loop.poll_fds, count, -1);
+    if (ret < 0) {
+        wl_display_cancel_read(loop.display);
+        return errno == EINTR ? 0 : -1;
+    }
+
+    if (loop.poll_fds[0].revents & (POLLIN | POLLERR | POLLHUP)) {
+        if (wl_display_read_events(loop.display) < 0) {
+            return -1;
+        }
+    } else {
+        wl_display_cancel_read(loop.display);
+    }
+
+    dispatch_sources(count);
+    return wl_display_dispatch_pending(loop.display);
+}
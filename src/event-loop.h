@@ -0,0 +1,39 @@
+#pragma once
+#include <wayland-client.h>
+
+typedef struct EventLoopSource EventLoopSource;
+
+/**
+ * Called when a registered file descriptor is ready.
+ * @param revents The events that occurred, as reported by poll(2).
+ */
+typedef void (*EventLoopCallback)(void *data, int fd, short revents);
+
+/**
+ * Set up the event loop for a display. This needs to be called before any
+ * other event loop functions.
+ */
+void event_loop_init(struct wl_display *display);
+
+/**
+ * Start watching a file descriptor alongside the Wayland connection.
+ * The event loop does not take ownership of the fd; close it yourself after
+ * removing the source.
+ * @param events The poll(2) events to wait for, usually POLLIN or POLLOUT.
+ */
+EventLoopSource *event_loop_add_fd(
+    int fd, short events, EventLoopCallback callback, void *data
+);
+/**
+ * Stop watching a file descriptor. This is safe to call from within any
+ * callback, including the source's own.
+ */
+void event_loop_remove(EventLoopSource *source);
+
+/**
+ * Wait for events on the Wayland connection or any registered file
+ * descriptor, and dispatch them. A drop-in replacement for
+ * wl_display_dispatch.
+ * @returns The number of Wayland events dispatched, or -1 on failure.
+ */
+int event_loop_dispatch();
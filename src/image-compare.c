@@ -0,0 +1,214 @@
+#include "image-compare.h"
+#include <stdlib.h>
+#include <string.h>
+
+// The kernel compares 8 pixels at a time using GCC vector extensions, which
+// compile to whatever SIMD instructions the target has.
+typedef uint32_t u32x8 __attribute__((vector_size(32)));
+typedef int32_t i32x8 __attribute__((vector_size(32)));
+
+constexpr uint32_t BLOCK_PIXELS = 8;
+
+typedef struct {
+    ImageChannelShifts actual;
+    ImageChannelShifts reference;
+    bool has_alpha;
+    int32_t tolerance;
+} CompareParams;
+
+// Vectors are passed around by pointer or in macros, because passing 256-bit
+// vectors by value depends on the target's ABI.
+
+/** Get |a - b| for each lane. */
+static inline void
+abs_difference(i32x8 *out, const i32x8 *a, const i32x8 *b) {
+    i32x8 difference = *a - *b;
+    i32x8 sign = difference >> 31;
+    *out = (difference ^ sign) - sign;
+}
+
+/**
+ * Compare a block of pixels.
+ * @param[out] is_mismatched -1 in each lane with a mismatched pixel, and 0
+ * elsewhere
+ */
+static inline void compare_block(
+    const uint8_t *actual_ptr,
+    const uint8_t *reference_ptr,
+    const CompareParams *params,
+    i32x8 *is_mismatched
+) {
+    u32x8 actual, reference;
+    memcpy(&actual, actual_ptr, sizeof(actual));
+    memcpy(&reference, reference_ptr, sizeof(reference));
+
+    const ImageChannelShifts *a = &params->actual;
+    const ImageChannelShifts *r = &params->reference;
+    i32x8 actual_r = (i32x8)(actual >> a->r_shift & 0xff);
+    i32x8 actual_g = (i32x8)(actual >> a->g_shift & 0xff);
+    i32x8 actual_b = (i32x8)(actual >> a->b_shift & 0xff);
+    i32x8 reference_r = (i32x8)(reference >> r->r_shift & 0xff);
+    i32x8 reference_g = (i32x8)(reference >> r->g_shift & 0xff);
+    i32x8 reference_b = (i32x8)(reference >> r->b_shift & 0xff);
+    i32x8 r_difference, g_difference, b_difference;
+    abs_difference(&r_difference, &actual_r, &reference_r);
+    abs_difference(&g_difference, &actual_g, &reference_g);
+    abs_difference(&b_difference, &actual_b, &reference_b);
+
+    *is_mismatched = (r_difference > params->tolerance) |
+                     (g_difference > params->tolerance) |
+                     (b_difference > params->tolerance);
+    if (params->has_alpha) {
+        *is_mismatched &= (i32x8)(reference >> 24) != 0;
+    }
+}
+
+static inline bool is_pixel_mismatched(
+    const uint8_t *actual_ptr,
+    const uint8_t *reference_ptr,
+    const CompareParams *params
+) {
+    uint32_t actual, reference;
+    memcpy(&actual, actual_ptr, sizeof(actual));
+    memcpy(&reference, reference_ptr, sizeof(reference));
+    if (params->has_alpha && reference >> 24 == 0) {
+        return false;
+    }
+
+    const ImageChannelShifts *a = &params->actual;
+    const ImageChannelShifts *r = &params->reference;
+    int32_t r_difference = (int32_t)(actual >> a->r_shift & 0xff) -
+                           (int32_t)(reference >> r->r_shift & 0xff);
+    int32_t g_difference = (int32_t)(actual >> a->g_shift & 0xff) -
+                           (int32_t)(reference >> r->g_shift & 0xff);
+    int32_t b_difference = (int32_t)(actual >> a->b_shift & 0xff) -
+                           (int32_t)(reference >> r->b_shift & 0xff);
+    return abs(r_difference) > params->tolerance ||
+           abs(g_difference) > params->tolerance ||
+           abs(b_difference) > params->tolerance;
+}
+
+static CompareParams make_compare_params(
+    const Image *actual, const Image *reference, uint8_t tolerance
+) {
+    return (CompareParams){
+        .actual = image_format_channel_shifts(actual->format),
+        .reference = image_format_channel_shifts(reference->format),
+        .has_alpha = reference->format == IMAGE_FORMAT_ARGB8888,
+        .tolerance = tolerance,
+    };
+}
+
+static void add_mismatch(ImageComparison *result, uint32_t x, uint32_t y) {
+    if (result->mismatched_count == 0) {
+        result->min_x = result->max_x = x;
+        result->min_y = result->max_y = y;
+    } else {
+        result->min_x = x < result->min_x ? x : result->min_x;
+        result->max_x = x > result->max_x ? x : result->max_x;
+        result->min_y = y < result->min_y ? y : result->min_y;
+        result->max_y = y > result->max_y ? y : result->max_y;
+    }
+    result->mismatched_count++;
+}
+
+ImageComparison image_compare(
+    const Image *actual,
+    uint32_t x,
+    uint32_t y,
+    const Image *reference,
+    uint8_t tolerance,
+    bool should_stop_early
+) {
+    CompareParams params = make_compare_params(actual, reference, tolerance);
+    ImageComparison result = {0};
+
+    for (uint32_t row = 0; row < reference->height; row++) {
+        const uint8_t *actual_row = actual->data +
+                                    (size_t)(row + y) * actual->stride +
+                                    (size_t)x * 4;
+        const uint8_t *reference_row =
+            reference->data + (size_t)row * reference->stride;
+
+        uint32_t col = 0;
+        for (; col + BLOCK_PIXELS <= reference->width; col += BLOCK_PIXELS) {
+            i32x8 is_mismatched;
+            compare_block(
+                actual_row + col * 4,
+                reference_row + col * 4,
+                &params,
+                &is_mismatched
+            );
+            // the common case is that everything matches
+            bool is_any_mismatched = false;
+            for (uint32_t i = 0; i < BLOCK_PIXELS; i++) {
+                is_any_mismatched |= is_mismatched[i] != 0;
+            }
+            if (!is_any_mismatched) {
+                continue;
+            }
+            if (should_stop_early) {
+                result.mismatched_count = 1;
+                return result;
+            }
+            for (uint32_t i = 0; i < BLOCK_PIXELS; i++) {
+                if (is_mismatched[i]) {
+                    add_mismatch(&result, col + i, row);
+                }
+            }
+        }
+        for (; col < reference->width; col++) {
+            if (is_pixel_mismatched(
+                    actual_row + col * 4, reference_row + col * 4, &params
+                )) {
+                if (should_stop_early) {
+                    result.mismatched_count = 1;
+                    return result;
+                }
+                add_mismatch(&result, col, row);
+            }
+        }
+    }
+    return result;
+}
+
+Image *image_compare_make_diff(
+    const Image *actual,
+    uint32_t x,
+    uint32_t y,
+    const Image *reference,
+    uint8_t tolerance
+) {
+    CompareParams params = make_compare_params(actual, reference, tolerance);
+    Image *result = image_new(
+        reference->width, reference->height, IMAGE_FORMAT_XRGB8888
+    );
+    const ImageChannelShifts *a = &params.actual;
+
+    for (uint32_t row = 0; row < reference->height; row++) {
+        const uint8_t *actual_row = actual->data +
+                                    (size_t)(row + y) * actual->stride +
+                                    (size_t)x * 4;
+        const uint8_t *reference_row =
+            reference->data + (size_t)row * reference->stride;
+        uint32_t *out = (uint32_t *)(result->data + row * result->stride);
+        for (uint32_t col = 0; col < reference->width; col++) {
+            if (is_pixel_mismatched(
+                    actual_row + col * 4, reference_row + col * 4, &params
+                )) {
+                out[col] = 0xff0000;
+                continue;
+            }
+            uint32_t pixel;
+            memcpy(&pixel, actual_row + col * 4, sizeof(pixel));
+            uint32_t luma = ((pixel >> a->r_shift & 0xff) * 54 +
+                             (pixel >> a->g_shift & 0xff) * 183 +
+                             (pixel >> a->b_shift & 0xff) * 19) >>
+                            8;
+            // dim it so that the red stands out
+            uint32_t value = luma / 3 + 64;
+            out[col] = value << 16 | value << 8 | value;
+        }
+    }
+    return result;
+}
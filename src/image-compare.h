@@ -0,0 +1,44 @@
+#pragma once
+#include "image.h"
+#include <stdint.h>
+
+typedef struct {
+    uint64_t mismatched_count;
+    // The smallest box containing every mismatched pixel, in reference
+    // coordinates. Only meaningful if there are any.
+    uint32_t min_x;
+    uint32_t min_y;
+    uint32_t max_x;
+    uint32_t max_y;
+} ImageComparison;
+
+/**
+ * Compare part of @p actual, starting at (@p x, @p y) and as large as
+ * @p reference, against @p reference. A pixel is mismatched if any channel
+ * differs by more than @p tolerance (in 8-bit steps). If the reference has an
+ * alpha channel, its fully transparent pixels match anything.
+ * @param should_stop_early Stop at the first mismatched pixel, for when it's
+ * only important whether the images match. The result then only has a
+ * nonzero count.
+ */
+ImageComparison image_compare(
+    const Image *actual,
+    uint32_t x,
+    uint32_t y,
+    const Image *reference,
+    uint8_t tolerance,
+    bool should_stop_early
+);
+
+/**
+ * Make an image that highlights the mismatched pixels in red, on top of a
+ * dimmed grayscale version of @p actual. The parameters are the same as for
+ * @c image_compare.
+ */
+Image *image_compare_make_diff(
+    const Image *actual,
+    uint32_t x,
+    uint32_t y,
+    const Image *reference,
+    uint8_t tolerance
+);
@@ -0,0 +1,162 @@
+#include "image-socket.h"
+#include "image.h"
+#include "log.h"
+#include "memfd.h"
+#include "unix-socket.h"
+#include <errno.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <wayland-client.h>
+
+static uint32_t image_format_to_fourcc(ImageFormat format) {
+    enum wl_shm_format wl_format = image_format_to_wl(format);
+    // These two are the only wl_shm formats which aren't fourccs themselves
+    switch (wl_format) {
+    case WL_SHM_FORMAT_ARGB8888:
+        return 'A' | 'R' << 8 | '2' << 16 | '4' << 24;
+    case WL_SHM_FORMAT_XRGB8888:
+        return 'X' | 'R' << 8 | '2' << 16 | '4' << 24;
+    default:
+        return wl_format;
+    }
+}
+
+static bool image_format_from_fourcc(uint32_t fourcc, ImageFormat *out) {
+    switch (fourcc) {
+    case 'X' | 'R' << 8 | '2' << 16 | '4' << 24:
+        *out = IMAGE_FORMAT_XRGB8888;
+        return true;
+    case WL_SHM_FORMAT_XBGR8888:
+        *out = IMAGE_FORMAT_XBGR8888;
+        return true;
+    case WL_SHM_FORMAT_XRGB2101010:
+        *out = IMAGE_FORMAT_XRGB2101010;
+        return true;
+    case WL_SHM_FORMAT_XBGR2101010:
+        *out = IMAGE_FORMAT_XBGR2101010;
+        return true;
+    default:
+        return false;
+    }
+}
+
+/**
+ * Copy the image's pixels into a new sealed memfd.
+ * @returns the memfd, or -1 on failure
+ */
+static int image_make_memfd(const Image *image, size_t size) {
+    int fd = memfd_new("spaceshot-image");
+    if (fd < 0) {
+        return -1;
+    }
+    // The receiver maps this directly, so make sure it can't change under it
+    if (!memfd_write(fd, image->data, size) || !memfd_seal(fd)) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+bool image_socket_send_on(int socket_fd, const Image *image) {
+    if (!image) {
+        ImageSocketHeader header = {
+            .magic = IMAGE_SOCKET_MAGIC,
+            .version = IMAGE_SOCKET_VERSION,
+        };
+        return unix_socket_send_with_fd(socket_fd, &header, sizeof(header), -1);
+    }
+
+    ImageSocketHeader header = {
+        .magic = IMAGE_SOCKET_MAGIC,
+        .version = IMAGE_SOCKET_VERSION,
+        .width = image->width,
+        .height = image->height,
+        .stride = image->stride,
+        .fourcc = image_format_to_fourcc(image->format),
+        .size = (uint64_t)image->stride * image->height,
+    };
+
+    int memfd = image_make_memfd(image, header.size);
+    if (memfd < 0) {
+        report_error("couldn't create image memfd: %s", strerror(errno));
+        return false;
+    }
+    bool success =
+        unix_socket_send_with_fd(socket_fd, &header, sizeof(header), memfd);
+    // the receiver has its own reference to the memfd now
+    close(memfd);
+    return success;
+}
+
+Image *image_socket_receive(int socket_fd) {
+    ImageSocketHeader header;
+    int memfd = -1;
+    ssize_t received =
+        unix_socket_recv_with_fd(socket_fd, &header, sizeof(header), &memfd);
+    if (received != sizeof(header) || header.magic != IMAGE_SOCKET_MAGIC ||
+        header.version != IMAGE_SOCKET_VERSION) {
+        report_error("received an invalid image message");
+        goto fail;
+    }
+    if (header.size == 0) {
+        // there's nothing to receive
+        goto fail;
+    }
+
+    ImageFormat format;
+    if (memfd < 0 || !image_format_from_fourcc(header.fourcc, &format) ||
+        header.stride < image_format_default_stride(format, header.width) ||
+        header.size < (uint64_t)header.stride * header.height) {
+        report_error("received an invalid image message");
+        goto fail;
+    }
+
+    void *data = mmap(NULL, header.size, PROT_READ, MAP_PRIVATE, memfd, 0);
+    if (data == MAP_FAILED) {
+        report_error("couldn't map received image: %s", strerror(errno));
+        goto fail;
+    }
+    Image *result = image_new(header.width, header.height, format);
+    for (uint32_t y = 0; y < header.height; y++) {
+        memcpy(
+            result->data + y * result->stride,
+            (uint8_t *)data + (size_t)y * header.stride,
+            image_format_default_stride(format, header.width)
+        );
+    }
+    munmap(data, header.size);
+    close(memfd);
+    return result;
+
+fail:
+    if (memfd >= 0) {
+        close(memfd);
+    }
+    return NULL;
+}
+
+bool image_socket_send(const char *socket_path, const Image *image) {
+    TIMING_START(image_socket_send);
+
+    int socket_fd = unix_socket_connect(socket_path);
+    if (socket_fd < 0) {
+        report_error(
+            "couldn't connect to socket %s: %s", socket_path, strerror(errno)
+        );
+        return false;
+    }
+
+    bool success = image_socket_send_on(socket_fd, image);
+    if (!success) {
+        report_error(
+            "couldn't send image to socket %s: %s",
+            socket_path,
+            strerror(errno)
+        );
+    }
+    close(socket_fd);
+
+    TIMING_END(image_socket_send);
+    return success;
+}
@@ -0,0 +1,46 @@
+#pragma once
+#include "image.h"
+#include <stdint.h>
+
+/** "SPSH" in little-endian */
+constexpr uint32_t IMAGE_SOCKET_MAGIC = 0x48535053;
+constexpr uint32_t IMAGE_SOCKET_VERSION = 1;
+
+/**
+ * The message sent over the socket for `unix:` output targets.
+ * It is accompanied by exactly one file descriptor (via SCM_RIGHTS): a sealed
+ * memfd of @c size bytes, which holds @c height rows of @c stride bytes each.
+ * All fields are in host byte order.
+ */
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t width;
+    uint32_t height;
+    uint32_t stride;
+    /** A DRM fourcc code, such as 'XR24' for XRGB8888. */
+    uint32_t fourcc;
+    uint64_t size;
+} ImageSocketHeader;
+
+/**
+ * Connect to the UNIX socket at @p socket_path and hand off the image to
+ * whoever is listening there, as a memfd.
+ * @returns whether the handoff was successful
+ */
+bool image_socket_send(const char *socket_path, const Image *image);
+
+/**
+ * Send an image over an already connected socket, using the same message as
+ * @c image_socket_send. A NULL @p image sends an empty header without a
+ * memfd, to tell the receiver that there's no image.
+ * @returns whether the message was sent
+ */
+bool image_socket_send_on(int socket_fd, const Image *image);
+
+/**
+ * Receive an image sent with @c image_socket_send_on.
+ * @returns a copy of the image, or NULL if there wasn't one (or it couldn't
+ * be received, in which case an error is reported)
+ */
+Image *image_socket_receive(int socket_fd);
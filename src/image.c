@@ -4,10 +4,14 @@
 #include <assert.h>
 #include <cairo.h>
 #include <config/config.h>
+#include <errno.h>
 #include <png.h>
 #include <setjmp.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/uio.h>
+#include <unistd.h>
 #include <wayland-client.h>
 
 // image format conversions
@@ -82,6 +86,29 @@ uint32_t image_format_default_stride(ImageFormat format, uint32_t width) {
     }
 }
 
+ImageChannelShifts image_format_channel_shifts(ImageFormat format) {
+    ImageChannelShifts result;
+    switch (format & ~IMAGE_FORMAT_FLIPPED_ORDER) {
+    case IMAGE_FORMAT_XRGB8888:
+    case IMAGE_FORMAT_ARGB8888:
+        result =
+            (ImageChannelShifts){.r_shift = 16, .g_shift = 8, .b_shift = 0};
+        break;
+    case IMAGE_FORMAT_XRGB2101010:
+        result =
+            (ImageChannelShifts){.r_shift = 22, .g_shift = 12, .b_shift = 2};
+        break;
+    default:
+        REPORT_UNHANDLED("image format", "%x", format);
+    }
+    if (format & IMAGE_FORMAT_FLIPPED_ORDER) {
+        uint32_t tmp = result.r_shift;
+        result.r_shift = result.b_shift;
+        result.b_shift = tmp;
+    }
+    return result;
+}
+
 Image *image_new(uint32_t width, uint32_t height, ImageFormat format) {
     Image *result = calloc(1, sizeof(Image));
     if (!result) {
@@ -93,6 +120,7 @@ Image *image_new(uint32_t width, uint32_t height, ImageFormat format) {
     result->height = height;
     result->stride = image_format_default_stride(format, width);
     result->data = malloc(result->stride * height);
+    atomic_init(&result->ref_count, 1);
     return result;
 }
 
@@ -570,8 +598,481 @@ LinkBuffer *image_save_png(const Image *image) {
     return result;
 }
 
+// raw (uncompressed) formats
+
+Image *image_load_png(const char *path) {
+    png_image png = {.version = PNG_IMAGE_VERSION};
+    if (!png_image_begin_read_from_file(&png, path)) {
+        report_error("couldn't read %s: %s", path, png.message);
+        return NULL;
+    }
+
+    // BGRA in memory is ARGB in little endian
+    png.format = PNG_FORMAT_BGRA;
+    Image *result = image_new(png.width, png.height, IMAGE_FORMAT_ARGB8888);
+    if (!png_image_finish_read(
+            &png, NULL, result->data, result->stride, NULL
+        )) {
+        report_error("couldn't decode %s: %s", path, png.message);
+        png_image_free(&png);
+        image_destroy(result);
+        return NULL;
+    }
+    return result;
+}
+
+static bool image_format_is_10_bit(ImageFormat format) {
+    return format == IMAGE_FORMAT_XRGB2101010 ||
+           format == IMAGE_FORMAT_XBGR2101010;
+}
+
+static inline uint8_t *put_be16(uint8_t *out, uint16_t value) {
+    out[0] = value >> 8;
+    out[1] = value & 0xff;
+    return out + 2;
+}
+
+static inline uint8_t *put_be32(uint8_t *out, uint32_t value) {
+    out[0] = value >> 24;
+    out[1] = value >> 16 & 0xff;
+    out[2] = value >> 8 & 0xff;
+    out[3] = value & 0xff;
+    return out + 4;
+}
+
+/**
+ * Write the header for a raw format into @p out, which needs to be at least
+ * 128 bytes long.
+ * @returns the header's length
+ */
+static size_t image_raw_header(
+    const Image *image, ImageRawFormat format, uint8_t *out
+) {
+    uint32_t max_value = image_format_is_10_bit(image->format) ? 1023 : 255;
+    switch (format) {
+    case IMAGE_RAW_FORMAT_PAM:
+        return sprintf(
+            (char *)out,
+            "P7\nWIDTH %u\nHEIGHT %u\nDEPTH 3\nMAXVAL %u\nTUPLTYPE RGB\n"
+            "ENDHDR\n",
+            image->width,
+            image->height,
+            max_value
+        );
+    case IMAGE_RAW_FORMAT_PPM:
+        return sprintf(
+            (char *)out,
+            "P6\n%u %u\n%u\n",
+            image->width,
+            image->height,
+            max_value
+        );
+    case IMAGE_RAW_FORMAT_FARBFELD: {
+        memcpy(out, "farbfeld", 8);
+        uint8_t *end = put_be32(out + 8, image->width);
+        end = put_be32(end, image->height);
+        return end - out;
+    }
+    default:
+        REPORT_UNHANDLED("raw image format", "%d", format);
+    }
+}
+
+static size_t image_raw_row_size(const Image *image, ImageRawFormat format) {
+    if (format == IMAGE_RAW_FORMAT_FARBFELD) {
+        // always RGBA with 16-bit samples
+        return image->width * 8;
+    }
+    return image->width * (image_format_is_10_bit(image->format) ? 6 : 3);
+}
+
+/** Convert row @p y of an image into a raw format's pixel layout. */
+static void image_raw_convert_row(
+    const Image *image, ImageRawFormat format, uint32_t y, uint8_t *out
+) {
+    const uint32_t *source_row =
+        (const uint32_t *)(image->data + y * image->stride);
+    bool is_flipped = image->format & IMAGE_FORMAT_FLIPPED_ORDER;
+    bool is_farbfeld = format == IMAGE_RAW_FORMAT_FARBFELD;
+
+    switch (image->format) {
+    case IMAGE_FORMAT_XRGB8888:
+    case IMAGE_FORMAT_XBGR8888:
+    case IMAGE_FORMAT_ARGB8888:
+        for (uint32_t x = 0; x < image->width; x++) {
+            uint32_t pixel = source_row[x];
+            uint8_t r = pixel >> 16 & 0xff;
+            uint8_t g = pixel >> 8 & 0xff;
+            uint8_t b = pixel & 0xff;
+            if (is_flipped) {
+                uint8_t tmp = r;
+                r = b;
+                b = tmp;
+            }
+            if (is_farbfeld) {
+                uint8_t a = image->format == IMAGE_FORMAT_ARGB8888
+                                ? pixel >> 24
+                                : 0xff;
+                // 0xff * 257 = 0xffff
+                out = put_be16(out, r * 257);
+                out = put_be16(out, g * 257);
+                out = put_be16(out, b * 257);
+                out = put_be16(out, a * 257);
+            } else {
+                out[0] = r;
+                out[1] = g;
+                out[2] = b;
+                out += 3;
+            }
+        }
+        break;
+    case IMAGE_FORMAT_XRGB2101010:
+    case IMAGE_FORMAT_XBGR2101010:
+        for (uint32_t x = 0; x < image->width; x++) {
+            uint32_t pixel = source_row[x];
+            uint16_t r = pixel >> 20 & 0x3ff;
+            uint16_t g = pixel >> 10 & 0x3ff;
+            uint16_t b = pixel & 0x3ff;
+            if (is_flipped) {
+                uint16_t tmp = r;
+                r = b;
+                b = tmp;
+            }
+            if (is_farbfeld) {
+                // farbfeld is always full-range 16-bit, so replicate the top
+                // bits into the bottom ones
+                out = put_be16(out, r << 6 | r >> 4);
+                out = put_be16(out, g << 6 | g >> 4);
+                out = put_be16(out, b << 6 | b >> 4);
+                out = put_be16(out, 0xffff);
+            } else {
+                // the header declares a maximum value of 1023
+                out = put_be16(out, r);
+                out = put_be16(out, g);
+                out = put_be16(out, b);
+            }
+        }
+        break;
+    default:
+        REPORT_UNHANDLED("image format", "%x", image->format);
+    }
+}
+
+/** Write all of the provided buffers, handling partial writes. */
+static bool write_all_vectored(int fd, struct iovec *iov, int iov_count) {
+    while (iov_count > 0) {
+        ssize_t written = writev(fd, iov, iov_count);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+
+        // skip over everything that was fully written
+        while (iov_count > 0 && (size_t)written >= iov->iov_len) {
+            written -= iov->iov_len;
+            iov++;
+            iov_count--;
+        }
+        if (iov_count > 0) {
+            iov->iov_base = (uint8_t *)iov->iov_base + written;
+            iov->iov_len -= written;
+        }
+    }
+    return true;
+}
+
+bool image_write_raw(const Image *image, ImageRawFormat format, int fd) {
+    // Converting a handful of rows at a time keeps the staging buffer in cache
+    const size_t BATCH_TARGET_SIZE = 256 * 1024;
+
+    TIMING_START(raw_write);
+
+    uint8_t header[128];
+    size_t header_len = image_raw_header(image, format, header);
+
+    size_t row_size = image_raw_row_size(image, format);
+    uint32_t rows_per_batch = row_size > 0 ? BATCH_TARGET_SIZE / row_size : 1;
+    if (rows_per_batch == 0) {
+        rows_per_batch = 1;
+    }
+    if (rows_per_batch > image->height && image->height > 0) {
+        rows_per_batch = image->height;
+    }
+    uint8_t *batch = malloc(rows_per_batch * row_size);
+    if (!batch) {
+        return false;
+    }
+
+    struct iovec iov[2] = {
+        {.iov_base = header, .iov_len = header_len},
+    };
+    int iov_count = 1;
+    bool success = true;
+    int write_errno = 0;
+    for (uint32_t y = 0; y < image->height; y += rows_per_batch) {
+        uint32_t row_count = image->height - y < rows_per_batch
+                                 ? image->height - y
+                                 : rows_per_batch;
+        for (uint32_t i = 0; i < row_count; i++) {
+            image_raw_convert_row(image, format, y + i, batch + i * row_size);
+        }
+        iov[iov_count++] = (struct iovec){
+            .iov_base = batch,
+            .iov_len = row_count * row_size,
+        };
+        if (!write_all_vectored(fd, iov, iov_count)) {
+            success = false;
+            write_errno = errno;
+            break;
+        }
+        // the header only goes out with the first batch
+        iov_count = 0;
+    }
+    // an empty image still needs its header
+    if (success && iov_count > 0 && !write_all_vectored(fd, iov, iov_count)) {
+        success = false;
+        write_errno = errno;
+    }
+    free(batch);
+
+    TIMING_END(raw_write);
+    // free and the timing output may have clobbered the writev error
+    if (!success) {
+        errno = write_errno;
+    }
+    return success;
+}
+
+LinkBuffer *image_save_raw(const Image *image, ImageRawFormat format) {
+    LinkBuffer *result = link_buffer_new();
+    LinkBuffer *curr_block = result;
+
+    uint8_t header[128];
+    size_t header_len = image_raw_header(image, format, header);
+    link_buffer_append(&curr_block, header, header_len);
+
+    size_t row_size = image_raw_row_size(image, format);
+    uint8_t *row = malloc(row_size);
+    for (uint32_t y = 0; y < image->height; y++) {
+        image_raw_convert_row(image, format, y, row);
+        link_buffer_append(&curr_block, row, row_size);
+    }
+    free(row);
+    return result;
+}
+
+// BMP and QOI
+
+static inline uint8_t *put_le16(uint8_t *out, uint16_t value) {
+    out[0] = value & 0xff;
+    out[1] = value >> 8;
+    return out + 2;
+}
+
+static inline uint8_t *put_le32(uint8_t *out, uint32_t value) {
+    out[0] = value & 0xff;
+    out[1] = value >> 8 & 0xff;
+    out[2] = value >> 16 & 0xff;
+    out[3] = value >> 24;
+    return out + 4;
+}
+
+/**
+ * Convert row @p y of an image into 8-bit RGB, dropping any extra precision.
+ */
+static void
+image_convert_row_rgb8(const Image *image, uint32_t y, uint8_t *out) {
+    const uint32_t *source_row =
+        (const uint32_t *)(image->data + y * image->stride);
+    bool is_flipped = image->format & IMAGE_FORMAT_FLIPPED_ORDER;
+    bool is_10_bit = image_format_is_10_bit(image->format);
+    if (image->format == IMAGE_FORMAT_GRAY8) {
+        REPORT_UNHANDLED("image format", "%x", image->format);
+    }
+
+    for (uint32_t x = 0; x < image->width; x++) {
+        uint32_t pixel = source_row[x];
+        uint8_t r, g, b;
+        if (is_10_bit) {
+            r = pixel >> 22 & 0xff;
+            g = pixel >> 12 & 0xff;
+            b = pixel >> 2 & 0xff;
+        } else {
+            r = pixel >> 16 & 0xff;
+            g = pixel >> 8 & 0xff;
+            b = pixel & 0xff;
+        }
+        out[0] = is_flipped ? b : r;
+        out[1] = g;
+        out[2] = is_flipped ? r : b;
+        out += 3;
+    }
+}
+
+LinkBuffer *image_save_bmp(const Image *image) {
+    TIMING_START(bmp_encode);
+    LinkBuffer *result = link_buffer_new();
+    LinkBuffer *curr_block = result;
+
+    uint32_t row_size = image->width * 4;
+    // BITMAPFILEHEADER + BITMAPINFOHEADER
+    uint8_t header[14 + 40];
+    const uint32_t HEADER_SIZE = sizeof(header);
+    uint8_t *out = header;
+    *out++ = 'B';
+    *out++ = 'M';
+    out = put_le32(out, HEADER_SIZE + row_size * image->height);
+    out = put_le32(out, 0);
+    out = put_le32(out, HEADER_SIZE);
+    out = put_le32(out, 40);
+    out = put_le32(out, image->width);
+    out = put_le32(out, image->height);
+    out = put_le16(out, 1);
+    out = put_le16(out, 32);
+    // BI_RGB, so the fourth byte is ignored
+    out = put_le32(out, 0);
+    out = put_le32(out, row_size * image->height);
+    // 2835 pixels per meter is 72 DPI
+    out = put_le32(out, 2835);
+    out = put_le32(out, 2835);
+    out = put_le32(out, 0);
+    out = put_le32(out, 0);
+    link_buffer_append(&curr_block, header, HEADER_SIZE);
+
+    // BMP's BGRX is what XRGB8888 already looks like in memory
+    bool is_native = image->format == IMAGE_FORMAT_XRGB8888 ||
+                     image->format == IMAGE_FORMAT_ARGB8888;
+    uint8_t *rgb_row = is_native ? NULL : malloc(image->width * 3);
+    uint8_t *bgrx_row = is_native ? NULL : malloc(row_size);
+    // rows are stored bottom-up
+    for (uint32_t i = 0; i < image->height; i++) {
+        uint32_t y = image->height - 1 - i;
+        if (is_native) {
+            link_buffer_append(
+                &curr_block, image->data + y * image->stride, row_size
+            );
+            continue;
+        }
+
+        image_convert_row_rgb8(image, y, rgb_row);
+        for (uint32_t x = 0; x < image->width; x++) {
+            bgrx_row[x * 4 + 0] = rgb_row[x * 3 + 2];
+            bgrx_row[x * 4 + 1] = rgb_row[x * 3 + 1];
+            bgrx_row[x * 4 + 2] = rgb_row[x * 3 + 0];
+            bgrx_row[x * 4 + 3] = 0xff;
+        }
+        link_buffer_append(&curr_block, bgrx_row, row_size);
+    }
+    free(rgb_row);
+    free(bgrx_row);
+
+    TIMING_END(bmp_encode);
+    return result;
+}
+
+LinkBuffer *image_save_qoi(const Image *image) {
+    const uint8_t QOI_OP_INDEX = 0x00;
+    const uint8_t QOI_OP_DIFF = 0x40;
+    const uint8_t QOI_OP_LUMA = 0x80;
+    const uint8_t QOI_OP_RUN = 0xc0;
+    const uint8_t QOI_OP_RGB = 0xfe;
+
+    TIMING_START(qoi_encode);
+    LinkBuffer *result = link_buffer_new();
+    LinkBuffer *curr_block = result;
+
+    uint8_t header[14];
+    memcpy(header, "qoif", 4);
+    uint8_t *out = put_be32(header + 4, image->width);
+    out = put_be32(out, image->height);
+    // 3 channels, sRGB
+    out[0] = 3;
+    out[1] = 0;
+    link_buffer_append(&curr_block, header, sizeof(header));
+
+    // Screenshots are opaque, so alpha is always 255 and QOI_OP_RGBA is never
+    // needed. That makes 4 bytes per pixel (plus a pending run) the worst case.
+    uint8_t *rgb_row = malloc(image->width * 3);
+    uint8_t *encoded_row = malloc(image->width * 4 + 1);
+    uint32_t seen[64] = {0};
+    uint8_t prev_r = 0, prev_g = 0, prev_b = 0;
+    uint32_t run = 0;
+    for (uint32_t y = 0; y < image->height; y++) {
+        image_convert_row_rgb8(image, y, rgb_row);
+        out = encoded_row;
+        for (uint32_t x = 0; x < image->width; x++) {
+            uint8_t r = rgb_row[x * 3];
+            uint8_t g = rgb_row[x * 3 + 1];
+            uint8_t b = rgb_row[x * 3 + 2];
+            if (r == prev_r && g == prev_g && b == prev_b) {
+                run++;
+                if (run == 62) {
+                    *out++ = QOI_OP_RUN | (run - 1);
+                    run = 0;
+                }
+                continue;
+            }
+            if (run > 0) {
+                *out++ = QOI_OP_RUN | (run - 1);
+                run = 0;
+            }
+
+            // the index is stored as packed RGBA with a constant alpha
+            uint32_t packed = (uint32_t)r << 24 | g << 16 | b << 8 | 0xff;
+            uint32_t hash = (r * 3 + g * 5 + b * 7 + 255 * 11) % 64;
+            if (seen[hash] == packed) {
+                *out++ = QOI_OP_INDEX | hash;
+            } else {
+                seen[hash] = packed;
+                int8_t dr = r - prev_r;
+                int8_t dg = g - prev_g;
+                int8_t db = b - prev_b;
+                int8_t dr_dg = dr - dg;
+                int8_t db_dg = db - dg;
+                if (dr >= -2 && dr <= 1 && dg >= -2 && dg <= 1 && db >= -2 &&
+                    db <= 1) {
+                    *out++ = QOI_OP_DIFF | (dr + 2) << 4 | (dg + 2) << 2 |
+                             (db + 2);
+                } else if (dg >= -32 && dg <= 31 && dr_dg >= -8 &&
+                           dr_dg <= 7 && db_dg >= -8 && db_dg <= 7) {
+                    *out++ = QOI_OP_LUMA | (dg + 32);
+                    *out++ = (dr_dg + 8) << 4 | (db_dg + 8);
+                } else {
+                    *out++ = QOI_OP_RGB;
+                    *out++ = r;
+                    *out++ = g;
+                    *out++ = b;
+                }
+            }
+            prev_r = r;
+            prev_g = g;
+            prev_b = b;
+        }
+        link_buffer_append(&curr_block, encoded_row, out - encoded_row);
+    }
+    free(rgb_row);
+    free(encoded_row);
+
+    uint8_t trailer[8] = {0, 0, 0, 0, 0, 0, 0, 1};
+    if (run > 0) {
+        uint8_t run_op = QOI_OP_RUN | (run - 1);
+        link_buffer_append(&curr_block, &run_op, 1);
+    }
+    link_buffer_append(&curr_block, trailer, sizeof(trailer));
+
+    TIMING_END(qoi_encode);
+    return result;
+}
+
+Image *image_ref(Image *image) {
+    atomic_fetch_add(&image->ref_count, 1);
+    return image;
+}
+
 void image_destroy(Image *image) {
-    if (image) {
+    if (image && atomic_fetch_sub(&image->ref_count, 1) == 1) {
         free(image->data);
         free(image);
     }
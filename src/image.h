@@ -2,6 +2,7 @@
 
 #include "link-buffer.h"
 #include <cairo.h>
+#include <stdatomic.h>
 #include <stdint.h>
 #include <wayland-client.h>
 
@@ -32,6 +33,19 @@ cairo_format_t image_format_to_cairo(ImageFormat format);
 uint32_t image_format_bytes_per_pixel(ImageFormat format);
 uint32_t image_format_default_stride(ImageFormat format, uint32_t width);
 
+/** Where the top 8 bits of each color channel are in a 32-bit pixel. */
+typedef struct {
+    uint32_t r_shift;
+    uint32_t g_shift;
+    uint32_t b_shift;
+} ImageChannelShifts;
+
+/**
+ * Get the channel positions for a 32-bit format, for code that only needs
+ * 8 bits of precision and wants to handle every format the same way.
+ */
+ImageChannelShifts image_format_channel_shifts(ImageFormat format);
+
 /** An enum of image transformations. Rotations are counterclockwise. */
 typedef enum {
     IMAGE_TRANSFORM_NORMAL,
@@ -58,6 +72,7 @@ typedef struct {
     uint32_t width;
     uint32_t height;
     uint32_t stride;
+    atomic_int ref_count;
 } Image;
 
 Image *image_new(uint32_t width, uint32_t height, ImageFormat format);
@@ -69,6 +84,15 @@ Image *image_new_from_wayland(
     uint32_t height,
     uint32_t stride
 );
+/**
+ * Take another reference to an image, for sharing it without copying.
+ * @returns the same image
+ */
+Image *image_ref(Image *image);
+/**
+ * Drop a reference to an image, freeing it once the last one is gone.
+ * Newly created images start out with one reference.
+ */
 void image_destroy(Image *image);
 
 Image *image_copy(const Image *src);
@@ -89,3 +113,33 @@ Image *image_convert_format(const Image *src, ImageFormat target);
 cairo_surface_t *image_make_cairo_surface(Image *image);
 
 LinkBuffer *image_save_png(const Image *image);
+/**
+ * Decode a PNG file into an ARGB8888 image. Note that unlike the rest of
+ * ARGB8888 images, the alpha isn't premultiplied.
+ * @returns the image, or NULL (after reporting an error) if it couldn't be
+ * read
+ */
+Image *image_load_png(const char *path);
+/** Encode an image as a 32-bit uncompressed BMP. */
+LinkBuffer *image_save_bmp(const Image *image);
+/** Encode an image as a QOI (Quite OK Image) file. */
+LinkBuffer *image_save_qoi(const Image *image);
+
+/** An enum of uncompressed image formats, which don't need an encoding step. */
+typedef enum {
+    IMAGE_RAW_FORMAT_PAM,
+    IMAGE_RAW_FORMAT_PPM,
+    IMAGE_RAW_FORMAT_FARBFELD,
+} ImageRawFormat;
+
+/**
+ * Write an image to a file descriptor in an uncompressed format.
+ * Rows are converted in small batches and written out with vectored writes,
+ * so this never makes a full-size copy of the image.
+ * 10-bit images are written with 16-bit samples.
+ * @returns whether the whole image was written successfully; on failure,
+ *          errno is set
+ */
+bool image_write_raw(const Image *image, ImageRawFormat format, int fd);
+/** Like @c image_write_raw, but into memory. */
+LinkBuffer *image_save_raw(const Image *image, ImageRawFormat format);
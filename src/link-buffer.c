@@ -14,16 +14,22 @@ LinkBuffer *link_buffer_new() {
 }
 
 void link_buffer_append(LinkBuffer **block, void *data, size_t length) {
-    LinkBuffer *cur_block = *block;
-    if (cur_block->used_size + length <= LINK_BUFFER_SIZE) {
-        memcpy(cur_block->data + cur_block->used_size, data, length);
-        cur_block->used_size += length;
-    } else {
-        LinkBuffer *new_block = link_buffer_new();
-        memcpy(new_block->data, data, length);
-        new_block->used_size = length;
-        cur_block->next = new_block;
-        *block = new_block;
+    const uint8_t *source = data;
+    while (length > 0) {
+        LinkBuffer *cur_block = *block;
+        size_t space = LINK_BUFFER_SIZE - cur_block->used_size;
+        if (space == 0) {
+            LinkBuffer *new_block = link_buffer_new();
+            cur_block->next = new_block;
+            *block = new_block;
+            continue;
+        }
+        // data larger than what's left gets split across blocks
+        size_t chunk = length < space ? length : space;
+        memcpy(cur_block->data + cur_block->used_size, source, chunk);
+        cur_block->used_size += chunk;
+        source += chunk;
+        length -= chunk;
     }
 }
 
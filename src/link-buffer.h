@@ -16,6 +16,11 @@ typedef struct LinkBuffer {
 } LinkBuffer;
 
 LinkBuffer *link_buffer_new();
+/**
+ * Append data to the end of a link buffer, which may span multiple blocks.
+ * @param block The last block of the buffer, which is updated as new blocks
+ * are added.
+ */
 void link_buffer_append(LinkBuffer **block, void *data, size_t length);
 /**
  * Write the contents of the link buffer to a file descriptor.
@@ -66,7 +66,34 @@ void timing_display(
     clock_gettime(CLOCK_MONOTONIC, &ts_end_##name);                            \
     timing_display(#name, &ts_start_##name, &ts_end_##name)
 
+/**
+ * Declare a span at file scope, so that it can start and end in different
+ * functions. Start it with TIMING_START_DECLARED and end it with TIMING_END.
+ */
+#define TIMING_DECLARE(name) static struct timespec ts_start_##name
+#define TIMING_START_DECLARED(name)                                            \
+    clock_gettime(CLOCK_MONOTONIC, &ts_start_##name)
+
+/**
+ * Declare a span as a struct member (without a trailing semicolon), for spans
+ * that several objects can have in flight at once. Its start is copied from
+ * the declared span of the same name with TIMING_COPY_DECLARED, and it's
+ * ended with TIMING_END_MEMBER.
+ */
+#define TIMING_MEMBER(name) struct timespec ts_start_##name;
+#define TIMING_COPY_DECLARED(object, name)                                     \
+    ((object)->ts_start_##name = ts_start_##name)
+#define TIMING_END_MEMBER(object, name)                                        \
+    struct timespec ts_end_##name;                                             \
+    clock_gettime(CLOCK_MONOTONIC, &ts_end_##name);                            \
+    timing_display(#name, &(object)->ts_start_##name, &ts_end_##name)
+
 #else
 #define TIMING_START(name)
 #define TIMING_END(name)
+#define TIMING_DECLARE(name) static_assert(true)
+#define TIMING_START_DECLARED(name)
+#define TIMING_MEMBER(name)
+#define TIMING_COPY_DECLARED(object, name)
+#define TIMING_END_MEMBER(object, name)
 #endif
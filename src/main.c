@@ -1,19 +1,37 @@
 #include "args.h"
 #include "bbox.h"
+#include "burst.h"
+#include "compare.h"
+#include "composite.h"
+#include "compressed-image.h"
+#include "content-hash.h"
+#include "daemon.h"
+#include "event-loop.h"
 #include "image.h"
 #include "link-buffer.h"
 #include "log.h"
 #include "output-picker.h"
 #include "paths.h"
 #include "region-picker.h"
+#include "replay.h"
+#include "save.h"
+#include "stream.h"
+#include "tar.h"
+#include "toplevel-export.h"
 #include "wayland/clipboard.h"
 #include "wayland/globals.h"
 #include "wayland/output.h"
 #include "wayland/screen-capture.h"
+#include "wayland/shared-memory.h"
 #include "wayland/toplevel.h"
+#include "watch.h"
+#include "worker.h"
 #include <assert.h>
 #include <config/config.h>
 #include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <spawn.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -23,6 +41,9 @@
 #include <wayland-client.h>
 #include <wayland-util.h>
 
+// used for spawning spaceshot-notify
+extern char **environ;
+
 /** A capture entry's state ("what is it used for") */
 typedef enum {
     /* Hasn't yet received its image. */
@@ -51,6 +72,29 @@ typedef struct {
         WrappedToplevel *toplevel;
     };
     Image *image;
+    /* Set instead of the image while a deferred capture waits in compressed
+       form. Use capture_entry_get_image to get the pixels. */
+    CompressedImage *compressed_image;
+    /* Whether the image only covers the predefined region, rather than the
+       whole output. */
+    bool is_region_only;
+    /* For region-only captures, the captured part of the output, in
+       output-local logical coordinates. */
+    BBox capture_region;
+    /* Whether a daemon request asked the compositor for this capture, so
+       that requests which arrive within a frame of it can share it. */
+    bool is_shareable;
+    /* When the daemon request arrived, in CLOCK_MONOTONIC microseconds. */
+    uint64_t requested_at_us;
+    /* Whether the capture callback hasn't run yet. Such entries can't be
+       freed right away, so destroying them only abandons them. */
+    bool is_capture_pending;
+    bool is_compressing;
+    bool is_abandoned;
+    /* The hash of the image's content, computed when looking for mirrored
+       outputs. */
+    uint64_t content_hash;
+    bool has_content_hash;
     struct wl_list link;
 } CaptureEntry;
 
@@ -59,175 +103,574 @@ typedef struct {
 // paste, then Wayland should be polled until a "clipboard wait" flag is unset.
 static bool should_active_wait = true;
 static bool should_clipboard_wait = false;
+// The copy being waited on, if should_clipboard_wait is set.
+static ClipboardCopy *active_copy = NULL;
 // This flag causes an unsuccessful exit code to be returned from main.
 static bool was_cancelled = false;
+// Like was_cancelled, but for errors, which exit with code 2. These are
+// reported without exiting, so that a daemon survives them.
+static bool has_failed = false;
 static Arguments args;
 static struct wl_list active_captures;
+// Set once pickers should open as soon as their entry's image arrives,
+// rather than all at once when everything is captured.
+static bool are_pickers_progressive = false;
+static bool is_first_picker_started = false;
+// The number of deferred images being compressed.
+static size_t compressing_count = 0;
 static struct wl_display *display;
 
-/**
- * Save an already-encoded image to disk.
- */
 static void
-save_screenshot(LinkBuffer *encoded_image, const char *output_filename) {
-    FILE *out_file;
-    if (strcmp(output_filename, "-") == 0) {
-        out_file = fdopen(dup(STDOUT_FILENO), "wb");
-    } else {
-        out_file = fopen(output_filename, "wb");
-    }
-    assert(out_file);
-    link_buffer_write(encoded_image, out_file);
-    fclose(out_file);
-}
-
-static void send_notification(char *output_filename, bool did_copy) {
+send_notification(const char *output_filename, bool did_copy) {
 #ifdef SPACESHOT_NOTIFICATIONS
-    if (config_get()->notify.enabled) {
-        pid_t pid = fork();
-        if (pid == 0) {
-            // child
-            char *notify_bin_path = getenv("SPACESHOT_NOTIFY_PATH");
-            notify_bin_path =
-                notify_bin_path ? notify_bin_path : "spaceshot-notify";
-            if (did_copy) {
-                log_debug(
-                    "invoking 'spaceshot-notify -p %s -c\n", output_filename
-                );
-                execlp(
-                    notify_bin_path,
-                    "spaceshot-notify",
-                    "-p",
-                    output_filename,
-                    "-c",
-                    NULL
-                );
-            } else {
-                log_debug(
-                    "invoking 'spaceshot-notify -p %s\n", output_filename
-                );
-                execlp(
-                    notify_bin_path,
-                    "spaceshot-notify",
-                    "-p",
-                    output_filename,
-                    NULL
+    // there's no file to show for socket handoffs
+    if (config_get()->notify.enabled && !is_socket_target(output_filename)) {
+        char *notify_bin_path = getenv("SPACESHOT_NOTIFY_PATH");
+        notify_bin_path =
+            notify_bin_path ? notify_bin_path : "spaceshot-notify";
+        char *notify_argv[] = {
+            "spaceshot-notify",
+            "-p",
+            (char *)output_filename,
+            did_copy ? "-c" : NULL,
+            NULL,
+        };
+        log_debug(
+            "invoking 'spaceshot-notify -p %s%s'\n",
+            output_filename,
+            did_copy ? " -c" : ""
+        );
+
+        // This runs on a helper thread, where fork() isn't safe
+        // main ignores SIGPIPE, which would otherwise be inherited
+        posix_spawnattr_t attributes;
+        posix_spawnattr_init(&attributes);
+        sigset_t default_signals;
+        sigemptyset(&default_signals);
+        sigaddset(&default_signals, SIGPIPE);
+        posix_spawnattr_setsigdefault(&attributes, &default_signals);
+        posix_spawnattr_setflags(&attributes, POSIX_SPAWN_SETSIGDEF);
+
+        // wait for the child to exit; usually this doesn't take too long
+        // (and the layers are closed by this point)
+        TIMING_START(exec_spaceshot_notify);
+        pid_t pid;
+        int spawn_error = posix_spawnp(
+            &pid, notify_bin_path, NULL, &attributes, notify_argv, environ
+        );
+        posix_spawnattr_destroy(&attributes);
+        if (spawn_error != 0) {
+            report_warning(
+                "Couldn't invoke spaceshot-notify; is it in "
+                "PATH?\ntip: notifications require installing the "
+                "spaceshot-notify binary and its D-Bus service "
+                "definition"
+            );
+            return;
+        }
+
+        int status;
+        waitpid(pid, &status, WUNTRACED);
+        if (WIFEXITED(status)) {
+            int status_code = WEXITSTATUS(status);
+            if (status_code != 0) {
+                report_warning(
+                    "spaceshot-notify exited with status code %d", status_code
                 );
             }
-
-            // if something has gone terribly wrong, exit
-            // 104 is a random number that is used as a heuristic for when
-            // exec() failed
-            exit(104);
-        } else if (pid == -1) {
-            report_error("couldn't spawn spaceshot-notify");
         } else {
-            // parent
-            // wait for the child to exit; usually this doesn't take too long
-            // (and the layers are closed by this point)
-            TIMING_START(exec_spaceshot_notify);
-            int status;
-            waitpid(pid, &status, WUNTRACED);
-            if (WIFEXITED(status)) {
-                int status_code = WEXITSTATUS(status);
-                if (status_code != 0) {
-                    if (status_code == 104) {
-                        report_warning(
-                            "Couldn't invoke spaceshot-notify; is it in "
-                            "PATH?\ntip: notifications require installing the "
-                            "spaceshot-notify binary and its D-Bus service "
-                            "definition"
-                        );
-                    } else {
-                        report_warning(
-                            "spaceshot-notify exited with status code %d",
-                            WEXITSTATUS(status)
-                        );
-                    }
-                }
-            } else {
-                report_warning("spaceshot-notify didn't exit?");
-            }
-            TIMING_END(exec_spaceshot_notify);
+            report_warning("spaceshot-notify didn't exit?");
         }
+        TIMING_END(exec_spaceshot_notify);
     }
 #endif
 }
 
+/** Give up on the current screenshot after an error has been reported. */
+static void fail_screenshot() {
+    has_failed = true;
+    should_active_wait = false;
+}
+
 static void clipboard_copy_finish(ClipboardCopy *source) {
     clipboard_copy_destroy(source);
-    should_clipboard_wait = false;
+    if (source == active_copy) {
+        active_copy = NULL;
+        should_clipboard_wait = false;
+    }
+}
+
+static LinkBuffer *encode_ppm(const Image *image) {
+    return image_save_raw(image, IMAGE_RAW_FORMAT_PPM);
+}
+
+// Everything the clipboard advertises. Only the formats that actually get
+// pasted are encoded.
+static const struct {
+    const char *mime;
+    LinkBuffer *(*encode)(const Image *image);
+} CLIPBOARD_IMAGE_FORMATS[] = {
+    {"image/png", image_save_png},
+    {"image/bmp", image_save_bmp},
+    {"image/x-portable-pixmap", encode_ppm},
+    {"image/qoi", image_save_qoi},
+};
+constexpr size_t CLIPBOARD_IMAGE_FORMAT_COUNT =
+    sizeof(CLIPBOARD_IMAGE_FORMATS) / sizeof(CLIPBOARD_IMAGE_FORMATS[0]);
+
+/** This needs to happen before the copy is activated. */
+static void offer_clipboard_image_formats(
+    ClipboardCopy *copy_source, ClipboardCopyOffer **offers
+) {
+    for (size_t i = 0; i < CLIPBOARD_IMAGE_FORMAT_COUNT; i++) {
+        offers[i] = clipboard_copy_offer_mime(
+            copy_source, CLIPBOARD_IMAGE_FORMATS[i].mime
+        );
+    }
+}
+
+/** Fill in the offers from @c offer_clipboard_image_formats. */
+static void
+fill_clipboard_image_offers(ClipboardCopyOffer **offers, Image *image) {
+    for (size_t i = 0; i < CLIPBOARD_IMAGE_FORMAT_COUNT; i++) {
+        offers[i]->encode = CLIPBOARD_IMAGE_FORMATS[i].encode;
+        offers[i]->image = image_ref(image);
+    }
+}
+
+/**
+ * Offer the output files' paths, for paste targets that would rather take a
+ * reference than the images themselves. These offers are complete right away.
+ * Like the image formats, this needs to happen before the copy is activated.
+ */
+static void offer_clipboard_paths(
+    ClipboardCopy *copy_source, char *const *output_filenames, size_t count
+) {
+    // text/uri-list entries are terminated by CRLF, and the plain text has
+    // one path per line
+    char *uri_list = strdup("");
+    size_t uri_list_length = 0;
+    char *path_list = strdup("");
+    size_t path_list_length = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (!is_file_target(output_filenames[i])) {
+            continue;
+        }
+        char *path = get_absolute_path(output_filenames[i]);
+        char *uri = get_file_uri(path);
+
+        size_t uri_length = strlen(uri);
+        uri_list = realloc(uri_list, uri_list_length + uri_length + 3);
+        strcpy(uri_list + uri_list_length, uri);
+        strcpy(uri_list + uri_list_length + uri_length, "\r\n");
+        uri_list_length += uri_length + 2;
+
+        size_t path_length = strlen(path);
+        path_list = realloc(path_list, path_list_length + path_length + 2);
+        if (path_list_length > 0) {
+            path_list[path_list_length++] = '\n';
+        }
+        strcpy(path_list + path_list_length, path);
+        path_list_length += path_length;
+
+        free(uri);
+        free(path);
+    }
+    if (uri_list_length == 0) {
+        free(uri_list);
+        free(path_list);
+        return;
+    }
+
+    ClipboardCopyOffer *uri_offer =
+        clipboard_copy_offer_mime(copy_source, "text/uri-list");
+    uri_offer->data = (uint8_t *)uri_list;
+    uri_offer->length = uri_list_length;
+
+    ClipboardCopyOffer *text_offer =
+        clipboard_copy_offer_mime(copy_source, "text/plain;charset=utf-8");
+    text_offer->data = (uint8_t *)path_list;
+    text_offer->length = path_list_length;
+}
+
+static void
+offer_clipboard_path(ClipboardCopy *copy_source, char *output_filename) {
+    offer_clipboard_paths(copy_source, &output_filename, 1);
+}
+
+/**
+ * The clipboard's archive for output --all, which gets a PNG of every output.
+ * It's put together once the last one has been written out.
+ */
+typedef struct {
+    ClipboardCopy *copy_source;
+    ClipboardCopyOffer *offer;
+    char **member_names;
+    LinkBuffer **members;
+    size_t member_count;
+    size_t received_count;
+    LinkBuffer *result;
+    TIMING_MEMBER(selection_to_clipboard_ready)
+} OutputArchive;
+
+/**
+ * The finish stage for a screenshot, which runs in steps:
+ * 1. (main thread) The clipboard starts serving. Everything except a PNG that
+ *    the file also needs can be pasted right away.
+ * 2. (worker) That PNG is encoded, and handed over to the clipboard.
+ * 3. (workers) The file is written, and at the same time, the notification
+ *    is sent.
+ * The main thread keeps handling pastes and Wayland events throughout.
+ */
+typedef struct {
+    Image *image;
+    char *output_filename;
+    ClipboardCopy *copy_source;
+    ClipboardCopyOffer *png_offer;
+    /** Whether the copy is held until the shared PNG has been written. */
+    bool is_copy_held;
+    LinkBuffer *encoded_image;
+    /** The archive to hand the PNG to once it's written, if any. */
+    OutputArchive *archive;
+    size_t archive_index;
+    bool should_notify;
+    /** Whether the notification says the image was copied. */
+    bool is_copied;
+    /** The number of step 3 jobs that haven't finished yet. */
+    int running_write_count;
+    /** Set by the save job, read back on the main thread. */
+    bool did_save_fail;
+    TIMING_MEMBER(selection_to_clipboard_ready)
+    TIMING_MEMBER(selection_to_file_written)
+} FinishPipeline;
+
+// Selection is when the user picks a region (or the capture finishes, if
+// there's no picker). Both of these spans start then, and every pipeline
+// started for the selection copies them.
+static int active_pipeline_count = 0;
+
+TIMING_DECLARE(selection_to_clipboard_ready);
+TIMING_DECLARE(selection_to_file_written);
+
+static void mark_selection_time() {
+    TIMING_START_DECLARED(selection_to_clipboard_ready);
+    TIMING_START_DECLARED(selection_to_file_written);
+}
+
+static void finish_pipeline_notify(void *data) {
+    FinishPipeline *pipeline = data;
+    send_notification(pipeline->output_filename, pipeline->is_copied);
+}
+
+static void output_archive_build(void *data) {
+    OutputArchive *archive = data;
+    archive->result = tar_archive_build(
+        (const char *const *)archive->member_names,
+        archive->members,
+        archive->member_count
+    );
+}
+
+static void output_archive_built(void *data) {
+    OutputArchive *archive = data;
+    clipboard_copy_offer_set_buffer(
+        archive->copy_source, archive->offer, archive->result
+    );
+    clipboard_copy_release(archive->copy_source);
+    TIMING_END_MEMBER(archive, selection_to_clipboard_ready);
+
+    for (size_t i = 0; i < archive->member_count; i++) {
+        free(archive->member_names[i]);
+        if (archive->members[i]) {
+            link_buffer_destroy(archive->members[i]);
+        }
+    }
+    free(archive->member_names);
+    free(archive->members);
+    free(archive);
+}
+
+/** Hand an output's PNG to the archive, which takes ownership of it. */
+static void output_archive_add(
+    OutputArchive *archive, size_t index, LinkBuffer *encoded_image
+) {
+    archive->members[index] = encoded_image;
+    archive->received_count++;
+    if (archive->received_count == archive->member_count) {
+        worker_run(output_archive_build, output_archive_built, archive);
+    }
+}
+
+static void finish_pipeline_done(FinishPipeline *pipeline) {
+    image_destroy(pipeline->image);
+    free(pipeline->output_filename);
+    // if copied, the clipboard owns the PNG
+    if (!pipeline->copy_source && pipeline->encoded_image) {
+        link_buffer_destroy(pipeline->encoded_image);
+    }
+    free(pipeline);
+
+    active_pipeline_count--;
+    if (active_pipeline_count == 0) {
+        should_active_wait = false;
+    }
+}
+
+static void finish_pipeline_write_done(FinishPipeline *pipeline) {
+    pipeline->running_write_count--;
+    if (pipeline->running_write_count == 0) {
+        finish_pipeline_done(pipeline);
+    }
+}
+
+static void finish_pipeline_notified(void *data) {
+    finish_pipeline_write_done(data);
+}
+
+static void finish_pipeline_save(void *data) {
+    FinishPipeline *pipeline = data;
+    pipeline->did_save_fail = !save_screenshot(
+        pipeline->image, pipeline->encoded_image, pipeline->output_filename
+    );
+}
+
+static void finish_pipeline_saved(void *data) {
+    FinishPipeline *pipeline = data;
+    TIMING_END_MEMBER(pipeline, selection_to_file_written);
+    if (pipeline->did_save_fail) {
+        has_failed = true;
+    }
+    if (pipeline->is_copy_held) {
+        // the file was written from the clipboard's copy of the PNG
+        clipboard_copy_release(pipeline->copy_source);
+    }
+    if (pipeline->archive) {
+        output_archive_add(
+            pipeline->archive, pipeline->archive_index, pipeline->encoded_image
+        );
+        pipeline->encoded_image = NULL;
+    }
+    finish_pipeline_write_done(pipeline);
+}
+
+/**
+ * Write the file and send the notification side by side. Starting
+ * spaceshot-notify and getting through to the notification server takes
+ * much longer than writing out an encoded image, so the file is there by the
+ * time the server looks at it.
+ */
+static void finish_pipeline_write(FinishPipeline *pipeline) {
+    pipeline->running_write_count = 1;
+    worker_run(finish_pipeline_save, finish_pipeline_saved, pipeline);
+    if (pipeline->should_notify) {
+        pipeline->running_write_count++;
+        worker_run(finish_pipeline_notify, finish_pipeline_notified, pipeline);
+    }
+}
+
+static void finish_pipeline_encode(void *data) {
+    FinishPipeline *pipeline = data;
+    pipeline->encoded_image = image_save_png(pipeline->image);
+}
+
+static void finish_pipeline_encoded(void *data) {
+    FinishPipeline *pipeline = data;
+    if (pipeline->copy_source) {
+        clipboard_copy_offer_set_buffer(
+            pipeline->copy_source,
+            pipeline->png_offer,
+            pipeline->encoded_image
+        );
+        TIMING_END_MEMBER(pipeline, selection_to_clipboard_ready);
+    }
+    finish_pipeline_write(pipeline);
+}
+
+/**
+ * Create a finish pipeline, whose options can be changed until it's started.
+ * This takes ownership of @p output_filename and takes a new reference to
+ * @p image.
+ */
+static FinishPipeline *finish_pipeline_new(
+    Image *image, char *output_filename, ClipboardCopy *copy_source
+) {
+    FinishPipeline *pipeline = calloc(1, sizeof(FinishPipeline));
+    pipeline->image = image_ref(image);
+    pipeline->output_filename = output_filename;
+    pipeline->copy_source = copy_source;
+    pipeline->should_notify = true;
+    pipeline->is_copied = copy_source != NULL;
+    TIMING_COPY_DECLARED(pipeline, selection_to_clipboard_ready);
+    TIMING_COPY_DECLARED(pipeline, selection_to_file_written);
+    return pipeline;
+}
+
+/**
+ * Start a finish pipeline.
+ * @param clipboard_offers The offers from @c offer_clipboard_image_formats,
+ * if copying.
+ */
+static void finish_pipeline_start(
+    FinishPipeline *pipeline, ClipboardCopyOffer **clipboard_offers
+) {
+    active_pipeline_count++;
+    ClipboardCopy *copy_source = pipeline->copy_source;
+
+    // A clipboard that's handed off to a holder gets its PNG encoded then,
+    // see clipboard_copy_hand_off
+    bool needs_png = is_png_needed_for_saving(pipeline->output_filename) ||
+                     pipeline->archive;
+    if (copy_source) {
+        fill_clipboard_image_offers(clipboard_offers, pipeline->image);
+        for (size_t i = 0; i < CLIPBOARD_IMAGE_FORMAT_COUNT; i++) {
+            if (clipboard_offers[i]->encode == image_save_png) {
+                pipeline->png_offer = clipboard_offers[i];
+            }
+        }
+        // the file's PNG is shared, so pastes shouldn't encode another one
+        pipeline->png_offer->is_pending = needs_png;
+        clipboard_copy_run(copy_source);
+        should_clipboard_wait = true;
+        active_copy = copy_source;
+        if (!needs_png) {
+            TIMING_END_MEMBER(pipeline, selection_to_clipboard_ready);
+        }
+    }
+
+    if (needs_png) {
+        if (copy_source) {
+            // Keep the copy (and with it, the PNG offer) alive until the PNG
+            // has been written out, even if it gets replaced in the meantime
+            clipboard_copy_hold(copy_source);
+            pipeline->is_copy_held = true;
+        }
+        worker_run(finish_pipeline_encode, finish_pipeline_encoded, pipeline);
+    } else {
+        finish_pipeline_write(pipeline);
+    }
+}
+
+/**
+ * Start the finish pipeline with the default options. This takes ownership of
+ * @p output_filename and takes a new reference to @p image.
+ * @param clipboard_offers The offers from @c offer_clipboard_image_formats,
+ * if copying.
+ */
+static void start_finish_pipeline(
+    Image *image,
+    char *output_filename,
+    ClipboardCopy *copy_source,
+    ClipboardCopyOffer **clipboard_offers
+) {
+    finish_pipeline_start(
+        finish_pipeline_new(image, output_filename, copy_source),
+        clipboard_offers
+    );
 }
 
 static void finish_noninteractive_screenshot(Image *image) {
-    LinkBuffer *out_data = image_save_png(image);
+    mark_selection_time();
 
     ClipboardCopy *copy_source = NULL;
     if (config_get()->copy_to_clipboard) {
         copy_source = clipboard_copy_setup(false);
     }
+
+    char *output_filename = get_output_filename();
+    ClipboardCopyOffer *clipboard_offers[CLIPBOARD_IMAGE_FORMAT_COUNT];
     // the copy may not be successful
     if (copy_source) {
         copy_source->finished = clipboard_copy_finish;
-        ClipboardCopyOffer *offer =
-            clipboard_copy_offer_mime(copy_source, "image/png");
-        offer->buffer = out_data;
+        offer_clipboard_image_formats(copy_source, clipboard_offers);
+        offer_clipboard_path(copy_source, output_filename);
         clipboard_copy_activate(copy_source);
-        clipboard_copy_run(copy_source);
-        should_clipboard_wait = true;
     }
 
-    char *output_filename = get_output_filename();
-    save_screenshot(out_data, output_filename);
-    send_notification(output_filename, copy_source != NULL);
-
-    free(output_filename);
-    // copies take ownership of link buffers
-    // so only destroy now if NOT copied
-    if (!copy_source) {
-        link_buffer_destroy(out_data);
-    }
-
-    should_active_wait = false;
+    start_finish_pipeline(
+        image, output_filename, copy_source, clipboard_offers
+    );
 }
 
-// This function uses logical coordinates
-static void finish_predefined_region_screenshot(
-    WrappedOutput *output, Image *image, BBox crop_bounds
-) {
-    if (!is_output_valid(output)) {
-        report_error("output disappeared while screenshotting");
-        should_active_wait = false;
-        return;
-    }
-
+/**
+ * Get the part of an entry's image under @p crop_bounds, which is in logical
+ * coordinates and needs to be within the entry's output.
+ */
+static Image *crop_capture_entry(CaptureEntry *entry, BBox crop_bounds) {
+    WrappedOutput *output = entry->output;
     // move to output space
     crop_bounds = bbox_translate(
         crop_bounds, -output->logical_bounds.x, -output->logical_bounds.y
     );
 
-    double scale_factor_x = image->width / output->logical_bounds.width;
-    double scale_factor_y = image->height / output->logical_bounds.height;
+    // A compressed image only needs the tiles under the region decompressed
+    uint32_t image_width = entry->compressed_image
+                               ? entry->compressed_image->width
+                               : entry->image->width;
+    uint32_t image_height = entry->compressed_image
+                                ? entry->compressed_image->height
+                                : entry->image->height;
+    double scale_factor_x = image_width / output->logical_bounds.width;
+    double scale_factor_y = image_height / output->logical_bounds.height;
     assert(fabs(scale_factor_x - scale_factor_y) < 0.01);
     // move to device space
     crop_bounds = bbox_scale(crop_bounds, scale_factor_x);
     // cropping takes place in pixels, which are whole, so round off any
     // potential inaccuracies
     crop_bounds = bbox_round(crop_bounds);
-
-    Image *cropped = image_crop(
-        image,
-        crop_bounds.x,
-        crop_bounds.y,
-        crop_bounds.width,
-        crop_bounds.height
+    // which can't be allowed to push it past the edge
+    crop_bounds = bbox_constrain(
+        crop_bounds, (BBox){0, 0, image_width, image_height}
     );
 
-    finish_noninteractive_screenshot(image);
+    if (entry->compressed_image) {
+        return compressed_image_crop(
+            entry->compressed_image,
+            crop_bounds.x,
+            crop_bounds.y,
+            crop_bounds.width,
+            crop_bounds.height
+        );
+    } else {
+        return image_crop(
+            entry->image,
+            crop_bounds.x,
+            crop_bounds.y,
+            crop_bounds.width,
+            crop_bounds.height
+        );
+    }
+}
+
+// This function uses logical coordinates
+static void
+finish_predefined_region_screenshot(CaptureEntry *entry, BBox crop_bounds) {
+    if (!is_output_valid(entry->output)) {
+        report_error("output disappeared while screenshotting");
+        should_active_wait = false;
+        return;
+    }
+
+    Image *cropped = crop_capture_entry(entry, crop_bounds);
+    finish_noninteractive_screenshot(cropped);
     image_destroy(cropped);
 }
 
+/** Free an entry's images and the entry itself, once it's out of the list. */
+static void capture_entry_free(CaptureEntry *entry) {
+    image_destroy(entry->image);
+    if (entry->compressed_image) {
+        compressed_image_destroy(entry->compressed_image);
+    }
+    free(entry);
+}
+
 static void capture_entry_destroy(CaptureEntry *entry) {
+    if (entry->is_capture_pending || entry->is_compressing) {
+        // the capture or compression callback frees it
+        wl_list_remove(&entry->link);
+        entry->is_abandoned = true;
+        return;
+    }
     if (entry->picker) {
         switch (entry->state) {
         case CAPTURE_ENTRY_STATE_REGION_PICKER:
@@ -240,9 +683,109 @@ static void capture_entry_destroy(CaptureEntry *entry) {
             REPORT_UNHANDLED("picker entry type", "%d", entry->state);
         }
     }
-    image_destroy(entry->image);
     wl_list_remove(&entry->link);
-    free(entry);
+    capture_entry_free(entry);
+}
+
+/**
+ * Get an entry's image, decompressing it first if needed. The compressed
+ * form is thrown away afterwards, since the image is about to be used.
+ */
+static Image *capture_entry_get_image(CaptureEntry *entry) {
+    if (entry->compressed_image) {
+        TIMING_START(decompress_deferred_image);
+        entry->image = compressed_image_decompress(entry->compressed_image);
+        compressed_image_destroy(entry->compressed_image);
+        entry->compressed_image = NULL;
+        TIMING_END(decompress_deferred_image);
+    }
+    return entry->image;
+}
+
+static uint64_t get_capture_entry_hash(CaptureEntry *entry) {
+    if (!entry->has_content_hash) {
+        entry->content_hash = content_hash(
+            entry->image, 0, 0, entry->image->width, entry->image->height
+        );
+        entry->has_content_hash = true;
+    }
+    return entry->content_hash;
+}
+
+/** Check whether another output is where @p output is, like a mirror. */
+static bool may_be_mirrored(WrappedOutput *output) {
+    WrappedOutput *other;
+    wl_list_for_each(other, &wayland_globals.outputs, link) {
+        if (other != output &&
+            bbox_equal(other->logical_bounds, output->logical_bounds)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void compress_capture_entry(void *data) {
+    CaptureEntry *entry = data;
+    // until this is done, the main thread only reads the image (to look for
+    // mirrors) and leaves compressed_image alone
+    entry->compressed_image = compressed_image_new(entry->image);
+}
+
+static void handle_capture_entry_compressed(void *data) {
+    CaptureEntry *entry = data;
+    entry->is_compressing = false;
+    compressing_count--;
+    // mirrors that arrived in the meantime share the image, so they get the
+    // compressed one too
+    CaptureEntry *other;
+    wl_list_for_each(other, &active_captures, link) {
+        if (other != entry && other->image == entry->image) {
+            other->compressed_image =
+                compressed_image_ref(entry->compressed_image);
+            image_destroy(other->image);
+            other->image = NULL;
+        }
+    }
+    if (entry->is_abandoned) {
+        capture_entry_free(entry);
+        return;
+    }
+    image_destroy(entry->image);
+    entry->image = NULL;
+}
+
+/**
+ * Deferred images can sit around for a while, so they're compressed in the
+ * background if configured to.
+ */
+static void maybe_compress_capture_entry(CaptureEntry *entry) {
+    if (args.mode != CAPTURE_DEFER ||
+        !config_get()->compress_deferred_images) {
+        return;
+    }
+    if (entry->compressed_image) {
+        // it mirrors an output that's already compressed
+        return;
+    }
+    CaptureEntry *other;
+    wl_list_for_each(other, &active_captures, link) {
+        if (other != entry && other->is_compressing &&
+            other->image == entry->image) {
+            // handle_capture_entry_compressed hands this one the result
+            return;
+        }
+    }
+    if (entry->image_type == CAPTURE_ENTRY_TYPE_OUTPUT &&
+        may_be_mirrored(entry->output)) {
+        // a mirror captured later needs to compare against it, and the
+        // uncompressed image won't be around anymore by then
+        get_capture_entry_hash(entry);
+    }
+    entry->is_compressing = true;
+    compressing_count++;
+    worker_run(
+        compress_capture_entry, handle_capture_entry_compressed, entry
+    );
 }
 
 static void capture_entry_destroy_all() {
@@ -252,6 +795,175 @@ static void capture_entry_destroy_all() {
     }
 }
 
+static void handle_composite_done(Image *image, void * /* data */) {
+    finish_noninteractive_screenshot(image);
+    image_destroy(image);
+}
+
+/**
+ * Screenshot an area spanning several outputs, by putting their images
+ * together. This only works if they all have the same scale, since nothing
+ * is resampled.
+ */
+static void finish_composite_screenshot(BBox bounds) {
+    CompositePart *parts =
+        calloc(wl_list_length(&active_captures), sizeof(CompositePart));
+    size_t part_count = 0;
+    CaptureEntry *entry;
+    wl_list_for_each(entry, &active_captures, link) {
+        if (entry->image_type != CAPTURE_ENTRY_TYPE_OUTPUT ||
+            !bbox_intersects(entry->output->logical_bounds, bounds)) {
+            continue;
+        }
+        BBox part_bounds =
+            bbox_constrain(bounds, entry->output->logical_bounds);
+        parts[part_count].logical_bounds = part_bounds;
+        parts[part_count].image =
+            entry->is_region_only
+                ? image_ref(capture_entry_get_image(entry))
+                : crop_capture_entry(entry, part_bounds);
+        part_count++;
+    }
+    double scale;
+    if (part_count == 0) {
+        report_error("couldn't find matching output");
+        fail_screenshot();
+    } else if (!composite_get_shared_scale(parts, part_count, &scale)) {
+        report_error(
+            "the outputs have different scales, so they can't be captured "
+            "together"
+        );
+        fail_screenshot();
+    } else {
+        log_debug("compositing %zu outputs at scale %f\n", part_count, scale);
+        composite_images(
+            parts, part_count, bounds, scale, handle_composite_done, NULL
+        );
+    }
+    for (size_t i = 0; i < part_count; i++) {
+        image_destroy(parts[i].image);
+    }
+    free(parts);
+}
+
+/**
+ * Whether @p entry should count as the primary output. Wayland doesn't have
+ * such a concept, so it's the one at the top left corner of the layout.
+ */
+static bool is_primary_output_entry(CaptureEntry *entry) {
+    return entry->output->logical_bounds.x == 0 &&
+           entry->output->logical_bounds.y == 0;
+}
+
+/** Save every captured output to its own file (output --all). */
+static void finish_all_outputs_screenshot() {
+    mark_selection_time();
+
+    // parse_argv already ruled out stdout
+    const char *template = config_get()->output_file;
+    size_t output_count = 0;
+    CaptureEntry *entry;
+    CaptureEntry *primary_entry = NULL;
+    wl_list_for_each(entry, &active_captures, link) {
+        if (entry->image_type != CAPTURE_ENTRY_TYPE_OUTPUT) {
+            continue;
+        }
+        output_count++;
+        if (!primary_entry || (is_primary_output_entry(entry) &&
+                               !is_primary_output_entry(primary_entry))) {
+            primary_entry = entry;
+        }
+    }
+    if (output_count == 0) {
+        report_error("no outputs captured");
+        fail_screenshot();
+        return;
+    }
+
+    CaptureEntry **entries = calloc(output_count, sizeof(CaptureEntry *));
+    char **output_filenames = calloc(output_count, sizeof(char *));
+    size_t index = 0;
+    wl_list_for_each(entry, &active_captures, link) {
+        if (entry->image_type != CAPTURE_ENTRY_TYPE_OUTPUT) {
+            continue;
+        }
+        entries[index] = entry;
+        // a socket gets every image in turn, so there's nothing to vary
+        output_filenames[index] =
+            is_socket_target(template)
+                ? get_output_filename()
+                : get_output_filename_for_output(entry->output->name);
+        index++;
+    }
+
+    ClipboardCopy *copy_source = NULL;
+    if (config_get()->copy_to_clipboard) {
+        copy_source = clipboard_copy_setup(false);
+    }
+    ClipboardCopyOffer *clipboard_offers[CLIPBOARD_IMAGE_FORMAT_COUNT];
+    OutputArchive *archive = NULL;
+    // the copy may not be successful
+    if (copy_source) {
+        copy_source->finished = clipboard_copy_finish;
+        if (config_get()->all_outputs_clipboard ==
+            CONFIG_ALL_OUTPUTS_CLIPBOARD_ARCHIVE) {
+            archive = calloc(1, sizeof(OutputArchive));
+            archive->copy_source = copy_source;
+            TIMING_COPY_DECLARED(archive, selection_to_clipboard_ready);
+            archive->member_count = output_count;
+            archive->member_names = calloc(output_count, sizeof(char *));
+            archive->members = calloc(output_count, sizeof(LinkBuffer *));
+            for (size_t i = 0; i < output_count; i++) {
+                const char *name = entries[i]->output->name;
+                archive->member_names[i] = malloc(strlen(name) + 5);
+                strcpy(archive->member_names[i], name);
+                sanitize_filename_part(archive->member_names[i]);
+                strcat(archive->member_names[i], ".png");
+            }
+            archive->offer =
+                clipboard_copy_offer_mime(copy_source, "application/x-tar");
+            archive->offer->is_pending = true;
+            offer_clipboard_paths(copy_source, output_filenames, output_count);
+        } else {
+            offer_clipboard_image_formats(copy_source, clipboard_offers);
+            for (size_t i = 0; i < output_count; i++) {
+                if (entries[i] == primary_entry) {
+                    offer_clipboard_path(copy_source, output_filenames[i]);
+                }
+            }
+        }
+        clipboard_copy_activate(copy_source);
+    }
+    if (archive) {
+        clipboard_copy_run(copy_source);
+        // released once the archive is done
+        clipboard_copy_hold(copy_source);
+        should_clipboard_wait = true;
+        active_copy = copy_source;
+    }
+
+    // Every output gets its own pipeline, so they're all encoded in parallel,
+    // and each file is written out as soon as its own encoding is done
+    for (size_t i = 0; i < output_count; i++) {
+        bool is_primary = entries[i] == primary_entry;
+        FinishPipeline *pipeline = finish_pipeline_new(
+            capture_entry_get_image(entries[i]),
+            output_filenames[i],
+            is_primary && !archive ? copy_source : NULL
+        );
+        if (archive) {
+            pipeline->archive = archive;
+            pipeline->archive_index = i;
+        }
+        // one notification is enough
+        pipeline->should_notify = is_primary;
+        pipeline->is_copied = copy_source != NULL;
+        finish_pipeline_start(pipeline, clipboard_offers);
+    }
+    free(output_filenames);
+    free(entries);
+}
+
 static void picker_finish_generic(
     void *picker,
     PickerFinishReason reason,
@@ -261,7 +973,8 @@ static void picker_finish_generic(
     CaptureEntry *entry, *tmp;
     Image *to_save = NULL;
     ClipboardCopy *copy_source = NULL;
-    ClipboardCopyOffer *image_png_offer = NULL;
+    ClipboardCopyOffer *clipboard_offers[CLIPBOARD_IMAGE_FORMAT_COUNT];
+    char *output_filename = NULL;
     bool should_copy = config_get()->copy_to_clipboard;
     wl_list_for_each_safe(entry, tmp, &active_captures, link) {
         if (entry->picker != picker) {
@@ -269,13 +982,15 @@ static void picker_finish_generic(
         }
 
         if (reason == PICKER_FINISH_REASON_SELECTED) {
+            mark_selection_time();
+            output_filename = get_output_filename();
             if (should_copy) {
                 // Set up the copy while the picker's still alive
                 copy_source = clipboard_copy_setup(true);
                 assert(copy_source);
                 copy_source->finished = clipboard_copy_finish;
-                image_png_offer =
-                    clipboard_copy_offer_mime(copy_source, "image/png");
+                offer_clipboard_image_formats(copy_source, clipboard_offers);
+                offer_clipboard_path(copy_source, output_filename);
                 clipboard_copy_activate(copy_source);
             }
 
@@ -297,29 +1012,12 @@ static void picker_finish_generic(
     }
 
     if (to_save) {
-        // saving is an expensive operation - flush the display first so that
-        // the region picker is properly closed before we block
-        // TODO: properly poll the display fd if EAGAIN
-        if (wl_display_flush(display) == -1) {
-            report_warning(
-                "flushing Wayland display failed before encoding image"
-            );
-        }
-
-        LinkBuffer *out_data = image_save_png(to_save);
+        start_finish_pipeline(
+            to_save, output_filename, copy_source, clipboard_offers
+        );
         image_destroy(to_save);
-        if (should_copy) {
-            image_png_offer->buffer = out_data;
-            clipboard_copy_run(copy_source);
-            should_clipboard_wait = true;
-        }
-
-        char *output_filename = get_output_filename();
-        save_screenshot(out_data, output_filename);
-        send_notification(output_filename, should_copy);
-
+    } else {
         free(output_filename);
-        should_active_wait = false;
     }
 }
 
@@ -364,7 +1062,8 @@ static bool is_output_matching(WrappedOutput *output) {
         }
     } else if (args.mode == CAPTURE_REGION) {
         if (args.region_params.has_region) {
-            if (bbox_contains(
+            // a region spanning several outputs needs all of them
+            if (bbox_intersects(
                     output->logical_bounds, args.region_params.region
                 )) {
                 return true;
@@ -376,6 +1075,7 @@ static bool is_output_matching(WrappedOutput *output) {
         // if we're not deferring outputs, we're not listening for them at all
         return true;
     }
+    // the modes without pickers capture their outputs separately
     // in toplevel mode, we don't need outputs
     // (this can happen if we defer into toplevel, and an output appears after
     // the mode switch)
@@ -384,7 +1084,7 @@ static bool is_output_matching(WrappedOutput *output) {
 }
 
 static bool is_toplevel_matching(WrappedToplevel *toplevel) {
-    if (args.mode == CAPTURE_TOPLEVEL) {
+    if (args.mode == CAPTURE_TOPLEVEL && !args.should_capture_all) {
         if (args.toplevel_params.toplevel_id) {
             if (strcmp(
                     toplevel->identifier, args.toplevel_params.toplevel_id
@@ -399,24 +1099,239 @@ static bool is_toplevel_matching(WrappedToplevel *toplevel) {
         return true;
     }
     // in non-toplevel modes, we don't need toplevels
+    // (and compare mode and toplevel --all capture theirs separately)
 
     return false;
 }
 
+TIMING_DECLARE(capture_to_first_picker);
+
+static void start_picker(CaptureEntry *entry) {
+    if (args.mode == CAPTURE_REGION) {
+        entry->picker = region_picker_new(
+            entry->output, capture_entry_get_image(entry), region_picker_finish
+        );
+        entry->state = CAPTURE_ENTRY_STATE_REGION_PICKER;
+    } else if (args.mode == CAPTURE_OUTPUT) {
+        entry->picker = output_picker_new(
+            entry->output, capture_entry_get_image(entry), output_picker_finish
+        );
+        entry->state = CAPTURE_ENTRY_STATE_OUTPUT_PICKER;
+    } else {
+        REPORT_UNHANDLED("picker mode", "%d", args.mode);
+    }
+}
+
+/**
+ * Mirrored outputs (like a projector showing the laptop's panel) produce the
+ * same image, so there's no point in keeping it twice. If @p entry's output
+ * mirrors one that's already captured, make the entry share that one's image,
+ * or its compressed form if it's been compressed already.
+ * Only outputs with the same position and size are hashed, so this is free
+ * for regular layouts.
+ */
+static void deduplicate_mirrored_capture(CaptureEntry *entry) {
+    if (entry->image_type != CAPTURE_ENTRY_TYPE_OUTPUT) {
+        return;
+    }
+    CaptureEntry *other;
+    wl_list_for_each(other, &active_captures, link) {
+        if (other == entry || other->image_type != CAPTURE_ENTRY_TYPE_OUTPUT ||
+            other->image == entry->image ||
+            other->is_region_only != entry->is_region_only ||
+            !bbox_equal(
+                other->output->logical_bounds, entry->output->logical_bounds
+            )) {
+            continue;
+        }
+        // While compressing, the worker only reads the pixels, so they can
+        // still be hashed and shared. Once compressed, only the hash from
+        // maybe_compress_capture_entry is left to compare against.
+        uint32_t width, height;
+        ImageFormat format;
+        if (other->image) {
+            width = other->image->width;
+            height = other->image->height;
+            format = other->image->format;
+        } else if (other->compressed_image && other->has_content_hash) {
+            width = other->compressed_image->width;
+            height = other->compressed_image->height;
+            format = other->compressed_image->format;
+        } else {
+            continue;
+        }
+        if (width != entry->image->width || height != entry->image->height ||
+            format != entry->image->format) {
+            continue;
+        }
+
+        TIMING_START(mirror_hash);
+        bool is_mirror =
+            get_capture_entry_hash(other) == get_capture_entry_hash(entry);
+        TIMING_END(mirror_hash);
+        if (is_mirror) {
+            log_debug(
+                "output %s mirrors %s, sharing its image\n",
+                entry->output->name,
+                other->output->name
+            );
+            image_destroy(entry->image);
+            if (other->image) {
+                entry->image = image_ref(other->image);
+            } else {
+                entry->image = NULL;
+                entry->compressed_image =
+                    compressed_image_ref(other->compressed_image);
+            }
+            return;
+        }
+    }
+}
+
+/**
+ * An output capture from an earlier daemon request. When identical requests
+ * come in at nearly the same moment, they get one capture between them.
+ */
+typedef struct {
+    struct wl_list link;
+    WrappedOutput *output;
+    bool is_region_only;
+    BBox region;
+    uint64_t requested_at_us;
+    Image *image;
+} SharedCapture;
+
+// Kept until the daemon runs out of queued requests
+static struct wl_list shared_captures;
+// Set while the daemon handles a request
+static bool is_serving_daemon_request = false;
+static uint64_t daemon_request_received_at_us;
+
+static uint64_t get_frame_interval_us(WrappedOutput *output) {
+    // assume 60 Hz if the compositor didn't say
+    int32_t refresh_mhz = output->refresh_mhz > 0 ? output->refresh_mhz : 60000;
+    return 1000000000 / refresh_mhz;
+}
+
+static bool is_same_capture(SharedCapture *shared, CaptureEntry *entry) {
+    return shared->output == entry->output &&
+           shared->is_region_only == entry->is_region_only &&
+           (!shared->is_region_only ||
+            bbox_equal(shared->region, entry->capture_region));
+}
+
+static void shared_capture_destroy(SharedCapture *shared) {
+    wl_list_remove(&shared->link);
+    image_destroy(shared->image);
+    free(shared);
+}
+
+static void share_capture(CaptureEntry *entry, Image *image) {
+    SharedCapture *shared, *tmp;
+    wl_list_for_each_safe(shared, tmp, &shared_captures, link) {
+        if (is_same_capture(shared, entry)) {
+            // only the newest one is kept
+            if (shared->requested_at_us > entry->requested_at_us) {
+                return;
+            }
+            shared_capture_destroy(shared);
+        }
+    }
+
+    shared = calloc(1, sizeof(SharedCapture));
+    shared->output = entry->output;
+    shared->is_region_only = entry->is_region_only;
+    shared->region = entry->capture_region;
+    shared->requested_at_us = entry->requested_at_us;
+    shared->image = image_ref(image);
+    wl_list_insert(&shared_captures, &shared->link);
+}
+
+static void release_shared_captures() {
+    SharedCapture *shared, *tmp;
+    wl_list_for_each_safe(shared, tmp, &shared_captures, link) {
+        shared_capture_destroy(shared);
+    }
+}
+
+/** Free what the last requests left behind, once the queue has run empty. */
+static void release_daemon_resources() {
+    release_shared_captures();
+    shared_buffer_pool_trim();
+}
+
 static void handle_captured_output(Image *image, void *data) {
     CaptureEntry *entry = data;
-
-    if (!is_output_valid(entry->output)) {
-        report_error("output disappeared while screenshotting");
-        capture_entry_destroy(entry);
+    entry->is_capture_pending = false;
+    if (entry->is_shareable && image) {
+        share_capture(entry, image);
+    }
+    if (entry->is_abandoned) {
+        // a picker finished before this capture was done
+        image_destroy(image);
+        free(entry);
         return;
     }
 
     entry->image = image;
-    if (!entry->image) {
-        report_error_fatal("capturing output %s failed\n", entry->output->name);
+    bool is_valid = is_output_valid(entry->output);
+    if (!is_valid || !entry->image) {
+        if (!is_valid) {
+            report_error("output disappeared while screenshotting");
+        } else {
+            report_error("capturing output %s failed", entry->output->name);
+        }
+        capture_entry_destroy(entry);
+        if (are_pickers_progressive && wl_list_empty(&active_captures)) {
+            report_error("no outputs captured");
+            fail_screenshot();
+        }
+        return;
     }
     entry->state = CAPTURE_ENTRY_STATE_READY;
+    deduplicate_mirrored_capture(entry);
+    maybe_compress_capture_entry(entry);
+
+    if (are_pickers_progressive) {
+        if (!is_first_picker_started) {
+            TIMING_END(capture_to_first_picker);
+            is_first_picker_started = true;
+        }
+        start_picker(entry);
+    }
+}
+
+/**
+ * Use a capture from another daemon request that arrived within a frame of
+ * this one, if there is one.
+ * @returns whether the entry got its image
+ */
+static bool reuse_shared_capture(CaptureEntry *entry) {
+    uint64_t frame_interval_us = get_frame_interval_us(entry->output);
+    SharedCapture *shared;
+    wl_list_for_each(shared, &shared_captures, link) {
+        // the queue isn't in order of arrival, so this can go either way
+        uint64_t distance_us =
+            shared->requested_at_us > entry->requested_at_us
+                ? shared->requested_at_us - entry->requested_at_us
+                : entry->requested_at_us - shared->requested_at_us;
+        if (shared->output != entry->output ||
+            distance_us > frame_interval_us) {
+            continue;
+        }
+        // a whole output has every region on it too
+        if (shared->is_region_only &&
+            (!entry->is_region_only ||
+             !bbox_equal(shared->region, entry->capture_region))) {
+            continue;
+        }
+
+        log_debug("sharing a capture of output %s\n", entry->output->name);
+        entry->is_region_only = shared->is_region_only;
+        handle_captured_output(image_ref(shared->image), entry);
+        return true;
+    }
+    return false;
 }
 
 static void add_new_output(WrappedOutput *output) {
@@ -451,25 +1366,66 @@ static void add_new_output(WrappedOutput *output) {
     entry->image_type = CAPTURE_ENTRY_TYPE_OUTPUT;
     entry->output = output;
     wl_list_insert(&active_captures, &entry->link);
-    capture_output(output, handle_captured_output, entry);
+    if (args.ago_ms) {
+        // The daemon only has whole outputs, which get cropped later like
+        // any other
+        handle_captured_output(replay_fetch(output->name, args.ago_ms), entry);
+        return;
+    }
+
+    if (args.mode == CAPTURE_REGION && args.region_params.has_region) {
+        // The rest of the output will never be needed, so don't copy it
+        entry->is_region_only = true;
+        BBox region =
+            bbox_constrain(args.region_params.region, output->logical_bounds);
+        entry->capture_region = bbox_translate(
+            region, -output->logical_bounds.x, -output->logical_bounds.y
+        );
+    }
+    if (is_serving_daemon_request) {
+        entry->requested_at_us = daemon_request_received_at_us;
+        if (reuse_shared_capture(entry)) {
+            return;
+        }
+        entry->is_shareable = true;
+    }
+
+    entry->is_capture_pending = true;
+    if (entry->is_region_only) {
+        capture_output_region(
+            output, entry->capture_region, handle_captured_output, entry
+        );
+    } else {
+        capture_output(output, handle_captured_output, entry);
+    }
 }
 
 static void handle_captured_toplevel(Image *image, void *data) {
     CaptureEntry *entry = data;
+    entry->is_capture_pending = false;
+    if (entry->is_abandoned) {
+        image_destroy(image);
+        free(entry);
+        return;
+    }
 
+    entry->image = image;
     if (!is_toplevel_valid(entry->toplevel)) {
         report_error("toplevel disappeared while screenshotting");
         capture_entry_destroy(entry);
         return;
     }
 
-    entry->image = image;
     if (!entry->image) {
-        report_error_fatal(
-            "capturing toplevel %s failed\n", entry->toplevel->identifier
+        report_error(
+            "capturing toplevel %s failed", entry->toplevel->identifier
         );
+        capture_entry_destroy(entry);
+        return;
     }
     entry->state = CAPTURE_ENTRY_STATE_READY;
+    deduplicate_mirrored_capture(entry);
+    maybe_compress_capture_entry(entry);
 }
 
 static void add_new_toplevel(WrappedToplevel *toplevel) {
@@ -493,6 +1449,7 @@ static void add_new_toplevel(WrappedToplevel *toplevel) {
     entry->image_type = CAPTURE_ENTRY_TYPE_TOPLEVEL;
     entry->toplevel = toplevel;
     wl_list_insert(&active_captures, &entry->link);
+    entry->is_capture_pending = true;
     capture_toplevel(toplevel, handle_captured_toplevel, entry);
 }
 
@@ -500,6 +1457,10 @@ static void get_required_capture_types(bool *output, bool *toplevel) {
     switch (args.mode) {
     case CAPTURE_REGION:
     case CAPTURE_OUTPUT:
+    case CAPTURE_BURST:
+    case CAPTURE_STREAM:
+    case CAPTURE_WATCH:
+    case CAPTURE_REPLAY_DAEMON:
         *output = true;
         *toplevel = false;
         break;
@@ -507,6 +1468,15 @@ static void get_required_capture_types(bool *output, bool *toplevel) {
         *output = false;
         *toplevel = true;
         break;
+    case CAPTURE_DAEMON:
+        // requests can ask for anything
+        *output = true;
+        *toplevel = true;
+        break;
+    case CAPTURE_COMPARE:
+        *output = args.target_params.type != CAPTURE_TOPLEVEL;
+        *toplevel = args.target_params.type == CAPTURE_TOPLEVEL;
+        break;
     case CAPTURE_DEFER:
         *output = args.defer_params.needs_output;
         *toplevel = args.defer_params.needs_toplevel;
@@ -516,7 +1486,21 @@ static void get_required_capture_types(bool *output, bool *toplevel) {
     }
 }
 
+static void handle_stdin_ready(void *data, int /* fd */, short /* revents */) {
+    *(bool *)data = true;
+}
+
 static void read_deferred_args() {
+    // Until the arguments start coming in, keep handling events, so that
+    // finished compression jobs can free up their uncompressed images.
+    bool is_stdin_ready = false;
+    EventLoopSource *stdin_source = event_loop_add_fd(
+        STDIN_FILENO, POLLIN, handle_stdin_ready, &is_stdin_ready
+    );
+    while (!is_stdin_ready && event_loop_dispatch() != -1) {
+    }
+    event_loop_remove(stdin_source);
+
     // Read stdin until EOF and use that as the actual arguments.
     char **new_argv = NULL;
     int new_argc = 0;
@@ -554,6 +1538,10 @@ static void read_deferred_args() {
     args.captured_mode_params = 0;
     parse_argv(&args, new_argc, new_argv);
 
+    // the entries can't be touched while they're being compressed
+    while (compressing_count > 0 && event_loop_dispatch() != -1) {
+    }
+
     for (int i = 0; i < new_argc; i++) {
         log_debug("new arg: '%s'\n", new_argv[i]);
         free(new_argv[i]);
@@ -594,40 +1582,69 @@ static void dispatch_capture_entries() {
             bool found = false;
             wl_list_for_each(entry, &active_captures, link) {
                 if (entry->image_type == CAPTURE_ENTRY_TYPE_OUTPUT &&
-                    is_output_matching(entry->output)) {
-                    finish_predefined_region_screenshot(
-                        entry->output, entry->image, args.region_params.region
-                    );
+                    bbox_contains(
+                        entry->output->logical_bounds, args.region_params.region
+                    )) {
+                    if (entry->is_region_only) {
+                        finish_noninteractive_screenshot(
+                            capture_entry_get_image(entry)
+                        );
+                    } else {
+                        // captured before the region was known (deferred)
+                        finish_predefined_region_screenshot(
+                            entry, args.region_params.region
+                        );
+                    }
                     found = true;
                     break;
                 }
             }
-            if (found) {
-                capture_entry_destroy_all();
-            } else {
-                report_error_fatal("couldn't find matching output");
+            if (!found) {
+                // no single output has all of it
+                finish_composite_screenshot(args.region_params.region);
             }
+            capture_entry_destroy_all();
         } else {
             CaptureEntry *entry;
             wl_list_for_each(entry, &active_captures, link) {
-                if (entry->image_type != CAPTURE_ENTRY_TYPE_OUTPUT) {
-                    continue;
+                if (entry->image_type == CAPTURE_ENTRY_TYPE_OUTPUT) {
+                    start_picker(entry);
                 }
-
-                entry->picker = region_picker_new(
-                    entry->output, entry->image, region_picker_finish
-                );
-                entry->state = CAPTURE_ENTRY_STATE_REGION_PICKER;
             }
         }
     } else if (args.mode == CAPTURE_OUTPUT) {
-        if (args.output_params.output_name) {
+        if (args.should_capture_all) {
+            finish_all_outputs_screenshot();
+            capture_entry_destroy_all();
+        } else if (args.should_capture_union) {
+            CaptureEntry *entry;
+            bool has_bounds = false;
+            BBox bounds;
+            wl_list_for_each(entry, &active_captures, link) {
+                if (entry->image_type != CAPTURE_ENTRY_TYPE_OUTPUT) {
+                    continue;
+                }
+                BBox output_bounds = entry->output->logical_bounds;
+                bounds = has_bounds ? bbox_union(bounds, output_bounds)
+                                    : output_bounds;
+                has_bounds = true;
+            }
+            if (has_bounds) {
+                finish_composite_screenshot(bounds);
+            } else {
+                report_error("no outputs captured");
+                fail_screenshot();
+            }
+            capture_entry_destroy_all();
+        } else if (args.output_params.output_name) {
             CaptureEntry *entry;
             bool found = false;
             wl_list_for_each(entry, &active_captures, link) {
                 if (entry->image_type == CAPTURE_ENTRY_TYPE_OUTPUT &&
                     is_output_matching(entry->output)) {
-                    finish_noninteractive_screenshot(entry->image);
+                    finish_noninteractive_screenshot(
+                        capture_entry_get_image(entry)
+                    );
                     found = true;
                     break;
                 }
@@ -648,7 +1665,9 @@ static void dispatch_capture_entries() {
             if (output_count == 1) {
                 wl_list_for_each(entry, &active_captures, link) {
                     if (entry->image_type == CAPTURE_ENTRY_TYPE_OUTPUT) {
-                        finish_noninteractive_screenshot(entry->image);
+                        finish_noninteractive_screenshot(
+                            capture_entry_get_image(entry)
+                        );
                         capture_entry_destroy(entry);
                         break;
                     }
@@ -656,14 +1675,9 @@ static void dispatch_capture_entries() {
             } else if (output_count > 1) {
                 CaptureEntry *entry;
                 wl_list_for_each(entry, &active_captures, link) {
-                    if (entry->image_type != CAPTURE_ENTRY_TYPE_OUTPUT) {
-                        continue;
+                    if (entry->image_type == CAPTURE_ENTRY_TYPE_OUTPUT) {
+                        start_picker(entry);
                     }
-
-                    entry->picker = output_picker_new(
-                        entry->output, entry->image, output_picker_finish
-                    );
-                    entry->state = CAPTURE_ENTRY_STATE_OUTPUT_PICKER;
                 }
             } else {
                 report_error_fatal("no outputs captured");
@@ -676,7 +1690,9 @@ static void dispatch_capture_entries() {
             wl_list_for_each(entry, &active_captures, link) {
                 if (entry->image_type == CAPTURE_ENTRY_TYPE_TOPLEVEL &&
                     is_toplevel_matching(entry->toplevel)) {
-                    finish_noninteractive_screenshot(entry->image);
+                    finish_noninteractive_screenshot(
+                        capture_entry_get_image(entry)
+                    );
                     found = true;
                     break;
                 }
@@ -697,6 +1713,15 @@ static void dispatch_capture_entries() {
         if (args.mode == CAPTURE_DEFER) {
             report_error_fatal("mode selection already deferred");
         }
+        if (args.mode == CAPTURE_BURST || args.mode == CAPTURE_STREAM ||
+            args.mode == CAPTURE_WATCH || args.mode == CAPTURE_COMPARE ||
+            args.mode == CAPTURE_REPLAY_DAEMON || args.mode == CAPTURE_DAEMON ||
+            (args.mode == CAPTURE_TOPLEVEL && args.should_capture_all)) {
+            report_error_fatal("this mode can't use deferred images");
+        }
+        if (args.ago_ms) {
+            report_error_fatal("--ago can't be used with deferred images");
+        }
 
         // This function will error out and exit the program if it can't find
         // matching capture targets
@@ -704,6 +1729,223 @@ static void dispatch_capture_entries() {
     }
 }
 
+/** Wait for all the captured outputs to be ready. */
+static void wait_for_capture_entries() {
+    TIMING_START(capture);
+    while (true) {
+        CaptureEntry *entry;
+        bool is_waiting = false;
+        wl_list_for_each(entry, &active_captures, link) {
+            if (entry->state == CAPTURE_ENTRY_STATE_EMPTY) {
+                log_debug("waiting for picker entry %p\n", (void *)entry);
+                is_waiting = true;
+                break;
+            }
+        }
+        if (is_waiting) {
+            event_loop_dispatch();
+        } else {
+            break;
+        }
+    }
+    TIMING_END(capture);
+}
+
+/**
+ * Whether the selected mode opens a picker on every output no matter what,
+ * so that each one can open without waiting for the others.
+ */
+static bool can_start_pickers_progressively() {
+    if (args.mode == CAPTURE_REGION) {
+        return !args.region_params.has_region;
+    }
+    if (args.mode == CAPTURE_OUTPUT && !args.output_params.output_name &&
+        !args.should_capture_all && !args.should_capture_union) {
+        // a single output is screenshotted right away instead
+        int output_count = 0;
+        CaptureEntry *entry;
+        wl_list_for_each(entry, &active_captures, link) {
+            if (entry->image_type == CAPTURE_ENTRY_TYPE_OUTPUT) {
+                output_count++;
+            }
+        }
+        return output_count > 1;
+    }
+    return false;
+}
+
+/**
+ * Take the screenshot (or run the mode) that the arguments ask for, once the
+ * capture entries for the targets that are already known have been added.
+ * This returns once the active wait is over, without waiting for pastes.
+ * @returns the exit code
+ */
+static int run_capture() {
+    if (args.mode == CAPTURE_BURST || args.mode == CAPTURE_STREAM ||
+        args.mode == CAPTURE_WATCH || args.mode == CAPTURE_COMPARE ||
+        args.mode == CAPTURE_REPLAY_DAEMON ||
+        (args.mode == CAPTURE_TOPLEVEL && args.should_capture_all)) {
+        if (args.mode == CAPTURE_BURST) {
+            return burst_run(&args);
+        } else if (args.mode == CAPTURE_STREAM) {
+            return stream_run(&args);
+        } else if (args.mode == CAPTURE_COMPARE) {
+            return compare_run(&args);
+        } else if (args.mode == CAPTURE_REPLAY_DAEMON) {
+            return replay_daemon_run(&args);
+        } else if (args.mode == CAPTURE_TOPLEVEL) {
+            return toplevel_export_run(&args);
+        } else {
+            return watch_run(&args);
+        }
+    }
+    // Non-matching outputs/toplevels are gonna be excluded from this list.
+    if (wl_list_empty(&active_captures)) {
+        // not fatal, so that a daemon survives a typo in a request
+        report_error("couldn't find matching capture target");
+        return 2;
+    }
+
+    if (can_start_pickers_progressively()) {
+        // Every capture has been requested already, so the images still all
+        // show the same moment. Each picker opens as soon as its own image
+        // is there, instead of waiting for the slowest output.
+        TIMING_START_DECLARED(capture_to_first_picker);
+        are_pickers_progressive = true;
+        CaptureEntry *entry;
+        wl_list_for_each(entry, &active_captures, link) {
+            if (entry->state == CAPTURE_ENTRY_STATE_READY) {
+                is_first_picker_started = true;
+                start_picker(entry);
+            }
+        }
+    } else {
+        wait_for_capture_entries();
+        if (wl_list_empty(&active_captures)) {
+            // every capture failed or went away, which was reported already
+            return 2;
+        }
+        dispatch_capture_entries();
+    }
+
+    // Workers don't survive the fork to the background, so wait for any that
+    // are still encoding for the clipboard too
+    while (event_loop_dispatch() != -1) {
+        if (!should_active_wait && worker_pending_count() == 0) {
+            break;
+        }
+    }
+    return has_failed ? 2 : was_cancelled ? 1 : 0;
+}
+
+static void parse_daemon_request(int argc, char **argv) {
+    // every request starts from the same state a new process would
+    config_load();
+    args = (Arguments){.executable_name = argv[0]};
+    parse_argv(&args, argc - 1, argv + 1);
+}
+
+static DaemonPriority get_daemon_request_priority() {
+    // Whoever asked for a picker is looking at the screen, waiting for it
+    if ((args.mode == CAPTURE_REGION && !args.region_params.has_region) ||
+        (args.mode == CAPTURE_OUTPUT && !args.output_params.output_name &&
+         !args.should_capture_all && !args.should_capture_union)) {
+        return DAEMON_PRIORITY_INTERACTIVE;
+    }
+    return DAEMON_PRIORITY_BACKGROUND;
+}
+
+static int handle_daemon_request(uint64_t received_at_us) {
+    if (args.mode == CAPTURE_DAEMON || args.mode == CAPTURE_REPLAY_DAEMON) {
+        report_error("the daemon can't run another daemon");
+        return 2;
+    }
+    // Nothing notices when the client goes away, and a request that never
+    // ends would keep every other one waiting
+    if ((args.mode == CAPTURE_STREAM && !args.count) ||
+        (args.mode == CAPTURE_WATCH && !args.until_stable_ms)) {
+        report_error(
+            "the daemon can't run a %s that doesn't end by itself "
+            "(use spaceshot directly, or pass %s)",
+            args.mode == CAPTURE_STREAM ? "stream" : "watch",
+            args.mode == CAPTURE_STREAM ? "--count" : "--until-stable"
+        );
+        return 2;
+    }
+    bool needs_output, needs_toplevel;
+    get_required_capture_types(&needs_output, &needs_toplevel);
+    if (!has_required_wayland_globals(needs_output, needs_toplevel)) {
+        report_error("didn't find every required Wayland object");
+        return 2;
+    }
+
+    should_active_wait = true;
+    should_clipboard_wait = false;
+    active_copy = NULL;
+    was_cancelled = false;
+    has_failed = false;
+    are_pickers_progressive = false;
+    is_first_picker_started = false;
+    // The globals are already there, so the targets can be captured straight
+    // away instead of waiting for them to be announced
+    if (needs_output) {
+        WrappedOutput *output;
+        wl_list_for_each(output, &wayland_globals.outputs, link) {
+            if (output->fill_state & WRAPPED_OUTPUT_CREATE_WAS_CALLED) {
+                add_new_output(output);
+            }
+        }
+    }
+    if (needs_toplevel) {
+        WrappedToplevel *toplevel;
+        wl_list_for_each(toplevel, &wayland_globals.toplevels, link) {
+            if (toplevel->identifier) {
+                add_new_toplevel(toplevel);
+            }
+        }
+    }
+
+    is_serving_daemon_request = true;
+    daemon_request_received_at_us = received_at_us;
+    int exit_code = run_capture();
+    is_serving_daemon_request = false;
+    // outputs and toplevels that show up between requests are left alone
+    should_active_wait = false;
+
+    // The copy is never waited for here, since that would hold up every
+    // queued request (including one that would replace the selection).
+    // Without a holder to take over, or in the foreground, the daemon keeps
+    // serving the copy from its own event loop, just like the background.
+    if (should_clipboard_wait && config_get()->move_to_background) {
+        clipboard_copy_hand_off(active_copy);
+    }
+    return exit_code;
+}
+
+/** Keep everything set up, and take screenshots for spaceshot-client. */
+static int run_daemon() {
+    // Nothing gets captured until a request comes in
+    should_active_wait = false;
+    // Requests can ask for anything, so bind everything. Toplevels are
+    // optional, as not every compositor has them.
+    find_wayland_globals(display, add_new_output, add_new_toplevel);
+    if (!has_required_wayland_globals(true, false)) {
+        report_error_fatal("didn't find every required Wayland object");
+    }
+    wl_display_roundtrip(display);
+
+    wl_list_init(&shared_captures);
+    static const DaemonHandlers handlers = {
+        .parse = parse_daemon_request,
+        .get_priority = get_daemon_request_priority,
+        .handle = handle_daemon_request,
+        .idle = release_daemon_resources,
+    };
+    int exit_code = daemon_run(&handlers);
+    release_shared_captures();
+    return exit_code;
+}
+
 // defined in debug.c
 extern void init_debug_mode();
 
@@ -722,6 +1964,17 @@ int main(int argc, char **argv) {
     if (!display) {
         report_error_fatal("failed to connect to Wayland display");
     }
+    event_loop_init(display);
+    // Pastes are written to pipes whose readers can go away at any time
+    signal(SIGPIPE, SIG_IGN);
+
+    if (args.mode == CAPTURE_DAEMON) {
+        int exit_code = run_daemon();
+        cleanup_wayland_globals();
+        wl_display_roundtrip(display);
+        wl_display_disconnect(display);
+        return exit_code;
+    }
 
     bool needs_output, needs_toplevel;
     get_required_capture_types(&needs_output, &needs_toplevel);
@@ -736,42 +1989,13 @@ int main(int argc, char **argv) {
     }
 
     wl_display_roundtrip(display);
-    // Non-matching outputs/toplevels are gonna be excluded from this list.
-    if (wl_list_empty(&active_captures)) {
-        report_error_fatal("couldn't find matching capture target");
-    }
-
-    // Wait for all the captured outputs to be ready.
-    TIMING_START(capture);
-    while (true) {
-        CaptureEntry *entry;
-        bool is_waiting = false;
-        wl_list_for_each(entry, &active_captures, link) {
-            if (entry->state == CAPTURE_ENTRY_STATE_EMPTY) {
-                log_debug("waiting for picker entry %p\n", (void *)entry);
-                is_waiting = true;
-                break;
-            }
-        }
-        if (is_waiting) {
-            wl_display_dispatch(display);
-        } else {
-            break;
-        }
-    }
-    TIMING_END(capture);
-
-    dispatch_capture_entries();
-
-    while (wl_display_dispatch(display) != -1) {
-        if (!should_active_wait) {
-            break;
-        }
-    }
+    int exit_code = run_capture();
 
     if (should_clipboard_wait) {
-        signal(SIGPIPE, SIG_IGN);
-        if (config_get()->move_to_background) {
+        // If a holder process takes over, this copy gets cancelled shortly,
+        // and the loop below only waits for in-flight pastes
+        if (config_get()->move_to_background &&
+            !clipboard_copy_hand_off(active_copy)) {
             // double-fork
             // I'm not quite sure why this works, but according to daemon(7)
             // it should prevent the process from re-acquiring terminals
@@ -808,7 +2032,7 @@ int main(int argc, char **argv) {
             }
         }
 
-        while (wl_display_dispatch(display) != -1) {
+        while (event_loop_dispatch() != -1) {
             if (!should_clipboard_wait) {
                 break;
             }
@@ -819,6 +2043,5 @@ int main(int argc, char **argv) {
     // destroying some objects is async, so wait a bit
     wl_display_roundtrip(display);
     wl_display_disconnect(display);
-    int exit_code = was_cancelled ? 1 : 0;
     return exit_code;
 }
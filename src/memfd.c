@@ -0,0 +1,48 @@
+// memfd_create and file sealing are Linux extensions
+#define _GNU_SOURCE
+#include "memfd.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+int memfd_new(const char *name) {
+    return memfd_create(name, MFD_CLOEXEC | MFD_ALLOW_SEALING);
+}
+
+bool memfd_write(int fd, const void *data, size_t length) {
+    // write() instead of a shared mapping, as that would block F_SEAL_WRITE
+    const uint8_t *cursor = data;
+    while (length > 0) {
+        ssize_t written = write(fd, cursor, length);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        cursor += written;
+        length -= written;
+    }
+    return true;
+}
+
+bool memfd_seal(int fd) {
+    return fcntl(
+               fd,
+               F_ADD_SEALS,
+               F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL
+           ) == 0;
+}
+
+bool memfd_check_sealed(int fd, size_t length) {
+    int required_seals = F_SEAL_SHRINK | F_SEAL_WRITE;
+    int seals = fcntl(fd, F_GET_SEALS);
+    if (seals < 0 || (seals & required_seals) != required_seals) {
+        return false;
+    }
+    struct stat stat_buf;
+    return fstat(fd, &stat_buf) == 0 && (uint64_t)stat_buf.st_size >= length;
+}
@@ -0,0 +1,24 @@
+#pragma once
+#include <stddef.h>
+
+/**
+ * Create an empty memfd which can be sealed later.
+ * @returns the file descriptor, or -1 on failure (with errno set)
+ */
+int memfd_new(const char *name);
+
+/** Append data to a memfd, handling partial writes. */
+bool memfd_write(int fd, const void *data, size_t length);
+
+/**
+ * Seal a memfd against any further changes, so that other processes can map
+ * it without it changing under them.
+ */
+bool memfd_seal(int fd);
+
+/**
+ * Check that a memfd from another process is at least @p length bytes long
+ * and can neither shrink nor be written to anymore. Mapping one that fails
+ * this could end in SIGBUS once the sender truncates it.
+ */
+bool memfd_check_sealed(int fd, size_t length);
@@ -37,7 +37,76 @@ const char *get_home_directory() {
     return result;
 }
 
-char *get_output_filename() {
+const char *get_output_extension() {
+    switch (config_get()->output_format) {
+    case CONFIG_OUTPUT_FORMAT_PNG:
+        return "png";
+    case CONFIG_OUTPUT_FORMAT_PAM:
+        return "pam";
+    case CONFIG_OUTPUT_FORMAT_PPM:
+        return "ppm";
+    case CONFIG_OUTPUT_FORMAT_FARBFELD:
+        return "ff";
+    default:
+        REPORT_UNHANDLED("output format", "%d", config_get()->output_format);
+    }
+}
+
+void sanitize_filename_part(char *part) {
+    for (char *c = part; *c; c++) {
+        bool is_allowed = (*c >= 'a' && *c <= 'z') ||
+                          (*c >= 'A' && *c <= 'Z') ||
+                          (*c >= '0' && *c <= '9') || strchr("-_.", *c);
+        if (!is_allowed) {
+            *c = '_';
+        }
+    }
+    // don't make hidden files or refer to parent directories
+    if (part[0] == '.') {
+        part[0] = '_';
+    }
+}
+
+/**
+ * Replace every occurrence of @p placeholder in @p str.
+ * This frees @p str and returns a newly-allocated string.
+ */
+static char *
+replace_placeholder(char *str, const char *placeholder, const char *value) {
+    size_t placeholder_len = strlen(placeholder);
+    size_t value_len = strlen(value);
+    size_t count = 0;
+    for (char *c = strstr(str, placeholder); c;
+         c = strstr(c + placeholder_len, placeholder)) {
+        count++;
+    }
+    if (count == 0) {
+        return str;
+    }
+
+    char *result =
+        malloc(strlen(str) + count * value_len - count * placeholder_len + 1);
+    char *out = result;
+    char *rest = str;
+    for (char *c = strstr(rest, placeholder); c;
+         c = strstr(rest, placeholder)) {
+        memcpy(out, rest, c - rest);
+        out += c - rest;
+        memcpy(out, value, value_len);
+        out += value_len;
+        rest = c + placeholder_len;
+    }
+    strcpy(out, rest);
+    free(str);
+    return result;
+}
+
+/**
+ * Expand the output filename template.
+ * @param output_name The name to substitute for {output}, or NULL if the
+ * template shouldn't refer to an output.
+ */
+static char *expand_output_filename(const char *output_name) {
     char *template = config_get()->output_file;
     int template_len = strlen(template);
     int tilde_count = 0;
@@ -93,10 +162,31 @@ char *get_output_filename() {
         // placeholder.
         strcpy(
             expanded_template + expanded_template_len - EXT_PLACEHOLDER_LEN,
-            "png"
+            get_output_extension()
         );
     }
 
+    if (output_name) {
+        // the name ends up in a strftime format, so % has to go too
+        char *sanitized_name = strdup(output_name);
+        sanitize_filename_part(sanitized_name);
+        if (strstr(expanded_template, "{output}")) {
+            expanded_template = replace_placeholder(
+                expanded_template, "{output}", sanitized_name
+            );
+        } else {
+            // make sure that every output still gets its own file
+            char *suffix = malloc(strlen(sanitized_name) + 2);
+            strcpy(suffix, "-");
+            strcat(suffix, sanitized_name);
+            char *suffixed = get_suffixed_filename(expanded_template, suffix);
+            free(suffix);
+            free(expanded_template);
+            expanded_template = suffixed;
+        }
+        free(sanitized_name);
+    }
+
     size_t filename_buf_size = strlen(expanded_template) + 64;
     char *filename = malloc(filename_buf_size);
     time_t timestamp = time(NULL);
@@ -113,6 +203,72 @@ char *get_output_filename() {
     return filename;
 }
 
+char *get_output_filename() { return expand_output_filename(NULL); }
+
+char *get_output_filename_for_output(const char *output_name) {
+    return expand_output_filename(output_name);
+}
+
+char *get_suffixed_filename(const char *filename, const char *suffix) {
+    // only a dot in the last path component starts an extension
+    const char *basename = strrchr(filename, '/');
+    basename = basename ? basename + 1 : filename;
+    const char *extension = strrchr(basename, '.');
+    // dotfiles don't have an extension
+    if (!extension || extension == basename) {
+        extension = filename + strlen(filename);
+    }
+
+    size_t stem_length = extension - filename;
+    char *result = malloc(strlen(filename) + strlen(suffix) + 1);
+    memcpy(result, filename, stem_length);
+    strcpy(result + stem_length, suffix);
+    strcat(result, extension);
+    return result;
+}
+
+char *get_absolute_path(const char *path) {
+    if (path[0] == '/') {
+        return strdup(path);
+    }
+
+    char *cwd = getcwd(NULL, 0);
+    if (!cwd) {
+        report_error("couldn't get current directory");
+        return strdup(path);
+    }
+    char *result = malloc(strlen(cwd) + 1 + strlen(path) + 1);
+    strcpy(result, cwd);
+    strcat(result, "/");
+    strcat(result, path);
+    free(cwd);
+    return result;
+}
+
+char *get_file_uri(const char *absolute_path) {
+    const char *PREFIX = "file://";
+    const char *HEX_DIGITS = "0123456789ABCDEF";
+
+    // worst case, every byte becomes %XX
+    char *result = malloc(strlen(PREFIX) + strlen(absolute_path) * 3 + 1);
+    strcpy(result, PREFIX);
+    char *out = result + strlen(PREFIX);
+    for (const char *c = absolute_path; *c; c++) {
+        // RFC 3986 unreserved characters, plus the path separator
+        unsigned char byte = *c;
+        if ((byte >= 'a' && byte <= 'z') || (byte >= 'A' && byte <= 'Z') ||
+            (byte >= '0' && byte <= '9') || strchr("-._~/", byte)) {
+            *out++ = byte;
+        } else {
+            *out++ = '%';
+            *out++ = HEX_DIGITS[byte >> 4];
+            *out++ = HEX_DIGITS[byte & 0xf];
+        }
+    }
+    *out = '\0';
+    return result;
+}
+
 /*
   The following function is copied from the source code of xdg-user-dirs.
   Its original license text is preserved below:
@@ -2,8 +2,40 @@
 
 const char *get_pictures_directory();
 
+/** Get the file extension (without a dot) for the configured output format. */
+const char *get_output_extension();
+
 /**
  * Create an output filename. Note that this function returns a newly-allocated
  * string that must be free'd.
  */
 char *get_output_filename();
+
+/**
+ * Like @c get_output_filename, but with every {output} in the template
+ * replaced by @p output_name. If the template has no {output}, the name is
+ * inserted before the extension instead, so that each output still gets its
+ * own file. Returns a newly-allocated string.
+ */
+char *get_output_filename_for_output(const char *output_name);
+
+/** Replace anything that doesn't belong in a file name, in place. */
+void sanitize_filename_part(char *part);
+
+/**
+ * Insert a suffix (like "-0007") before a filename's extension, or append it
+ * if there is none. Returns a newly-allocated string.
+ */
+char *get_suffixed_filename(const char *filename, const char *suffix);
+
+/**
+ * Resolve a path relative to the current directory. The file doesn't need to
+ * exist yet. Returns a newly-allocated string.
+ */
+char *get_absolute_path(const char *path);
+
+/**
+ * Turn an absolute path into a file:// URI, percent-encoding where needed.
+ * Returns a newly-allocated string.
+ */
+char *get_file_uri(const char *absolute_path);
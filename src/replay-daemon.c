@@ -0,0 +1,456 @@
+#include "event-loop.h"
+#include "image-socket.h"
+#include "image.h"
+#include "log.h"
+#include "replay.h"
+#include "tile-rle.h"
+#include "unix-socket.h"
+#include "wayland/globals.h"
+#include "wayland/screen-capture.h"
+#include "worker.h"
+#include <config/config.h>
+#include <errno.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/timerfd.h>
+#include <time.h>
+#include <unistd.h>
+
+// The history is kept per tile, so that a change only costs the tiles it
+// touches. Each tile version is run-length encoded.
+constexpr uint32_t TILE_SIZE = TILE_RLE_SIZE;
+constexpr int CLIENT_TIMEOUT_SECONDS = 2;
+
+typedef struct RecordedOutput RecordedOutput;
+typedef struct TileVersion TileVersion;
+
+struct TileVersion {
+    /** When this version was captured, in CLOCK_MONOTONIC milliseconds. */
+    uint64_t timestamp_ms;
+    TileVersion *newer;
+    /** Link in the eviction list, once a newer version exists. */
+    struct wl_list eviction_link;
+    RecordedOutput *recorded_output;
+    size_t tile_index;
+    size_t size;
+    uint8_t data[];
+};
+
+typedef struct {
+    TileVersion *oldest;
+    TileVersion *newest;
+} TileHistory;
+
+struct RecordedOutput {
+    /** A copy, since the output itself may go away. */
+    char *name;
+    CaptureSession *session;
+    /** Set while a frame is being compressed. */
+    bool is_busy;
+
+    // The geometry of the history; a frame with a different one starts over.
+    ImageFormat format;
+    uint32_t width;
+    uint32_t height;
+    uint32_t tiles_x;
+    uint32_t tiles_y;
+    /** NULL until the first frame arrives. */
+    TileHistory *tiles;
+    /** The earliest time every tile has a version for. */
+    uint64_t horizon_ms;
+
+    // The frame being compressed, if any.
+    Image *image;
+    uint64_t frame_timestamp_ms;
+    bool *is_tile_damaged;
+    /** Filled in by the job; NULL where the tile didn't actually change. */
+    TileVersion **new_versions;
+};
+
+static struct {
+    RecordedOutput *outputs;
+    size_t output_count;
+    /**
+     * Superseded tile versions, ordered by when they were superseded. Those
+     * are the ones that can be forgotten, starting from the front.
+     */
+    struct wl_list eviction_list;
+    size_t total_size;
+    size_t memory_budget;
+} replay;
+
+static uint64_t get_time_ms() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+typedef struct {
+    uint32_t x;
+    uint32_t y;
+    uint32_t width;
+    uint32_t height;
+} TileBounds;
+
+static TileBounds
+get_tile_bounds(const RecordedOutput *recorded, size_t index) {
+    uint32_t x = index % recorded->tiles_x * TILE_SIZE;
+    uint32_t y = index / recorded->tiles_x * TILE_SIZE;
+    return (TileBounds){
+        .x = x,
+        .y = y,
+        .width = recorded->width - x < TILE_SIZE ? recorded->width - x
+                                                 : TILE_SIZE,
+        .height = recorded->height - y < TILE_SIZE ? recorded->height - y
+                                                   : TILE_SIZE,
+    };
+}
+
+/** Compress the damaged tiles of a frame, skipping ones that didn't change. */
+static void compress_frame(void *data) {
+    RecordedOutput *recorded = data;
+    const Image *image = recorded->image;
+    uint8_t *encoded = malloc(TILE_RLE_MAX_ENCODED_SIZE);
+
+    size_t tile_count = recorded->tiles_x * recorded->tiles_y;
+    for (size_t i = 0; i < tile_count; i++) {
+        recorded->new_versions[i] = NULL;
+        if (!recorded->is_tile_damaged[i]) {
+            continue;
+        }
+
+        TileBounds bounds = get_tile_bounds(recorded, i);
+        size_t size = tile_rle_encode(
+            image, bounds.x, bounds.y, bounds.width, bounds.height, encoded
+        );
+
+        // The newest version isn't touched by the main thread while this
+        // output is busy, so it's safe to look at here.
+        const TileVersion *newest = recorded->tiles[i].newest;
+        if (newest && newest->size == size &&
+            memcmp(newest->data, encoded, size) == 0) {
+            continue;
+        }
+
+        TileVersion *version = malloc(sizeof(TileVersion) + size);
+        version->timestamp_ms = recorded->frame_timestamp_ms;
+        version->newer = NULL;
+        version->recorded_output = recorded;
+        version->tile_index = i;
+        version->size = size;
+        memcpy(version->data, encoded, size);
+        recorded->new_versions[i] = version;
+    }
+
+    free(encoded);
+}
+
+/** Forget the oldest version of a tile, which must have a newer one. */
+static void evict_version(TileVersion *version) {
+    RecordedOutput *recorded = version->recorded_output;
+    TileHistory *history = &recorded->tiles[version->tile_index];
+    history->oldest = version->newer;
+    // the tile doesn't go back further than this anymore
+    if (version->newer->timestamp_ms > recorded->horizon_ms) {
+        recorded->horizon_ms = version->newer->timestamp_ms;
+    }
+    wl_list_remove(&version->eviction_link);
+    replay.total_size -= sizeof(TileVersion) + version->size;
+    free(version);
+}
+
+static void apply_compressed_frame(void *data) {
+    RecordedOutput *recorded = data;
+    image_destroy(recorded->image);
+    recorded->image = NULL;
+    recorded->is_busy = false;
+
+    size_t tile_count = recorded->tiles_x * recorded->tiles_y;
+    for (size_t i = 0; i < tile_count; i++) {
+        TileVersion *version = recorded->new_versions[i];
+        if (!version) {
+            continue;
+        }
+        TileHistory *history = &recorded->tiles[i];
+        if (history->newest) {
+            history->newest->newer = version;
+            wl_list_insert(
+                replay.eviction_list.prev, &history->newest->eviction_link
+            );
+        } else {
+            history->oldest = version;
+        }
+        history->newest = version;
+        replay.total_size += sizeof(TileVersion) + version->size;
+    }
+
+    while (replay.total_size > replay.memory_budget &&
+           !wl_list_empty(&replay.eviction_list)) {
+        TileVersion *oldest =
+            wl_container_of(replay.eviction_list.next, oldest, eviction_link);
+        evict_version(oldest);
+    }
+}
+
+static void reset_history(RecordedOutput *recorded) {
+    if (!recorded->tiles) {
+        return;
+    }
+    size_t tile_count = recorded->tiles_x * recorded->tiles_y;
+    for (size_t i = 0; i < tile_count; i++) {
+        TileVersion *version = recorded->tiles[i].oldest;
+        while (version) {
+            TileVersion *newer = version->newer;
+            if (newer) {
+                wl_list_remove(&version->eviction_link);
+            }
+            replay.total_size -= sizeof(TileVersion) + version->size;
+            free(version);
+            version = newer;
+        }
+    }
+    free(recorded->tiles);
+    free(recorded->is_tile_damaged);
+    free(recorded->new_versions);
+    recorded->tiles = NULL;
+    recorded->is_tile_damaged = NULL;
+    recorded->new_versions = NULL;
+}
+
+static void set_up_history(RecordedOutput *recorded, const Image *image) {
+    recorded->format = image->format;
+    recorded->width = image->width;
+    recorded->height = image->height;
+    recorded->tiles_x = (image->width + TILE_SIZE - 1) / TILE_SIZE;
+    recorded->tiles_y = (image->height + TILE_SIZE - 1) / TILE_SIZE;
+    size_t tile_count = recorded->tiles_x * recorded->tiles_y;
+    recorded->tiles = calloc(tile_count, sizeof(TileHistory));
+    recorded->is_tile_damaged = calloc(tile_count, sizeof(bool));
+    recorded->new_versions = calloc(tile_count, sizeof(TileVersion *));
+}
+
+static void handle_session_frame(
+    Image *image, const BBox *damage, size_t damage_count, void *data
+) {
+    RecordedOutput *recorded = data;
+    if (!image) {
+        // Usually because the output was unplugged. Its history can still
+        // be asked for, so keep that around.
+        report_warning("stopped recording output %s", recorded->name);
+        capture_session_destroy(recorded->session);
+        recorded->session = NULL;
+        return;
+    }
+
+    if (recorded->tiles &&
+        (image->width != recorded->width ||
+         image->height != recorded->height ||
+         image->format != recorded->format)) {
+        log_debug("output %s changed modes, starting over\n", recorded->name);
+        reset_history(recorded);
+    }
+    recorded->frame_timestamp_ms = get_time_ms();
+    if (!recorded->tiles) {
+        set_up_history(recorded, image);
+        // the first frame is fully damaged, so every tile gets a version
+        recorded->horizon_ms = recorded->frame_timestamp_ms;
+    }
+
+    size_t tile_count = recorded->tiles_x * recorded->tiles_y;
+    memset(recorded->is_tile_damaged, 0, tile_count * sizeof(bool));
+    for (size_t i = 0; i < damage_count; i++) {
+        BBox area = bbox_constrain(
+            damage[i],
+            (BBox){.width = recorded->width, .height = recorded->height}
+        );
+        if (area.width <= 0 || area.height <= 0) {
+            continue;
+        }
+        uint32_t first_x = area.x / TILE_SIZE;
+        uint32_t first_y = area.y / TILE_SIZE;
+        uint32_t last_x = (area.x + area.width - 1) / TILE_SIZE;
+        uint32_t last_y = (area.y + area.height - 1) / TILE_SIZE;
+        for (uint32_t y = first_y; y <= last_y; y++) {
+            for (uint32_t x = first_x; x <= last_x; x++) {
+                recorded->is_tile_damaged[y * recorded->tiles_x + x] = true;
+            }
+        }
+    }
+
+    recorded->image = image;
+    recorded->is_busy = true;
+    worker_run(compress_frame, apply_compressed_frame, recorded);
+}
+
+/** Rebuild what the output looked like at @p timestamp_ms. */
+static Image *
+reconstruct_frame(const RecordedOutput *recorded, uint64_t timestamp_ms) {
+    if (timestamp_ms < recorded->horizon_ms) {
+        timestamp_ms = recorded->horizon_ms;
+    }
+
+    TIMING_START(replay_reconstruct);
+    Image *image =
+        image_new(recorded->width, recorded->height, recorded->format);
+    size_t tile_count = recorded->tiles_x * recorded->tiles_y;
+    for (size_t i = 0; i < tile_count; i++) {
+        // Everything is at least as old as the horizon, so this finds the
+        // version that was current at the time
+        const TileVersion *version = recorded->tiles[i].oldest;
+        if (!version) {
+            // the first frame is still being compressed
+            continue;
+        }
+        while (version->newer && version->newer->timestamp_ms <= timestamp_ms) {
+            version = version->newer;
+        }
+
+        TileBounds bounds = get_tile_bounds(recorded, i);
+        tile_rle_decode(
+            version->data,
+            version->size,
+            image,
+            bounds.x,
+            bounds.y,
+            bounds.width,
+            bounds.height
+        );
+    }
+    TIMING_END(replay_reconstruct);
+    return image;
+}
+
+static const RecordedOutput *find_recorded_output(const char *name) {
+    for (size_t i = 0; i < replay.output_count; i++) {
+        if (strcmp(replay.outputs[i].name, name) == 0) {
+            return &replay.outputs[i];
+        }
+    }
+    return NULL;
+}
+
+static void
+handle_client(void * /* data */, int listen_fd, short /* revents */) {
+    int client_fd = accept(listen_fd, NULL, NULL);
+    if (client_fd < 0) {
+        return;
+    }
+    struct timeval timeout = {.tv_sec = CLIENT_TIMEOUT_SECONDS};
+    setsockopt(client_fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(client_fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+    ReplayRequest request;
+    if (recv(client_fd, &request, sizeof(request), MSG_WAITALL) !=
+            sizeof(request) ||
+        request.magic != REPLAY_REQUEST_MAGIC ||
+        request.version != REPLAY_REQUEST_VERSION) {
+        log_debug("received an invalid replay request\n");
+        close(client_fd);
+        return;
+    }
+    request.output_name[sizeof(request.output_name) - 1] = '\0';
+
+    uint64_t now = get_time_ms();
+    uint64_t timestamp_ms = now > request.ago_ms ? now - request.ago_ms : 0;
+    const RecordedOutput *recorded = find_recorded_output(request.output_name);
+    Image *image = recorded && recorded->tiles && recorded->tiles[0].oldest
+                       ? reconstruct_frame(recorded, timestamp_ms)
+                       : NULL;
+    log_debug(
+        "serving %s from %u ms ago: %s\n",
+        request.output_name,
+        request.ago_ms,
+        image ? "found" : "not found"
+    );
+    image_socket_send_on(client_fd, image);
+    if (image) {
+        image_destroy(image);
+    }
+    close(client_fd);
+}
+
+static void handle_frame_timer(void * /* data */, int fd, short /* revents */) {
+    uint64_t expirations;
+    if (read(fd, &expirations, sizeof(expirations)) != sizeof(expirations)) {
+        return;
+    }
+    for (size_t i = 0; i < replay.output_count; i++) {
+        RecordedOutput *recorded = &replay.outputs[i];
+        // Holding on to a frame while the next one lands would make the
+        // session copy its whole buffer, so wait until it's compressed.
+        if (recorded->session && !recorded->is_busy) {
+            capture_session_request_frame(recorded->session);
+        }
+    }
+}
+
+int replay_daemon_run(const Arguments * /* args */) {
+    wl_list_init(&replay.eviction_list);
+    replay.memory_budget =
+        (size_t)config_get()->replay.memory_budget * 1024 * 1024;
+
+    char *socket_path = unix_socket_runtime_path(REPLAY_SOCKET_NAME);
+    if (!socket_path) {
+        report_error_fatal("XDG_RUNTIME_DIR is not set");
+    }
+    int listen_fd = unix_socket_listen(socket_path);
+    if (listen_fd < 0) {
+        if (errno == EADDRINUSE) {
+            report_error_fatal("the replay daemon is already running");
+        }
+        report_error_fatal(
+            "couldn't listen on %s: %s", socket_path, strerror(errno)
+        );
+    }
+    free(socket_path);
+
+    // Outputs connected after this point aren't recorded.
+    size_t output_capacity = wl_list_length(&wayland_globals.outputs);
+    replay.outputs = calloc(output_capacity, sizeof(RecordedOutput));
+    WrappedOutput *output;
+    wl_list_for_each(output, &wayland_globals.outputs, link) {
+        if ((output->fill_state & WRAPPED_OUTPUT_HAS_ALL) !=
+            WRAPPED_OUTPUT_HAS_ALL) {
+            continue;
+        }
+        RecordedOutput *recorded = &replay.outputs[replay.output_count++];
+        recorded->name = strdup(output->name);
+        recorded->session =
+            capture_session_new(output, handle_session_frame, recorded);
+        capture_session_request_frame(recorded->session);
+    }
+    if (replay.output_count == 0) {
+        report_error_fatal("couldn't find any outputs to record");
+    }
+
+    int timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+    if (timer_fd < 0) {
+        report_error_fatal("couldn't create timer: %s", strerror(errno));
+    }
+    long interval_ms = 1000 / config_get()->replay.fps;
+    struct timespec interval = {
+        .tv_sec = interval_ms / 1000,
+        .tv_nsec = interval_ms % 1000 * 1000000,
+    };
+    struct itimerspec timer_spec = {
+        .it_interval = interval,
+        .it_value = interval,
+    };
+    timerfd_settime(timer_fd, 0, &timer_spec, NULL);
+    event_loop_add_fd(timer_fd, POLLIN, handle_frame_timer, NULL);
+    event_loop_add_fd(listen_fd, POLLIN, handle_client, NULL);
+
+    log_debug(
+        "recording %zu outputs at %d fps\n",
+        replay.output_count,
+        (int)config_get()->replay.fps
+    );
+    while (event_loop_dispatch() != -1) {
+    }
+    // without the compositor, there's nothing left to record
+    report_error("lost connection to the compositor");
+    return 2;
+}
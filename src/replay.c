@@ -0,0 +1,51 @@
+#include "replay.h"
+#include "image-socket.h"
+#include "log.h"
+#include "unix-socket.h"
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+Image *replay_fetch(const char *output_name, uint32_t ago_ms) {
+    ReplayRequest request = {
+        .magic = REPLAY_REQUEST_MAGIC,
+        .version = REPLAY_REQUEST_VERSION,
+        .ago_ms = ago_ms,
+    };
+    if (strlen(output_name) >= sizeof(request.output_name)) {
+        report_error("output name %s is too long", output_name);
+        return NULL;
+    }
+    strcpy(request.output_name, output_name);
+
+    char *socket_path = unix_socket_runtime_path(REPLAY_SOCKET_NAME);
+    if (!socket_path) {
+        report_error("XDG_RUNTIME_DIR is not set");
+        return NULL;
+    }
+    int socket_fd = unix_socket_connect(socket_path);
+    free(socket_path);
+    if (socket_fd < 0) {
+        report_error(
+            "couldn't connect to the replay daemon (is 'spaceshot "
+            "replay-daemon' running?): %s",
+            strerror(errno)
+        );
+        return NULL;
+    }
+
+    Image *image = NULL;
+    if (send(socket_fd, &request, sizeof(request), MSG_NOSIGNAL) !=
+        sizeof(request)) {
+        report_error("couldn't send request to the replay daemon");
+    } else {
+        image = image_socket_receive(socket_fd);
+        if (!image) {
+            report_error("the replay daemon has no frames for %s", output_name);
+        }
+    }
+    close(socket_fd);
+    return image;
+}
@@ -0,0 +1,40 @@
+#pragma once
+#include "args.h"
+#include "image.h"
+#include <stdint.h>
+
+/** The replay daemon's socket, in $XDG_RUNTIME_DIR. */
+static const char *const REPLAY_SOCKET_NAME = "spaceshot-replay.sock";
+
+/** "SPRP" in little-endian */
+constexpr uint32_t REPLAY_REQUEST_MAGIC = 0x50525053;
+constexpr uint32_t REPLAY_REQUEST_VERSION = 1;
+
+/**
+ * The message a client sends to the replay daemon. The daemon answers with an
+ * image-socket message (see image-socket.h), which is empty if it doesn't
+ * have a frame for the output. All fields are in host byte order.
+ */
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t ago_ms;
+    /** NUL-terminated. */
+    char output_name[64];
+} ReplayRequest;
+
+/**
+ * Ask the replay daemon for what @p output_name looked like @p ago_ms
+ * milliseconds ago. If the daemon hasn't been running for that long, the
+ * oldest frame it remembers is used instead.
+ * @returns the frame, or NULL (with an error reported) if there isn't one
+ */
+Image *replay_fetch(const char *output_name, uint32_t ago_ms);
+
+/**
+ * Record every output into an in-memory history until interrupted, and serve
+ * frames from it to @c replay_fetch. The Wayland globals need to be set up
+ * already.
+ * @returns the exit code
+ */
+int replay_daemon_run(const Arguments *args);
@@ -0,0 +1,93 @@
+#include "save.h"
+#include "image-socket.h"
+#include "log.h"
+#include <assert.h>
+#include <config/config.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+ImageRawFormat get_raw_output_format() {
+    switch (config_get()->output_format) {
+    case CONFIG_OUTPUT_FORMAT_PAM:
+        return IMAGE_RAW_FORMAT_PAM;
+    case CONFIG_OUTPUT_FORMAT_PPM:
+        return IMAGE_RAW_FORMAT_PPM;
+    case CONFIG_OUTPUT_FORMAT_FARBFELD:
+        return IMAGE_RAW_FORMAT_FARBFELD;
+    default:
+        REPORT_UNHANDLED(
+            "raw output format", "%d", config_get()->output_format
+        );
+    }
+}
+
+static const char *const SOCKET_TARGET_PREFIX = "unix:";
+
+bool is_socket_target(const char *output_filename) {
+    return strncmp(
+               output_filename,
+               SOCKET_TARGET_PREFIX,
+               strlen(SOCKET_TARGET_PREFIX)
+           ) == 0;
+}
+
+bool is_file_target(const char *output_filename) {
+    return strcmp(output_filename, "-") != 0 &&
+           !is_socket_target(output_filename);
+}
+
+bool is_png_needed_for_saving(const char *output_filename) {
+    return config_get()->output_format == CONFIG_OUTPUT_FORMAT_PNG &&
+           !is_socket_target(output_filename);
+}
+
+bool save_screenshot(
+    const Image *image, LinkBuffer *encoded_image, const char *output_filename
+) {
+    if (is_socket_target(output_filename)) {
+        return image_socket_send(
+            output_filename + strlen(SOCKET_TARGET_PREFIX), image
+        );
+    }
+
+    bool is_stdout = strcmp(output_filename, "-") == 0;
+    if (config_get()->output_format == CONFIG_OUTPUT_FORMAT_PNG) {
+        FILE *out_file;
+        if (is_stdout) {
+            out_file = fdopen(dup(STDOUT_FILENO), "wb");
+        } else {
+            out_file = fopen(output_filename, "wb");
+        }
+        assert(out_file);
+        link_buffer_write(encoded_image, out_file);
+        fclose(out_file);
+        return true;
+    }
+
+    int fd = is_stdout ? STDOUT_FILENO
+                       : open(
+                             output_filename,
+                             O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                             0666
+                         );
+    if (fd < 0) {
+        report_error("couldn't open %s: %s", output_filename, strerror(errno));
+        return false;
+    }
+    bool success = image_write_raw(image, get_raw_output_format(), fd);
+    int write_errno = errno;
+    // a failed close can still lose the tail end of the data
+    if (!is_stdout && close(fd) != 0 && success) {
+        success = false;
+        write_errno = errno;
+    }
+    if (!success) {
+        report_error(
+            "couldn't write %s: %s", output_filename, strerror(write_errno)
+        );
+    }
+    return success;
+}
@@ -0,0 +1,29 @@
+#pragma once
+#include "image.h"
+#include "link-buffer.h"
+
+/**
+ * Whether the output "filename" is actually a UNIX socket to hand the image
+ * off to, which never needs any encoding.
+ */
+bool is_socket_target(const char *output_filename);
+
+/** Whether the output is an actual file, which can be referred to by path. */
+bool is_file_target(const char *output_filename);
+
+/** Whether saving to @p output_filename requires a PNG-encoded image. */
+bool is_png_needed_for_saving(const char *output_filename);
+
+/** Get the raw format matching the configured output format. */
+ImageRawFormat get_raw_output_format();
+
+/**
+ * Save a screenshot to disk (or to stdout, if the filename is "-", or to a
+ * UNIX socket, if it starts with "unix:").
+ * When saving as PNG, @p encoded_image needs to be set; the uncompressed
+ * formats are written straight from @p image instead.
+ * @returns whether the screenshot was saved; failures have been reported
+ */
+bool save_screenshot(
+    const Image *image, LinkBuffer *encoded_image, const char *output_filename
+);
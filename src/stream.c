@@ -0,0 +1,434 @@
+#include "stream.h"
+#include "capture-target.h"
+#include "event-loop.h"
+#include "log.h"
+#include "wayland/damage-tracker.h"
+#include "wayland/screen-capture.h"
+#include "worker.h"
+#include "yuv.h"
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+
+// The frame rate put in the y4m header when frames follow the compositor
+constexpr uint32_t NOMINAL_FPS = 60;
+
+static struct {
+    WrappedOutput *output;
+    BBox region;
+    CaptureSession *session;
+    StreamFormat format;
+    uint32_t fps;
+    uint32_t max_frames;
+
+    bool has_geometry;
+    // the size of the session's images
+    uint32_t image_width;
+    uint32_t image_height;
+    // the streamed part of the image, in its pixels
+    uint32_t src_x;
+    uint32_t src_y;
+    uint32_t width;
+    uint32_t height;
+
+    // The last frame as written, so that only damaged parts are converted
+    // again. Only touched by the frame job, of which there's one at a time.
+    YuvFrame *yuv;
+    uint8_t *raw;
+    size_t raw_size;
+
+    // the newest frame that hasn't been written yet
+    Image *pending_image;
+    BBox pending_damage[DAMAGE_TRACKER_MAX_RECTS];
+    size_t pending_damage_count;
+
+    // the frame being written
+    bool is_writing;
+    Image *job_image;
+    BBox job_damage[DAMAGE_TRACKER_MAX_RECTS];
+    size_t job_damage_count;
+    int job_errno;
+
+    uint32_t written_count;
+    uint32_t late_count;
+    bool is_done;
+    bool has_failed;
+    int timer_fd;
+    EventLoopSource *timer_source;
+} stream;
+
+/** Write all of @p data to stdout, handling partial writes. */
+static bool write_all(const uint8_t *data, size_t size) {
+    while (size > 0) {
+        ssize_t written = write(STDOUT_FILENO, data, size);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        data += written;
+        size -= written;
+    }
+    return true;
+}
+
+static inline uint8_t *put_le32(uint8_t *out, uint32_t value) {
+    out[0] = value & 0xff;
+    out[1] = value >> 8 & 0xff;
+    out[2] = value >> 16 & 0xff;
+    out[3] = value >> 24;
+    return out + 4;
+}
+
+static bool write_stream_header() {
+    if (stream.format == STREAM_FORMAT_Y4M) {
+        char header[128];
+        int len = snprintf(
+            header,
+            sizeof(header),
+            "YUV4MPEG2 W%u H%u F%u:1 Ip A1:1 C420jpeg XCOLORRANGE=LIMITED\n",
+            stream.width,
+            stream.height,
+            stream.fps ? stream.fps : NOMINAL_FPS
+        );
+        return write_all((const uint8_t *)header, len);
+    } else {
+        // magic, then width, height, stride and frame rate (0 if following
+        // the compositor), followed by the frames without any separators
+        uint8_t header[24];
+        memcpy(header, "SPSHRAW1", 8);
+        uint8_t *out = header + 8;
+        out = put_le32(out, stream.width);
+        out = put_le32(out, stream.height);
+        out = put_le32(out, stream.width * 4);
+        put_le32(out, stream.fps);
+        return write_all(header, sizeof(header));
+    }
+}
+
+/** Convert part of an image into the BGRx frame buffer. */
+static void convert_raw(
+    const Image *image, uint32_t x, uint32_t y, uint32_t width, uint32_t height
+) {
+    bool is_flipped = image->format & IMAGE_FORMAT_FLIPPED_ORDER;
+    bool is_10_bit = (image->format & ~IMAGE_FORMAT_FLIPPED_ORDER) ==
+                     IMAGE_FORMAT_XRGB2101010;
+    for (uint32_t row = y; row < y + height; row++) {
+        const uint8_t *src_row = image->data +
+                                 (size_t)(row + stream.src_y) * image->stride +
+                                 (size_t)(x + stream.src_x) * 4;
+        uint8_t *out_row =
+            stream.raw + (size_t)row * stream.width * 4 + (size_t)x * 4;
+        if (!is_flipped && !is_10_bit) {
+            // already in the right layout
+            memcpy(out_row, src_row, (size_t)width * 4);
+            continue;
+        }
+
+        const uint32_t *src = (const uint32_t *)src_row;
+        uint32_t *out = (uint32_t *)out_row;
+        for (uint32_t i = 0; i < width; i++) {
+            uint32_t pixel = src[i];
+            uint32_t r, g, b;
+            if (is_10_bit) {
+                r = pixel >> 22 & 0xff;
+                g = pixel >> 12 & 0xff;
+                b = pixel >> 2 & 0xff;
+            } else {
+                r = pixel >> 16 & 0xff;
+                g = pixel >> 8 & 0xff;
+                b = pixel & 0xff;
+            }
+            if (is_flipped) {
+                uint32_t tmp = r;
+                r = b;
+                b = tmp;
+            }
+            out[i] = r << 16 | g << 8 | b;
+        }
+    }
+}
+
+/** Update the frame buffer with what changed, and write it out. */
+static void stream_frame_write(void * /* data */) {
+    stream.job_errno = 0;
+    if (stream.job_image) {
+        for (size_t i = 0; i < stream.job_damage_count; i++) {
+            BBox rect = stream.job_damage[i];
+            if (stream.format == STREAM_FORMAT_Y4M) {
+                yuv_frame_convert(
+                    stream.yuv,
+                    stream.job_image,
+                    stream.src_x,
+                    stream.src_y,
+                    rect
+                );
+            } else {
+                convert_raw(
+                    stream.job_image, rect.x, rect.y, rect.width, rect.height
+                );
+            }
+        }
+    }
+
+    bool success;
+    if (stream.format == STREAM_FORMAT_Y4M) {
+        success = write_all((const uint8_t *)"FRAME\n", 6) &&
+                  write_all(stream.yuv->data, stream.yuv->size);
+    } else {
+        success = write_all(stream.raw, stream.raw_size);
+    }
+    if (!success) {
+        stream.job_errno = errno;
+    }
+}
+
+static void stream_frame_written(void *data);
+
+/** Write the pending frame, or repeat the last one if nothing changed. */
+static void start_frame_write() {
+    stream.is_writing = true;
+    stream.job_image = stream.pending_image;
+    stream.job_damage_count = stream.pending_damage_count;
+    memcpy(
+        stream.job_damage,
+        stream.pending_damage,
+        stream.pending_damage_count * sizeof(BBox)
+    );
+    stream.pending_image = NULL;
+    stream.pending_damage_count = 0;
+    worker_run(stream_frame_write, stream_frame_written, NULL);
+}
+
+static void stream_frame_written(void * /* data */) {
+    stream.is_writing = false;
+    // Dropping the reference before asking for the next frame lets the
+    // session update its image in place
+    bool had_image = stream.job_image != NULL;
+    if (stream.job_image) {
+        image_destroy(stream.job_image);
+        stream.job_image = NULL;
+    }
+
+    if (stream.job_errno != 0) {
+        // the reader going away is the usual way to stop streaming
+        if (stream.job_errno != EPIPE) {
+            report_error(
+                "couldn't write frame: %s", strerror(stream.job_errno)
+            );
+            stream.has_failed = true;
+        }
+        stream.is_done = true;
+        return;
+    }
+
+    stream.written_count++;
+    if (stream.max_frames && stream.written_count >= stream.max_frames) {
+        stream.is_done = true;
+        return;
+    }
+    if (had_image && !stream.is_done) {
+        capture_session_request_frame(stream.session);
+    }
+}
+
+static void stop_timer() {
+    if (stream.timer_source) {
+        event_loop_remove(stream.timer_source);
+        close(stream.timer_fd);
+        stream.timer_source = NULL;
+    }
+}
+
+static void handle_timer(void * /* data */, int fd, short /* revents */) {
+    uint64_t expirations;
+    if (read(fd, &expirations, sizeof(expirations)) != sizeof(expirations)) {
+        return;
+    }
+    if (stream.is_done) {
+        return;
+    }
+    if (stream.is_writing) {
+        // the reader (or the conversion) can't keep up
+        stream.late_count += expirations;
+        return;
+    }
+    stream.late_count += expirations - 1;
+    start_frame_write();
+}
+
+static void start_timer() {
+    stream.timer_fd =
+        timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+    if (stream.timer_fd < 0) {
+        report_error_fatal("couldn't create timer: %s", strerror(errno));
+    }
+    struct timespec interval = {
+        .tv_sec = stream.fps == 1 ? 1 : 0,
+        .tv_nsec = stream.fps == 1 ? 0 : 1000 * 1000 * 1000 / stream.fps,
+    };
+    struct itimerspec timer_spec = {
+        .it_interval = interval,
+        .it_value = interval,
+    };
+    timerfd_settime(stream.timer_fd, 0, &timer_spec, NULL);
+    stream.timer_source =
+        event_loop_add_fd(stream.timer_fd, POLLIN, handle_timer, NULL);
+}
+
+/** Work out the streamed area from the first frame, and allocate buffers. */
+static bool set_up_geometry(const Image *image) {
+    double scale = image->width / stream.output->logical_bounds.width;
+    BBox area = bbox_constrain(
+        bbox_round(bbox_scale(stream.region, scale)),
+        (BBox){.width = image->width, .height = image->height}
+    );
+    stream.image_width = image->width;
+    stream.image_height = image->height;
+    stream.src_x = area.x;
+    stream.src_y = area.y;
+    stream.width = area.width;
+    stream.height = area.height;
+
+    if (stream.format == STREAM_FORMAT_Y4M) {
+        // 4:2:0 needs even dimensions, so drop the last row/column if needed
+        stream.yuv = yuv_frame_new(stream.width, stream.height);
+        if (!stream.yuv) {
+            return false;
+        }
+        stream.width = stream.yuv->width;
+        stream.height = stream.yuv->height;
+    } else {
+        stream.raw_size = (size_t)stream.width * stream.height * 4;
+        stream.raw = malloc(stream.raw_size);
+        if (!stream.raw) {
+            return false;
+        }
+    }
+    if (stream.width == 0 || stream.height == 0) {
+        report_error("the streamed area is empty");
+        return false;
+    }
+    log_debug(
+        "streaming %ux%u pixels at %u,%u\n",
+        stream.width,
+        stream.height,
+        stream.src_x,
+        stream.src_y
+    );
+    stream.has_geometry = true;
+    return true;
+}
+
+static void add_pending_damage(BBox rect) {
+    // move into the streamed area
+    BBox bounds = {
+        .x = stream.src_x,
+        .y = stream.src_y,
+        .width = stream.width,
+        .height = stream.height,
+    };
+    rect = bbox_constrain(rect, bounds);
+    if (rect.width <= 0.0 || rect.height <= 0.0) {
+        return;
+    }
+    rect = bbox_translate(rect, -bounds.x, -bounds.y);
+
+    if (stream.pending_damage_count < DAMAGE_TRACKER_MAX_RECTS) {
+        stream.pending_damage[stream.pending_damage_count++] = rect;
+    } else {
+        BBox *last = &stream.pending_damage[DAMAGE_TRACKER_MAX_RECTS - 1];
+        *last = bbox_union(*last, rect);
+    }
+}
+
+static void handle_session_frame(
+    Image *image, const BBox *damage, size_t damage_count, void * /* data */
+) {
+    if (!image) {
+        report_error("capturing the stream failed");
+        stream.has_failed = true;
+        stream.is_done = true;
+        return;
+    }
+    if (stream.is_done) {
+        image_destroy(image);
+        return;
+    }
+
+    if (!stream.has_geometry) {
+        if (!set_up_geometry(image) || !write_stream_header()) {
+            image_destroy(image);
+            stream.has_failed = true;
+            stream.is_done = true;
+            return;
+        }
+        if (stream.fps) {
+            start_timer();
+        }
+    } else if (image->width != stream.image_width ||
+               image->height != stream.image_height) {
+        // y4m can't change sizes in the middle of a stream
+        report_error("the output's size changed, stopping the stream");
+        image_destroy(image);
+        stream.has_failed = true;
+        stream.is_done = true;
+        return;
+    }
+
+    for (size_t i = 0; i < damage_count; i++) {
+        add_pending_damage(damage[i]);
+    }
+    if (stream.pending_image) {
+        image_destroy(stream.pending_image);
+    }
+    stream.pending_image = image;
+
+    // with a target frame rate, the timer writes frames instead
+    if (!stream.fps && !stream.is_writing) {
+        start_frame_write();
+    }
+}
+
+int stream_run(const Arguments *args) {
+    if (isatty(STDOUT_FILENO)) {
+        report_error_fatal("refusing to write video to a terminal");
+    }
+
+    stream.output = find_target_output(&args->target_params, &stream.region);
+    stream.format = args->stream_format;
+    stream.fps = args->fps;
+    stream.max_frames = args->count;
+
+    stream.session =
+        capture_session_new(stream.output, handle_session_frame, NULL);
+    capture_session_request_frame(stream.session);
+    while (!stream.is_done || stream.is_writing) {
+        if (event_loop_dispatch() == -1) {
+            report_error("lost connection to the compositor");
+            stream.has_failed = true;
+            break;
+        }
+    }
+    stop_timer();
+
+    capture_session_destroy(stream.session);
+    if (stream.pending_image) {
+        image_destroy(stream.pending_image);
+    }
+    if (stream.late_count > 0) {
+        report_warning(
+            "%u frames were late, so the video runs faster than real time",
+            stream.late_count
+        );
+    }
+    log_debug("wrote %u frames\n", stream.written_count);
+    yuv_frame_destroy(stream.yuv);
+    free(stream.raw);
+    return stream.has_failed ? 2 : 0;
+}
@@ -0,0 +1,10 @@
+#pragma once
+#include "args.h"
+
+/**
+ * Write video frames of the target described by @p args to stdout until it's
+ * closed, or until --count frames have been written. The Wayland globals need
+ * to be set up already.
+ * @returns the exit code
+ */
+int stream_run(const Arguments *args);
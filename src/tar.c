@@ -0,0 +1,86 @@
+#include "tar.h"
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+constexpr size_t TAR_BLOCK_SIZE = 512;
+
+typedef struct {
+    char name[100];
+    char mode[8];
+    char uid[8];
+    char gid[8];
+    char size[12];
+    char mtime[12];
+    char checksum[8];
+    char type;
+    char link_name[100];
+    char magic[6];
+    char version[2];
+    char user_name[32];
+    char group_name[32];
+    char device_major[8];
+    char device_minor[8];
+    char prefix[155];
+    char padding[12];
+} TarHeader;
+
+static_assert(sizeof(TarHeader) == TAR_BLOCK_SIZE);
+
+static void
+append_member(LinkBuffer **tail, const char *name, LinkBuffer *contents) {
+    size_t size = 0;
+    for (LinkBuffer *block = contents; block; block = block->next) {
+        size += block->used_size;
+    }
+
+    TarHeader header = {};
+    snprintf(header.name, sizeof(header.name), "%s", name);
+    snprintf(header.mode, sizeof(header.mode), "%07o", 0644);
+    snprintf(header.uid, sizeof(header.uid), "%07o", 0);
+    snprintf(header.gid, sizeof(header.gid), "%07o", 0);
+    snprintf(header.size, sizeof(header.size), "%011zo", size);
+    snprintf(
+        header.mtime, sizeof(header.mtime), "%011llo", (long long)time(NULL)
+    );
+    header.type = '0';
+    memcpy(header.magic, "ustar", 6);
+    memcpy(header.version, "00", 2);
+
+    // the checksum is calculated as if its own field was all spaces
+    memset(header.checksum, ' ', sizeof(header.checksum));
+    unsigned int checksum = 0;
+    const unsigned char *header_bytes = (const unsigned char *)&header;
+    for (size_t i = 0; i < sizeof(header); i++) {
+        checksum += header_bytes[i];
+    }
+    snprintf(header.checksum, sizeof(header.checksum), "%06o", checksum);
+    header.checksum[7] = ' ';
+    link_buffer_append(tail, &header, sizeof(header));
+
+    for (LinkBuffer *block = contents; block; block = block->next) {
+        link_buffer_append(tail, block->data, block->used_size);
+    }
+    static const uint8_t ZEROES[TAR_BLOCK_SIZE] = {};
+    size_t remainder = size % TAR_BLOCK_SIZE;
+    if (remainder != 0) {
+        link_buffer_append(tail, (void *)ZEROES, TAR_BLOCK_SIZE - remainder);
+    }
+}
+
+LinkBuffer *tar_archive_build(
+    const char *const *names, LinkBuffer *const *contents, size_t count
+) {
+    LinkBuffer *result = link_buffer_new();
+    LinkBuffer *tail = result;
+    for (size_t i = 0; i < count; i++) {
+        if (contents[i]) {
+            append_member(&tail, names[i], contents[i]);
+        }
+    }
+    // the archive ends with two empty blocks
+    static const uint8_t END[TAR_BLOCK_SIZE * 2] = {};
+    link_buffer_append(&tail, (void *)END, sizeof(END));
+    return result;
+}
@@ -0,0 +1,15 @@
+#pragma once
+#include "link-buffer.h"
+#include <stddef.h>
+
+// Just enough of the ustar format to bundle a few files together, e.g. to put
+// several screenshots on the clipboard at once.
+
+/**
+ * Build a tar archive with a regular file for each member.
+ * Names longer than 99 bytes are cut off. NULL contents are skipped.
+ * @returns the archive, which the caller owns
+ */
+LinkBuffer *tar_archive_build(
+    const char *const *names, LinkBuffer *const *contents, size_t count
+);
@@ -0,0 +1,118 @@
+#include "tile-rle.h"
+#include "log.h"
+#include <string.h>
+
+// Pixels are encoded as packets, each of which starts with a header byte.
+// With RLE_RUN_FLAG set, the header is followed by one pixel, repeated
+// (header & ~RLE_RUN_FLAG) + 1 times; otherwise, by header + 1 pixels.
+constexpr size_t RLE_MAX_PACKET = 128;
+constexpr uint8_t RLE_RUN_FLAG = 0x80;
+
+/** The bits of each pixel that are actually visible. */
+static uint32_t get_pixel_mask(ImageFormat format) {
+    switch (format & ~IMAGE_FORMAT_FLIPPED_ORDER) {
+    case IMAGE_FORMAT_XRGB8888:
+        return 0x00ffffff;
+    case IMAGE_FORMAT_ARGB8888:
+        return 0xffffffff;
+    case IMAGE_FORMAT_XRGB2101010:
+        return 0x3fffffff;
+    default:
+        REPORT_UNHANDLED("image format", "%x", format);
+    }
+}
+
+static size_t rle_encode(const uint32_t *pixels, size_t count, uint8_t *out) {
+    uint8_t *start = out;
+    size_t i = 0;
+    while (i < count) {
+        size_t run = 1;
+        while (i + run < count && run < RLE_MAX_PACKET &&
+               pixels[i + run] == pixels[i]) {
+            run++;
+        }
+        if (run > 1) {
+            *out++ = RLE_RUN_FLAG | (run - 1);
+            memcpy(out, &pixels[i], sizeof(uint32_t));
+            out += sizeof(uint32_t);
+            i += run;
+            continue;
+        }
+
+        // a literal lasts until the next pair of equal pixels
+        size_t literal = 1;
+        while (i + literal < count && literal < RLE_MAX_PACKET &&
+               (i + literal + 1 >= count ||
+                pixels[i + literal] != pixels[i + literal + 1])) {
+            literal++;
+        }
+        *out++ = literal - 1;
+        memcpy(out, &pixels[i], literal * sizeof(uint32_t));
+        out += literal * sizeof(uint32_t);
+        i += literal;
+    }
+    return out - start;
+}
+
+static void rle_decode(const uint8_t *data, size_t size, uint32_t *out) {
+    const uint8_t *end = data + size;
+    while (data < end) {
+        uint8_t header = *data++;
+        if (header & RLE_RUN_FLAG) {
+            uint32_t pixel;
+            memcpy(&pixel, data, sizeof(pixel));
+            data += sizeof(pixel);
+            for (uint32_t i = 0; i <= (header & ~RLE_RUN_FLAG); i++) {
+                *out++ = pixel;
+            }
+        } else {
+            size_t length = (header + 1) * sizeof(uint32_t);
+            memcpy(out, data, length);
+            data += length;
+            out += header + 1;
+        }
+    }
+}
+
+size_t tile_rle_encode(
+    const Image *image,
+    uint32_t x,
+    uint32_t y,
+    uint32_t width,
+    uint32_t height,
+    uint8_t *out
+) {
+    // Runs can continue from one row into the next, so gather the rows first
+    uint32_t pixels[TILE_RLE_SIZE * TILE_RLE_SIZE];
+    uint32_t mask = get_pixel_mask(image->format);
+    uint32_t *dest = pixels;
+    for (uint32_t row = y; row < y + height; row++) {
+        const uint32_t *src =
+            (const uint32_t *)(image->data + (size_t)row * image->stride) + x;
+        for (uint32_t col = 0; col < width; col++) {
+            *dest++ = src[col] & mask;
+        }
+    }
+    return rle_encode(pixels, (size_t)width * height, out);
+}
+
+void tile_rle_decode(
+    const uint8_t *data,
+    size_t size,
+    Image *image,
+    uint32_t x,
+    uint32_t y,
+    uint32_t width,
+    uint32_t height
+) {
+    uint32_t pixels[TILE_RLE_SIZE * TILE_RLE_SIZE];
+    rle_decode(data, size, pixels);
+    for (uint32_t row = 0; row < height; row++) {
+        memcpy(
+            image->data + (size_t)(y + row) * image->stride +
+                x * sizeof(uint32_t),
+            pixels + row * width,
+            width * sizeof(uint32_t)
+        );
+    }
+}
@@ -0,0 +1,42 @@
+#pragma once
+#include "image.h"
+#include <stddef.h>
+#include <stdint.h>
+
+// A run-length encoding for small areas of 32-bit images, which is cheap to
+// produce and does well on the flat areas most of a desktop is made of.
+
+/** The largest area that can be encoded at once, in each dimension. */
+constexpr uint32_t TILE_RLE_SIZE = 64;
+/** The worst-case encoded size of a full tile. */
+constexpr size_t TILE_RLE_MAX_ENCODED_SIZE =
+    TILE_RLE_SIZE * TILE_RLE_SIZE * 4 + TILE_RLE_SIZE * TILE_RLE_SIZE / 128;
+
+/**
+ * Encode an area of at most TILE_RLE_SIZE x TILE_RLE_SIZE pixels. Padding
+ * bits (such as the X in XRGB) are cleared, so they don't break up runs.
+ * @param out At least TILE_RLE_MAX_ENCODED_SIZE bytes.
+ * @returns the encoded size
+ */
+size_t tile_rle_encode(
+    const Image *image,
+    uint32_t x,
+    uint32_t y,
+    uint32_t width,
+    uint32_t height,
+    uint8_t *out
+);
+
+/**
+ * Decode a tile from @c tile_rle_encode into an area of @p image, which
+ * needs to be the same size as the one it was encoded from.
+ */
+void tile_rle_decode(
+    const uint8_t *data,
+    size_t size,
+    Image *image,
+    uint32_t x,
+    uint32_t y,
+    uint32_t width,
+    uint32_t height
+);
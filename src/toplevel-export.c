@@ -0,0 +1,280 @@
+#include "toplevel-export.h"
+#include "event-loop.h"
+#include "link-buffer.h"
+#include "log.h"
+#include "paths.h"
+#include "save.h"
+#include "wayland/globals.h"
+#include "wayland/screen-capture.h"
+#include "worker.h"
+#include <config/config.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Each window goes through three stages: it's captured (a few at a time),
+// encoded on the worker pool, and then written out by a single writer, so
+// that the disk isn't seeking between files. Every stage counts towards the
+// memory budget, and new captures only start when there's room for them.
+
+typedef struct {
+    const char *identifier;
+    char *filename;
+    Image *image;
+    LinkBuffer *encoded_image;
+    /** How much this job counts for against the memory budget. */
+    size_t accounted_size;
+    struct wl_list link;
+} ExportJob;
+
+static struct {
+    /** The identifiers of every toplevel, in the order they're exported. */
+    char **identifiers;
+    size_t identifier_count;
+    size_t next_index;
+    const char *dir;
+
+    size_t captures_in_flight;
+    size_t max_captures_in_flight;
+    size_t memory_used;
+    size_t memory_budget;
+    /** The estimate for captures that haven't landed yet. */
+    size_t largest_image_size;
+
+    /** Jobs waiting for the writer, oldest first. */
+    struct wl_list write_queue;
+    bool is_writer_busy;
+
+    /** Jobs that have started and aren't written yet. */
+    size_t active_count;
+    size_t exported_count;
+    size_t failed_count;
+} toplevel_export;
+
+static size_t link_buffer_memory_size(const LinkBuffer *buffer) {
+    size_t size = 0;
+    for (; buffer; buffer = buffer->next) {
+        size += sizeof(LinkBuffer);
+    }
+    return size;
+}
+
+static char *get_export_filename(const WrappedToplevel *toplevel) {
+    const char *app_id = toplevel->app_id && toplevel->app_id[0]
+                             ? toplevel->app_id
+                             : "toplevel";
+    const char *extension = get_output_extension();
+    size_t length = strlen(app_id) + 1 + strlen(toplevel->identifier);
+    char *name = malloc(length + 1);
+    snprintf(name, length + 1, "%s-%s", app_id, toplevel->identifier);
+    sanitize_filename_part(name);
+
+    size_t filename_size =
+        strlen(toplevel_export.dir) + 1 + length + 1 + strlen(extension) + 1;
+    char *filename = malloc(filename_size);
+    snprintf(
+        filename,
+        filename_size,
+        "%s/%s.%s",
+        toplevel_export.dir,
+        name,
+        extension
+    );
+    free(name);
+    return filename;
+}
+
+static void set_accounted_size(ExportJob *job, size_t size) {
+    toplevel_export.memory_used -= job->accounted_size;
+    toplevel_export.memory_used += size;
+    job->accounted_size = size;
+}
+
+static void export_job_finish(ExportJob *job) {
+    set_accounted_size(job, 0);
+    image_destroy(job->image);
+    if (job->encoded_image) {
+        link_buffer_destroy(job->encoded_image);
+    }
+    free(job->filename);
+    free(job);
+    toplevel_export.active_count--;
+}
+
+static bool can_start_capture() {
+    if (toplevel_export.captures_in_flight >=
+        toplevel_export.max_captures_in_flight) {
+        return false;
+    }
+    // always make progress, even if a single window is over budget
+    if (toplevel_export.memory_used == 0 &&
+        toplevel_export.captures_in_flight == 0) {
+        return true;
+    }
+    // without an estimate, wait for the first capture to land
+    if (toplevel_export.largest_image_size == 0) {
+        return false;
+    }
+    return toplevel_export.memory_used + toplevel_export.largest_image_size <=
+           toplevel_export.memory_budget;
+}
+
+static void start_captures();
+
+static void write_job(void *data) {
+    ExportJob *job = data;
+    save_screenshot(job->image, job->encoded_image, job->filename);
+}
+
+static void start_writer();
+
+static void handle_job_written(void *data) {
+    ExportJob *job = data;
+    toplevel_export.is_writer_busy = false;
+    printf("%s\n", job->filename);
+    fflush(stdout);
+    toplevel_export.exported_count++;
+    export_job_finish(job);
+
+    start_writer();
+    start_captures();
+}
+
+static void start_writer() {
+    if (toplevel_export.is_writer_busy ||
+        wl_list_empty(&toplevel_export.write_queue)) {
+        return;
+    }
+    ExportJob *job =
+        wl_container_of(toplevel_export.write_queue.next, job, link);
+    wl_list_remove(&job->link);
+    toplevel_export.is_writer_busy = true;
+    worker_run(write_job, handle_job_written, job);
+}
+
+static void encode_job(void *data) {
+    ExportJob *job = data;
+    job->encoded_image = image_save_png(job->image);
+}
+
+static void handle_job_encoded(void *data) {
+    ExportJob *job = data;
+    // only the PNG is written, so the pixels can go right away
+    image_destroy(job->image);
+    job->image = NULL;
+    set_accounted_size(job, link_buffer_memory_size(job->encoded_image));
+
+    wl_list_insert(toplevel_export.write_queue.prev, &job->link);
+    start_writer();
+    start_captures();
+}
+
+static void handle_captured_toplevel(Image *image, void *data) {
+    ExportJob *job = data;
+    toplevel_export.captures_in_flight--;
+    if (!image) {
+        if (find_toplevel_by_identifier(job->identifier)) {
+            report_error("capturing toplevel %s failed", job->identifier);
+            toplevel_export.failed_count++;
+        } else {
+            log_debug("toplevel %s closed while exporting\n", job->identifier);
+        }
+        export_job_finish(job);
+        start_captures();
+        return;
+    }
+
+    job->image = image;
+    size_t image_size = (size_t)image->stride * image->height;
+    set_accounted_size(job, image_size);
+    if (image_size > toplevel_export.largest_image_size) {
+        toplevel_export.largest_image_size = image_size;
+    }
+
+    if (is_png_needed_for_saving(job->filename)) {
+        worker_run(encode_job, handle_job_encoded, job);
+    } else {
+        wl_list_insert(toplevel_export.write_queue.prev, &job->link);
+        start_writer();
+    }
+    start_captures();
+}
+
+static void start_captures() {
+    while (toplevel_export.next_index < toplevel_export.identifier_count &&
+           can_start_capture()) {
+        const char *identifier =
+            toplevel_export.identifiers[toplevel_export.next_index++];
+        WrappedToplevel *toplevel = find_toplevel_by_identifier(identifier);
+        if (!toplevel) {
+            log_debug("toplevel %s closed before exporting\n", identifier);
+            continue;
+        }
+
+        ExportJob *job = calloc(1, sizeof(ExportJob));
+        job->identifier = identifier;
+        job->filename = get_export_filename(toplevel);
+        // reserve room for the image until its real size is known
+        set_accounted_size(job, toplevel_export.largest_image_size);
+        toplevel_export.captures_in_flight++;
+        toplevel_export.active_count++;
+        capture_toplevel(toplevel, handle_captured_toplevel, job);
+    }
+}
+
+int toplevel_export_run(const Arguments *args) {
+    toplevel_export.dir = args->export_dir;
+    toplevel_export.memory_budget =
+        (size_t)config_get()->export.memory_budget * 1024 * 1024;
+    toplevel_export.max_captures_in_flight =
+        config_get()->export.captures_in_flight;
+    wl_list_init(&toplevel_export.write_queue);
+
+    if (mkdir(toplevel_export.dir, 0777) < 0 && errno != EEXIST) {
+        report_error_fatal(
+            "couldn't create %s: %s", toplevel_export.dir, strerror(errno)
+        );
+    }
+    if (access(toplevel_export.dir, W_OK | X_OK) < 0) {
+        report_error_fatal(
+            "can't write to %s: %s", toplevel_export.dir, strerror(errno)
+        );
+    }
+
+    // The list can change while exporting, so go by identifier
+    size_t toplevel_count = wl_list_length(&wayland_globals.toplevels);
+    toplevel_export.identifiers = calloc(toplevel_count, sizeof(char *));
+    WrappedToplevel *toplevel;
+    wl_list_for_each(toplevel, &wayland_globals.toplevels, link) {
+        toplevel_export.identifiers[toplevel_export.identifier_count++] =
+            strdup(toplevel->identifier);
+    }
+    log_debug("exporting %zu toplevels\n", toplevel_export.identifier_count);
+
+    TIMING_START(toplevel_export);
+    start_captures();
+    bool has_failed = false;
+    while (toplevel_export.active_count > 0 ||
+           toplevel_export.next_index < toplevel_export.identifier_count) {
+        if (event_loop_dispatch() == -1) {
+            report_error("lost connection to the compositor");
+            has_failed = true;
+            break;
+        }
+    }
+    TIMING_END(toplevel_export);
+
+    log_debug(
+        "exported %zu toplevels, %zu failed\n",
+        toplevel_export.exported_count,
+        toplevel_export.failed_count
+    );
+    for (size_t i = 0; i < toplevel_export.identifier_count; i++) {
+        free(toplevel_export.identifiers[i]);
+    }
+    free(toplevel_export.identifiers);
+    return has_failed || toplevel_export.failed_count > 0 ? 2 : 0;
+}
@@ -0,0 +1,11 @@
+#pragma once
+#include "args.h"
+
+/**
+ * Save every toplevel into the --dir in @p args, one file each. Captures,
+ * encoding and writing overlap, but only as much as the export section of
+ * the config allows, so memory use doesn't grow with the number of windows.
+ * The Wayland globals need to be set up already.
+ * @returns the exit code
+ */
+int toplevel_export_run(const Arguments *args);
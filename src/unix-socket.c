@@ -0,0 +1,244 @@
+#include "unix-socket.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+// How many descriptors a received message can carry before it's rejected
+constexpr size_t MAX_RECEIVED_FD_COUNT = 4;
+
+int unix_socket_connect(const char *path) {
+    struct sockaddr_un address = {.sun_family = AF_UNIX};
+    if (strlen(path) >= sizeof(address.sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    strcpy(address.sun_path, path);
+
+    int socket_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (socket_fd < 0) {
+        return -1;
+    }
+
+    int ret;
+    do {
+        ret = connect(
+            socket_fd, (struct sockaddr *)&address, sizeof(address)
+        );
+    } while (ret < 0 && errno == EINTR);
+    if (ret != 0) {
+        int saved_errno = errno;
+        close(socket_fd);
+        errno = saved_errno;
+        return -1;
+    }
+
+    return socket_fd;
+}
+
+int unix_socket_from_activation() {
+    const char *listen_pid = getenv("LISTEN_PID");
+    const char *listen_fds = getenv("LISTEN_FDS");
+    if (!listen_pid || !listen_fds || atoi(listen_pid) != getpid() ||
+        atoi(listen_fds) < 1) {
+        return -1;
+    }
+    // the first passed descriptor is always 3
+    int fd = 3;
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    return fd;
+}
+
+int unix_socket_listen(const char *path) {
+    struct sockaddr_un address = {.sun_family = AF_UNIX};
+    if (strlen(path) >= sizeof(address.sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    strcpy(address.sun_path, path);
+
+    int socket_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (socket_fd < 0) {
+        return -1;
+    }
+
+    if (bind(socket_fd, (struct sockaddr *)&address, sizeof(address)) != 0) {
+        if (errno != EADDRINUSE) {
+            goto error;
+        }
+        // Only take over the path if nobody's answering on it
+        int existing_fd = unix_socket_connect(path);
+        if (existing_fd >= 0) {
+            close(existing_fd);
+            errno = EADDRINUSE;
+            goto error;
+        }
+        unlink(path);
+        if (bind(socket_fd, (struct sockaddr *)&address, sizeof(address)) !=
+            0) {
+            goto error;
+        }
+    }
+    if (listen(socket_fd, 8) != 0) {
+        goto error;
+    }
+    return socket_fd;
+
+error:;
+    int saved_errno = errno;
+    close(socket_fd);
+    errno = saved_errno;
+    return -1;
+}
+
+char *unix_socket_runtime_path(const char *name) {
+    const char *runtime_dir = getenv("XDG_RUNTIME_DIR");
+    if (!runtime_dir || !runtime_dir[0]) {
+        return NULL;
+    }
+    char *result = malloc(strlen(runtime_dir) + 1 + strlen(name) + 1);
+    strcpy(result, runtime_dir);
+    strcat(result, "/");
+    strcat(result, name);
+    return result;
+}
+
+bool unix_socket_send_with_fd(
+    int socket_fd, const void *data, size_t length, int fd
+) {
+    struct iovec iov = {.iov_base = (void *)data, .iov_len = length};
+    union {
+        char buf[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } control = {0};
+
+    struct msghdr message = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+    };
+    if (fd >= 0) {
+        message.msg_control = control.buf;
+        message.msg_controllen = sizeof(control.buf);
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&message);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+    }
+
+    ssize_t sent;
+    do {
+        sent = sendmsg(socket_fd, &message, MSG_NOSIGNAL);
+    } while (sent < 0 && errno == EINTR);
+    if (sent < 0) {
+        return false;
+    }
+
+    // The descriptor goes out with the first byte, so any leftovers can be
+    // sent normally
+    const char *rest = (const char *)data + sent;
+    size_t rest_length = length - sent;
+    while (rest_length > 0) {
+        ssize_t written = send(socket_fd, rest, rest_length, MSG_NOSIGNAL);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        rest += written;
+        rest_length -= written;
+    }
+    return true;
+}
+
+ssize_t unix_socket_recv_some_with_fd(
+    int socket_fd, void *data, size_t length, int *fd
+) {
+    struct iovec iov = {.iov_base = data, .iov_len = length};
+    // Room for a few more descriptors than the one expected, so that extras
+    // can be closed rather than leaked
+    union {
+        char buf[CMSG_SPACE(MAX_RECEIVED_FD_COUNT * sizeof(int))];
+        struct cmsghdr align;
+    } control;
+
+    struct msghdr message = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control.buf,
+        .msg_controllen = sizeof(control.buf),
+    };
+
+    ssize_t received;
+    do {
+        received = recvmsg(socket_fd, &message, MSG_CMSG_CLOEXEC);
+    } while (received < 0 && errno == EINTR);
+    if (received < 0) {
+        return -1;
+    }
+
+    // only the first descriptor of a message is kept
+    int kept_fd = -1;
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&message); cmsg;
+         cmsg = CMSG_NXTHDR(&message, cmsg)) {
+        if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+            continue;
+        }
+        size_t count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        for (size_t i = 0; i < count; i++) {
+            int received_fd;
+            memcpy(
+                &received_fd,
+                CMSG_DATA(cmsg) + i * sizeof(int),
+                sizeof(received_fd)
+            );
+            if (*fd < 0 && kept_fd < 0) {
+                kept_fd = received_fd;
+            } else {
+                close(received_fd);
+            }
+        }
+    }
+
+    if (message.msg_flags & MSG_CTRUNC) {
+        // the kernel dropped descriptors, so the message can't be trusted
+        if (kept_fd >= 0) {
+            close(kept_fd);
+        }
+        errno = EMSGSIZE;
+        return -1;
+    }
+    if (kept_fd >= 0) {
+        *fd = kept_fd;
+    }
+    return received;
+}
+
+ssize_t
+unix_socket_recv_with_fd(int socket_fd, void *data, size_t length, int *fd) {
+    *fd = -1;
+    // A stream socket can split the message up; the descriptor comes with
+    // the first part
+    size_t total = 0;
+    while (total < length) {
+        ssize_t received = unix_socket_recv_some_with_fd(
+            socket_fd, (char *)data + total, length - total, fd
+        );
+        if (received < 0) {
+            if (*fd >= 0) {
+                close(*fd);
+                *fd = -1;
+            }
+            return -1;
+        }
+        if (received == 0) {
+            break;
+        }
+        total += received;
+    }
+    return total;
+}
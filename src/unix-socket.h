@@ -0,0 +1,65 @@
+#pragma once
+#include <stddef.h>
+#include <sys/types.h>
+
+/**
+ * Connect to the UNIX stream socket at @p path.
+ * @returns the socket's file descriptor, or -1 on failure (with errno set)
+ */
+int unix_socket_connect(const char *path);
+
+/**
+ * Create a listening UNIX stream socket at @p path. A stale socket file left
+ * behind by a dead process is replaced, but a live one is not.
+ * @returns the socket's file descriptor, or -1 on failure (with errno set to
+ * EADDRINUSE if another process is already listening)
+ */
+int unix_socket_listen(const char *path);
+
+/**
+ * Get the listening socket passed in by a service manager, as described in
+ * sd_listen_fds(3).
+ * @returns the socket's file descriptor, or -1 if there isn't one
+ */
+int unix_socket_from_activation();
+
+/**
+ * Get the path for a socket in $XDG_RUNTIME_DIR. Note that this function
+ * returns a newly-allocated string that must be free'd.
+ * @returns the path, or NULL if $XDG_RUNTIME_DIR isn't set
+ */
+char *unix_socket_runtime_path(const char *name);
+
+/**
+ * Send a message, along with a file descriptor, over a UNIX socket.
+ * @param fd The descriptor to pass, or -1 to not pass one.
+ * @returns whether the entire message was sent
+ */
+bool unix_socket_send_with_fd(
+    int socket_fd, const void *data, size_t length, int fd
+);
+
+/**
+ * Receive a message which may carry a file descriptor, waiting until all
+ * @p length bytes are there.
+ * @param fd Set to the received descriptor, or -1 if there wasn't one. Only
+ * one is accepted; any others that come along are closed.
+ * @returns the number of bytes received (less than @p length only if the
+ * connection was closed), or -1 on failure (with errno set, to EMSGSIZE if
+ * the message carried too many descriptors to receive them all)
+ */
+ssize_t
+unix_socket_recv_with_fd(int socket_fd, void *data, size_t length, int *fd);
+
+/**
+ * Receive whatever has arrived of a message which may carry a file
+ * descriptor, without waiting for the rest. This is meant for non-blocking
+ * sockets, where the rest is received on later calls.
+ * @param fd Set to the received descriptor if one came with this part, and
+ * left alone otherwise.
+ * @returns the number of bytes received, 0 if the connection was closed, or
+ * -1 on failure (with errno set, to EAGAIN if nothing has arrived)
+ */
+ssize_t unix_socket_recv_some_with_fd(
+    int socket_fd, void *data, size_t length, int *fd
+);
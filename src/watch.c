@@ -0,0 +1,336 @@
+#include "watch.h"
+#include "content-hash.h"
+#include "event-loop.h"
+#include "log.h"
+#include "paths.h"
+#include "save.h"
+#include "wayland/globals.h"
+#include "wayland/screen-capture.h"
+#include "worker.h"
+#include <errno.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/timerfd.h>
+#include <time.h>
+#include <unistd.h>
+
+typedef struct {
+    WrappedOutput *output;
+    CaptureSession *session;
+    /** The frame being checked by a job, if any. */
+    Image *image;
+    struct timespec timestamp;
+    /** Where changed regions get saved (without the region suffix). */
+    char *save_filename;
+} WatchedOutput;
+
+typedef struct {
+    /** 1-based, in command line order. */
+    uint32_t id;
+    WatchedOutput *watched_output;
+    /** In logical coordinates relative to the output. */
+    BBox local_region;
+    bool has_geometry;
+    // in the session's image pixels
+    uint32_t x;
+    uint32_t y;
+    uint32_t width;
+    uint32_t height;
+    bool has_hash;
+    uint64_t hash;
+    // Set before a job starts, and read after it's done.
+    bool is_damaged;
+    bool has_changed;
+    char *saved_filename;
+} WatchedRegion;
+
+static struct {
+    WatchedRegion *regions;
+    size_t region_count;
+    WatchedOutput *outputs;
+    size_t output_count;
+    bool should_save_changes;
+    uint32_t until_stable_ms;
+    int timer_fd;
+    EventLoopSource *timer_source;
+    bool is_done;
+    bool has_failed;
+} watch;
+
+/** Hash the damaged regions of a frame, and save the ones that changed. */
+static void watch_frame_check(void *data) {
+    WatchedOutput *watched_output = data;
+    const Image *image = watched_output->image;
+    for (size_t i = 0; i < watch.region_count; i++) {
+        WatchedRegion *region = &watch.regions[i];
+        if (region->watched_output != watched_output || !region->is_damaged) {
+            continue;
+        }
+
+        uint64_t hash = content_hash(
+            image, region->x, region->y, region->width, region->height
+        );
+        // the first frame only sets the baseline
+        region->has_changed = region->has_hash && hash != region->hash;
+        region->has_hash = true;
+        region->hash = hash;
+        if (!region->has_changed || !watched_output->save_filename) {
+            continue;
+        }
+
+        Image *cropped = image_crop(
+            image, region->x, region->y, region->width, region->height
+        );
+        if (is_file_target(watched_output->save_filename)) {
+            char suffix[16];
+            snprintf(suffix, sizeof(suffix), "-%u", region->id);
+            region->saved_filename =
+                get_suffixed_filename(watched_output->save_filename, suffix);
+        } else {
+            region->saved_filename = strdup(watched_output->save_filename);
+        }
+        LinkBuffer *encoded = is_png_needed_for_saving(region->saved_filename)
+                                  ? image_save_png(cropped)
+                                  : NULL;
+        save_screenshot(cropped, encoded, region->saved_filename);
+        if (encoded) {
+            link_buffer_destroy(encoded);
+        }
+        image_destroy(cropped);
+    }
+}
+
+static void rearm_stable_timer() {
+    if (!watch.timer_source) {
+        return;
+    }
+    struct timespec duration = {
+        .tv_sec = watch.until_stable_ms / 1000,
+        .tv_nsec = (long)(watch.until_stable_ms % 1000) * 1000000,
+    };
+    // one-shot, so it only fires if nothing changes in the meantime
+    struct itimerspec timer_spec = {.it_value = duration};
+    timerfd_settime(watch.timer_fd, 0, &timer_spec, NULL);
+}
+
+static void watch_frame_checked(void *data) {
+    WatchedOutput *watched_output = data;
+    image_destroy(watched_output->image);
+    watched_output->image = NULL;
+    free(watched_output->save_filename);
+    watched_output->save_filename = NULL;
+
+    bool has_anything_changed = false;
+    for (size_t i = 0; i < watch.region_count; i++) {
+        WatchedRegion *region = &watch.regions[i];
+        if (region->watched_output != watched_output || !region->is_damaged) {
+            continue;
+        }
+        region->is_damaged = false;
+        if (!region->has_changed) {
+            continue;
+        }
+
+        has_anything_changed = true;
+        printf(
+            "%u %lld.%03ld %016" PRIx64,
+            region->id,
+            (long long)watched_output->timestamp.tv_sec,
+            watched_output->timestamp.tv_nsec / 1000000,
+            region->hash
+        );
+        if (region->saved_filename) {
+            printf(" %s", region->saved_filename);
+            free(region->saved_filename);
+            region->saved_filename = NULL;
+        }
+        printf("\n");
+    }
+
+    if (has_anything_changed) {
+        if (fflush(stdout) != 0) {
+            // nobody's listening anymore
+            watch.is_done = true;
+            return;
+        }
+        rearm_stable_timer();
+    }
+    if (!watch.is_done) {
+        capture_session_request_frame(watched_output->session);
+    }
+}
+
+static void set_up_geometry(WatchedOutput *watched_output, const Image *image) {
+    double scale = image->width / watched_output->output->logical_bounds.width;
+    BBox image_bounds = {.width = image->width, .height = image->height};
+    for (size_t i = 0; i < watch.region_count; i++) {
+        WatchedRegion *region = &watch.regions[i];
+        if (region->watched_output != watched_output) {
+            continue;
+        }
+        BBox area = bbox_constrain(
+            bbox_round(bbox_scale(region->local_region, scale)), image_bounds
+        );
+        region->x = area.x;
+        region->y = area.y;
+        region->width = area.width;
+        region->height = area.height;
+        region->has_geometry = true;
+    }
+}
+
+static bool is_damage_overlapping(
+    const WatchedRegion *region, const BBox *damage, size_t damage_count
+) {
+    for (size_t i = 0; i < damage_count; i++) {
+        if (damage[i].x < region->x + region->width &&
+            damage[i].y < region->y + region->height &&
+            damage[i].x + damage[i].width > region->x &&
+            damage[i].y + damage[i].height > region->y) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void handle_session_frame(
+    Image *image, const BBox *damage, size_t damage_count, void *data
+) {
+    WatchedOutput *watched_output = data;
+    if (!image) {
+        report_error(
+            "capturing output %s failed", watched_output->output->name
+        );
+        watch.has_failed = true;
+        watch.is_done = true;
+        return;
+    }
+    if (watch.is_done) {
+        image_destroy(image);
+        return;
+    }
+
+    // The geometry is redone on every frame, in case the output's mode
+    // changes; it's just a bit of arithmetic
+    set_up_geometry(watched_output, image);
+    bool is_any_damaged = false;
+    for (size_t i = 0; i < watch.region_count; i++) {
+        WatchedRegion *region = &watch.regions[i];
+        if (region->watched_output == watched_output &&
+            is_damage_overlapping(region, damage, damage_count)) {
+            region->is_damaged = true;
+            is_any_damaged = true;
+        }
+    }
+    if (!is_any_damaged) {
+        // something else on the output changed
+        image_destroy(image);
+        capture_session_request_frame(watched_output->session);
+        return;
+    }
+
+    clock_gettime(CLOCK_REALTIME, &watched_output->timestamp);
+    watched_output->image = image;
+    if (watch.should_save_changes) {
+        watched_output->save_filename = get_output_filename();
+    }
+    worker_run(watch_frame_check, watch_frame_checked, watched_output);
+}
+
+static void
+handle_stable_timer(void * /* data */, int fd, short /* revents */) {
+    uint64_t expirations;
+    if (read(fd, &expirations, sizeof(expirations)) != sizeof(expirations)) {
+        return;
+    }
+    log_debug("regions have been stable for %u ms\n", watch.until_stable_ms);
+    watch.is_done = true;
+}
+
+static WatchedOutput *get_watched_output(WrappedOutput *output) {
+    for (size_t i = 0; i < watch.output_count; i++) {
+        if (watch.outputs[i].output == output) {
+            return &watch.outputs[i];
+        }
+    }
+    WatchedOutput *result = &watch.outputs[watch.output_count++];
+    result->output = output;
+    return result;
+}
+
+int watch_run(const Arguments *args) {
+    const WatchParams *params = &args->watch_params;
+    watch.region_count = params->region_count;
+    watch.regions = calloc(watch.region_count, sizeof(WatchedRegion));
+    // there's at most one output per region
+    watch.outputs = calloc(watch.region_count, sizeof(WatchedOutput));
+    watch.should_save_changes = args->should_save_changes;
+    watch.until_stable_ms = args->until_stable_ms;
+
+    if (watch.should_save_changes) {
+        char *filename = get_output_filename();
+        if (strcmp(filename, "-") == 0) {
+            report_error_fatal("watch mode can't save to stdout");
+        }
+        free(filename);
+    }
+
+    for (size_t i = 0; i < watch.region_count; i++) {
+        WatchedRegion *region = &watch.regions[i];
+        region->id = i + 1;
+        WrappedOutput *output = find_output_containing(params->regions[i]);
+        if (!output) {
+            report_error_fatal(
+                "couldn't find an output containing region %u", region->id
+            );
+        }
+        region->watched_output = get_watched_output(output);
+        region->local_region = bbox_translate(
+            params->regions[i],
+            -output->logical_bounds.x,
+            -output->logical_bounds.y
+        );
+    }
+
+    if (watch.until_stable_ms) {
+        watch.timer_fd =
+            timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+        if (watch.timer_fd < 0) {
+            report_error_fatal("couldn't create timer: %s", strerror(errno));
+        }
+        watch.timer_source = event_loop_add_fd(
+            watch.timer_fd, POLLIN, handle_stable_timer, NULL
+        );
+        rearm_stable_timer();
+    }
+
+    for (size_t i = 0; i < watch.output_count; i++) {
+        WatchedOutput *watched_output = &watch.outputs[i];
+        watched_output->session = capture_session_new(
+            watched_output->output, handle_session_frame, watched_output
+        );
+        capture_session_request_frame(watched_output->session);
+    }
+
+    while (!watch.is_done || worker_pending_count() > 0) {
+        if (event_loop_dispatch() == -1) {
+            report_error("lost connection to the compositor");
+            watch.has_failed = true;
+            break;
+        }
+    }
+
+    if (watch.timer_source) {
+        event_loop_remove(watch.timer_source);
+        close(watch.timer_fd);
+    }
+    for (size_t i = 0; i < watch.output_count; i++) {
+        capture_session_destroy(watch.outputs[i].session);
+    }
+    free(watch.outputs);
+    free(watch.regions);
+    return watch.has_failed ? 2 : 0;
+}
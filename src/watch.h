@@ -0,0 +1,10 @@
+#pragma once
+#include "args.h"
+
+/**
+ * Watch the regions described by @p args, printing a line to stdout each
+ * time one of them changes. Runs until --until-stable is satisfied, or
+ * forever without it. The Wayland globals need to be set up already.
+ * @returns the exit code
+ */
+int watch_run(const Arguments *args);
@@ -1,7 +1,14 @@
 #include "clipboard.h"
+#include "event-loop.h"
 #include "link-buffer.h"
 #include "log.h"
 #include "wayland/globals.h"
+#include "worker.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <string.h>
+#include <unistd.h>
 #include <wayland-util.h>
 
 extern void clipboard_core_setup_impl(ClipboardCopy *source);
@@ -16,9 +23,231 @@ clipboard_ext_offer_impl(ClipboardCopy *source, ClipboardCopyOffer *offer);
 extern void clipboard_ext_activate_impl(ClipboardCopy *source);
 extern void clipboard_ext_run_impl(ClipboardCopy *source);
 
+/**
+ * A single paste in progress. The cursor points into the offer's data, which
+ * stays alive until the copy source is destroyed.
+ */
+typedef struct {
+    ClipboardCopy *source;
+    int fd;
+    EventLoopSource *loop_source;
+    const uint8_t *chunk;
+    size_t chunk_remaining;
+    // The block to continue with once the current chunk is written
+    const LinkBuffer *next_block;
+    // Set if the offer's data doesn't exist yet
+    ClipboardCopyOffer *waiting_for;
+    struct wl_list link;
+} ClipboardTransfer;
+
+typedef struct {
+    ClipboardCopy *source;
+    ClipboardCopyOffer *offer;
+    LinkBuffer *result;
+} ClipboardEncodeJob;
+
+static void clipboard_transfer_destroy(ClipboardTransfer *transfer) {
+    if (transfer->loop_source) {
+        event_loop_remove(transfer->loop_source);
+    }
+    close(transfer->fd);
+    wl_list_remove(&transfer->link);
+    free(transfer);
+}
+
+static void clipboard_copy_maybe_finish(ClipboardCopy *source) {
+    // The offers can only be freed once every paste has been written out
+    if (source->is_cancelled && source->hold_count == 0 &&
+        wl_list_empty(&source->transfers)) {
+        source->finished(source);
+    }
+}
+
+/**
+ * Write as much as possible without blocking.
+ * @returns Whether the transfer is over, either due to completion or an error.
+ */
+static bool clipboard_transfer_advance(ClipboardTransfer *transfer) {
+    while (true) {
+        if (transfer->chunk_remaining == 0) {
+            if (!transfer->next_block) {
+                return true;
+            }
+            transfer->chunk = transfer->next_block->data;
+            transfer->chunk_remaining = transfer->next_block->used_size;
+            transfer->next_block = transfer->next_block->next;
+            continue;
+        }
+
+        ssize_t written =
+            write(transfer->fd, transfer->chunk, transfer->chunk_remaining);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return false;
+            }
+            // The reader going away early isn't worth reporting
+            if (errno != EPIPE) {
+                report_error("clipboard transfer failed: %s", strerror(errno));
+            }
+            return true;
+        }
+        transfer->chunk += written;
+        transfer->chunk_remaining -= written;
+    }
+}
+
+static void clipboard_transfer_handle_ready(
+    void *data, int /* fd */, short /* revents */
+) {
+    ClipboardTransfer *transfer = data;
+    if (clipboard_transfer_advance(transfer)) {
+        ClipboardCopy *source = transfer->source;
+        log_debug("clipboard transfer to fd %d done\n", transfer->fd);
+        clipboard_transfer_destroy(transfer);
+        clipboard_copy_maybe_finish(source);
+    }
+}
+
+/**
+ * Point the transfer at the offer's data and write out what fits right away.
+ * This may destroy the transfer.
+ */
+static void clipboard_transfer_start(
+    ClipboardTransfer *transfer, ClipboardCopyOffer *offer
+) {
+    if (offer->buffer) {
+        transfer->next_block = offer->buffer;
+    } else {
+        transfer->chunk = offer->data;
+        transfer->chunk_remaining = offer->length;
+    }
+
+    // Small pastes fit in the pipe buffer, so try to get them over with now
+    if (clipboard_transfer_advance(transfer)) {
+        clipboard_transfer_destroy(transfer);
+        return;
+    }
+    log_debug(
+        "clipboard transfer to fd %d continues in the background\n",
+        transfer->fd
+    );
+    transfer->loop_source = event_loop_add_fd(
+        transfer->fd, POLLOUT, clipboard_transfer_handle_ready, transfer
+    );
+}
+
+static void clipboard_encode_job_run(void *data) {
+    ClipboardEncodeJob *job = data;
+    job->result = job->offer->encode(job->offer->image);
+}
+
+static void clipboard_encode_job_done(void *data) {
+    ClipboardEncodeJob *job = data;
+    log_debug("encoded %s for the clipboard\n", job->offer->mime);
+    clipboard_copy_offer_set_buffer(job->source, job->offer, job->result);
+    clipboard_copy_release(job->source);
+    free(job);
+}
+
+void clipboard_copy_serve(
+    ClipboardCopy *source, const char *mime_type, int fd
+) {
+    ClipboardCopyOffer *offer;
+    bool found = false;
+    wl_list_for_each(offer, &source->offers, link) {
+        if (strcmp(mime_type, offer->mime) == 0) {
+            found = true;
+            break;
+        }
+    }
+    if (!found) {
+        report_warning("no offer for mime type %s\n", mime_type);
+        close(fd);
+        return;
+    }
+    if (!offer->buffer && !offer->data && !offer->encode &&
+        !offer->is_pending) {
+        report_error_fatal(
+            "tried to paste mime type %s, but no data was present\n",
+            offer->mime
+        );
+    }
+
+    int flags = fcntl(fd, F_GETFL);
+    if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+        report_error("couldn't make clipboard fd %d non-blocking", fd);
+        close(fd);
+        return;
+    }
+
+    ClipboardTransfer *transfer = calloc(1, sizeof(ClipboardTransfer));
+    if (!transfer) {
+        report_error_fatal("couldn't allocate clipboard transfer");
+    }
+    transfer->source = source;
+    transfer->fd = fd;
+    wl_list_insert(&source->transfers, &transfer->link);
+
+    if (offer->buffer || offer->data) {
+        clipboard_transfer_start(transfer, offer);
+        return;
+    }
+
+    // Encoding can take a while, so do it off the main thread and let the
+    // paste wait for it. Further pastes of the same type wait for the same job.
+    transfer->waiting_for = offer;
+    if (!offer->is_pending) {
+        log_debug("encoding %s for the clipboard\n", offer->mime);
+        offer->is_pending = true;
+        ClipboardEncodeJob *job = calloc(1, sizeof(ClipboardEncodeJob));
+        job->source = source;
+        job->offer = offer;
+        clipboard_copy_hold(source);
+        worker_run(clipboard_encode_job_run, clipboard_encode_job_done, job);
+    }
+}
+
+void clipboard_copy_offer_set_buffer(
+    ClipboardCopy *source, ClipboardCopyOffer *offer, LinkBuffer *buffer
+) {
+    if (offer->buffer || offer->data) {
+        link_buffer_destroy(buffer);
+    } else {
+        offer->buffer = buffer;
+    }
+    offer->is_pending = false;
+
+    ClipboardTransfer *transfer, *tmp;
+    wl_list_for_each_safe(transfer, tmp, &source->transfers, link) {
+        if (transfer->waiting_for == offer) {
+            transfer->waiting_for = NULL;
+            clipboard_transfer_start(transfer, offer);
+        }
+    }
+    clipboard_copy_maybe_finish(source);
+}
+
+void clipboard_copy_hold(ClipboardCopy *source) {
+    source->hold_count++;
+}
+
+void clipboard_copy_release(ClipboardCopy *source) {
+    source->hold_count--;
+    clipboard_copy_maybe_finish(source);
+}
+
+void clipboard_copy_cancel(ClipboardCopy *source) {
+    source->is_cancelled = true;
+    clipboard_copy_maybe_finish(source);
+}
+
 ClipboardCopy *clipboard_copy_setup(bool has_surface_serial) {
     ClipboardCopy *copy_source = calloc(1, sizeof(ClipboardCopy));
     wl_list_init(&copy_source->offers);
+    wl_list_init(&copy_source->transfers);
 
     if (has_surface_serial &&
         wayland_globals.seat_dispatcher->last_clipboard_serial) {
@@ -70,6 +299,11 @@ void clipboard_copy_run(ClipboardCopy *source) {
 }
 
 void clipboard_copy_destroy(ClipboardCopy *source) {
+    ClipboardTransfer *transfer, *transfer_tmp;
+    wl_list_for_each_safe(transfer, transfer_tmp, &source->transfers, link) {
+        clipboard_transfer_destroy(transfer);
+    }
+
     ClipboardCopyOffer *offer, *tmp;
     wl_list_for_each_safe(offer, tmp, &source->offers, link) {
         if (offer->buffer) {
@@ -78,6 +312,7 @@ void clipboard_copy_destroy(ClipboardCopy *source) {
         if (offer->data) {
             free(offer->data);
         }
+        image_destroy(offer->image);
         wl_list_remove(&offer->link);
         free(offer);
     }
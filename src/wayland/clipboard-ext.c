@@ -3,42 +3,19 @@
 #include "link-buffer.h"
 #include "log.h"
 #include "wayland/globals.h"
-#include <stdio.h>
-#include <string.h>
-#include <unistd.h>
 #include <wayland-client.h>
 
+extern void
+clipboard_copy_serve(ClipboardCopy *source, const char *mime_type, int fd);
+extern void clipboard_copy_cancel(ClipboardCopy *source);
+
 static void clipboard_handle_send(
     void *data,
     struct ext_data_control_source_v1 * /* ext_data_source */,
     const char *mime_type,
     int fd
 ) {
-    ClipboardCopy *copy_source = data;
-    ClipboardCopyOffer *offer;
-    wl_list_for_each(offer, &copy_source->offers, link) {
-        if (strcmp(mime_type, offer->mime) == 0) {
-            FILE *wrapped_fd = fdopen(fd, "w");
-            if (!wrapped_fd) {
-                perror("fdopen");
-                close(fd);
-                report_error_fatal("couldn't open clipboard fd %d", fd);
-            }
-            if (offer->buffer) {
-                link_buffer_write(offer->buffer, wrapped_fd);
-            } else if (offer->data) {
-                fwrite(offer->data, offer->length, 1, wrapped_fd);
-            } else {
-                report_error_fatal(
-                    "tried to paste mime type %s, but no data was present\n",
-                    offer->mime
-                );
-            }
-            fclose(wrapped_fd);
-            return;
-        }
-    }
-    report_warning("no offer for mime type %s\n", mime_type);
+    clipboard_copy_serve(data, mime_type, fd);
 }
 
 static void clipboard_handle_cancelled(
@@ -46,7 +23,7 @@ static void clipboard_handle_cancelled(
 ) {
     ClipboardCopy *source = data;
     ext_data_control_source_v1_destroy(data_source);
-    source->finished(source);
+    clipboard_copy_cancel(source);
 }
 
 static struct ext_data_control_source_v1_listener clipboard_source_listener = {
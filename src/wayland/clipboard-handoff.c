@@ -0,0 +1,238 @@
+#include "clipboard-holder.h"
+#include "clipboard.h"
+#include "log.h"
+#include "memfd.h"
+#include "unix-socket.h"
+#include "wayland/globals.h"
+#include <config/config.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <spawn.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+extern char **environ;
+
+// The holder should only take a few milliseconds to set the selection
+constexpr int HANDOFF_ACK_TIMEOUT_MS = 2000;
+// How long to wait for a freshly started persistent holder to start listening
+constexpr int PERSISTENT_HOLDER_START_ATTEMPTS = 50;
+constexpr long PERSISTENT_HOLDER_START_INTERVAL_NS = 20 * 1000 * 1000;
+
+/**
+ * Start a clipboard holder.
+ * @param socket_fd The hand-off socket for a one-shot holder, or -1 to start a
+ * persistent one.
+ */
+static pid_t spawn_holder(int socket_fd) {
+    char *holder_path = getenv("SPACESHOT_CLIPBOARD_HOLDER_PATH");
+    holder_path = holder_path ? holder_path : "spaceshot-clipboard-holder";
+    char *oneshot_argv[] = {"spaceshot-clipboard-holder", NULL};
+    char *persistent_argv[] = {
+        "spaceshot-clipboard-holder", "--persistent", NULL
+    };
+    char **holder_argv = socket_fd >= 0 ? oneshot_argv : persistent_argv;
+
+    posix_spawn_file_actions_t file_actions;
+    posix_spawn_file_actions_init(&file_actions);
+    if (socket_fd >= 0) {
+        // dup2 clears O_CLOEXEC on the target descriptor
+        posix_spawn_file_actions_adddup2(
+            &file_actions, socket_fd, CLIPBOARD_HANDOFF_FD
+        );
+    }
+
+    posix_spawnattr_t attributes;
+    posix_spawnattr_init(&attributes);
+    sigset_t default_signals;
+    sigemptyset(&default_signals);
+    sigaddset(&default_signals, SIGPIPE);
+    posix_spawnattr_setsigdefault(&attributes, &default_signals);
+    posix_spawnattr_setflags(&attributes, POSIX_SPAWN_SETSIGDEF);
+
+    pid_t pid;
+    int spawn_error = posix_spawnp(
+        &pid, holder_path, &file_actions, &attributes, holder_argv, environ
+    );
+    posix_spawn_file_actions_destroy(&file_actions);
+    posix_spawnattr_destroy(&attributes);
+    if (spawn_error != 0) {
+        log_debug(
+            "couldn't spawn %s: %s\n", holder_path, strerror(spawn_error)
+        );
+        return -1;
+    }
+    return pid;
+}
+
+static bool send_offer(int socket_fd, ClipboardCopyOffer *offer) {
+    int memfd = memfd_new("spaceshot-clipboard");
+    if (memfd < 0) {
+        return false;
+    }
+
+    ClipboardHandoffOffer message = {0};
+    strncpy(message.mime, offer->mime, sizeof(message.mime) - 1);
+    bool success = true;
+    if (offer->buffer) {
+        for (LinkBuffer *block = offer->buffer; block; block = block->next) {
+            success = success &&
+                      memfd_write(memfd, block->data, block->used_size);
+            message.length += block->used_size;
+        }
+    } else {
+        success = memfd_write(memfd, offer->data, offer->length);
+        message.length = offer->length;
+    }
+    success = success && memfd_seal(memfd) &&
+              unix_socket_send_with_fd(
+                  socket_fd, &message, sizeof(message), memfd
+              );
+    close(memfd);
+    return success;
+}
+
+/**
+ * The holder can't encode anything, so unless a paste has already encoded an
+ * image format, encode the first one offered (the preferred one) now. The
+ * others are dropped. One that a paste is still encoding on a worker is
+ * encoded again, since that result would arrive too late.
+ */
+static void encode_first_image_offer(ClipboardCopy *source) {
+    ClipboardCopyOffer *first_offer = NULL;
+    ClipboardCopyOffer *offer;
+    wl_list_for_each_reverse(offer, &source->offers, link) {
+        if (!offer->encode) {
+            continue;
+        }
+        if (offer->buffer) {
+            return;
+        }
+        if (!first_offer) {
+            first_offer = offer;
+        }
+    }
+    if (first_offer) {
+        TIMING_START(clipboard_hand_off_encode);
+        clipboard_copy_offer_set_buffer(
+            source, first_offer, first_offer->encode(first_offer->image)
+        );
+        TIMING_END(clipboard_hand_off_encode);
+    }
+}
+
+/**
+ * Connect to the persistent holder, starting it if it isn't running yet.
+ * @returns the connection, or -1 if there's no holder to connect to
+ */
+static int connect_to_persistent_holder() {
+    char *socket_path = unix_socket_runtime_path(CLIPBOARD_HOLDER_SOCKET_NAME);
+    if (!socket_path) {
+        return -1;
+    }
+
+    int socket_fd = unix_socket_connect(socket_path);
+    if (socket_fd < 0 && spawn_holder(-1) >= 0) {
+        // If two invocations race to start it, the loser exits immediately
+        // and both end up connecting to the winner
+        struct timespec interval = {
+            .tv_nsec = PERSISTENT_HOLDER_START_INTERVAL_NS
+        };
+        for (int attempt = 0;
+             socket_fd < 0 && attempt < PERSISTENT_HOLDER_START_ATTEMPTS;
+             attempt++) {
+            nanosleep(&interval, NULL);
+            socket_fd = unix_socket_connect(socket_path);
+        }
+    }
+    if (socket_fd < 0) {
+        log_debug("couldn't connect to %s: %s\n", socket_path, strerror(errno));
+    }
+    free(socket_path);
+    return socket_fd;
+}
+
+/**
+ * Start a one-shot holder dedicated to this hand-off.
+ * @returns the hand-off socket, or -1 on failure
+ */
+static int start_oneshot_holder() {
+    int sockets[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sockets) != 0) {
+        report_error("couldn't create socket pair: %s", strerror(errno));
+        return -1;
+    }
+    pid_t pid = spawn_holder(sockets[1]);
+    close(sockets[1]);
+    if (pid < 0) {
+        close(sockets[0]);
+        return -1;
+    }
+    log_debug("started clipboard holder %d\n", pid);
+    return sockets[0];
+}
+
+bool clipboard_copy_hand_off(ClipboardCopy *source) {
+    // The holder has no surfaces, so it can only use ext-data-control
+    if (!wayland_globals.ext_data_control_manager) {
+        return false;
+    }
+
+    TIMING_START(clipboard_hand_off);
+    int socket_fd = config_get()->persistent_clipboard_holder
+                        ? connect_to_persistent_holder()
+                        : -1;
+    if (socket_fd < 0) {
+        socket_fd = start_oneshot_holder();
+    }
+    if (socket_fd < 0) {
+        return false;
+    }
+
+    encode_first_image_offer(source);
+
+    bool success = true;
+    size_t offer_count = 0;
+    ClipboardCopyOffer *offer;
+    wl_list_for_each_reverse(offer, &source->offers, link) {
+        // Formats nobody has asked for yet are only encoded on demand, and the
+        // holder can't do that. They're dropped.
+        if (!offer->buffer && !offer->data) {
+            continue;
+        }
+        if (!send_offer(socket_fd, offer)) {
+            report_error(
+                "couldn't hand off %s: %s", offer->mime, strerror(errno)
+            );
+            success = false;
+            break;
+        }
+        offer_count++;
+    }
+    shutdown(socket_fd, SHUT_WR);
+
+    // Wait for the holder to take over the selection, so that the clipboard
+    // is never empty in between
+    if (success) {
+        struct pollfd poll_fd = {.fd = socket_fd, .events = POLLIN};
+        char ack;
+        success = offer_count > 0 &&
+                  poll(&poll_fd, 1, HANDOFF_ACK_TIMEOUT_MS) == 1 &&
+                  read(socket_fd, &ack, 1) == 1;
+    }
+    close(socket_fd);
+    if (!success) {
+        // A one-shot holder that's still around exits on its own after
+        // reading EOF; a persistent one just drops the connection
+        log_debug("clipboard hand-off failed\n");
+        return false;
+    }
+
+    log_debug("handed %zu offers over to the holder\n", offer_count);
+    TIMING_END(clipboard_hand_off);
+    return true;
+}
@@ -1,5 +1,6 @@
 #pragma once
 #include "ext-data-control-client.h"
+#include "image.h"
 #include "link-buffer.h"
 #include <wayland-client.h>
 
@@ -10,10 +11,24 @@ typedef enum {
 
 typedef struct {
     const char *mime;
-    // At least one of buffer or (data, length) must be set.
+    // At least one of buffer, (data, length) or (encode, image) must be set,
+    // unless the offer is pending.
     LinkBuffer *buffer;
     uint8_t *data;
     size_t length;
+    /**
+     * Encode the image on the first paste of this type. The result is kept in
+     * buffer, so each format is encoded at most once.
+     * The offer holds a reference to the image.
+     */
+    LinkBuffer *(*encode)(const Image *image);
+    Image *image;
+    /**
+     * Whether the data is still being produced. Pastes wait until it's
+     * provided with @c clipboard_copy_offer_set_buffer. Set this yourself if
+     * you're producing the data elsewhere, so that it isn't encoded twice.
+     */
+    bool is_pending;
 
     struct wl_list link;
 } ClipboardCopyOffer;
@@ -30,6 +45,12 @@ typedef struct ClipboardCopy {
      */
     void (*finished)(struct ClipboardCopy *source);
     struct wl_list offers;
+    // Pastes that are still being written out. Each one is served
+    // independently, so slow readers don't block anything else.
+    struct wl_list transfers;
+    bool is_cancelled;
+    // While this is above 0, the copy won't be finished.
+    int hold_count;
 } ClipboardCopy;
 
 /**
@@ -54,7 +75,34 @@ clipboard_copy_offer_mime(ClipboardCopy *source, const char *mime);
 void clipboard_copy_activate(ClipboardCopy *source);
 /**
  * Activate the copy. All offers added by this point need to have at least one
- * data pointer filled out.
+ * data pointer filled out, or be pending.
  */
 void clipboard_copy_run(ClipboardCopy *source);
+/**
+ * Provide the data for a pending offer and start any pastes waiting for it.
+ * This takes ownership of @p buffer. If the offer already has data, the buffer
+ * is destroyed instead.
+ */
+void clipboard_copy_offer_set_buffer(
+    ClipboardCopy *source, ClipboardCopyOffer *offer, LinkBuffer *buffer
+);
+/**
+ * Keep the copy (and so its offers' data) alive even if it gets cancelled,
+ * e.g. while its data is being read elsewhere. Every hold needs a matching
+ * @c clipboard_copy_release.
+ */
+void clipboard_copy_hold(ClipboardCopy *source);
+void clipboard_copy_release(ClipboardCopy *source);
+/**
+ * Hand the copy's data over to a separate, much smaller holder process, which
+ * keeps the clipboard going after this process exits. Only offers whose data
+ * exists at this point are passed on, plus the first image format, which is
+ * encoded now if no image format has been yet. Once the holder takes over the
+ * selection, this copy gets cancelled as usual.
+ * @returns whether the holder took over; if not, nothing has changed
+ */
+bool clipboard_copy_hand_off(ClipboardCopy *source);
+/**
+ * Destroy the copy source, aborting any pastes that are still in progress.
+ */
 void clipboard_copy_destroy(ClipboardCopy *source);
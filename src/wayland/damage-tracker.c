@@ -0,0 +1,98 @@
+#include "damage-tracker.h"
+#include <stdatomic.h>
+#include <string.h>
+
+void damage_tracker_add(
+    DamageTracker *tracker, int32_t x, int32_t y, int32_t width, int32_t height
+) {
+    BBox rect = {.x = x, .y = y, .width = width, .height = height};
+    if (tracker->rect_count < DAMAGE_TRACKER_MAX_RECTS) {
+        tracker->rects[tracker->rect_count++] = rect;
+        return;
+    }
+
+    // Too fragmented to be worth tracking precisely
+    BBox bounds = rect;
+    for (size_t i = 0; i < tracker->rect_count; i++) {
+        bounds = bbox_union(bounds, tracker->rects[i]);
+    }
+    tracker->rects[0] = bounds;
+    tracker->rect_count = 1;
+}
+
+void damage_tracker_add_full(DamageTracker *tracker) {
+    tracker->is_full = true;
+}
+
+bool damage_tracker_apply(
+    DamageTracker *tracker,
+    enum wl_shm_format format,
+    const uint8_t *data,
+    uint32_t width,
+    uint32_t height,
+    uint32_t stride
+) {
+    ImageFormat image_format = image_format_from_wl(format);
+    Image *image = tracker->image;
+    if (!image || image->width != width || image->height != height ||
+        image->format != image_format) {
+        tracker->is_full = true;
+    }
+
+    BBox buffer_bounds = {.width = width, .height = height};
+    if (tracker->is_full) {
+        image_destroy(tracker->image);
+        tracker->image =
+            image_new_from_wayland(format, data, width, height, stride);
+        tracker->rects[0] = buffer_bounds;
+        tracker->rect_count = 1;
+        tracker->is_full = false;
+        return tracker->image != NULL;
+    }
+
+    if (tracker->rect_count == 0) {
+        return true;
+    }
+    // copy on write
+    if (atomic_load(&image->ref_count) > 1) {
+        Image *copy = image_copy(image);
+        if (!copy) {
+            return false;
+        }
+        image_destroy(image);
+        tracker->image = image = copy;
+    }
+
+    uint32_t bytes_per_pixel = image_format_bytes_per_pixel(image_format);
+    size_t kept_count = 0;
+    for (size_t i = 0; i < tracker->rect_count; i++) {
+        BBox rect = bbox_constrain(tracker->rects[i], buffer_bounds);
+        if (rect.width <= 0 || rect.height <= 0) {
+            continue;
+        }
+        tracker->rects[kept_count++] = rect;
+
+        size_t row_length = rect.width * bytes_per_pixel;
+        size_t column_offset = rect.x * bytes_per_pixel;
+        for (uint32_t y = rect.y; y < rect.y + rect.height; y++) {
+            memcpy(
+                image->data + y * image->stride + column_offset,
+                data + y * stride + column_offset,
+                row_length
+            );
+        }
+    }
+    tracker->rect_count = kept_count;
+    return true;
+}
+
+void damage_tracker_clear(DamageTracker *tracker) {
+    tracker->rect_count = 0;
+    tracker->is_full = false;
+}
+
+void damage_tracker_finish(DamageTracker *tracker) {
+    image_destroy(tracker->image);
+    tracker->image = NULL;
+    damage_tracker_clear(tracker);
+}
@@ -0,0 +1,51 @@
+#pragma once
+#include "bbox.h"
+#include "image.h"
+#include <wayland-client.h>
+
+constexpr size_t DAMAGE_TRACKER_MAX_RECTS = 16;
+
+/**
+ * Keeps a CPU-side copy of a capture buffer that's reused across frames, and
+ * only copies the parts the compositor reports as damaged.
+ */
+typedef struct {
+    /** The up-to-date contents, in buffer coordinates. May be shared. */
+    Image *image;
+    /**
+     * The damaged rectangles, in buffer pixels. Once there would be more than
+     * DAMAGE_TRACKER_MAX_RECTS, they're merged into their bounding box.
+     */
+    BBox rects[DAMAGE_TRACKER_MAX_RECTS];
+    size_t rect_count;
+    /** Whether the whole buffer has to be copied, regardless of rects. */
+    bool is_full;
+} DamageTracker;
+
+void damage_tracker_add(
+    DamageTracker *tracker, int32_t x, int32_t y, int32_t width, int32_t height
+);
+void damage_tracker_add_full(DamageTracker *tracker);
+
+/**
+ * Copy the damaged parts of @p data into the image. If anyone else still
+ * holds a reference to the image, it's copied first, so shared images never
+ * change. This doesn't touch any Wayland state, so it can run on a worker.
+ *
+ * Afterwards, the rects describe exactly what was copied.
+ * @returns whether the image could be updated
+ */
+bool damage_tracker_apply(
+    DamageTracker *tracker,
+    enum wl_shm_format format,
+    const uint8_t *data,
+    uint32_t width,
+    uint32_t height,
+    uint32_t stride
+);
+
+/** Forget the damage, after it's been applied and passed on. */
+void damage_tracker_clear(DamageTracker *tracker);
+
+/** Free the image. The tracker can be reused afterwards. */
+void damage_tracker_finish(DamageTracker *tracker);
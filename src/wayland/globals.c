@@ -3,6 +3,7 @@
 #include "ext-foreign-toplevel-list-client.h"
 #include "log.h"
 #include "wayland/seat.h"
+#include "wayland/shared-memory.h"
 #include "wayland/toplevel.h"
 #include <cursor-shape-client.h>
 #include <ext-image-capture-source-client.h>
@@ -35,14 +36,17 @@ static void output_handle_geometry(
 }
 
 static void output_handle_mode(
-    void * /* data */,
+    void *data,
     struct wl_output * /* output */,
-    uint32_t /* flags */,
+    uint32_t flags,
     int32_t /* width */,
     int32_t /* height */,
-    int32_t /* refresh */
+    int32_t refresh
 ) {
-    // this space intentionally left blank
+    WrappedOutput *output = data;
+    if (flags & WL_OUTPUT_MODE_CURRENT) {
+        output->refresh_mhz = refresh;
+    }
 }
 
 static void output_handle_scale(
@@ -436,6 +440,12 @@ bool find_wayland_globals(
     wl_registry_add_listener(registry, &registry_listener, &wayland_globals);
     wl_display_roundtrip(display);
 
+    return has_required_wayland_globals(
+        create_output_callback != NULL, create_toplevel_callback != NULL
+    );
+}
+
+bool has_required_wayland_globals(bool needs_output, bool needs_toplevel) {
     if (wayland_globals.compositor == NULL || wayland_globals.shm == NULL ||
         wayland_globals.fractional_scale_manager == NULL ||
         wayland_globals.viewporter == NULL ||
@@ -444,12 +454,11 @@ bool find_wayland_globals(
         return false;
     }
 
-    if (create_output_callback && wayland_globals.output_manager == NULL) {
+    if (needs_output && wayland_globals.output_manager == NULL) {
         return false;
     }
 
-    if (create_toplevel_callback &&
-        wayland_globals.ext_foreign_toplevel_list == NULL) {
+    if (needs_toplevel && wayland_globals.ext_foreign_toplevel_list == NULL) {
         return false;
     }
 
@@ -475,6 +484,7 @@ void cleanup_wayland_globals() {
     if (wayland_globals.data_device) {
         wl_data_device_release(wayland_globals.data_device);
     }
+    shared_buffer_pool_cleanup();
     if (wl_shm_get_version(wayland_globals.shm) >= 2) {
         wl_shm_release(wayland_globals.shm);
     }
@@ -520,6 +530,50 @@ bool is_output_valid(WrappedOutput *test_output) {
     return false;
 }
 
+WrappedOutput *find_output_by_name(const char *name) {
+    WrappedOutput *result = NULL;
+    WrappedOutput *it;
+    wl_list_for_each(it, &wayland_globals.outputs, link) {
+        if ((it->fill_state & WRAPPED_OUTPUT_HAS_ALL) !=
+            WRAPPED_OUTPUT_HAS_ALL) {
+            continue;
+        }
+        if (name && strcmp(it->name, name) == 0) {
+            return it;
+        }
+        if (!name) {
+            if (result) {
+                // ambiguous
+                return NULL;
+            }
+            result = it;
+        }
+    }
+    return result;
+}
+
+WrappedOutput *find_output_containing(BBox region) {
+    WrappedOutput *it;
+    wl_list_for_each(it, &wayland_globals.outputs, link) {
+        if ((it->fill_state & WRAPPED_OUTPUT_HAS_ALL) ==
+                WRAPPED_OUTPUT_HAS_ALL &&
+            bbox_contains(it->logical_bounds, region)) {
+            return it;
+        }
+    }
+    return NULL;
+}
+
+WrappedToplevel *find_toplevel_by_identifier(const char *identifier) {
+    WrappedToplevel *it;
+    wl_list_for_each(it, &wayland_globals.toplevels, link) {
+        if (it->identifier && strcmp(it->identifier, identifier) == 0) {
+            return it;
+        }
+    }
+    return NULL;
+}
+
 bool is_toplevel_valid(WrappedToplevel *test_toplevel) {
     WrappedToplevel *it;
     wl_list_for_each(it, &wayland_globals.toplevels, link) {
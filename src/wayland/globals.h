@@ -50,6 +50,12 @@ bool find_wayland_globals(
     ToplevelCallback create_toplevel_callback
 );
 
+/**
+ * Check whether everything needed for capturing outputs and/or toplevels was
+ * found by @c find_wayland_globals.
+ */
+bool has_required_wayland_globals(bool needs_output, bool needs_toplevel);
+
 void cleanup_wayland_globals();
 
 /**
@@ -57,6 +63,25 @@ void cleanup_wayland_globals();
  */
 bool is_output_valid(WrappedOutput *output);
 
+/**
+ * Find a fully set up output by name, or the only output if @p name is NULL.
+ * @returns the output, or NULL if there's no match (or, without a name, if
+ * there's more than one output)
+ */
+WrappedOutput *find_output_by_name(const char *name);
+
+/**
+ * Find a fully set up output which contains all of @p region, which is in
+ * global logical coordinates.
+ */
+WrappedOutput *find_output_containing(BBox region);
+
+/**
+ * Find a toplevel by its ext-foreign-toplevel-list identifier.
+ * @returns the toplevel, or NULL if there's no match
+ */
+WrappedToplevel *find_toplevel_by_identifier(const char *identifier);
+
 /**
  * Returns whether the specified toplevel still exists.
  */
@@ -17,6 +17,8 @@ typedef struct {
     struct zxdg_output_v1 *xdg_output;
     char *name;
     BBox logical_bounds;
+    /** The refresh rate of the current mode in mHz, or 0 if it's unknown. */
+    int32_t refresh_mhz;
     WrappedOutputFillState fill_state;
     struct wl_list link;
     uint32_t object_id;
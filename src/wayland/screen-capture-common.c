@@ -1,7 +1,62 @@
 #include "config/config.h"
 #include "log.h"
 #include "screen-capture.h"
+#include "wayland/screen-capture-common.h"
 #include "wayland/toplevel.h"
+#include <stdlib.h>
+
+Image *capture_convert_buffer(
+    enum wl_shm_format format,
+    const uint8_t *data,
+    uint32_t width,
+    uint32_t height,
+    uint32_t stride,
+    ImageTransform transform,
+    const BBox *region,
+    double logical_width
+) {
+    if (region && transform == IMAGE_TRANSFORM_NORMAL) {
+        // The buffer is upright, so only copy the pixels that are kept
+        BBox crop_bounds = bbox_constrain(
+            bbox_round(bbox_scale(*region, width / logical_width)),
+            (BBox){.width = width, .height = height}
+        );
+        uint32_t bytes_per_pixel =
+            image_format_bytes_per_pixel(image_format_from_wl(format));
+        return image_new_from_wayland(
+            format,
+            data + (size_t)crop_bounds.y * stride +
+                (size_t)crop_bounds.x * bytes_per_pixel,
+            crop_bounds.width,
+            crop_bounds.height,
+            stride
+        );
+    }
+
+    Image *result = image_new_from_wayland(format, data, width, height, stride);
+    if (result && transform != IMAGE_TRANSFORM_NORMAL) {
+        Image *transformed =
+            image_transform(result, image_transform_invert(transform));
+        image_destroy(result);
+        result = transformed;
+    }
+    if (result && region) {
+        BBox crop_bounds = bbox_constrain(
+            bbox_round(bbox_scale(*region, result->width / logical_width)),
+            (BBox){.width = result->width, .height = result->height}
+        );
+        Image *cropped = image_crop(
+            result,
+            crop_bounds.x,
+            crop_bounds.y,
+            crop_bounds.width,
+            crop_bounds.height
+        );
+        image_destroy(result);
+        result = cropped;
+    }
+    return result;
+}
 
 void capture_output_ext(
     WrappedOutput *output, ImageCaptureCallback image_callback, void *data
@@ -15,15 +70,39 @@ void capture_output_wlr(
 
 bool capture_output_wlr_is_available();
 
+void capture_output_region_ext(
+    WrappedOutput *output,
+    BBox region,
+    ImageCaptureCallback image_callback,
+    void *data
+);
+
+void capture_output_region_wlr(
+    WrappedOutput *output,
+    BBox region,
+    ImageCaptureCallback image_callback,
+    void *data
+);
+
+void *capture_session_new_ext(
+    WrappedOutput *output, CaptureSessionCallback callback, void *data
+);
+void capture_session_request_frame_ext(void *session);
+void capture_session_destroy_ext(void *session);
+
+void *capture_session_new_wlr(
+    WrappedOutput *output, CaptureSessionCallback callback, void *data
+);
+void capture_session_request_frame_wlr(void *session);
+void capture_session_destroy_wlr(void *session);
+
 typedef enum {
     OUTPUT_CAPTURE_BACKEND_NONE,
     OUTPUT_CAPTURE_BACKEND_EXT,
     OUTPUT_CAPTURE_BACKEND_WLR,
 } OutputCaptureBackend;
 
-void capture_output(
-    WrappedOutput *output, ImageCaptureCallback image_callback, void *data
-) {
+static OutputCaptureBackend get_output_capture_backend() {
     static bool has_selected_backend = false;
     static OutputCaptureBackend backend;
 
@@ -57,8 +136,13 @@ void capture_output(
     end:
         log_debug("chosen output backend: %d\n", backend);
     }
+    return backend;
+}
 
-    switch (backend) {
+void capture_output(
+    WrappedOutput *output, ImageCaptureCallback image_callback, void *data
+) {
+    switch (get_output_capture_backend()) {
     case OUTPUT_CAPTURE_BACKEND_NONE:
         report_error_fatal("couldn't choose an output capture backend");
     case OUTPUT_CAPTURE_BACKEND_EXT:
@@ -70,6 +154,76 @@ void capture_output(
     }
 }
 
+void capture_output_region(
+    WrappedOutput *output,
+    BBox region,
+    ImageCaptureCallback image_callback,
+    void *data
+) {
+    switch (get_output_capture_backend()) {
+    case OUTPUT_CAPTURE_BACKEND_NONE:
+        report_error_fatal("couldn't choose an output capture backend");
+    case OUTPUT_CAPTURE_BACKEND_EXT:
+        capture_output_region_ext(output, region, image_callback, data);
+        break;
+    case OUTPUT_CAPTURE_BACKEND_WLR:
+        capture_output_region_wlr(output, region, image_callback, data);
+        break;
+    }
+}
+
+struct CaptureSession {
+    OutputCaptureBackend backend;
+    void *backend_session;
+};
+
+CaptureSession *capture_session_new(
+    WrappedOutput *output, CaptureSessionCallback callback, void *data
+) {
+    CaptureSession *result = calloc(1, sizeof(CaptureSession));
+    result->backend = get_output_capture_backend();
+    switch (result->backend) {
+    case OUTPUT_CAPTURE_BACKEND_NONE:
+        report_error_fatal("couldn't choose an output capture backend");
+    case OUTPUT_CAPTURE_BACKEND_EXT:
+        result->backend_session =
+            capture_session_new_ext(output, callback, data);
+        break;
+    case OUTPUT_CAPTURE_BACKEND_WLR:
+        result->backend_session =
+            capture_session_new_wlr(output, callback, data);
+        break;
+    }
+    return result;
+}
+
+void capture_session_request_frame(CaptureSession *session) {
+    switch (session->backend) {
+    case OUTPUT_CAPTURE_BACKEND_EXT:
+        capture_session_request_frame_ext(session->backend_session);
+        break;
+    case OUTPUT_CAPTURE_BACKEND_WLR:
+        capture_session_request_frame_wlr(session->backend_session);
+        break;
+    default:
+        REPORT_UNHANDLED("output capture backend", "%d", session->backend);
+    }
+}
+
+void capture_session_destroy(CaptureSession *session) {
+    switch (session->backend) {
+    case OUTPUT_CAPTURE_BACKEND_EXT:
+        capture_session_destroy_ext(session->backend_session);
+        break;
+    case OUTPUT_CAPTURE_BACKEND_WLR:
+        capture_session_destroy_wlr(session->backend_session);
+        break;
+    default:
+        REPORT_UNHANDLED("output capture backend", "%d", session->backend);
+    }
+    free(session);
+}
+
 void capture_toplevel_ext(
     WrappedToplevel *toplevel, ImageCaptureCallback image_callback, void *data
 );
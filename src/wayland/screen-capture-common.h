@@ -0,0 +1,26 @@
+#pragma once
+#include "bbox.h"
+#include "image.h"
+#include <wayland-client.h>
+
+// Helpers shared by the screen capture backends. These aren't part of the
+// screen-capture.h interface.
+
+/**
+ * Turn a captured buffer into an image, optionally cropped. This is used by
+ * the backends, and is safe to call from worker threads.
+ * @param region The area to keep, in logical coordinates relative to the
+ * captured area, or NULL to keep everything.
+ * @param logical_width The captured area's width in logical coordinates,
+ * used to find the scale.
+ */
+Image *capture_convert_buffer(
+    enum wl_shm_format format,
+    const uint8_t *data,
+    uint32_t width,
+    uint32_t height,
+    uint32_t stride,
+    ImageTransform transform,
+    const BBox *region,
+    double logical_width
+);
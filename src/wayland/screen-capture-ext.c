@@ -1,9 +1,13 @@
 #include "image.h"
 #include "log.h"
 #include "screen-capture.h"
+#include "wayland/damage-tracker.h"
 #include "wayland/globals.h"
+#include "wayland/screen-capture-common.h"
 #include "wayland/shared-memory.h"
+#include "worker.h"
 #include <assert.h>
+#include <string.h>
 #include <ext-image-capture-source-client.h>
 #include <ext-image-copy-capture-client.h>
 #include <wayland-client-protocol.h>
@@ -17,6 +21,12 @@ typedef struct {
     bool has_selected_format;
     // Transform applied by the compositor to the captured buffer
     ImageTransform transform;
+    // The part of the output to keep, in logical coordinates. ext-image-copy
+    // has no way to request only part of a source, so this is cropped out
+    // after the fact.
+    bool has_region;
+    BBox region;
+    double logical_width;
     // associated Wayland objects
     struct ext_image_capture_source_v1 *source;
     struct ext_image_copy_capture_session_v1 *session;
@@ -36,7 +46,7 @@ static void frame_context_unref(FrameContext *context) {
         context->image_callback(context->result, context->user_data);
 
         if (context->buffer) {
-            shared_buffer_destroy(context->buffer);
+            shared_buffer_pool_release(context->buffer);
         }
         if (context->source) {
             ext_image_capture_source_v1_destroy(context->source);
@@ -79,28 +89,34 @@ static void frame_handle_presentation_time(
     // we don't need this
 }
 
-static void
-frame_handle_ready(void *data, struct ext_image_copy_capture_frame_v1 *frame) {
+/** Copy the frame out of the shared buffer, off the main thread. */
+static void frame_convert(void *data) {
     FrameContext *context = data;
 
     uint32_t stride = image_format_default_stride(
         image_format_from_wl(context->selected_format), context->width
     );
-    Image *captured = image_new_from_wayland(
+    context->result = capture_convert_buffer(
         context->selected_format,
         context->buffer->data,
         context->width,
         context->height,
-        stride
+        stride,
+        context->transform,
+        context->has_region ? &context->region : NULL,
+        context->logical_width
     );
-    if (context->transform == IMAGE_TRANSFORM_NORMAL) {
-        context->result = captured;
-    } else {
-        context->result = image_transform(
-            captured, image_transform_invert(context->transform)
-        );
-        image_destroy(captured);
-    }
+}
+
+static void frame_converted(void *data) {
+    frame_context_unref(data);
+}
+
+static void
+frame_handle_ready(void *data, struct ext_image_copy_capture_frame_v1 *frame) {
+    FrameContext *context = data;
+    // the conversion holds on to the context (and its buffer) until it's done
+    context->ref_count++;
 
     // This deletes BOTH objects which have a reference to the frame context.
     // So, unref twice!
@@ -109,6 +125,8 @@ frame_handle_ready(void *data, struct ext_image_copy_capture_frame_v1 *frame) {
     frame_context_unref(context);
     ext_image_copy_capture_frame_v1_destroy(frame);
     frame_context_unref(context);
+
+    worker_run(frame_convert, frame_converted, context);
 }
 
 static void frame_handle_transform(
@@ -157,13 +175,12 @@ static void session_handle_dmabuf_format(
     // we don't do dmabufs
 }
 
-static void session_handle_shm_format(
-    void *data,
-    struct ext_image_copy_capture_session_v1 * /* session */,
+/** Pick the best of the formats the compositor offers, one at a time. */
+static void select_shm_format(
+    enum wl_shm_format *selected_format,
+    bool *has_selected_format,
     uint32_t format
 ) {
-    FrameContext *context = data;
-
     log_debug("got buffer format %x\n", format);
 
     // 10-bit should be preferred if available
@@ -172,14 +189,25 @@ static void session_handle_shm_format(
         goto accept_format;
     } else if ((format == WL_SHM_FORMAT_XRGB8888 ||
                 format == WL_SHM_FORMAT_XBGR8888) &&
-               !context->has_selected_format) {
+               !*has_selected_format) {
         goto accept_format;
     }
     log_debug("skipping\n");
     return;
 accept_format:
-    context->selected_format = format;
-    context->has_selected_format = true;
+    *selected_format = format;
+    *has_selected_format = true;
+}
+
+static void session_handle_shm_format(
+    void *data,
+    struct ext_image_copy_capture_session_v1 * /* session */,
+    uint32_t format
+) {
+    FrameContext *context = data;
+    select_shm_format(
+        &context->selected_format, &context->has_selected_format, format
+    );
 }
 
 static void session_handle_done(
@@ -197,7 +225,7 @@ static void session_handle_done(
     uint32_t stride = image_format_default_stride(
         image_format_from_wl(context->selected_format), context->width
     );
-    context->buffer = shared_buffer_new(
+    context->buffer = shared_buffer_pool_acquire(
         context->width, context->height, stride, context->selected_format
     );
     assert(context->buffer);
@@ -232,7 +260,7 @@ static const struct ext_image_copy_capture_session_v1_listener
         .stopped = session_handle_stopped,
 };
 
-void capture_output_ext(
+static FrameContext *frame_context_new_for_output(
     WrappedOutput *output, ImageCaptureCallback image_callback, void *data
 ) {
     FrameContext *context = calloc(1, sizeof(FrameContext));
@@ -251,6 +279,27 @@ void capture_output_ext(
     ext_image_copy_capture_session_v1_add_listener(
         context->session, &session_listener, context
     );
+    return context;
+}
+
+void capture_output_ext(
+    WrappedOutput *output, ImageCaptureCallback image_callback, void *data
+) {
+    frame_context_new_for_output(output, image_callback, data);
+}
+
+void capture_output_region_ext(
+    WrappedOutput *output,
+    BBox region,
+    ImageCaptureCallback image_callback,
+    void *data
+) {
+    // Nothing has been dispatched yet, so it's fine to fill this in after
+    FrameContext *context =
+        frame_context_new_for_output(output, image_callback, data);
+    context->has_region = true;
+    context->region = region;
+    context->logical_width = output->logical_bounds.width;
 }
 
 void capture_toplevel_ext(
@@ -285,3 +334,328 @@ bool capture_toplevel_ext_is_available() {
     return wayland_globals.ext_toplevel_capture_source_manager != NULL &&
            wayland_globals.ext_image_copy_capture_manager != NULL;
 }
+
+/** A capture session that's kept open across frames. */
+typedef struct {
+    struct ext_image_capture_source_v1 *source;
+    struct ext_image_copy_capture_session_v1 *session;
+    struct ext_image_copy_capture_frame_v1 *frame;
+    // Buffer constraints; they can change during the session
+    enum wl_shm_format selected_format;
+    uint32_t width;
+    uint32_t height;
+    bool has_selected_format;
+    bool has_constraints;
+    // The buffer is kept between frames, so that the compositor only has to
+    // copy what's changed since the last one
+    SharedBuffer *buffer;
+    bool is_buffer_stale;
+    ImageTransform transform;
+    DamageTracker damage;
+    // Set by the conversion job
+    Image *result;
+    bool is_frame_requested;
+    bool is_converting;
+    bool is_destroyed;
+    bool has_failed;
+    CaptureSessionCallback callback;
+    void *user_data;
+} PersistentSession;
+
+static void persistent_session_free(PersistentSession *session) {
+    if (session->buffer) {
+        shared_buffer_pool_release(session->buffer);
+    }
+    damage_tracker_finish(&session->damage);
+    free(session);
+}
+
+static void persistent_session_fail(PersistentSession *session) {
+    if (session->has_failed) {
+        return;
+    }
+    session->has_failed = true;
+    session->callback(NULL, NULL, 0, session->user_data);
+}
+
+static void persistent_session_start_frame(PersistentSession *session);
+
+static void persistent_frame_handle_damage(
+    void *data,
+    struct ext_image_copy_capture_frame_v1 * /* frame */,
+    int32_t x,
+    int32_t y,
+    int32_t width,
+    int32_t height
+) {
+    PersistentSession *session = data;
+    damage_tracker_add(&session->damage, x, y, width, height);
+}
+
+static void persistent_frame_handle_failed(
+    void *data, struct ext_image_copy_capture_frame_v1 *frame, uint32_t reason
+) {
+    PersistentSession *session = data;
+    ext_image_copy_capture_frame_v1_destroy(frame);
+    session->frame = NULL;
+    // Whatever the compositor managed to write is unknown now
+    session->is_buffer_stale = true;
+    damage_tracker_add_full(&session->damage);
+
+    const uint32_t CONSTRAINTS_CHANGED =
+        EXT_IMAGE_COPY_CAPTURE_FRAME_V1_FAILURE_REASON_BUFFER_CONSTRAINTS;
+    if (reason == CONSTRAINTS_CHANGED) {
+        // new constraints are on their way, and will restart the frame
+        session->is_frame_requested = true;
+        return;
+    }
+    persistent_session_fail(session);
+}
+
+static void persistent_frame_handle_transform(
+    void *data,
+    struct ext_image_copy_capture_frame_v1 * /* frame */,
+    uint32_t transform
+) {
+    PersistentSession *session = data;
+    session->transform = image_transform_from_wl(transform);
+}
+
+/** Bring the CPU-side copy up to date, off the main thread. */
+static void persistent_frame_convert(void *data) {
+    PersistentSession *session = data;
+
+    uint32_t stride = image_format_default_stride(
+        image_format_from_wl(session->selected_format), session->width
+    );
+    if (!damage_tracker_apply(
+            &session->damage,
+            session->selected_format,
+            session->buffer->data,
+            session->width,
+            session->height,
+            stride
+        )) {
+        session->result = NULL;
+        return;
+    }
+
+    if (session->transform == IMAGE_TRANSFORM_NORMAL) {
+        session->result = image_ref(session->damage.image);
+    } else {
+        // Damage is in buffer coordinates, so don't bother mapping it
+        session->result = image_transform(
+            session->damage.image, image_transform_invert(session->transform)
+        );
+        if (session->result) {
+            session->damage.rects[0] = (BBox){
+                .width = session->result->width,
+                .height = session->result->height,
+            };
+            session->damage.rect_count = 1;
+        }
+    }
+}
+
+static void persistent_frame_converted(void *data) {
+    PersistentSession *session = data;
+    if (session->is_destroyed) {
+        image_destroy(session->result);
+        persistent_session_free(session);
+        return;
+    }
+    if (!session->result) {
+        session->is_converting = false;
+        persistent_session_fail(session);
+        return;
+    }
+
+    // the callback may destroy the session, so take everything out first
+    BBox damage[DAMAGE_TRACKER_MAX_RECTS];
+    size_t damage_count = session->damage.rect_count;
+    memcpy(damage, session->damage.rects, damage_count * sizeof(BBox));
+    damage_tracker_clear(&session->damage);
+    Image *result = session->result;
+    session->result = NULL;
+
+    // While this is still set, destroying the session from the callback
+    // only marks it, and asking for the next frame waits until afterwards
+    session->callback(result, damage, damage_count, session->user_data);
+    session->is_converting = false;
+    if (session->is_destroyed) {
+        persistent_session_free(session);
+        return;
+    }
+    if (session->is_frame_requested) {
+        // requested while converting, or from the callback
+        persistent_session_start_frame(session);
+    }
+}
+
+static void persistent_frame_handle_ready(
+    void *data, struct ext_image_copy_capture_frame_v1 *frame
+) {
+    PersistentSession *session = data;
+    ext_image_copy_capture_frame_v1_destroy(frame);
+    session->frame = NULL;
+    session->is_converting = true;
+    worker_run(persistent_frame_convert, persistent_frame_converted, session);
+}
+
+static const struct ext_image_copy_capture_frame_v1_listener
+    persistent_frame_listener = {
+        .damage = persistent_frame_handle_damage,
+        .failed = persistent_frame_handle_failed,
+        .presentation_time = frame_handle_presentation_time,
+        .ready = persistent_frame_handle_ready,
+        .transform = persistent_frame_handle_transform,
+};
+
+static void persistent_session_start_frame(PersistentSession *session) {
+    if (!session->has_constraints || session->frame ||
+        session->is_converting || session->has_failed) {
+        // this is retried once the obstacle is gone
+        session->is_frame_requested = true;
+        return;
+    }
+    session->is_frame_requested = false;
+
+    if (session->buffer &&
+        (session->buffer->width != session->width ||
+         session->buffer->height != session->height ||
+         session->buffer->format != session->selected_format)) {
+        // the constraints changed since the last frame
+        shared_buffer_pool_release(session->buffer);
+        session->buffer = NULL;
+    }
+    if (!session->buffer) {
+        uint32_t stride = image_format_default_stride(
+            image_format_from_wl(session->selected_format), session->width
+        );
+        session->buffer = shared_buffer_pool_acquire(
+            session->width, session->height, stride, session->selected_format
+        );
+        if (!session->buffer) {
+            persistent_session_fail(session);
+            return;
+        }
+        session->is_buffer_stale = true;
+        damage_tracker_add_full(&session->damage);
+    }
+
+    session->frame =
+        ext_image_copy_capture_session_v1_create_frame(session->session);
+    ext_image_copy_capture_frame_v1_add_listener(
+        session->frame, &persistent_frame_listener, session
+    );
+    ext_image_copy_capture_frame_v1_attach_buffer(
+        session->frame, session->buffer->wl_buffer
+    );
+    // Buffer damage says which parts of the buffer don't match the last
+    // frame anymore. Nothing touches it between frames, so usually none do.
+    if (session->is_buffer_stale) {
+        ext_image_copy_capture_frame_v1_damage_buffer(
+            session->frame, 0, 0, session->width, session->height
+        );
+        session->is_buffer_stale = false;
+    }
+    ext_image_copy_capture_frame_v1_capture(session->frame);
+}
+
+static void persistent_session_handle_buffer_size(
+    void *data,
+    struct ext_image_copy_capture_session_v1 * /* session */,
+    uint32_t width,
+    uint32_t height
+) {
+    PersistentSession *session = data;
+    session->width = width;
+    session->height = height;
+}
+
+static void persistent_session_handle_shm_format(
+    void *data,
+    struct ext_image_copy_capture_session_v1 * /* session */,
+    uint32_t format
+) {
+    PersistentSession *session = data;
+    // constraints are sent as a whole batch, so start over
+    if (session->has_constraints) {
+        session->has_constraints = false;
+        session->has_selected_format = false;
+    }
+    select_shm_format(
+        &session->selected_format, &session->has_selected_format, format
+    );
+}
+
+static void persistent_session_handle_done(
+    void *data, struct ext_image_copy_capture_session_v1 * /* session */
+) {
+    PersistentSession *session = data;
+    if (!session->has_selected_format) {
+        report_error("couldn't agree on screenshot image format");
+        persistent_session_fail(session);
+        return;
+    }
+    session->has_constraints = true;
+    if (session->is_frame_requested) {
+        persistent_session_start_frame(session);
+    }
+}
+
+static void persistent_session_handle_stopped(
+    void *data, struct ext_image_copy_capture_session_v1 * /* session */
+) {
+    PersistentSession *session = data;
+    persistent_session_fail(session);
+}
+
+static const struct ext_image_copy_capture_session_v1_listener
+    persistent_session_listener = {
+        .buffer_size = persistent_session_handle_buffer_size,
+        .dmabuf_device = session_handle_dmabuf_device,
+        .dmabuf_format = session_handle_dmabuf_format,
+        .shm_format = persistent_session_handle_shm_format,
+        .done = persistent_session_handle_done,
+        .stopped = persistent_session_handle_stopped,
+};
+
+void *capture_session_new_ext(
+    WrappedOutput *output, CaptureSessionCallback callback, void *data
+) {
+    PersistentSession *session = calloc(1, sizeof(PersistentSession));
+    session->callback = callback;
+    session->user_data = data;
+
+    session->source = ext_output_image_capture_source_manager_v1_create_source(
+        wayland_globals.ext_output_capture_source_manager, output->wl_output
+    );
+    session->session = ext_image_copy_capture_manager_v1_create_session(
+        wayland_globals.ext_image_copy_capture_manager, session->source, 0
+    );
+    ext_image_copy_capture_session_v1_add_listener(
+        session->session, &persistent_session_listener, session
+    );
+    return session;
+}
+
+void capture_session_request_frame_ext(void *data) {
+    persistent_session_start_frame(data);
+}
+
+void capture_session_destroy_ext(void *data) {
+    PersistentSession *session = data;
+    if (session->frame) {
+        ext_image_copy_capture_frame_v1_destroy(session->frame);
+    }
+    ext_image_copy_capture_session_v1_destroy(session->session);
+    ext_image_capture_source_v1_destroy(session->source);
+
+    if (session->is_converting) {
+        // freed once the conversion is done with the buffer
+        session->is_destroyed = true;
+    } else {
+        persistent_session_free(session);
+    }
+}
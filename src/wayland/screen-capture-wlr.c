@@ -1,10 +1,14 @@
 #include "image.h"
 #include "log.h"
 #include "screen-capture.h"
+#include "wayland/damage-tracker.h"
 #include "wayland/globals.h"
+#include "wayland/screen-capture-common.h"
 #include "wayland/shared-memory.h"
+#include "worker.h"
 #include <stdbool.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/mman.h>
 #include <wlr-screencopy-client.h>
 
@@ -16,22 +20,41 @@ typedef struct {
     uint32_t stride;
     bool has_selected_format;
     enum zwlr_screencopy_frame_v1_flags frame_flags;
+    // The part of the captured area to keep, in logical coordinates. The
+    // compositor can only capture whole logical pixels, so this trims off
+    // any fractional remainder.
+    bool has_region;
+    BBox region;
+    double logical_width;
     // Shared memory bookkeeping
     SharedBuffer *buffer;
     // callback
     WrappedOutput *output;
     ImageCaptureCallback image_callback;
     void *user_data;
+    Image *result;
 } FrameContext;
 
-static void frame_context_finalize(
-    FrameContext *context, struct zwlr_screencopy_frame_v1 *frame, Image *result
-) {
+/**
+ * Decide whether to switch to @p format, given that the compositor offers
+ * formats one at a time.
+ */
+static bool is_format_acceptable(uint32_t format, bool has_selected_format) {
+    // 10-bit should be preferred if available
+    if (format == WL_SHM_FORMAT_XRGB2101010 ||
+        format == WL_SHM_FORMAT_XBGR2101010) {
+        return true;
+    }
+    return format == WL_SHM_FORMAT_XRGB8888 && !has_selected_format;
+}
+
+static void frame_context_finalize(FrameContext *context, Image *result) {
     context->image_callback(result, context->user_data);
 
     // cleanup
-    zwlr_screencopy_frame_v1_destroy(frame);
-    shared_buffer_destroy(context->buffer);
+    if (context->buffer) {
+        shared_buffer_pool_release(context->buffer);
+    }
     free(context);
 }
 
@@ -53,17 +76,10 @@ static void frame_handle_buffer(
         stride
     );
 
-    // 10-bit should be preferred if available
-    if (format == WL_SHM_FORMAT_XRGB2101010 ||
-        format == WL_SHM_FORMAT_XBGR2101010) {
-        goto accept_format;
-    } else if (format == WL_SHM_FORMAT_XRGB8888 &&
-               !context->has_selected_format) {
-        goto accept_format;
-    }
-    log_debug("skipping\n");
-    return;
-accept_format:
+    if (!is_format_acceptable(format, context->has_selected_format)) {
+        log_debug("skipping\n");
+        return;
+    }
     context->selected_format = format;
     context->width = width;
     context->height = height;
@@ -89,12 +105,15 @@ frame_handle_buffer_done(void *data, struct zwlr_screencopy_frame_v1 *frame) {
         report_error_fatal("couldn't agree on screenshot image format");
     }
 
-    context->buffer = shared_buffer_new(
+    context->buffer = shared_buffer_pool_acquire(
         context->width,
         context->height,
         context->stride,
         context->selected_format
     );
+    if (!context->buffer) {
+        report_error_fatal("couldn't allocate screenshot buffer");
+    }
     zwlr_screencopy_frame_v1_copy(frame, context->buffer->wl_buffer);
 
     log_debug("buffer done\n");
@@ -109,41 +128,51 @@ static void frame_handle_flags(
     context->frame_flags = flags;
 }
 
-static void frame_handle_ready(
-    void *data,
-    struct zwlr_screencopy_frame_v1 *frame,
-    uint32_t /* tv_sec_hi */,
-    uint32_t /* tv_sec_lo */,
-    uint32_t /* tv_nsec */
-) {
+/** Copy the frame out of the shared buffer, off the main thread. */
+static void frame_convert(void *data) {
     FrameContext *context = data;
 
-    Image *result = image_new_from_wayland(
+    context->result = capture_convert_buffer(
         context->selected_format,
         context->buffer->data,
         context->width,
         context->height,
-        context->stride
+        context->stride,
+        IMAGE_TRANSFORM_NORMAL,
+        context->has_region ? &context->region : NULL,
+        context->logical_width
     );
     log_debug(
         "Got image from wayland: %dx%d, %d bytes in total\n",
-        result->width,
-        result->height,
-        result->stride * result->height
-    );
-    log_debug(
-        "Top-left pixel: %x, original: %x\n",
-        ((uint32_t *)result->data)[0],
-        ((uint32_t *)context->buffer->data)[0]
+        context->result->width,
+        context->result->height,
+        context->result->stride * context->result->height
     );
+}
 
-    frame_context_finalize(context, frame, result);
+static void frame_converted(void *data) {
+    FrameContext *context = data;
+    frame_context_finalize(context, context->result);
+}
+
+static void frame_handle_ready(
+    void *data,
+    struct zwlr_screencopy_frame_v1 *frame,
+    uint32_t /* tv_sec_hi */,
+    uint32_t /* tv_sec_lo */,
+    uint32_t /* tv_nsec */
+) {
+    FrameContext *context = data;
+    // the compositor is done with the frame, but not the buffer
+    zwlr_screencopy_frame_v1_destroy(frame);
+    worker_run(frame_convert, frame_converted, context);
 }
 
 static void
 frame_handle_failed(void *data, struct zwlr_screencopy_frame_v1 *frame) {
+    zwlr_screencopy_frame_v1_destroy(frame);
     // return a null image to signal error
-    frame_context_finalize(data, frame, NULL);
+    frame_context_finalize(data, NULL);
 }
 
 static const struct zwlr_screencopy_frame_v1_listener frame_listener = {
@@ -171,6 +200,295 @@ void capture_output_wlr(
     zwlr_screencopy_frame_v1_add_listener(frame, &frame_listener, context);
 }
 
+void capture_output_region_wlr(
+    WrappedOutput *output,
+    BBox region,
+    ImageCaptureCallback image_callback,
+    void *data
+) {
+    BBox requested_region = bbox_expand_to_grid(region);
+    struct zwlr_screencopy_frame_v1 *frame =
+        zwlr_screencopy_manager_v1_capture_output_region(
+            wayland_globals.wlr_screencopy_manager,
+            0,
+            output->wl_output,
+            requested_region.x,
+            requested_region.y,
+            requested_region.width,
+            requested_region.height
+        );
+    FrameContext *context = calloc(1, sizeof(FrameContext));
+    context->output = output;
+    context->image_callback = image_callback;
+    context->user_data = data;
+    context->has_region = true;
+    context->region =
+        bbox_translate(region, -requested_region.x, -requested_region.y);
+    context->logical_width = requested_region.width;
+    zwlr_screencopy_frame_v1_add_listener(frame, &frame_listener, context);
+}
+
 bool capture_output_wlr_is_available() {
     return wayland_globals.wlr_screencopy_manager != NULL;
 }
+
+/**
+ * A capture session that's kept open across frames. wlr-screencopy has no
+ * sessions of its own, so this requests a frame at a time, using
+ * copy_with_damage to learn what changed.
+ */
+typedef struct {
+    struct wl_output *wl_output;
+    struct zwlr_screencopy_frame_v1 *frame;
+    // Image format of the frame in flight
+    enum wl_shm_format selected_format;
+    uint32_t width;
+    uint32_t height;
+    uint32_t stride;
+    bool has_selected_format;
+    // kept between frames, unless the format changes
+    SharedBuffer *buffer;
+    DamageTracker damage;
+    // the first frame has to be copied in full
+    bool has_frame;
+    // Set by the conversion job
+    Image *result;
+    bool is_frame_requested;
+    bool is_converting;
+    bool is_destroyed;
+    bool has_failed;
+    CaptureSessionCallback callback;
+    void *user_data;
+} PersistentSession;
+
+static void persistent_session_free(PersistentSession *session) {
+    if (session->buffer) {
+        shared_buffer_pool_release(session->buffer);
+    }
+    damage_tracker_finish(&session->damage);
+    free(session);
+}
+
+static void persistent_session_fail(PersistentSession *session) {
+    if (session->has_failed) {
+        return;
+    }
+    session->has_failed = true;
+    session->callback(NULL, NULL, 0, session->user_data);
+}
+
+static void persistent_session_start_frame(PersistentSession *session);
+
+static void persistent_frame_handle_buffer(
+    void *data,
+    struct zwlr_screencopy_frame_v1 * /* frame */,
+    uint32_t format,
+    uint32_t width,
+    uint32_t height,
+    uint32_t stride
+) {
+    PersistentSession *session = data;
+    if (!is_format_acceptable(format, session->has_selected_format)) {
+        return;
+    }
+    session->selected_format = format;
+    session->width = width;
+    session->height = height;
+    session->stride = stride;
+    session->has_selected_format = true;
+}
+
+static void persistent_frame_handle_buffer_done(
+    void *data, struct zwlr_screencopy_frame_v1 *frame
+) {
+    PersistentSession *session = data;
+    if (!session->has_selected_format) {
+        report_error("couldn't agree on screenshot image format");
+        zwlr_screencopy_frame_v1_destroy(frame);
+        session->frame = NULL;
+        persistent_session_fail(session);
+        return;
+    }
+
+    SharedBuffer *buffer = session->buffer;
+    if (buffer &&
+        (buffer->width != session->width || buffer->height != session->height ||
+         buffer->stride != session->stride ||
+         buffer->format != session->selected_format)) {
+        // the output changed since the last frame
+        shared_buffer_pool_release(session->buffer);
+        session->buffer = NULL;
+    }
+    if (!session->buffer) {
+        session->buffer = shared_buffer_pool_acquire(
+            session->width,
+            session->height,
+            session->stride,
+            session->selected_format
+        );
+        if (!session->buffer) {
+            zwlr_screencopy_frame_v1_destroy(frame);
+            session->frame = NULL;
+            persistent_session_fail(session);
+            return;
+        }
+        session->has_frame = false;
+    }
+
+    if (session->has_frame) {
+        // this waits until there is damage
+        zwlr_screencopy_frame_v1_copy_with_damage(
+            frame, session->buffer->wl_buffer
+        );
+    } else {
+        damage_tracker_add_full(&session->damage);
+        zwlr_screencopy_frame_v1_copy(frame, session->buffer->wl_buffer);
+    }
+}
+
+static void persistent_frame_handle_flags(
+    void * /* data */,
+    struct zwlr_screencopy_frame_v1 * /* frame */,
+    enum zwlr_screencopy_frame_v1_flags /* flags */
+) {}
+
+static void persistent_frame_handle_damage(
+    void *data,
+    struct zwlr_screencopy_frame_v1 * /* frame */,
+    uint32_t x,
+    uint32_t y,
+    uint32_t width,
+    uint32_t height
+) {
+    PersistentSession *session = data;
+    damage_tracker_add(&session->damage, x, y, width, height);
+}
+
+/** Bring the CPU-side copy up to date, off the main thread. */
+static void persistent_frame_convert(void *data) {
+    PersistentSession *session = data;
+    bool success = damage_tracker_apply(
+        &session->damage,
+        session->selected_format,
+        session->buffer->data,
+        session->width,
+        session->height,
+        session->stride
+    );
+    session->result = success ? image_ref(session->damage.image) : NULL;
+}
+
+static void persistent_frame_converted(void *data) {
+    PersistentSession *session = data;
+    if (session->is_destroyed) {
+        image_destroy(session->result);
+        persistent_session_free(session);
+        return;
+    }
+    if (!session->result) {
+        session->is_converting = false;
+        persistent_session_fail(session);
+        return;
+    }
+    session->has_frame = true;
+
+    // the callback may destroy the session, so take everything out first
+    BBox damage[DAMAGE_TRACKER_MAX_RECTS];
+    size_t damage_count = session->damage.rect_count;
+    memcpy(damage, session->damage.rects, damage_count * sizeof(BBox));
+    damage_tracker_clear(&session->damage);
+    Image *result = session->result;
+    session->result = NULL;
+
+    // While this is still set, destroying the session from the callback
+    // only marks it, and asking for the next frame waits until afterwards
+    session->callback(result, damage, damage_count, session->user_data);
+    session->is_converting = false;
+    if (session->is_destroyed) {
+        persistent_session_free(session);
+        return;
+    }
+    if (session->is_frame_requested) {
+        // requested while converting, or from the callback
+        persistent_session_start_frame(session);
+    }
+}
+
+static void persistent_frame_handle_ready(
+    void *data,
+    struct zwlr_screencopy_frame_v1 *frame,
+    uint32_t /* tv_sec_hi */,
+    uint32_t /* tv_sec_lo */,
+    uint32_t /* tv_nsec */
+) {
+    PersistentSession *session = data;
+    zwlr_screencopy_frame_v1_destroy(frame);
+    session->frame = NULL;
+    session->is_converting = true;
+    worker_run(persistent_frame_convert, persistent_frame_converted, session);
+}
+
+static void persistent_frame_handle_failed(
+    void *data, struct zwlr_screencopy_frame_v1 *frame
+) {
+    PersistentSession *session = data;
+    zwlr_screencopy_frame_v1_destroy(frame);
+    session->frame = NULL;
+    persistent_session_fail(session);
+}
+
+static const struct zwlr_screencopy_frame_v1_listener
+    persistent_frame_listener = {
+        .buffer = persistent_frame_handle_buffer,
+        .buffer_done = persistent_frame_handle_buffer_done,
+        .linux_dmabuf = frame_handle_linux_dmabuf,
+        .flags = persistent_frame_handle_flags,
+        .damage = persistent_frame_handle_damage,
+        .ready = persistent_frame_handle_ready,
+        .failed = persistent_frame_handle_failed,
+};
+
+static void persistent_session_start_frame(PersistentSession *session) {
+    if (session->frame || session->is_converting || session->has_failed) {
+        // this is retried once the conversion is done
+        session->is_frame_requested = true;
+        return;
+    }
+    session->is_frame_requested = false;
+    session->has_selected_format = false;
+
+    session->frame = zwlr_screencopy_manager_v1_capture_output(
+        wayland_globals.wlr_screencopy_manager, 0, session->wl_output
+    );
+    zwlr_screencopy_frame_v1_add_listener(
+        session->frame, &persistent_frame_listener, session
+    );
+}
+
+void *capture_session_new_wlr(
+    WrappedOutput *output, CaptureSessionCallback callback, void *data
+) {
+    PersistentSession *session = calloc(1, sizeof(PersistentSession));
+    session->wl_output = output->wl_output;
+    session->callback = callback;
+    session->user_data = data;
+    return session;
+}
+
+void capture_session_request_frame_wlr(void *data) {
+    persistent_session_start_frame(data);
+}
+
+void capture_session_destroy_wlr(void *data) {
+    PersistentSession *session = data;
+    if (session->frame) {
+        zwlr_screencopy_frame_v1_destroy(session->frame);
+    }
+
+    if (session->is_converting) {
+        // freed once the conversion is done with the buffer
+        session->is_destroyed = true;
+    } else {
+        persistent_session_free(session);
+    }
+}
@@ -17,6 +17,20 @@ void capture_output(
     WrappedOutput *output, ImageCaptureCallback image_callback, void *data
 );
 
+/**
+ * Takes a screenshot of part of an output. @p region is in logical
+ * coordinates, relative to the output, and the result covers exactly that
+ * area. Where the backend allows it, only that area is copied by the
+ * compositor.
+ * You are responsible for `image_free`ing the result yourself.
+ */
+void capture_output_region(
+    WrappedOutput *output,
+    BBox region,
+    ImageCaptureCallback image_callback,
+    void *data
+);
+
 /**
  * Takes a screenshot of a toplevel.
  * You are responsible for `image_free`ing the result yourself.
@@ -24,3 +38,36 @@ void capture_output(
 void capture_toplevel(
     WrappedToplevel *toplevel, ImageCaptureCallback image_callback, void *data
 );
+
+typedef struct CaptureSession CaptureSession;
+
+/**
+ * Called on the main thread after each frame of a capture session.
+ * @param image A new reference to the output's current contents, which you
+ * need to `image_destroy`. It's NULL if the session has failed, after which
+ * no more frames arrive.
+ * @param damage The rectangles (in image pixels) that changed since the
+ * previous frame. The first frame is always fully damaged.
+ */
+typedef void (*CaptureSessionCallback)(
+    Image *image, const BBox *damage, size_t damage_count, void *data
+);
+
+/**
+ * Start capturing an output continuously. The session keeps its buffer
+ * between frames, and the compositor only has to copy (and spaceshot only
+ * has to convert) what changed.
+ */
+CaptureSession *capture_session_new(
+    WrappedOutput *output, CaptureSessionCallback callback, void *data
+);
+
+/**
+ * Ask for the next frame. Compositors usually wait until something changes
+ * before delivering it. Only one frame is in flight at a time; requesting
+ * one while another is pending does nothing.
+ */
+void capture_session_request_frame(CaptureSession *session);
+
+/** Stop capturing. This is safe to call from the session's callback. */
+void capture_session_destroy(CaptureSession *session);
@@ -1,47 +1,48 @@
+// file sealing and MAP_POPULATE are Linux extensions
+#define _GNU_SOURCE
 #include "shared-memory.h"
 #include "log.h"
+#include "memfd.h"
 #include "wayland/globals.h"
 #include <assert.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/mman.h>
-#include <time.h>
 #include <unistd.h>
 #include <wayland-client.h>
 
-// The contents of this file are adapted from wayland-book.com
+/**
+ * All pooled buffers of one (page-rounded) size. They're slots in one memfd,
+ * which only ever grows, shared with the compositor through one wl_shm_pool.
+ */
+struct SharedBufferClass {
+    size_t slot_size;
+    size_t slot_count;
+    int fd;
+    struct wl_shm_pool *pool;
+    // released buffers, ready to be reused
+    struct wl_list free_buffers;
+    struct wl_list link;
+};
 
-static void randname(char *buf) {
-    struct timespec ts;
-    clock_gettime(CLOCK_REALTIME, &ts);
-    long r = ts.tv_nsec;
-    for (int i = 0; i < 6; ++i) {
-        buf[i] = 'A' + (r & 15) + (r & 16) * 2;
-        r >>= 5;
-    }
-}
+static struct wl_list size_classes;
+static bool has_size_classes = false;
 
-static int make_shm_file() {
-    int retries = 100;
+static bool resize_file(int fd, size_t size) {
+    int ret;
     do {
-        char name[] = "/spaceshot_wl_shm-XXXXXX";
-        randname(name + sizeof(name) - 7);
-        --retries;
-        int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
-        if (fd >= 0) {
-            shm_unlink(name);
-            return fd;
-        }
-    } while (retries > 0 && errno == EEXIST);
-    return -1;
+        ret = ftruncate(fd, size);
+    } while (ret < 0 && errno == EINTR);
+    return ret == 0;
 }
 
 SharedBuffer *shared_buffer_new(
     uint32_t width, uint32_t height, uint32_t stride, enum wl_shm_format format
 ) {
     SharedBuffer *result = calloc(1, sizeof(SharedBuffer));
-    result->fd = make_shm_file();
+    result->fd = memfd_new("spaceshot-wl-shm");
     result->width = width;
     result->height = height;
     result->stride = stride;
@@ -53,11 +54,7 @@ SharedBuffer *shared_buffer_new(
     }
 
     // truncate the file to the new size
-    int ret;
-    do {
-        ret = ftruncate(result->fd, size);
-    } while (ret < 0 && errno == EINTR);
-    if (ret != 0) {
+    if (!resize_file(result->fd, size)) {
         goto error;
     }
 
@@ -83,11 +80,12 @@ error:
 }
 
 void shared_buffer_destroy(SharedBuffer *buffer) {
+    assert(!buffer->size_class);
     if (buffer->data && buffer->data != MAP_FAILED) {
         munmap(buffer->data, buffer->height * buffer->stride);
     }
 
-    if (buffer->fd != 0) {
+    if (buffer->fd >= 0) {
         close(buffer->fd);
     }
 
@@ -97,3 +95,185 @@ void shared_buffer_destroy(SharedBuffer *buffer) {
 
     free(buffer);
 }
+
+static SharedBufferClass *size_class_get(size_t slot_size) {
+    if (!has_size_classes) {
+        wl_list_init(&size_classes);
+        has_size_classes = true;
+    }
+
+    SharedBufferClass *size_class;
+    wl_list_for_each(size_class, &size_classes, link) {
+        if (size_class->slot_size == slot_size) {
+            return size_class;
+        }
+    }
+
+    int fd = memfd_new("spaceshot-capture");
+    if (fd < 0) {
+        report_error("couldn't create capture buffer: %s", strerror(errno));
+        return NULL;
+    }
+    // The compositor maps this too; make sure it can't be truncated from
+    // under it
+    if (fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK) != 0) {
+        report_error("couldn't seal capture buffer: %s", strerror(errno));
+        close(fd);
+        return NULL;
+    }
+
+    size_class = calloc(1, sizeof(SharedBufferClass));
+    size_class->slot_size = slot_size;
+    size_class->fd = fd;
+    wl_list_init(&size_class->free_buffers);
+    wl_list_insert(&size_classes, &size_class->link);
+    return size_class;
+}
+
+/** Add a slot to a size class, growing its file and pool. */
+static SharedBuffer *size_class_add_slot(SharedBufferClass *size_class) {
+    size_t offset = size_class->slot_count * size_class->slot_size;
+    size_t new_size = offset + size_class->slot_size;
+    // wl_shm_pool sizes are 32-bit
+    if (new_size > INT32_MAX || !resize_file(size_class->fd, new_size)) {
+        report_error("couldn't grow capture buffer pool");
+        return NULL;
+    }
+
+    // Prefault the pages now, so that copying the capture out doesn't take a
+    // page fault every 4 KiB
+    uint8_t *data = mmap(
+        NULL,
+        size_class->slot_size,
+        PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE,
+        size_class->fd,
+        offset
+    );
+    if (data == MAP_FAILED) {
+        report_error("couldn't map capture buffer: %s", strerror(errno));
+        return NULL;
+    }
+
+    if (!size_class->pool) {
+        size_class->pool =
+            wl_shm_create_pool(wayland_globals.shm, size_class->fd, new_size);
+    } else {
+        wl_shm_pool_resize(size_class->pool, new_size);
+    }
+    size_class->slot_count++;
+
+    SharedBuffer *result = calloc(1, sizeof(SharedBuffer));
+    result->fd = -1;
+    result->data = data;
+    result->size_class = size_class;
+    result->offset = offset;
+    result->mapped_size = size_class->slot_size;
+    return result;
+}
+
+SharedBuffer *shared_buffer_pool_acquire(
+    uint32_t width, uint32_t height, uint32_t stride, enum wl_shm_format format
+) {
+    size_t page_size = sysconf(_SC_PAGESIZE);
+    size_t slot_size =
+        ((size_t)height * stride + page_size - 1) / page_size * page_size;
+    SharedBufferClass *size_class = size_class_get(slot_size);
+    if (!size_class) {
+        return NULL;
+    }
+
+    SharedBuffer *result = NULL;
+    SharedBuffer *candidate;
+    // prefer a buffer that doesn't need a new wl_buffer
+    wl_list_for_each(candidate, &size_class->free_buffers, link) {
+        if (candidate->width == width && candidate->height == height &&
+            candidate->stride == stride && candidate->format == format) {
+            result = candidate;
+            break;
+        }
+    }
+    if (!result && !wl_list_empty(&size_class->free_buffers)) {
+        result = wl_container_of(size_class->free_buffers.next, result, link);
+    }
+
+    if (result) {
+        wl_list_remove(&result->link);
+        log_debug("reusing pooled capture buffer (%zu bytes)\n", slot_size);
+    } else {
+        result = size_class_add_slot(size_class);
+        if (!result) {
+            return NULL;
+        }
+        log_debug("new pooled capture buffer (%zu bytes)\n", slot_size);
+    }
+
+    if (!result->wl_buffer || result->width != width ||
+        result->height != height || result->stride != stride ||
+        result->format != format) {
+        if (result->wl_buffer) {
+            wl_buffer_destroy(result->wl_buffer);
+        }
+        result->width = width;
+        result->height = height;
+        result->stride = stride;
+        result->format = format;
+        result->wl_buffer = wl_shm_pool_create_buffer(
+            size_class->pool, result->offset, width, height, stride, format
+        );
+    }
+    return result;
+}
+
+void shared_buffer_pool_release(SharedBuffer *buffer) {
+    assert(buffer->size_class);
+    wl_list_insert(&buffer->size_class->free_buffers, &buffer->link);
+}
+
+static void size_class_destroy(SharedBufferClass *size_class) {
+    SharedBuffer *buffer, *tmp;
+    wl_list_for_each_safe(buffer, tmp, &size_class->free_buffers, link) {
+        munmap(buffer->data, buffer->mapped_size);
+        if (buffer->wl_buffer) {
+            wl_buffer_destroy(buffer->wl_buffer);
+        }
+        free(buffer);
+    }
+    if (size_class->pool) {
+        wl_shm_pool_destroy(size_class->pool);
+    }
+    close(size_class->fd);
+    wl_list_remove(&size_class->link);
+    free(size_class);
+}
+
+void shared_buffer_pool_trim() {
+    if (!has_size_classes) {
+        return;
+    }
+
+    SharedBufferClass *size_class, *tmp;
+    wl_list_for_each_safe(size_class, tmp, &size_classes, link) {
+        // The memfd can't give back slots in the middle, so a size class
+        // can only go as a whole, once none of its buffers are in use
+        int free_count = wl_list_length(&size_class->free_buffers);
+        if ((size_t)free_count == size_class->slot_count) {
+            log_debug(
+                "releasing capture buffer pool (%zu bytes)\n",
+                size_class->slot_count * size_class->slot_size
+            );
+            size_class_destroy(size_class);
+        }
+    }
+}
+
+void shared_buffer_pool_cleanup() {
+    if (!has_size_classes) {
+        return;
+    }
+
+    SharedBufferClass *size_class, *tmp;
+    wl_list_for_each_safe(size_class, tmp, &size_classes, link) {
+        size_class_destroy(size_class);
+    }
+}
@@ -3,15 +3,42 @@
 #include <stdint.h>
 #include <wayland-client.h>
 
+typedef struct SharedBufferClass SharedBufferClass;
+
 typedef struct {
     int fd;
     uint32_t width, height, stride;
     uint8_t *data;
     enum wl_shm_format format;
     struct wl_buffer *wl_buffer;
+    // pooled buffers only
+    SharedBufferClass *size_class;
+    size_t offset, mapped_size;
+    struct wl_list link;
 } SharedBuffer;
 
 SharedBuffer *shared_buffer_new(
     uint32_t width, uint32_t height, uint32_t stride, enum wl_shm_format format
 );
 void shared_buffer_destroy(SharedBuffer *buffer);
+
+/**
+ * Get a buffer for the compositor to copy a capture into. Buffers that are
+ * the same size share a memfd and a wl_shm_pool, and are kept around after
+ * being released, so repeated captures (other outputs of the same size,
+ * bursts, daemon mode) don't have to set anything up again.
+ * @returns the buffer, or NULL on failure
+ */
+SharedBuffer *shared_buffer_pool_acquire(
+    uint32_t width, uint32_t height, uint32_t stride, enum wl_shm_format format
+);
+/** Return a buffer to the pool once the compositor is done with it. */
+void shared_buffer_pool_release(SharedBuffer *buffer);
+/**
+ * Free the pooled buffers of every size that has none in use. Long-running
+ * processes call this once they've gone idle, so the pool doesn't keep its
+ * largest captures mapped forever.
+ */
+void shared_buffer_pool_trim();
+/** Free every pooled buffer. None of them may be in use. */
+void shared_buffer_pool_cleanup();
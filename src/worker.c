@@ -0,0 +1,203 @@
+#include "worker.h"
+#include "event-loop.h"
+#include "log.h"
+#include <poll.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/eventfd.h>
+#include <threads.h>
+#include <unistd.h>
+
+// Some jobs (like notifications) mostly wait, so don't go too low
+constexpr long MIN_THREAD_COUNT = 4;
+constexpr long MAX_THREAD_COUNT = 16;
+
+typedef struct WorkerJob {
+    WorkerFunc work;
+    WorkerFunc done;
+    void *data;
+    struct WorkerJob *next;
+} WorkerJob;
+
+static struct {
+    bool is_initialized;
+    // The pool's threads are started on demand and then kept around, waiting
+    // on the condition variable for more jobs.
+    mtx_t lock;
+    cnd_t has_jobs;
+    WorkerJob *queue_head, *queue_tail;
+    size_t queued_count;
+    size_t idle_count;
+    size_t thread_count;
+    size_t max_thread_count;
+    // threads don't survive fork(), so the pool has to start over in a child
+    pid_t owner_pid;
+    // Finished jobs are pushed here by the worker threads, and then picked up
+    // by the main thread when the eventfd fires.
+    WorkerJob *completed;
+    int event_fd;
+    size_t pending_count;
+} workers;
+
+static void worker_handle_completions(
+    void * /* data */, int fd, short /* revents */
+) {
+    uint64_t count;
+    if (read(fd, &count, sizeof(count)) < 0) {
+        // EAGAIN means another wakeup got to the list first
+        return;
+    }
+
+    mtx_lock(&workers.lock);
+    WorkerJob *completed = workers.completed;
+    workers.completed = NULL;
+    mtx_unlock(&workers.lock);
+
+    // the list is pushed to from the front, so reverse it to go in order
+    WorkerJob *in_order = NULL;
+    while (completed) {
+        WorkerJob *next = completed->next;
+        completed->next = in_order;
+        in_order = completed;
+        completed = next;
+    }
+
+    while (in_order) {
+        WorkerJob *job = in_order;
+        in_order = job->next;
+        workers.pending_count--;
+        if (job->done) {
+            job->done(job->data);
+        }
+        free(job);
+    }
+}
+
+static void worker_init_threading() {
+    if (mtx_init(&workers.lock, mtx_plain) != thrd_success ||
+        cnd_init(&workers.has_jobs) != thrd_success) {
+        report_error_fatal("couldn't create worker lock");
+    }
+    workers.thread_count = 0;
+    workers.idle_count = 0;
+    workers.owner_pid = getpid();
+}
+
+static void worker_init() {
+    worker_init_threading();
+    long cpu_count = sysconf(_SC_NPROCESSORS_ONLN);
+    workers.max_thread_count = cpu_count < MIN_THREAD_COUNT   ? MIN_THREAD_COUNT
+                               : cpu_count > MAX_THREAD_COUNT ? MAX_THREAD_COUNT
+                                                              : cpu_count;
+
+    workers.event_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (workers.event_fd < 0) {
+        report_error_fatal("couldn't create worker eventfd");
+    }
+    event_loop_add_fd(
+        workers.event_fd, POLLIN, worker_handle_completions, NULL
+    );
+    workers.is_initialized = true;
+}
+
+static void worker_complete(WorkerJob *job) {
+    mtx_lock(&workers.lock);
+    job->next = workers.completed;
+    workers.completed = job;
+    mtx_unlock(&workers.lock);
+
+    uint64_t one = 1;
+    if (write(workers.event_fd, &one, sizeof(one)) < 0) {
+        // the counter can only overflow after 2^64 jobs
+        report_error("couldn't wake up the main thread");
+    }
+}
+
+/** Pop the oldest queued job. The lock needs to be held. */
+static WorkerJob *worker_take_job() {
+    WorkerJob *job = workers.queue_head;
+    workers.queue_head = job->next;
+    if (!workers.queue_head) {
+        workers.queue_tail = NULL;
+    }
+    workers.queued_count--;
+    return job;
+}
+
+static int worker_thread_func(void * /* data */) {
+    mtx_lock(&workers.lock);
+    while (true) {
+        while (!workers.queue_head) {
+            workers.idle_count++;
+            cnd_wait(&workers.has_jobs, &workers.lock);
+            workers.idle_count--;
+        }
+        WorkerJob *job = worker_take_job();
+        mtx_unlock(&workers.lock);
+
+        job->work(job->data);
+        worker_complete(job);
+
+        mtx_lock(&workers.lock);
+    }
+    return 0;
+}
+
+void worker_run(WorkerFunc work, WorkerFunc done, void *data) {
+    if (!workers.is_initialized) {
+        worker_init();
+    } else if (workers.owner_pid != getpid()) {
+        // Only the forking thread exists in a child. Nothing was running at
+        // the time (see main), so there's no work to lose.
+        worker_init_threading();
+    }
+
+    WorkerJob *job = calloc(1, sizeof(WorkerJob));
+    if (!job) {
+        report_error_fatal("couldn't allocate worker job");
+    }
+    job->work = work;
+    job->done = done;
+    job->data = data;
+    workers.pending_count++;
+
+    mtx_lock(&workers.lock);
+    if (workers.queue_tail) {
+        workers.queue_tail->next = job;
+    } else {
+        workers.queue_head = job;
+    }
+    workers.queue_tail = job;
+    workers.queued_count++;
+
+    // only start another thread if the idle ones can't take everything
+    bool needs_thread = workers.queued_count > workers.idle_count &&
+                        workers.thread_count < workers.max_thread_count;
+    if (needs_thread) {
+        thrd_t thread;
+        if (thrd_create(&thread, worker_thread_func, NULL) == thrd_success) {
+            thrd_detach(thread);
+            workers.thread_count++;
+        } else if (workers.thread_count == 0) {
+            // Still deliver the results the usual way, just late. The job
+            // may not be alone in the queue, so run everything ahead of it
+            // first to keep jobs starting in order.
+            report_warning("couldn't start worker thread, running job inline");
+            while (workers.queue_head) {
+                WorkerJob *queued = worker_take_job();
+                mtx_unlock(&workers.lock);
+                queued->work(queued->data);
+                worker_complete(queued);
+                mtx_lock(&workers.lock);
+            }
+            mtx_unlock(&workers.lock);
+            return;
+        }
+    }
+    cnd_signal(&workers.has_jobs);
+    mtx_unlock(&workers.lock);
+}
+
+size_t worker_pending_count() {
+    return workers.pending_count;
+}
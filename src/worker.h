@@ -0,0 +1,15 @@
+#pragma once
+#include <stddef.h>
+
+typedef void (*WorkerFunc)(void *data);
+
+/**
+ * Run @p work on a thread from the worker pool. Jobs are started in the order
+ * they're submitted, but may run concurrently. Once it's done, @p done (if not
+ * NULL) is called on the main thread from the event loop, so it's free to
+ * touch Wayland objects and other state that isn't thread-safe.
+ */
+void worker_run(WorkerFunc work, WorkerFunc done, void *data);
+
+/** Get the number of jobs whose done callback hasn't run yet. */
+size_t worker_pending_count();
@@ -0,0 +1,202 @@
+#include "yuv.h"
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+// The conversion works on 8 pixels from each of 2 rows at a time. These are
+// GCC vector extensions, which compile to whatever SIMD instructions the
+// target has (and to plain scalar code if it has none).
+typedef uint32_t u32x8 __attribute__((vector_size(32)));
+typedef int32_t i32x8 __attribute__((vector_size(32)));
+typedef int32_t i32x4 __attribute__((vector_size(16)));
+typedef uint8_t u8x8 __attribute__((vector_size(8)));
+typedef uint8_t u8x4 __attribute__((vector_size(4)));
+
+constexpr uint32_t BLOCK_WIDTH = 8;
+
+// BT.601 limited range, in 8-bit fixed point
+#define RGB_TO_Y(r, g, b) (((66 * (r) + 129 * (g) + 25 * (b) + 128) >> 8) + 16)
+#define RGB_TO_U(r, g, b)                                                      \
+    (((-38 * (r) - 74 * (g) + 112 * (b) + 128) >> 8) + 128)
+#define RGB_TO_V(r, g, b)                                                      \
+    (((112 * (r) - 94 * (g) - 18 * (b) + 128) >> 8) + 128)
+
+// Sum each pair of neighboring lanes. This is a macro because passing 256-bit
+// vectors to functions depends on the target's ABI.
+#define SUM_PAIRS(value)                                                       \
+    (__builtin_shufflevector(value, value, 0, 2, 4, 6) +                       \
+     __builtin_shufflevector(value, value, 1, 3, 5, 7))
+
+static inline void convert_block(
+    const uint8_t *src_top,
+    const uint8_t *src_bottom,
+    ImageChannelShifts layout,
+    uint8_t *y_top,
+    uint8_t *y_bottom,
+    uint8_t *u,
+    uint8_t *v
+) {
+    u32x8 top, bottom;
+    memcpy(&top, src_top, sizeof(top));
+    memcpy(&bottom, src_bottom, sizeof(bottom));
+
+    i32x8 r_top = (i32x8)(top >> layout.r_shift & 0xff);
+    i32x8 g_top = (i32x8)(top >> layout.g_shift & 0xff);
+    i32x8 b_top = (i32x8)(top >> layout.b_shift & 0xff);
+    i32x8 r_bottom = (i32x8)(bottom >> layout.r_shift & 0xff);
+    i32x8 g_bottom = (i32x8)(bottom >> layout.g_shift & 0xff);
+    i32x8 b_bottom = (i32x8)(bottom >> layout.b_shift & 0xff);
+
+    u8x8 luma = __builtin_convertvector(RGB_TO_Y(r_top, g_top, b_top), u8x8);
+    memcpy(y_top, &luma, sizeof(luma));
+    luma = __builtin_convertvector(
+        RGB_TO_Y(r_bottom, g_bottom, b_bottom), u8x8
+    );
+    memcpy(y_bottom, &luma, sizeof(luma));
+
+    // chroma is taken from the average of each 2x2 block
+    i32x8 r_sum = r_top + r_bottom;
+    i32x8 g_sum = g_top + g_bottom;
+    i32x8 b_sum = b_top + b_bottom;
+    i32x4 r = (SUM_PAIRS(r_sum) + 2) >> 2;
+    i32x4 g = (SUM_PAIRS(g_sum) + 2) >> 2;
+    i32x4 b = (SUM_PAIRS(b_sum) + 2) >> 2;
+    u8x4 chroma = __builtin_convertvector(RGB_TO_U(r, g, b), u8x4);
+    memcpy(u, &chroma, sizeof(chroma));
+    chroma = __builtin_convertvector(RGB_TO_V(r, g, b), u8x4);
+    memcpy(v, &chroma, sizeof(chroma));
+}
+
+/** Like convert_block, but for a single 2x2 block. */
+static inline void convert_pair(
+    const uint8_t *src_top,
+    const uint8_t *src_bottom,
+    ImageChannelShifts layout,
+    uint8_t *y_top,
+    uint8_t *y_bottom,
+    uint8_t *u,
+    uint8_t *v
+) {
+    uint32_t pixels[4];
+    memcpy(&pixels[0], src_top, 2 * sizeof(uint32_t));
+    memcpy(&pixels[2], src_bottom, 2 * sizeof(uint32_t));
+
+    int32_t r_sum = 0, g_sum = 0, b_sum = 0;
+    for (int i = 0; i < 4; i++) {
+        int32_t r = pixels[i] >> layout.r_shift & 0xff;
+        int32_t g = pixels[i] >> layout.g_shift & 0xff;
+        int32_t b = pixels[i] >> layout.b_shift & 0xff;
+        uint8_t luma = RGB_TO_Y(r, g, b);
+        if (i < 2) {
+            y_top[i] = luma;
+        } else {
+            y_bottom[i - 2] = luma;
+        }
+        r_sum += r;
+        g_sum += g;
+        b_sum += b;
+    }
+    int32_t r = (r_sum + 2) >> 2;
+    int32_t g = (g_sum + 2) >> 2;
+    int32_t b = (b_sum + 2) >> 2;
+    *u = RGB_TO_U(r, g, b);
+    *v = RGB_TO_V(r, g, b);
+}
+
+YuvFrame *yuv_frame_new(uint32_t width, uint32_t height) {
+    YuvFrame *frame = calloc(1, sizeof(YuvFrame));
+    frame->width = width & ~1u;
+    frame->height = height & ~1u;
+    size_t luma_size = (size_t)frame->width * frame->height;
+    frame->size = luma_size + luma_size / 2;
+    frame->data = malloc(frame->size);
+    if (!frame->data) {
+        free(frame);
+        return NULL;
+    }
+    return frame;
+}
+
+void yuv_frame_destroy(YuvFrame *frame) {
+    if (!frame) {
+        return;
+    }
+    free(frame->data);
+    free(frame);
+}
+
+/** Round down to an even number, and clamp it to [0, max]. */
+static uint32_t snap_down(double value, uint32_t max) {
+    if (value <= 0.0) {
+        return 0;
+    }
+    uint32_t result = (uint32_t)floor(value) & ~1u;
+    return result < max ? result : max;
+}
+
+/** Round up to an even number, and clamp it to [0, max]. */
+static uint32_t snap_up(double value, uint32_t max) {
+    if (value <= 0.0) {
+        return 0;
+    }
+    uint32_t result = ((uint32_t)ceil(value) + 1) & ~1u;
+    return result < max ? result : max;
+}
+
+void yuv_frame_convert(
+    YuvFrame *frame,
+    const Image *image,
+    uint32_t src_x,
+    uint32_t src_y,
+    BBox area
+) {
+    uint32_t x_start = snap_down(area.x, frame->width);
+    uint32_t x_end = snap_up(area.x + area.width, frame->width);
+    uint32_t y_start = snap_down(area.y, frame->height);
+    uint32_t y_end = snap_up(area.y + area.height, frame->height);
+    if (x_start >= x_end || y_start >= y_end) {
+        return;
+    }
+
+    ImageChannelShifts layout = image_format_channel_shifts(image->format);
+    uint32_t chroma_width = frame->width / 2;
+    uint8_t *y_plane = frame->data;
+    uint8_t *u_plane = y_plane + (size_t)frame->width * frame->height;
+    uint8_t *v_plane = u_plane + (size_t)chroma_width * (frame->height / 2);
+
+    for (uint32_t y = y_start; y < y_end; y += 2) {
+        const uint8_t *src_top = image->data +
+                                 (size_t)(y + src_y) * image->stride +
+                                 (size_t)src_x * 4;
+        const uint8_t *src_bottom = src_top + image->stride;
+        uint8_t *y_top = y_plane + (size_t)y * frame->width;
+        uint8_t *y_bottom = y_top + frame->width;
+        size_t chroma_row = (size_t)(y / 2) * chroma_width;
+        uint8_t *u_row = u_plane + chroma_row;
+        uint8_t *v_row = v_plane + chroma_row;
+
+        uint32_t x = x_start;
+        for (; x + BLOCK_WIDTH <= x_end; x += BLOCK_WIDTH) {
+            convert_block(
+                src_top + x * 4,
+                src_bottom + x * 4,
+                layout,
+                y_top + x,
+                y_bottom + x,
+                u_row + x / 2,
+                v_row + x / 2
+            );
+        }
+        for (; x < x_end; x += 2) {
+            convert_pair(
+                src_top + x * 4,
+                src_bottom + x * 4,
+                layout,
+                y_top + x,
+                y_bottom + x,
+                u_row + x / 2,
+                v_row + x / 2
+            );
+        }
+    }
+}
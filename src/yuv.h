@@ -0,0 +1,36 @@
+#pragma once
+#include "bbox.h"
+#include "image.h"
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * A planar 8-bit YUV 4:2:0 picture with BT.601 limited-range colors, which is
+ * what y4m and most video encoders expect. The dimensions are always even.
+ */
+typedef struct {
+    uint32_t width;
+    uint32_t height;
+    /** The Y plane, followed by the U and V planes. */
+    uint8_t *data;
+    size_t size;
+} YuvFrame;
+
+/** Create a frame. Odd dimensions are rounded down. */
+YuvFrame *yuv_frame_new(uint32_t width, uint32_t height);
+void yuv_frame_destroy(YuvFrame *frame);
+
+/**
+ * Convert part of an image into the frame; the rest of the frame is left
+ * alone. Pixel (x, y) of the frame comes from pixel (x + src_x, y + src_y)
+ * of the image, which needs to cover the whole frame.
+ * @param area The part of the frame to update. It's widened to whole 2x2
+ * chroma blocks.
+ */
+void yuv_frame_convert(
+    YuvFrame *frame,
+    const Image *image,
+    uint32_t src_x,
+    uint32_t src_y,
+    BBox area
+);
@@ -0,0 +1,180 @@
+// Checks image_compare against a straightforward per-pixel comparison, for
+// widths that do and don't fill the vectorized kernel's blocks.
+
+#include "image-compare.h"
+#include "test.h"
+#include <stdint.h>
+#include <stdlib.h>
+
+static uint32_t *get_pixel(const Image *image, uint32_t x, uint32_t y) {
+    return (uint32_t *)(image->data + (size_t)y * image->stride) + x;
+}
+
+static uint32_t channel(uint32_t pixel, uint32_t shift) {
+    return pixel >> shift & 0xff;
+}
+
+static ImageComparison compare_naively(
+    const Image *actual,
+    uint32_t x,
+    uint32_t y,
+    const Image *reference,
+    uint8_t tolerance
+) {
+    ImageChannelShifts a = image_format_channel_shifts(actual->format);
+    ImageChannelShifts r = image_format_channel_shifts(reference->format);
+    ImageComparison result = {.min_x = UINT32_MAX, .min_y = UINT32_MAX};
+    for (uint32_t row = 0; row < reference->height; row++) {
+        for (uint32_t col = 0; col < reference->width; col++) {
+            uint32_t actual_pixel = *get_pixel(actual, x + col, y + row);
+            uint32_t reference_pixel = *get_pixel(reference, col, row);
+            if (reference->format == IMAGE_FORMAT_ARGB8888 &&
+                reference_pixel >> 24 == 0) {
+                continue;
+            }
+            int r_difference = (int)channel(actual_pixel, a.r_shift) -
+                               (int)channel(reference_pixel, r.r_shift);
+            int g_difference = (int)channel(actual_pixel, a.g_shift) -
+                               (int)channel(reference_pixel, r.g_shift);
+            int b_difference = (int)channel(actual_pixel, a.b_shift) -
+                               (int)channel(reference_pixel, r.b_shift);
+            if (abs(r_difference) > tolerance ||
+                abs(g_difference) > tolerance ||
+                abs(b_difference) > tolerance) {
+                result.mismatched_count++;
+                result.min_x = col < result.min_x ? col : result.min_x;
+                result.min_y = row < result.min_y ? row : result.min_y;
+                result.max_x = col > result.max_x ? col : result.max_x;
+                result.max_y = row > result.max_y ? row : result.max_y;
+            }
+        }
+    }
+    return result;
+}
+
+static void check_against_naive(
+    const Image *actual,
+    uint32_t x,
+    uint32_t y,
+    const Image *reference,
+    uint8_t tolerance
+) {
+    ImageComparison expected =
+        compare_naively(actual, x, y, reference, tolerance);
+    ImageComparison result =
+        image_compare(actual, x, y, reference, tolerance, false);
+    uint32_t width = reference->width, height = reference->height;
+    CHECK(
+        result.mismatched_count == expected.mismatched_count,
+        "%ux%u: %llu instead of %llu",
+        width,
+        height,
+        (unsigned long long)result.mismatched_count,
+        (unsigned long long)expected.mismatched_count
+    );
+    if (expected.mismatched_count > 0) {
+        CHECK(
+            result.min_x == expected.min_x && result.min_y == expected.min_y &&
+                result.max_x == expected.max_x &&
+                result.max_y == expected.max_y,
+            "%ux%u",
+            width,
+            height
+        );
+    }
+
+    ImageComparison early =
+        image_compare(actual, x, y, reference, tolerance, true);
+    CHECK(
+        (early.mismatched_count > 0) == (expected.mismatched_count > 0),
+        "%ux%u",
+        width,
+        height
+    );
+}
+
+/**
+ * Compare a reference against a noisier copy of itself, placed at an offset
+ * in a larger image with its channels in the other order.
+ */
+static void check_noisy_copy(uint32_t width, uint32_t height, bool has_alpha) {
+    const uint32_t X = 3, Y = 2;
+    Image *reference = image_new(
+        width, height, has_alpha ? IMAGE_FORMAT_ARGB8888 : IMAGE_FORMAT_XRGB8888
+    );
+    Image *actual = image_new(width + X + 1, height + Y, IMAGE_FORMAT_XBGR8888);
+
+    uint32_t state = width * 7919 + height;
+    for (uint32_t row = 0; row < actual->height; row++) {
+        for (uint32_t col = 0; col < actual->width; col++) {
+            state = state * 1103515245u + 12345u;
+            *get_pixel(actual, col, row) = state >> 8;
+        }
+    }
+    for (uint32_t row = 0; row < height; row++) {
+        for (uint32_t col = 0; col < width; col++) {
+            uint32_t pixel = *get_pixel(actual, X + col, Y + row);
+            state = state * 1103515245u + 12345u;
+            // mostly within a tolerance of 4, with the odd larger difference
+            int noise = (int)(state >> 28) - 8;
+            uint32_t r = channel(pixel, 0), g = channel(pixel, 8);
+            uint32_t b = channel(pixel, 16);
+            r = (uint32_t)((int)r + noise) & 0xff;
+            uint32_t alpha = has_alpha && state % 5 == 0 ? 0 : 0xff;
+            *get_pixel(reference, col, row) =
+                alpha << 24 | r << 16 | g << 8 | b;
+        }
+    }
+
+    for (uint8_t tolerance = 0; tolerance <= 8; tolerance += 4) {
+        check_against_naive(actual, X, Y, reference, tolerance);
+    }
+
+    image_destroy(reference);
+    image_destroy(actual);
+}
+
+/** A single bad pixel is found wherever it is, including in the tail. */
+static void check_single_mismatch(uint32_t width) {
+    Image *reference = image_new(width, 2, IMAGE_FORMAT_XRGB8888);
+    Image *actual = image_new(width, 2, IMAGE_FORMAT_XRGB8888);
+    for (uint32_t bad_x = 0; bad_x < width; bad_x++) {
+        for (uint32_t row = 0; row < 2; row++) {
+            for (uint32_t col = 0; col < width; col++) {
+                *get_pixel(reference, col, row) = 0x808080;
+                *get_pixel(actual, col, row) = 0x818283;
+            }
+        }
+        *get_pixel(actual, bad_x, 1) = 0x80808a;
+
+        ImageComparison result =
+            image_compare(actual, 0, 0, reference, 3, false);
+        CHECK(
+            result.mismatched_count == 1 && result.min_x == bad_x &&
+                result.max_x == bad_x && result.min_y == 1 &&
+                result.max_y == 1,
+            "width %u, x %u",
+            width,
+            bad_x
+        );
+
+        Image *diff = image_compare_make_diff(actual, 0, 0, reference, 3);
+        CHECK(*get_pixel(diff, bad_x, 1) == 0xff0000, "width %u", width);
+        CHECK(*get_pixel(diff, bad_x, 0) != 0xff0000, "width %u", width);
+        image_destroy(diff);
+    }
+    image_destroy(reference);
+    image_destroy(actual);
+}
+
+int main() {
+    const uint32_t widths[] = {1, 7, 8, 9, 16, 23, 64, 67};
+    for (size_t i = 0; i < sizeof(widths) / sizeof(widths[0]); i++) {
+        for (uint32_t height = 1; height <= 5; height += 4) {
+            check_noisy_copy(widths[i], height, false);
+            check_noisy_copy(widths[i], height, true);
+        }
+        check_single_mismatch(widths[i]);
+    }
+    return TEST_EXIT_CODE();
+}
@@ -0,0 +1,245 @@
+// Decodes the output of image_save_qoi and image_save_bmp again, and checks
+// it against the image's pixels.
+
+#include "image.h"
+#include "test.h"
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct {
+    uint8_t *data;
+    size_t size;
+} Bytes;
+
+/** Copy a LinkBuffer into one block, and free it. */
+static Bytes flatten(LinkBuffer *buffer) {
+    Bytes result = {0};
+    for (LinkBuffer *block = buffer; block; block = block->next) {
+        result.size += block->used_size;
+    }
+    result.data = malloc(result.size > 0 ? result.size : 1);
+    size_t offset = 0;
+    for (LinkBuffer *block = buffer; block; block = block->next) {
+        memcpy(result.data + offset, block->data, block->used_size);
+        offset += block->used_size;
+    }
+    link_buffer_destroy(buffer);
+    return result;
+}
+
+static uint32_t get_le32(const uint8_t *data) {
+    return data[0] | data[1] << 8 | data[2] << 16 | (uint32_t)data[3] << 24;
+}
+
+static uint32_t get_be32(const uint8_t *data) {
+    return (uint32_t)data[0] << 24 | data[1] << 16 | data[2] << 8 | data[3];
+}
+
+/** The 8-bit RGB that an image's pixel should be saved as. */
+static void get_expected_rgb(
+    const Image *image, uint32_t x, uint32_t y, uint8_t rgb[3]
+) {
+    ImageChannelShifts shifts = image_format_channel_shifts(image->format);
+    uint32_t pixel =
+        *((const uint32_t *)(image->data + (size_t)y * image->stride) + x);
+    rgb[0] = pixel >> shifts.r_shift & 0xff;
+    rgb[1] = pixel >> shifts.g_shift & 0xff;
+    rgb[2] = pixel >> shifts.b_shift & 0xff;
+}
+
+/**
+ * Decode a QOI file as in the specification.
+ * @returns the RGB pixels, or NULL if the file isn't valid or is the wrong size
+ */
+static uint8_t *decode_qoi(Bytes file, uint32_t width, uint32_t height) {
+    const uint8_t TRAILER[8] = {0, 0, 0, 0, 0, 0, 0, 1};
+    if (file.size < 14 + sizeof(TRAILER) || memcmp(file.data, "qoif", 4) ||
+        get_be32(file.data + 4) != width || get_be32(file.data + 8) != height ||
+        file.data[12] != 3 || file.data[13] != 0 ||
+        memcmp(file.data + file.size - sizeof(TRAILER), TRAILER, 8)) {
+        return NULL;
+    }
+
+    size_t pixel_count = (size_t)width * height;
+    uint8_t *pixels = malloc(pixel_count * 3 + 1);
+    uint8_t index[64][4] = {0};
+    uint8_t px[4] = {0, 0, 0, 255};
+    const uint8_t *in = file.data + 14;
+    const uint8_t *end = file.data + file.size - sizeof(TRAILER);
+    size_t i = 0;
+    while (i < pixel_count && in < end) {
+        uint8_t op = *in++;
+        uint32_t run = 1;
+        if (op == 0xfe) {
+            memcpy(px, in, 3);
+            in += 3;
+        } else if (op == 0xff) {
+            memcpy(px, in, 4);
+            in += 4;
+        } else if ((op & 0xc0) == 0x00) {
+            memcpy(px, index[op], 4);
+        } else if ((op & 0xc0) == 0x40) {
+            px[0] += (op >> 4 & 3) - 2;
+            px[1] += (op >> 2 & 3) - 2;
+            px[2] += (op & 3) - 2;
+        } else if ((op & 0xc0) == 0x80) {
+            int dg = (op & 0x3f) - 32;
+            uint8_t next = *in++;
+            px[0] += dg + (next >> 4) - 8;
+            px[1] += dg;
+            px[2] += dg + (next & 0xf) - 8;
+        } else {
+            run = (op & 0x3f) + 1;
+        }
+        uint32_t hash = (px[0] * 3 + px[1] * 5 + px[2] * 7 + px[3] * 11) % 64;
+        memcpy(index[hash], px, 4);
+        for (; run > 0 && i < pixel_count; run--, i++) {
+            memcpy(pixels + i * 3, px, 3);
+        }
+    }
+    if (i != pixel_count || in != end) {
+        free(pixels);
+        return NULL;
+    }
+    return pixels;
+}
+
+static void check_qoi(const Image *image, const char *description) {
+    Bytes file = flatten(image_save_qoi(image));
+    uint8_t *pixels = decode_qoi(file, image->width, image->height);
+    CHECK(pixels, "%s: couldn't decode", description);
+    if (pixels) {
+        uint64_t mismatched_count = 0;
+        for (uint32_t y = 0; y < image->height; y++) {
+            for (uint32_t x = 0; x < image->width; x++) {
+                uint8_t expected[3];
+                get_expected_rgb(image, x, y, expected);
+                size_t i = (size_t)y * image->width + x;
+                if (memcmp(pixels + i * 3, expected, 3)) {
+                    mismatched_count++;
+                }
+            }
+        }
+        CHECK(mismatched_count == 0, "%s", description);
+    }
+    free(pixels);
+    free(file.data);
+}
+
+static void check_bmp(const Image *image, const char *description) {
+    const uint32_t HEADER_SIZE = 14 + 40;
+    Bytes file = flatten(image_save_bmp(image));
+    size_t row_size = (size_t)image->width * 4;
+    size_t data_size = row_size * image->height;
+
+    bool is_header_valid =
+        file.size == HEADER_SIZE + data_size && file.data[0] == 'B' &&
+        file.data[1] == 'M' && get_le32(file.data + 2) == file.size &&
+        get_le32(file.data + 10) == HEADER_SIZE &&
+        get_le32(file.data + 14) == 40 &&
+        get_le32(file.data + 18) == image->width &&
+        get_le32(file.data + 22) == image->height &&
+        (file.data[28] | file.data[29] << 8) == 32 &&
+        get_le32(file.data + 34) == data_size;
+    CHECK(is_header_valid, "%s", description);
+    if (is_header_valid) {
+        uint64_t mismatched_count = 0;
+        for (uint32_t y = 0; y < image->height; y++) {
+            // rows are stored bottom-up, as BGRX
+            const uint8_t *row =
+                file.data + HEADER_SIZE + (image->height - 1 - y) * row_size;
+            for (uint32_t x = 0; x < image->width; x++) {
+                uint8_t expected[3];
+                get_expected_rgb(image, x, y, expected);
+                const uint8_t *bgrx = row + x * 4;
+                if (bgrx[2] != expected[0] || bgrx[1] != expected[1] ||
+                    bgrx[0] != expected[2]) {
+                    mismatched_count++;
+                }
+            }
+        }
+        CHECK(mismatched_count == 0, "%s", description);
+    }
+    free(file.data);
+}
+
+/**
+ * Fill an image with a mix of flat areas, gradients and noise, so that every
+ * kind of QOI chunk is used.
+ */
+static void fill_pattern(Image *image, uint32_t seed) {
+    uint32_t state = seed;
+    for (uint32_t y = 0; y < image->height; y++) {
+        uint32_t *row = (uint32_t *)(image->data + (size_t)y * image->stride);
+        for (uint32_t x = 0; x < image->width; x++) {
+            state = state * 1103515245u + 12345u;
+            switch ((x / 5 + y) % 4) {
+            case 0:
+                row[x] = 0xff204060;
+                break;
+            case 1:
+                row[x] = 0xff000000 | (x & 0xff) << 16 | (x & 0xff) << 8 | y;
+                break;
+            case 2:
+                row[x] = 0xff000000 | (x * 9 & 0xff) << 16 |
+                         (x * 10 & 0xff) << 8 | (x * 11 & 0xff);
+                break;
+            default:
+                row[x] = state >> 8 | 0xff000000;
+            }
+        }
+    }
+}
+
+static void check_image(
+    uint32_t width, uint32_t height, ImageFormat format, bool is_flat
+) {
+    char description[64];
+    snprintf(
+        description,
+        sizeof(description),
+        "%ux%u%s format %x",
+        width,
+        height,
+        is_flat ? " flat" : "",
+        format
+    );
+    Image *image = image_new(width, height, format);
+    if (is_flat) {
+        memset(image->data, 0, (size_t)image->stride * height);
+    } else {
+        fill_pattern(image, width * 131 + height);
+    }
+    check_qoi(image, description);
+    check_bmp(image, description);
+    image_destroy(image);
+}
+
+int main() {
+    const uint32_t sizes[][2] = {
+        {1, 1},
+        {2, 1},
+        {1, 3},
+        // runs are cut off at 62 pixels
+        {61, 1},
+        {62, 1},
+        {63, 2},
+        {130, 7},
+    };
+    const ImageFormat formats[] = {
+        IMAGE_FORMAT_XRGB8888,
+        IMAGE_FORMAT_ARGB8888,
+        IMAGE_FORMAT_XBGR8888,
+        IMAGE_FORMAT_XRGB2101010,
+        IMAGE_FORMAT_XBGR2101010,
+    };
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        for (size_t j = 0; j < sizeof(formats) / sizeof(formats[0]); j++) {
+            check_image(sizes[i][0], sizes[i][1], formats[j], false);
+            // black is where QOI's previous pixel starts, so it's all one run
+            check_image(sizes[i][0], sizes[i][1], formats[j], true);
+        }
+    }
+    return TEST_EXIT_CODE();
+}
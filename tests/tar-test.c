@@ -0,0 +1,183 @@
+// Builds archives with tar_archive_build and reads them back, checking the
+// ustar headers, the contents and the padding between members.
+
+#include "tar.h"
+#include "test.h"
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+constexpr size_t BLOCK_SIZE = 512;
+
+typedef struct {
+    const char *name;
+    size_t size;
+} MemberSpec;
+
+/** Make contents that differ from member to member and block to block. */
+static LinkBuffer *make_contents(size_t size, uint8_t seed) {
+    LinkBuffer *result = link_buffer_new();
+    LinkBuffer *tail = result;
+    // append in uneven pieces, so that members span LinkBuffer blocks
+    uint8_t piece[1000];
+    for (size_t offset = 0; offset < size; offset += sizeof(piece)) {
+        size_t length =
+            size - offset < sizeof(piece) ? size - offset : sizeof(piece);
+        for (size_t i = 0; i < length; i++) {
+            piece[i] = (uint8_t)(offset + i) * 7 + seed;
+        }
+        link_buffer_append(&tail, piece, length);
+    }
+    return result;
+}
+
+static uint8_t *flatten(LinkBuffer *buffer, size_t *size) {
+    *size = 0;
+    for (LinkBuffer *block = buffer; block; block = block->next) {
+        *size += block->used_size;
+    }
+    uint8_t *result = malloc(*size);
+    size_t offset = 0;
+    for (LinkBuffer *block = buffer; block; block = block->next) {
+        memcpy(result + offset, block->data, block->used_size);
+        offset += block->used_size;
+    }
+    return result;
+}
+
+static bool is_zeroed(const uint8_t *data, size_t size) {
+    for (size_t i = 0; i < size; i++) {
+        if (data[i] != 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/** Check a header block, and get the size of the member it starts. */
+static bool
+check_header(const uint8_t *header, const char *name, size_t *size) {
+    char expected_name[100] = {0};
+    snprintf(expected_name, sizeof(expected_name), "%s", name);
+    CHECK(memcmp(header, expected_name, 100) == 0, "%.99s", name);
+    CHECK(memcmp(header + 257, "ustar\0" "00", 8) == 0, "%.99s", name);
+    CHECK(header[156] == '0', "%.99s", name);
+
+    // the checksum covers the header with its own field as spaces
+    unsigned int checksum = 0;
+    for (size_t i = 0; i < BLOCK_SIZE; i++) {
+        checksum += i >= 148 && i < 156 ? ' ' : header[i];
+    }
+    char *end;
+    unsigned long stored_checksum =
+        strtoul((const char *)header + 148, &end, 8);
+    CHECK(stored_checksum == checksum, "%.99s", name);
+
+    char size_field[13] = {0};
+    memcpy(size_field, header + 124, 12);
+    *size = strtoull(size_field, &end, 8);
+    return *end == '\0' && end == size_field + 11;
+}
+
+static void check_archive(const MemberSpec *specs, size_t count) {
+    const char **names = calloc(count + 1, sizeof(const char *));
+    LinkBuffer **contents = calloc(count + 1, sizeof(LinkBuffer *));
+    for (size_t i = 0; i < count; i++) {
+        names[i] = specs[i].name;
+        contents[i] = specs[i].size == SIZE_MAX
+                          ? NULL
+                          : make_contents(specs[i].size, (uint8_t)i);
+    }
+    LinkBuffer *archive_buffer = tar_archive_build(names, contents, count);
+    size_t archive_size;
+    uint8_t *archive = flatten(archive_buffer, &archive_size);
+    link_buffer_destroy(archive_buffer);
+    CHECK(archive_size % BLOCK_SIZE == 0, "%zu bytes", archive_size);
+
+    size_t offset = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (!contents[i]) {
+            // skipped, so the next member follows right away
+            continue;
+        }
+        size_t member_size = 0;
+        bool is_size_valid =
+            offset + BLOCK_SIZE <= archive_size &&
+            check_header(archive + offset, specs[i].name, &member_size);
+        CHECK(is_size_valid && member_size == specs[i].size, "member %zu", i);
+        offset += BLOCK_SIZE;
+        if (!is_size_valid || member_size != specs[i].size) {
+            break;
+        }
+
+        size_t padded_size =
+            (member_size + BLOCK_SIZE - 1) / BLOCK_SIZE * BLOCK_SIZE;
+        bool is_in_bounds = offset + padded_size <= archive_size;
+        CHECK(is_in_bounds, "member %zu", i);
+        if (!is_in_bounds) {
+            break;
+        }
+        size_t expected_size;
+        uint8_t *expected = flatten(contents[i], &expected_size);
+        CHECK(
+            memcmp(archive + offset, expected, member_size) == 0,
+            "member %zu",
+            i
+        );
+        const uint8_t *padding = archive + offset + member_size;
+        CHECK(is_zeroed(padding, padded_size - member_size), "member %zu", i);
+        free(expected);
+        offset += padded_size;
+    }
+
+    // the end-of-archive marker, and nothing after it
+    CHECK(offset + 2 * BLOCK_SIZE == archive_size, "%zu bytes", archive_size);
+    if (offset + 2 * BLOCK_SIZE <= archive_size) {
+        CHECK(is_zeroed(archive + offset, 2 * BLOCK_SIZE));
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        if (contents[i]) {
+            link_buffer_destroy(contents[i]);
+        }
+    }
+    free(names);
+    free(contents);
+    free(archive);
+}
+
+int main() {
+    check_archive(NULL, 0);
+
+    const MemberSpec edge_sizes[] = {
+        {"empty.png", 0},
+        {"one.png", 1},
+        {"exact.png", BLOCK_SIZE},
+        {"skipped.png", SIZE_MAX},
+        {"over.png", BLOCK_SIZE + 1},
+        {"two-blocks.png", 2 * BLOCK_SIZE},
+        {"under.png", BLOCK_SIZE - 1},
+    };
+    check_archive(edge_sizes, sizeof(edge_sizes) / sizeof(edge_sizes[0]));
+
+    // a member whose size is a multiple of 512 right at the end
+    const MemberSpec exact_last[] = {{"last.png", 4 * BLOCK_SIZE}};
+    check_archive(exact_last, 1);
+
+    // members that span several LinkBuffer blocks, on both sides of them
+    const MemberSpec large[] = {
+        {"large.png", LINK_BUFFER_SIZE + 123},
+        {"larger.png", 3 * LINK_BUFFER_SIZE},
+        {"aligned.png", 300 * BLOCK_SIZE},
+    };
+    check_archive(large, sizeof(large) / sizeof(large[0]));
+
+    // names are cut off to fit the 100-byte field with its terminator
+    char long_name[200];
+    memset(long_name, 'a', sizeof(long_name) - 1);
+    long_name[sizeof(long_name) - 1] = '\0';
+    const MemberSpec long_names[] = {{long_name, 10}, {"after.png", 10}};
+    check_archive(long_names, 2);
+
+    return TEST_EXIT_CODE();
+}
@@ -0,0 +1,25 @@
+#pragma once
+#include <stdio.h>
+#include <stdlib.h>
+
+// Just enough to write the tests in this directory: a failed check is printed
+// and remembered, and the remaining checks still run.
+
+static int test_failed_count = 0;
+
+/**
+ * Check a condition. The optional arguments are a printf format and its
+ * arguments, printed on failure to tell apart the cases of a loop.
+ */
+#define CHECK(condition, ...)                                                  \
+    do {                                                                       \
+        if (!(condition)) {                                                    \
+            fprintf(stderr, "%s:%d: %s", __FILE__, __LINE__, #condition);      \
+            __VA_OPT__(fprintf(stderr, " (" __VA_ARGS__); fputc(')', stderr);) \
+            fputc('\n', stderr);                                               \
+            test_failed_count++;                                               \
+        }                                                                      \
+    } while (false)
+
+/** The exit code for main, once every check has run. */
+#define TEST_EXIT_CODE() (test_failed_count > 0 ? EXIT_FAILURE : EXIT_SUCCESS)
@@ -0,0 +1,121 @@
+// Round-trips images through tile_rle_encode and tile_rle_decode, split into
+// tiles the same way compressed-image.c does.
+
+#include "test.h"
+#include "tile-rle.h"
+#include <stdint.h>
+#include <string.h>
+
+static uint32_t *get_pixel(const Image *image, uint32_t x, uint32_t y) {
+    return (uint32_t *)(image->data + (size_t)y * image->stride) + x;
+}
+
+/** A pseudo-random pattern, with some flat areas for runs to form in. */
+static void fill_pattern(Image *image, uint32_t seed) {
+    uint32_t state = seed * 2654435761u + 1;
+    for (uint32_t y = 0; y < image->height; y++) {
+        for (uint32_t x = 0; x < image->width; x++) {
+            state = state * 1103515245u + 12345u;
+            bool is_flat = (x / 7 + y / 5) % 3 == 0;
+            *get_pixel(image, x, y) = is_flat ? 0xff336699 : state;
+        }
+    }
+}
+
+static void check_round_trip(
+    uint32_t width, uint32_t height, ImageFormat format, uint32_t mask
+) {
+    Image *image = image_new(width, height, format);
+    Image *decoded = image_new(width, height, format);
+    fill_pattern(image, width * 31 + height);
+    memset(decoded->data, 0, (size_t)decoded->stride * height);
+
+    static uint8_t encoded[TILE_RLE_MAX_ENCODED_SIZE];
+    for (uint32_t y = 0; y < height; y += TILE_RLE_SIZE) {
+        uint32_t tile_height =
+            height - y < TILE_RLE_SIZE ? height - y : TILE_RLE_SIZE;
+        for (uint32_t x = 0; x < width; x += TILE_RLE_SIZE) {
+            uint32_t tile_width =
+                width - x < TILE_RLE_SIZE ? width - x : TILE_RLE_SIZE;
+            size_t size = tile_rle_encode(
+                image, x, y, tile_width, tile_height, encoded
+            );
+            CHECK(size <= TILE_RLE_MAX_ENCODED_SIZE, "%ux%u", width, height);
+            tile_rle_decode(
+                encoded, size, decoded, x, y, tile_width, tile_height
+            );
+        }
+    }
+
+    uint64_t mismatched_count = 0;
+    for (uint32_t y = 0; y < height; y++) {
+        for (uint32_t x = 0; x < width; x++) {
+            uint32_t expected = *get_pixel(image, x, y) & mask;
+            if (*get_pixel(decoded, x, y) != expected) {
+                mismatched_count++;
+            }
+        }
+    }
+    CHECK(mismatched_count == 0, "%ux%u format %x", width, height, format);
+
+    image_destroy(image);
+    image_destroy(decoded);
+}
+
+/** Tiles that don't compress at all shouldn't go over the stated maximum. */
+static void check_worst_case() {
+    Image *image =
+        image_new(TILE_RLE_SIZE, TILE_RLE_SIZE, IMAGE_FORMAT_ARGB8888);
+    static uint8_t encoded[TILE_RLE_MAX_ENCODED_SIZE];
+
+    // no two neighbours are equal
+    for (uint32_t i = 0; i < TILE_RLE_SIZE * TILE_RLE_SIZE; i++) {
+        ((uint32_t *)image->data)[i] = i;
+    }
+    size_t size = tile_rle_encode(
+        image, 0, 0, TILE_RLE_SIZE, TILE_RLE_SIZE, encoded
+    );
+    CHECK(size <= TILE_RLE_MAX_ENCODED_SIZE, "%zu bytes", size);
+
+    // pairs that are just long enough to break up every literal
+    for (uint32_t i = 0; i < TILE_RLE_SIZE * TILE_RLE_SIZE; i++) {
+        ((uint32_t *)image->data)[i] = i % 3 == 0 ? i : i - i % 3 + 1;
+    }
+    size = tile_rle_encode(image, 0, 0, TILE_RLE_SIZE, TILE_RLE_SIZE, encoded);
+    CHECK(size <= TILE_RLE_MAX_ENCODED_SIZE, "%zu bytes", size);
+
+    image_destroy(image);
+}
+
+/** Padding bits are cleared, so a flat XRGB tile is a single run per packet. */
+static void check_padding_ignored() {
+    Image *image = image_new(16, 1, IMAGE_FORMAT_XRGB8888);
+    for (uint32_t x = 0; x < 16; x++) {
+        *get_pixel(image, x, 0) = (x << 24) | 0x123456;
+    }
+    uint8_t encoded[64];
+    size_t size = tile_rle_encode(image, 0, 0, 16, 1, encoded);
+    CHECK(size == 1 + sizeof(uint32_t), "%zu bytes", size);
+    image_destroy(image);
+}
+
+int main() {
+    const uint32_t sizes[][2] = {
+        {1, 1},
+        {2, 1},
+        {1, 130},
+        {TILE_RLE_SIZE, TILE_RLE_SIZE},
+        {TILE_RLE_SIZE - 1, TILE_RLE_SIZE + 1},
+        {TILE_RLE_SIZE + 1, 3},
+        {3 * TILE_RLE_SIZE + 17, 2 * TILE_RLE_SIZE + 5},
+    };
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        uint32_t width = sizes[i][0], height = sizes[i][1];
+        check_round_trip(width, height, IMAGE_FORMAT_ARGB8888, 0xffffffff);
+        check_round_trip(width, height, IMAGE_FORMAT_XRGB8888, 0x00ffffff);
+        check_round_trip(width, height, IMAGE_FORMAT_XBGR2101010, 0x3fffffff);
+    }
+    check_worst_case();
+    check_padding_ignored();
+    return TEST_EXIT_CODE();
+}